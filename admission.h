@@ -0,0 +1,283 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+/**
+ * --- admission.h defines ---
+ * session table of the listening server,
+ * accept batching and early rejection of connections under overload
+ *
+ * The listening socket is non-blocking. Every time poll() reports it
+ * readable, the server accepts connections until EAGAIN and admits each
+ * one against the session limits before it forks. A connection that can
+ * not be served gets a 421 code and is closed at once, so a storm is
+ * answered quickly instead of piling up in the SYN queue or in fork().
+ */
+
+#include "server.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/**
+ * default listen() backlog of the command port
+ */
+#define DEFAULT_LISTEN_BACKLOG 128
+
+/**
+ * default number of sessions served at the same time
+ */
+#define DEFAULT_MAX_SESSIONS 256
+
+/**
+ * the most connections accepted in one round before the
+ * server goes back to reap its children
+ */
+#define ACCEPT_BATCH 64
+
+/**
+ * how long the server backs off when the kernel is out of memory
+ */
+#define ACCEPT_BACKOFF_MS 10
+
+/**
+ * a session in the table, pid is 0 for a free slot
+ * and -1 for a slot reserved before fork()
+ */
+struct admission_session
+{
+    pid_t pid;
+    struct in_addr address;
+};
+
+static struct admission_session *admission_sessions = NULL;
+static int admission_max_sessions = 0;
+static int admission_max_per_ip = 0;
+static int admission_active = 0;
+static int admission_spare_fd = -1;
+
+/**
+ * allocate the session table
+ * max_per_ip is 0 for no limit on the sessions of one address
+ * return 0 if success or -1 if error
+ */
+int admission_initialize(int max_sessions, int max_per_ip);
+
+/**
+ * accept one connection from the non-blocking listen_sockfd
+ * return the new sock fd or -1 if there is nothing more to accept now
+ */
+int admission_accept(int listen_sockfd, struct sockaddr_in *address);
+
+/**
+ * check the limits and reserve a slot for a connection from address
+ * return the slot or -1 if the connection must be rejected
+ */
+int admission_reserve(const struct sockaddr_in *address);
+
+/**
+ * bind the child process pid to a reserved slot
+ */
+void admission_commit(int slot, pid_t pid);
+
+/**
+ * free slot, or the slot of the child process pid if slot is -1
+ */
+void admission_release(int slot, pid_t pid);
+
+/**
+ * wait for all the exited children and free the slots of the sessions, the
+ * indexer goes to search_exited()
+ * return the number of the sessions reaped
+ */
+int admission_reap(void);
+
+/**
+ * send 421 to the connection and close it
+ */
+void admission_reject(int sockfd);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+int admission_initialize(int max_sessions, int max_per_ip)
+{
+    if (max_sessions <= 0 || max_per_ip < 0)
+    {
+        error_handling("invalid session limits");
+        return -1;
+    }
+
+    admission_sessions = calloc(max_sessions, sizeof(struct admission_session));
+
+    if (!admission_sessions)
+    {
+        perror("calloc() error");
+        return -1;
+    }
+
+    admission_max_sessions = max_sessions;
+    admission_max_per_ip = max_per_ip;
+    admission_active = 0;
+
+    /* a descriptor held back to accept and reject when the table of fds is full */
+    admission_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return 0;
+}
+
+int admission_accept(int listen_sockfd, struct sockaddr_in *address)
+{
+    int sockfd;
+    socklen_t len;
+    struct timespec ts;
+
+    while (1)
+    {
+        len = sizeof(*address);
+        sockfd = accept4(listen_sockfd, (struct sockaddr *)address, &len, SOCK_CLOEXEC);
+
+        if (sockfd >= 0)
+            return sockfd;
+
+        switch (errno)
+        {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+            continue;
+
+        case EAGAIN:
+            return -1;
+
+        case EMFILE:
+        case ENFILE:
+            /* out of descriptors, give the spare one up to shed the connection */
+            if (admission_spare_fd < 0)
+                return -1;
+
+            close(admission_spare_fd);
+            sockfd = accept(listen_sockfd, NULL, NULL);
+            if (sockfd >= 0)
+                admission_reject(sockfd);
+            admission_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            error_handling("out of file descriptors, connection rejected");
+            continue;
+
+        case ENOBUFS:
+        case ENOMEM:
+            perror("accept4() error");
+            ts.tv_sec = 0;
+            ts.tv_nsec = ACCEPT_BACKOFF_MS * 1000000L;
+            nanosleep(&ts, NULL);
+            return -1;
+
+        default:
+            perror("accept4() error");
+            return -1;
+        }
+    }
+}
+
+int admission_reserve(const struct sockaddr_in *address)
+{
+    int i;
+    int slot;
+    int same_ip;
+
+    if (admission_active >= admission_max_sessions)
+        return -1;
+
+    slot = -1;
+    same_ip = 0;
+
+    for (i = 0; i < admission_max_sessions; i++)
+    {
+        if (0 == admission_sessions[i].pid)
+        {
+            if (slot < 0)
+                slot = i;
+        }
+        else if (admission_sessions[i].address.s_addr == address->sin_addr.s_addr)
+        {
+            same_ip++;
+        }
+    }
+
+    if (slot < 0)
+        return -1;
+
+    if (admission_max_per_ip > 0 && same_ip >= admission_max_per_ip)
+        return -1;
+
+    admission_sessions[slot].pid = -1;
+    admission_sessions[slot].address = address->sin_addr;
+    admission_active++;
+
+    return slot;
+}
+
+void admission_commit(int slot, pid_t pid)
+{
+    admission_sessions[slot].pid = pid;
+}
+
+void admission_release(int slot, pid_t pid)
+{
+    int i;
+
+    if (slot < 0)
+    {
+        for (i = 0; i < admission_max_sessions; i++)
+        {
+            if (admission_sessions[i].pid == pid)
+            {
+                slot = i;
+                break;
+            }
+        }
+    }
+
+    if (slot < 0 || 0 == admission_sessions[slot].pid)
+        return;
+
+    metrics_retire(slot);
+    cache_retire(slot);
+    rate_limit_retire(slot);
+
+    admission_sessions[slot].pid = 0;
+    admission_active--;
+}
+
+int admission_reap(void)
+{
+    pid_t pid;
+    int status;
+    int count;
+
+    count = 0;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        if (search_exited(pid, status))
+            continue;
+
+        admission_release(-1, pid);
+        count++;
+    }
+
+    return count;
+}
+
+void admission_reject(int sockfd)
+{
+    int temp;
+
+    temp = htonl(421);
+    send(sockfd, &temp, sizeof(temp), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(sockfd);
+}
+
+#endif
@@ -5,7 +5,7 @@
  * A ftp system based on C and Linux.
  * The whole program includes
  * --- code file ---
- * base.h,
+ * base.h, control.h,
  * server.h, client.h,
  * server.c, client.c,
  * Makefile,
@@ -37,6 +37,11 @@
  *
  */
 
+/* accept4() and the other linux extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 /* socket inclusion */
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -49,6 +54,8 @@
 #include <fcntl.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <termios.h>
@@ -91,10 +98,24 @@
 #define CMD_RMD "RMDR" /* Remove a directory. */
 #define CMD_CWD "CWDR" /* Change working directory. */
 
+#define CMD_STAT "STAT" /* Returns the server metrics. */
+
+#define CMD_OPTS "OPTS" /* Select options, like the control encoding of control.h. */
+
+#define CMD_RNFR "RNFR" /* Rename from, the source of RNTO and COPY. */
+#define CMD_RNTO "RNTO" /* Rename to. */
+#define CMD_COPY "COPY" /* Copy the file of RNFR on the server. */
+
+#define CMD_DUSG "DUSG" /* Returns the disk usage and the quota of the user. */
+#define CMD_SRCH "SRCH" /* Returns the paths matching a pattern and predicates. */
+#define CMD_SUBS "SUBS" /* Streams the changes under a directory. */
+
 /**
  * the status code server returns
  * size of status code is int
  *
+ * 200  Command okay.
+ *
  * 230  User logged in, proceed.
  * 430  Invalid username or password.
  *
@@ -102,24 +123,29 @@
  * 221  Service closing control connection.
  * 502  Command not implemented.
  *
+ * 421  Service not available, closing control connection.
+ *
  * 125  Data connection already open; transfer starting.
  * 226  Closing data connection. Requested file action successful.
  */
 
 /**
- * create a socket(), bind() it and listen() it using port in server
+ * create a socket(), bind() it and listen() it using port in server,
+ * backlog is the length of the queue of pending connections
  * return the sock fd or -1 if error
  */
-int server_socket_initialize(int port);
+int server_socket_initialize(int port, int backlog);
 
 /**
- * accept a connection of client in listen_sockfd in server
+ * accept a connection of client in listen_sockfd in server,
+ * behind the link of FTP_NETEM when it is set
  * return the new connected sock fd or -1 if error
  */
 int server_socket_accept(int listen_sockfd);
 
 /**
- * connect to a ftp server using IP address host and its port in client
+ * connect to a ftp server using IP address host and its port in client,
+ * behind the link of FTP_NETEM when it is set
  * return the connected sock fd or -1 if error
  */
 int client_socket_connect(const char *host, int port);
@@ -130,17 +156,48 @@ int client_socket_connect(const char *host, int port);
 void error_handling(const char *message);
 
 /**
- * function definitions
+ * get the CLOCK_MONOTONIC time in nanoseconds
+ */
+long long monotonic_ns(void);
+
+/**
+ * parse a size like 512, 64k, 10M or 1g (powers of 1024)
+ * return the size or -1 if error
+ */
+long long parse_size(const char *str);
+
+/**
+ * initialize mutex in a MAP_SHARED mapping for the processes sharing it,
+ * robust so a process that dies holding it does not block the others
+ * return 0 if success or -1 if error
+ */
+int shared_mutex_initialize(pthread_mutex_t *mutex);
+
+/**
+ * lock mutex of shared_mutex_initialize(), taking it over from a holder that died
+ * return 1 if it was taken over or 0 if not
+ */
+int shared_mutex_lock(pthread_mutex_t *mutex);
+
+/**
+ * function definitions, left out where BASE_DECLARATIONS_ONLY is defined
+ * so a library can share the protocol without these symbols
  * -------------------------------------------------------------------
  */
 
-int server_socket_initialize(int port)
+#ifndef BASE_DECLARATIONS_ONLY
+
+/* the link emulation of FTP_NETEM under the sockets below */
+#include "netem.h"
+
+int server_socket_initialize(int port, int backlog)
 {
     int sockfd;
     int len;
     struct sockaddr_in address;
 
     int result;
+    int enable;
 
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -150,6 +207,16 @@ int server_socket_initialize(int port)
         return -1;
     }
 
+    enable = 1;
+    result = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    if (result < 0)
+    {
+        close(sockfd);
+        perror("setsockopt() error");
+        return -1;
+    }
+
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = htonl(INADDR_ANY);
     address.sin_port = htons(port);
@@ -164,7 +231,7 @@ int server_socket_initialize(int port)
         return -1;
     }
 
-    result = listen(sockfd, 5);
+    result = listen(sockfd, backlog);
 
     if (result < 0)
     {
@@ -191,7 +258,7 @@ int server_socket_accept(int listen_sockfd)
         return -1;
     }
 
-    return sockfd;
+    return netem_wrap(sockfd);
 }
 
 int client_socket_connect(const char *host, int port)
@@ -223,7 +290,7 @@ int client_socket_connect(const char *host, int port)
         return -1;
     }
 
-    return sockfd;
+    return netem_wrap(sockfd);
 }
 
 void error_handling(const char *message)
@@ -231,4 +298,83 @@ void error_handling(const char *message)
     fprintf(stderr, "Error: %s\n", message);
 }
 
+long long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long parse_size(const char *str)
+{
+    char *end;
+    long long size;
+
+    size = strtoll(str, &end, 10);
+
+    if (end == str || size < 0)
+        return -1;
+
+    switch (toupper(*end))
+    {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+
+    if (*end != '\0')
+        return -1;
+
+    return size;
+}
+
+int shared_mutex_initialize(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+    int result;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+    result = pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (result != 0)
+    {
+        errno = result;
+        perror("pthread_mutex_init() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int shared_mutex_lock(pthread_mutex_t *mutex)
+{
+    /* what the dead holder was changing may be half updated, the caller
+     * decides whether its data can still be trusted */
+    if (EOWNERDEAD == pthread_mutex_lock(mutex))
+    {
+        error_handling("a session died holding a shared lock, it is taken over");
+        pthread_mutex_consistent(mutex);
+        return 1;
+    }
+
+    return 0;
+}
+
+#endif /* BASE_DECLARATIONS_ONLY */
+
 #endif
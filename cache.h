@@ -0,0 +1,817 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/**
+ * --- cache.h defines ---
+ * the hot-file cache of RETR, shared by all the sessions
+ *
+ * Small files are kept in a MAP_SHARED mapping made before any session is
+ * forked, in chunks of CACHE_CHUNK_SIZE. An entry is found by the device
+ * and inode of the file and is only used while the size and the mtime
+ * stat() reports still match, so a file replaced or written is read again;
+ * a hit is sent straight from the mapping without opening the file.
+ *
+ * The eviction is S3-FIFO: a new file goes into the small queue and is
+ * dropped from it unless it is read again meanwhile, which moves it to the
+ * main queue; a file dropped from the small queue leaves a ghost, and when
+ * it comes back soon it goes to the main queue at once. The main queue is
+ * a FIFO whose entries read since their last pass get another round. A
+ * scan of many cold files only churns the small queue. The ghosts are a
+ * direct-mapped table of keys, so one is found in a single probe and a
+ * newer ghost takes the place of an older one that maps to the same slot.
+ *
+ * A session pins the entry it sends, in a table indexed by its admission
+ * slot, so a session that dies while sending is unpinned when it is reaped.
+ * The tables are guarded by one robust mutex held only for bookkeeping; the
+ * data is read and sent outside of it. A session that dies holding it may
+ * leave the queues half linked, so the next one to take it disables the
+ * cache: nothing is inserted or freed any more, and the entries still
+ * pinned are sent unchanged.
+ */
+
+#include "base.h"
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+/**
+ * the size of a chunk of cached data
+ */
+#define CACHE_CHUNK_SIZE 4096
+
+/**
+ * the default size of the cache, -C of the server
+ */
+#define CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+/**
+ * the largest file cached, at most a quarter of the cache
+ */
+#define CACHE_MAX_FILE (1024 * 1024)
+
+/**
+ * the part of the chunks the small queue holds before it gives up entries
+ */
+#define CACHE_SMALL_PERCENT 10
+
+/**
+ * the reads counted for an entry of the main queue, the rounds it gets
+ */
+#define CACHE_FREQ_MAX 3
+
+#define CACHE_NONE -1
+
+enum cache_state
+{
+    CACHE_FREE,
+    CACHE_LOADING, /* being read from the file by the session that made it */
+    CACHE_READY,
+    CACHE_STALE /* out of the index, freed when its last reader is done */
+};
+
+enum cache_queue
+{
+    CACHE_QUEUE_SMALL,
+    CACHE_QUEUE_MAIN,
+    CACHE_QUEUES
+};
+
+struct cache_entry
+{
+    dev_t dev;
+    ino_t ino;
+    long long size;
+    long long mtime_ns;
+
+    int state;
+    int queue;
+    int freq;
+    int refs;
+
+    int prev; /* toward the head of its queue */
+    int next; /* toward the tail, or the next free entry */
+    int hash_next;
+    int first_chunk;
+    int chunks;
+};
+
+struct cache_stats
+{
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long bytes_served; /* by hits */
+    unsigned long long insertions;
+    unsigned long long evictions;
+    unsigned long long stale;
+    long long bytes;
+    int entries;
+};
+
+struct cache_shared
+{
+    pthread_mutex_t lock;
+    int disabled; /* a session died holding the lock */
+
+    int entry_count;
+    int chunk_count;
+    int bucket_count;
+    int ghost_count;
+    int slot_count;
+    long long max_file;
+
+    int head[CACHE_QUEUES]; /* the newest entry */
+    int tail[CACHE_QUEUES]; /* the oldest entry */
+    int queue_chunks[CACHE_QUEUES];
+
+    int free_entry;
+    int free_chunk;
+    int free_chunks;
+
+    struct cache_stats stats;
+};
+
+/**
+ * an entry pinned for sending, read chunk by chunk
+ */
+struct cache_file
+{
+    int entry;
+    int chunk;
+    long long left;
+};
+
+static struct cache_shared *cache_shared = NULL;
+static int *cache_buckets;
+static struct cache_entry *cache_entries;
+static int *cache_chunk_next;
+static unsigned long long *cache_ghosts;
+static int *cache_pins;
+static char *cache_data;
+static int cache_slot = CACHE_NONE;
+
+/**
+ * map a cache of size bytes before any session is forked, 0 disables it,
+ * max_sessions sessions can pin an entry at the same time
+ * return 0 if success or -1 if error
+ */
+int cache_initialize(long long size, int max_sessions);
+
+/**
+ * pin the entries of the current session in the admission slot
+ */
+void cache_session_begin(int slot);
+
+/**
+ * unpin what the session of slot still pinned, in the listening process
+ */
+void cache_retire(int slot);
+
+/**
+ * find filename in the cache, reading it in on a miss if it fits,
+ * and pin it in file for cache_next()
+ * return 1 if it is sent from the cache or 0 if it has to be read
+ */
+int cache_open(const char *filename, struct cache_file *file);
+
+/**
+ * point at most max_iov of iov at the next chunks of file, count gets
+ * how many were used
+ * return the bytes in them, 0 at the end of the file
+ */
+int cache_next(struct cache_file *file, struct iovec *iov, int max_iov, int *count);
+
+/**
+ * unpin the entry of file
+ */
+void cache_close(struct cache_file *file);
+
+/**
+ * copy the counters of the cache into stats
+ * return 0 if success or -1 if the cache is disabled
+ */
+int cache_read_stats(struct cache_stats *stats);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+/**
+ * take the lock of the cache
+ * return 0 if its tables can be used or -1 if the cache is disabled
+ */
+static int cache_lock(void)
+{
+    if (shared_mutex_lock(&cache_shared->lock) && !cache_shared->disabled)
+    {
+        cache_shared->disabled = 1;
+        error_handling("the hot-file cache is disabled");
+    }
+
+    return cache_shared->disabled ? -1 : 0;
+}
+
+static void cache_unlock(void)
+{
+    pthread_mutex_unlock(&cache_shared->lock);
+}
+
+int cache_initialize(long long size, int max_sessions)
+{
+    struct cache_shared *shared;
+    size_t offset;
+    size_t total;
+    char *base;
+    int chunks;
+    int buckets;
+    int i;
+
+    if (size < 0 || max_sessions <= 0)
+    {
+        error_handling("invalid cache size");
+        return -1;
+    }
+
+    chunks = size / CACHE_CHUNK_SIZE;
+    if (0 == chunks)
+        return 0;
+
+    for (buckets = 1; buckets < chunks; buckets <<= 1)
+        ;
+
+    /* the tables first, the chunks page aligned after them */
+    offset = sizeof(struct cache_shared);
+    offset += buckets * sizeof(int);
+    offset += chunks * sizeof(struct cache_entry);
+    offset += chunks * sizeof(int);
+    offset += buckets * sizeof(unsigned long long);
+    offset += max_sessions * sizeof(int);
+    offset = (offset + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE * CACHE_CHUNK_SIZE;
+    total = offset + (size_t)chunks * CACHE_CHUNK_SIZE;
+
+    base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == base)
+    {
+        perror("mmap() error");
+        return -1;
+    }
+
+    shared = (struct cache_shared *)base;
+    offset = sizeof(struct cache_shared);
+    cache_buckets = (int *)(base + offset);
+    offset += buckets * sizeof(int);
+    cache_entries = (struct cache_entry *)(base + offset);
+    offset += chunks * sizeof(struct cache_entry);
+    cache_chunk_next = (int *)(base + offset);
+    offset += chunks * sizeof(int);
+    cache_ghosts = (unsigned long long *)(base + offset);
+    offset += buckets * sizeof(unsigned long long);
+    cache_pins = (int *)(base + offset);
+    cache_data = base + total - (size_t)chunks * CACHE_CHUNK_SIZE;
+
+    if (shared_mutex_initialize(&shared->lock) < 0)
+    {
+        munmap(base, total);
+        return -1;
+    }
+
+    shared->entry_count = chunks;
+    shared->chunk_count = chunks;
+    shared->bucket_count = buckets;
+    shared->ghost_count = buckets;
+    shared->slot_count = max_sessions;
+    shared->max_file = size / 4 < CACHE_MAX_FILE ? size / 4 : CACHE_MAX_FILE;
+
+    for (i = 0; i < CACHE_QUEUES; i++)
+        shared->head[i] = shared->tail[i] = CACHE_NONE;
+
+    for (i = 0; i < buckets; i++)
+        cache_buckets[i] = CACHE_NONE;
+
+    for (i = 0; i < chunks; i++)
+    {
+        cache_entries[i].state = CACHE_FREE;
+        cache_entries[i].next = i + 1 < chunks ? i + 1 : CACHE_NONE;
+        cache_chunk_next[i] = i + 1 < chunks ? i + 1 : CACHE_NONE;
+    }
+
+    for (i = 0; i < max_sessions; i++)
+        cache_pins[i] = CACHE_NONE;
+
+    shared->free_entry = 0;
+    shared->free_chunk = 0;
+    shared->free_chunks = chunks;
+
+    cache_shared = shared;
+
+    return 0;
+}
+
+void cache_session_begin(int slot)
+{
+    cache_slot = slot;
+}
+
+/**
+ * the key of a file in the ghosts, never 0
+ */
+static unsigned long long cache_key(dev_t dev, ino_t ino)
+{
+    unsigned long long key;
+
+    key = ((unsigned long long)dev * 0x9e3779b97f4a7c15ULL) ^ (unsigned long long)ino;
+    key ^= key >> 29;
+
+    return key | 1;
+}
+
+static int cache_bucket(dev_t dev, ino_t ino)
+{
+    return (int)(cache_key(dev, ino) * 0xbf58476d1ce4e5b9ULL >> 32) & (cache_shared->bucket_count - 1);
+}
+
+static void cache_queue_push(int index, int queue)
+{
+    struct cache_entry *entry = &cache_entries[index];
+
+    entry->queue = queue;
+    entry->prev = CACHE_NONE;
+    entry->next = cache_shared->head[queue];
+
+    if (entry->next != CACHE_NONE)
+        cache_entries[entry->next].prev = index;
+    else
+        cache_shared->tail[queue] = index;
+
+    cache_shared->head[queue] = index;
+    cache_shared->queue_chunks[queue] += entry->chunks;
+}
+
+static void cache_queue_remove(int index)
+{
+    struct cache_entry *entry = &cache_entries[index];
+
+    if (entry->prev != CACHE_NONE)
+        cache_entries[entry->prev].next = entry->next;
+    else
+        cache_shared->head[entry->queue] = entry->next;
+
+    if (entry->next != CACHE_NONE)
+        cache_entries[entry->next].prev = entry->prev;
+    else
+        cache_shared->tail[entry->queue] = entry->prev;
+
+    cache_shared->queue_chunks[entry->queue] -= entry->chunks;
+}
+
+static void cache_hash_remove(int index)
+{
+    struct cache_entry *entry = &cache_entries[index];
+    int *link;
+
+    link = &cache_buckets[cache_bucket(entry->dev, entry->ino)];
+
+    while (*link != index)
+        link = &cache_entries[*link].hash_next;
+
+    *link = entry->hash_next;
+}
+
+/**
+ * give the chunks and the entry of index back
+ */
+static void cache_free(int index)
+{
+    struct cache_entry *entry = &cache_entries[index];
+    int last;
+
+    if (entry->chunks > 0)
+    {
+        for (last = entry->first_chunk; cache_chunk_next[last] != CACHE_NONE; last = cache_chunk_next[last])
+            ;
+
+        cache_chunk_next[last] = cache_shared->free_chunk;
+        cache_shared->free_chunk = entry->first_chunk;
+        cache_shared->free_chunks += entry->chunks;
+    }
+
+    cache_shared->stats.bytes -= entry->size;
+    cache_shared->stats.entries--;
+
+    entry->state = CACHE_FREE;
+    entry->next = cache_shared->free_entry;
+    cache_shared->free_entry = index;
+}
+
+/**
+ * take index out of the index and its queue, it is freed once unpinned
+ */
+static void cache_remove(int index)
+{
+    cache_hash_remove(index);
+    cache_queue_remove(index);
+
+    if (0 == cache_entries[index].refs)
+        cache_free(index);
+    else
+        cache_entries[index].state = CACHE_STALE;
+}
+
+static void cache_unpin(int index)
+{
+    struct cache_entry *entry = &cache_entries[index];
+
+    entry->refs--;
+
+    if (0 == entry->refs && CACHE_STALE == entry->state)
+        cache_free(index);
+}
+
+/**
+ * the slot of key in the ghosts, other bits than those of its bucket
+ */
+static int cache_ghost_slot(unsigned long long key)
+{
+    return (int)(key * 0x94d049bb133111ebULL >> 32) & (cache_shared->ghost_count - 1);
+}
+
+/**
+ * remember the key of an entry dropped from the small queue
+ */
+static void cache_ghost_add(unsigned long long key)
+{
+    cache_ghosts[cache_ghost_slot(key)] = key;
+}
+
+/**
+ * return 1 and forget key if it is a ghost or 0 if not
+ */
+static int cache_ghost_take(unsigned long long key)
+{
+    int slot;
+
+    slot = cache_ghost_slot(key);
+
+    if (cache_ghosts[slot] != key)
+        return 0;
+
+    cache_ghosts[slot] = 0;
+
+    return 1;
+}
+
+/**
+ * pass over the oldest entry of queue: promote, give another round or drop it
+ * return 1 if an entry was dropped or 0 if not
+ */
+static int cache_evict_one(int queue)
+{
+    struct cache_entry *entry;
+    int index;
+
+    index = cache_shared->tail[queue];
+    if (CACHE_NONE == index)
+        return 0;
+
+    entry = &cache_entries[index];
+    cache_queue_remove(index);
+
+    if (entry->refs > 0)
+    {
+        cache_queue_push(index, queue);
+        return 0;
+    }
+
+    if (CACHE_QUEUE_SMALL == queue && entry->freq > 0)
+    {
+        entry->freq = 0;
+        cache_queue_push(index, CACHE_QUEUE_MAIN);
+        return 0;
+    }
+
+    if (CACHE_QUEUE_MAIN == queue && entry->freq > 0)
+    {
+        entry->freq--;
+        cache_queue_push(index, CACHE_QUEUE_MAIN);
+        return 0;
+    }
+
+    if (CACHE_QUEUE_SMALL == queue)
+        cache_ghost_add(cache_key(entry->dev, entry->ino));
+
+    cache_hash_remove(index);
+    cache_free(index);
+    cache_shared->stats.evictions++;
+
+    return 1;
+}
+
+/**
+ * evict until chunks chunks and an entry are free
+ * return 0 if success or -1 if every entry left is pinned
+ */
+static int cache_make_room(int chunks)
+{
+    int small_target;
+    int queue;
+    int passes;
+
+    small_target = cache_shared->chunk_count / 100 * CACHE_SMALL_PERCENT;
+
+    /* every entry is passed over a few times at most before giving up */
+    passes = 0;
+
+    while (cache_shared->free_chunks < chunks || CACHE_NONE == cache_shared->free_entry)
+    {
+        if (passes++ > (CACHE_FREQ_MAX + 2) * cache_shared->entry_count)
+            return -1;
+
+        if (cache_shared->queue_chunks[CACHE_QUEUE_SMALL] > small_target ||
+            CACHE_NONE == cache_shared->tail[CACHE_QUEUE_MAIN])
+            queue = CACHE_QUEUE_SMALL;
+        else
+            queue = CACHE_QUEUE_MAIN;
+
+        if (CACHE_NONE == cache_shared->tail[queue])
+            return -1;
+
+        cache_evict_one(queue);
+    }
+
+    return 0;
+}
+
+/**
+ * make a pinned entry for the file of statbuf, its chunks taken off the free list
+ * return the entry or CACHE_NONE if there is no room
+ */
+static int cache_insert(const struct stat *statbuf)
+{
+    struct cache_entry *entry;
+    int chunks;
+    int index;
+    int last;
+    int i;
+
+    chunks = (statbuf->st_size + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE;
+
+    if (cache_make_room(chunks) < 0)
+        return CACHE_NONE;
+
+    index = cache_shared->free_entry;
+    entry = &cache_entries[index];
+    cache_shared->free_entry = entry->next;
+
+    entry->dev = statbuf->st_dev;
+    entry->ino = statbuf->st_ino;
+    entry->size = statbuf->st_size;
+    entry->mtime_ns = (long long)statbuf->st_mtim.tv_sec * 1000000000LL + statbuf->st_mtim.tv_nsec;
+    entry->state = CACHE_LOADING;
+    entry->freq = 0;
+    entry->refs = 1;
+    entry->chunks = chunks;
+    entry->first_chunk = CACHE_NONE;
+
+    if (chunks > 0)
+    {
+        entry->first_chunk = last = cache_shared->free_chunk;
+        for (i = 1; i < chunks; i++)
+            last = cache_chunk_next[last];
+
+        cache_shared->free_chunk = cache_chunk_next[last];
+        cache_chunk_next[last] = CACHE_NONE;
+        cache_shared->free_chunks -= chunks;
+    }
+
+    i = cache_bucket(entry->dev, entry->ino);
+    entry->hash_next = cache_buckets[i];
+    cache_buckets[i] = index;
+
+    cache_queue_push(index, cache_ghost_take(cache_key(entry->dev, entry->ino)) ? CACHE_QUEUE_MAIN
+                                                                                : CACHE_QUEUE_SMALL);
+
+    cache_shared->stats.bytes += entry->size;
+    cache_shared->stats.entries++;
+
+    return index;
+}
+
+/**
+ * read the file of filename into the chunks of the pinned entry index
+ * return 0 if success or -1 if error or the file changed meanwhile
+ */
+static int cache_load(const char *filename, int index)
+{
+    struct cache_entry *entry = &cache_entries[index];
+    struct stat statbuf;
+    long long left;
+    ssize_t size;
+    int chunk;
+    int fd;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    left = entry->size;
+
+    for (chunk = entry->first_chunk; left > 0; chunk = cache_chunk_next[chunk])
+    {
+        size = pread(fd, cache_data + (size_t)chunk * CACHE_CHUNK_SIZE,
+                     left < CACHE_CHUNK_SIZE ? left : CACHE_CHUNK_SIZE, entry->size - left);
+
+        if (size <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+
+        left -= size;
+
+        /* a short read leaves a hole in the chunk, the file changed */
+        if (size < CACHE_CHUNK_SIZE && left > 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (fstat(fd, &statbuf) < 0 ||
+        statbuf.st_ino != entry->ino || statbuf.st_size != entry->size ||
+        (long long)statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec != entry->mtime_ns)
+    {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+static void cache_pin(struct cache_file *file, int index)
+{
+    file->entry = index;
+    file->chunk = cache_entries[index].first_chunk;
+    file->left = cache_entries[index].size;
+
+    if (cache_slot >= 0 && cache_slot < cache_shared->slot_count)
+        cache_pins[cache_slot] = index;
+}
+
+int cache_open(const char *filename, struct cache_file *file)
+{
+    struct cache_entry *entry;
+    struct stat statbuf;
+    long long mtime_ns;
+    int index;
+
+    if (!cache_shared)
+        return 0;
+
+    if (stat(filename, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) ||
+        statbuf.st_size > cache_shared->max_file)
+        return 0;
+
+    mtime_ns = (long long)statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec;
+
+    if (cache_lock() < 0)
+    {
+        cache_unlock();
+        return 0;
+    }
+
+    index = cache_buckets[cache_bucket(statbuf.st_dev, statbuf.st_ino)];
+    while (index != CACHE_NONE &&
+           (cache_entries[index].dev != statbuf.st_dev || cache_entries[index].ino != statbuf.st_ino))
+        index = cache_entries[index].hash_next;
+
+    if (index != CACHE_NONE)
+    {
+        entry = &cache_entries[index];
+
+        if (CACHE_READY == entry->state && entry->size == statbuf.st_size && entry->mtime_ns == mtime_ns)
+        {
+            if (entry->freq < CACHE_FREQ_MAX)
+                entry->freq++;
+            entry->refs++;
+            cache_pin(file, index);
+
+            cache_shared->stats.hits++;
+            cache_shared->stats.bytes_served += entry->size;
+
+            cache_unlock();
+            return 1;
+        }
+
+        /* another session is reading it in, this one reads the file */
+        if (CACHE_LOADING == entry->state)
+        {
+            cache_shared->stats.misses++;
+            cache_unlock();
+            return 0;
+        }
+
+        cache_remove(index);
+        cache_shared->stats.stale++;
+    }
+
+    cache_shared->stats.misses++;
+
+    index = cache_insert(&statbuf);
+    if (CACHE_NONE == index)
+    {
+        cache_unlock();
+        return 0;
+    }
+
+    cache_pin(file, index);
+    cache_unlock();
+
+    if (cache_load(filename, index) < 0)
+    {
+        if (0 == cache_lock())
+        {
+            cache_remove(index);
+            cache_unpin(index);
+            if (cache_slot >= 0 && cache_slot < cache_shared->slot_count)
+                cache_pins[cache_slot] = CACHE_NONE;
+        }
+        cache_unlock();
+        return 0;
+    }
+
+    /* disabled meanwhile, the chunks are read in and stay pinned */
+    if (0 == cache_lock())
+    {
+        cache_entries[index].state = CACHE_READY;
+        cache_shared->stats.insertions++;
+    }
+    cache_unlock();
+
+    return 1;
+}
+
+int cache_next(struct cache_file *file, struct iovec *iov, int max_iov, int *count)
+{
+    int total;
+    int size;
+
+    total = 0;
+    *count = 0;
+
+    while (file->left > 0 && *count < max_iov)
+    {
+        size = file->left < CACHE_CHUNK_SIZE ? file->left : CACHE_CHUNK_SIZE;
+
+        iov[*count].iov_base = cache_data + (size_t)file->chunk * CACHE_CHUNK_SIZE;
+        iov[*count].iov_len = size;
+        (*count)++;
+
+        total += size;
+        file->left -= size;
+        file->chunk = cache_chunk_next[file->chunk];
+    }
+
+    return total;
+}
+
+void cache_close(struct cache_file *file)
+{
+    if (0 == cache_lock())
+    {
+        cache_unpin(file->entry);
+        if (cache_slot >= 0 && cache_slot < cache_shared->slot_count)
+            cache_pins[cache_slot] = CACHE_NONE;
+    }
+
+    cache_unlock();
+}
+
+void cache_retire(int slot)
+{
+    if (!cache_shared || slot < 0 || slot >= cache_shared->slot_count)
+        return;
+
+    if (0 == cache_lock() && cache_pins[slot] != CACHE_NONE)
+    {
+        cache_unpin(cache_pins[slot]);
+        cache_pins[slot] = CACHE_NONE;
+    }
+
+    cache_unlock();
+}
+
+int cache_read_stats(struct cache_stats *stats)
+{
+    if (!cache_shared)
+        return -1;
+
+    /* the counters are read even from a disabled cache */
+    cache_lock();
+    *stats = cache_shared->stats;
+    cache_unlock();
+
+    return 0;
+}
+
+#endif
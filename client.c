@@ -4,6 +4,18 @@
  */
 
 #include "client.h"
+#include "parallel.h"
+
+/**
+ * print the options
+ */
+void usage(void);
+
+/**
+ * run the batch mode over a pool of sessions
+ * return 0 if every file is moved or -1 if not
+ */
+int batch_main(int argc, char *argv[]);
 
 int main(int argc, char *argv[])
 {
@@ -12,22 +24,43 @@ int main(int argc, char *argv[])
 
     char *host;
     int code;
+    int id;
+    int varlen;
 
     int result;
 
     char user_name[BUF_SIZE];
     char password[BUF_SIZE];
-    char command[BUF_SIZE];
+    char command[COMMAND_INPUT_SIZE];
+
+    long long session_start;
+    long long command_start;
+    long long phase_start;
+
+    if (command_registry_check() < 0)
+        exit(1);
+
+    if (argc > 1 && '-' == argv[1][0])
+        exit(batch_main(argc, argv) < 0 ? 1 : 0);
 
     if (argc != 3)
     {
-        error_handling("usage: ./client hostname port\n");
+        usage();
         exit(1);
     }
 
     host = argv[1];
     cmd_port = atoi(argv[2]);
 
+    result = trace_initialize("client");
+    if (result < 0)
+    {
+        error_handling("trace_initialize() error");
+        exit(1);
+    }
+
+    session_start = trace_begin();
+
     command_sockfd = client_socket_connect(host, cmd_port);
     if (command_sockfd < 0)
     {
@@ -35,6 +68,23 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    trace_end(TRACE_CONNECT, session_start, host, cmd_port);
+
+    /* asked for, TLS is required: the password never goes in the clear */
+    if (getenv(TLS_CA_ENV))
+    {
+        result = tls_client_initialize(getenv(TLS_CA_ENV));
+        if (0 == result)
+            result = negotiate_tls(command_sockfd, host);
+
+        if (result <= 0)
+        {
+            close(command_sockfd);
+            error_handling(result < 0 ? "negotiate_tls() error" : "the server refused TLS");
+            exit(1);
+        }
+    }
+
     result = user_input_name_and_password(user_name, password);
     if (result < 0)
     {
@@ -43,6 +93,8 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    phase_start = trace_begin();
+
     result = login(command_sockfd, user_name, password);
     if (result < 0)
     {
@@ -59,6 +111,8 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    trace_end(TRACE_LOGIN, phase_start, user_name + CMD_LEN, code);
+
     result = print_code(code);
     if (result < 0)
     {
@@ -67,6 +121,24 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    /* a server without it replies 502 and the fixed encoding stays */
+    varlen = negotiate_varlen(command_sockfd);
+    if (varlen < 0)
+    {
+        close(command_sockfd);
+        error_handling("negotiate_varlen() error");
+        exit(1);
+    }
+
+    /* a 213 reply says by itself that the file follows inline */
+    result = negotiate_inline(command_sockfd, varlen);
+    if (result < 0)
+    {
+        close(command_sockfd);
+        error_handling("negotiate_inline() error");
+        exit(1);
+    }
+
     result = chdir(DEFAULT_CLIENT_WORK_DIR);
     if (result < 0)
     {
@@ -77,19 +149,28 @@ int main(int argc, char *argv[])
 
     while (1)
     {
-        result = user_input_command(command);
-        if (result < 0)
+        id = user_input_command(command);
+        if (id < 0)
         {
             continue;
         }
 
-        if (0 == strncmp(command, CMD_HELP, ARG_LEN))
+        if (command_specs[id].flags & COMMAND_LOCAL)
         {
             print_help_information();
             continue;
         }
 
-        result = send_command(command_sockfd, command);
+        /* the fixed encoding holds ARG_LEN chars with the '\0' */
+        if (!varlen && strlen(command + CMD_LEN) >= ARG_LEN)
+        {
+            error_handling("the server takes names of at most 122 chars");
+            continue;
+        }
+
+        command_start = trace_begin();
+
+        result = send_command(command_sockfd, command, varlen);
         if (result < 0)
         {
             close(command_sockfd);
@@ -97,6 +178,8 @@ int main(int argc, char *argv[])
             exit(1);
         }
 
+        phase_start = trace_begin();
+
         result = recv_code(command_sockfd, &code);
         if (result < 0)
         {
@@ -105,6 +188,8 @@ int main(int argc, char *argv[])
             exit(1);
         }
 
+        trace_end(TRACE_REPLY_WAIT, phase_start, NULL, code);
+
         result = print_code(code);
         if (result < 0)
         {
@@ -116,9 +201,7 @@ int main(int argc, char *argv[])
         switch (code)
         {
         case 120:
-            if (0 == strncmp(command, CMD_LIST, CMD_LEN) ||
-                0 == strncmp(command, CMD_RETR, CMD_LEN) ||
-                0 == strncmp(command, CMD_STOR, CMD_LEN))
+            if (command_specs[id].flags & COMMAND_DATA)
             {
                 result = recv_data_port(command_sockfd, &data_port);
                 if (result < 0)
@@ -128,6 +211,8 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
+                phase_start = trace_begin();
+
                 data_sockfd = client_socket_connect(host, data_port);
                 if (data_sockfd < 0)
                 {
@@ -136,6 +221,16 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
+                if (tls_configured && tls_connect(data_sockfd, host) < 0)
+                {
+                    close(command_sockfd);
+                    close(data_sockfd);
+                    error_handling("tls_connect() error");
+                    exit(1);
+                }
+
+                trace_end(TRACE_DATA_CONNECT, phase_start, NULL, data_port);
+
                 result = recv_code(command_sockfd, &code);
                 if (result < 0)
                 {
@@ -152,7 +247,7 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
-                if (0 == strncmp(command, CMD_RETR, CMD_LEN))
+                if (COMMAND_RETR == id)
                 {
                     result = recv_file(data_sockfd, command);
                     if (result < 0)
@@ -163,9 +258,11 @@ int main(int argc, char *argv[])
                         exit(1);
                     }
                 }
-                else if (0 == strncmp(command, CMD_STOR, CMD_LEN))
+                else if (COMMAND_STOR == id)
                 {
                     result = send_file(data_sockfd, command);
+                    if (result >= 0)
+                        result = tls_close_notify(data_sockfd);
                     if (result < 0)
                     {
                         close(command_sockfd);
@@ -174,7 +271,7 @@ int main(int argc, char *argv[])
                         exit(1);
                     }
                 }
-                else if (0 == strncmp(command, CMD_LIST, CMD_LEN))
+                else if (COMMAND_LIST == id || COMMAND_STAT == id || COMMAND_SRCH == id)
                 {
                     result = recv_list(command_sockfd, data_sockfd);
                     if (result < 0)
@@ -185,9 +282,22 @@ int main(int argc, char *argv[])
                         exit(1);
                     }
                 }
+                else if (COMMAND_SUBS == id)
+                {
+                    result = recv_events(data_sockfd);
+                    if (result < 0)
+                    {
+                        close(command_sockfd);
+                        close(data_sockfd);
+                        error_handling("recv_events() error");
+                        exit(1);
+                    }
+                }
 
                 close(data_sockfd);
 
+                phase_start = trace_begin();
+
                 result = recv_code(command_sockfd, &code);
                 if (result < 0)
                 {
@@ -196,6 +306,8 @@ int main(int argc, char *argv[])
                     exit(1);
                 }
 
+                trace_end(TRACE_REPLY_WAIT, phase_start, NULL, code);
+
                 result = print_code(code);
                 if (result < 0)
                 {
@@ -205,12 +317,32 @@ int main(int argc, char *argv[])
                 }
             }
 
+            trace_end(TRACE_COMMAND, command_start, command, code);
+
+            break;
+        case 213:
+            if (COMMAND_DUSG == id)
+                result = recv_inline_text(command_sockfd);
+            else
+                result = recv_inline_file(command_sockfd, command);
+
+            if (result < 0)
+            {
+                close(command_sockfd);
+                error_handling("recv_inline_file() error");
+                exit(1);
+            }
+
+            trace_end(TRACE_COMMAND, command_start, command, code);
             break;
         case 221:
+            trace_end(TRACE_COMMAND, command_start, command, code);
             goto break_2;
         case 502:
+            trace_end(TRACE_COMMAND, command_start, command, code);
             break;
         default:
+            trace_end(TRACE_COMMAND, command_start, command, code);
             break;
         }
     }
@@ -219,5 +351,101 @@ break_2:
 
     close(command_sockfd);
 
+    trace_end(TRACE_SESSION, session_start, user_name + CMD_LEN, 0);
+
     exit(0);
+}
+
+void usage(void)
+{
+    error_handling("usage: ./client hostname port\n"
+                   "  with " TLS_CA_ENV " set to a PEM file of CA certificates the session is encrypted, make TLS=1\n"
+                   "       ./client -R|-S [options] hostname port [file...]\n"
+                   "  -R       retrieve the files, names or patterns matched against LIST\n"
+                   "  -S       store the local files, names or glob patterns\n"
+                   "  -l path  read more names or patterns from path, - for stdin\n"
+                   "  -j num   sessions transferring at the same time (4)\n"
+                   "  -U name  user name (anonymous)\n"
+                   "  -P word  password\n"
+                   "  the batch sessions have no TLS and refuse to start with " TLS_CA_ENV " set");
+}
+
+int batch_main(int argc, char *argv[])
+{
+    struct parallel_batch batch;
+    const char *list = NULL;
+    int sessions = PARALLEL_DEFAULT_SESSIONS;
+    int mode = 0;
+    int option;
+    int i;
+
+    /* asked for, TLS is required, and the sessions of a batch log in in the clear */
+    if (getenv(TLS_CA_ENV))
+    {
+        error_handling("the batch transfers have no TLS, unset " TLS_CA_ENV);
+        return -1;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.user = ANONYMOUS;
+    batch.password = "";
+    batch.pool = getenv(POOL_ENV);
+
+    while ((option = getopt(argc, argv, "RSl:j:U:P:")) != -1)
+    {
+        switch (option)
+        {
+        case 'R':
+        case 'S':
+            mode = option;
+            break;
+        case 'l':
+            list = optarg;
+            break;
+        case 'j':
+            sessions = atoi(optarg);
+            break;
+        case 'U':
+            batch.user = optarg;
+            break;
+        case 'P':
+            batch.password = optarg;
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+
+    if (!mode || argc - optind < 2 || sessions < 1 || sessions > PARALLEL_MAX_SESSIONS)
+    {
+        usage();
+        return -1;
+    }
+
+    batch.host = argv[optind];
+    batch.port = atoi(argv[optind + 1]);
+    batch.upload = 'S' == mode;
+
+    /* the local names are relative to where the client was started */
+    for (i = optind + 2; i < argc; i++)
+    {
+        if (parallel_add(&batch, argv[i]) < 0)
+            return -1;
+    }
+
+    if (list && parallel_add_list(&batch, list) < 0)
+        return -1;
+
+    if (chdir(DEFAULT_CLIENT_WORK_DIR) < 0)
+    {
+        error_handling("The DEFAULT_CLIENT_WORK_DIR is unavailable");
+        perror("chdir() error");
+        return -1;
+    }
+
+    i = parallel_run(&batch, sessions);
+    free(batch.jobs);
+
+    return i;
 }
\ No newline at end of file
@@ -7,8 +7,23 @@
  */
 
 #include "base.h"
+#include "commands.h"
+#include "control.h"
+#include "tls.h"
+#include "trace.h"
 #include <features.h>
 
+/**
+ * the size of the reads of a file sent by STOR
+ */
+#define SEND_BUF_SIZE (64 * 1024)
+
+/**
+ * the size of a typed command, its argument may be as long as a path
+ * once the variable encoding is negotiated
+ */
+#define COMMAND_INPUT_SIZE (CMD_LEN + CONTROL_ARG_MAX)
+
 /**
  * get user name and password from stdin
  * return 0 if success or -1 if error
@@ -34,16 +49,37 @@ int recv_code(int command_sockfd, int *code);
 int print_code(int code);
 
 /**
- * get a command from stdin
- * return 0 if success or -1 if error
+ * get a command from stdin into command of COMMAND_INPUT_SIZE chars,
+ * its argument at CMD_LEN
+ * return its id in commands.h or -1 if error
  */
 int user_input_command(char *command);
 
 /**
- * send the command to server
+ * ask the server for the variable encoding of control.h
+ * return 1 if it was accepted, 0 if refused or -1 if error
+ */
+int negotiate_varlen(int command_sockfd);
+
+/**
+ * ask the server for TLS with OPTS_TLS and run the handshake on the
+ * command connection, checking the certificate of host
+ * return 1 if it is encrypted, 0 if the server refused or -1 if error
+ */
+int negotiate_tls(int command_sockfd, const char *host);
+
+/**
+ * ask the server to send small files inline with OPTS_INLINE, in the
+ * encoding of varlen
+ * return 1 if it agreed, 0 if not or -1 if error
+ */
+int negotiate_inline(int command_sockfd, int varlen);
+
+/**
+ * send the command to server, in the variable encoding if varlen
  * return 0 if success or -1 if error
  */
-int send_command(int command_sockfd, const char *command);
+int send_command(int command_sockfd, const char *command, int varlen);
 
 /**
  * receive the current random port for receiving/sending data from server
@@ -57,6 +93,18 @@ int recv_data_port(int command_sockfd, int *data_port);
  */
 int recv_file(int data_sockfd, const char *command);
 
+/**
+ * receive the length and the data of a 213 reply into the file of command
+ * return 0 if success or -1 if error
+ */
+int recv_inline_file(int command_sockfd, const char *command);
+
+/**
+ * receive the length and the text of a 213 reply and print it
+ * return 0 if success or -1 if error
+ */
+int recv_inline_text(int command_sockfd);
+
 /**
  * send a file to server via data sock fd
  * return 0 if success or -1 if error
@@ -69,6 +117,13 @@ int send_file(int data_sockfd, const char *command);
  */
 int recv_list(int command_sockfd, int data_sockfd);
 
+/**
+ * print the events of a subscription as they come, line by line,
+ * until the server ends the feed or the client is interrupted
+ * return 0 if success or -1 if error
+ */
+int recv_events(int data_sockfd);
+
 /**
  * read a piece of buffer in stdin
  * and change '\\n' and space in buffer to '\0'
@@ -161,6 +216,9 @@ int print_code(int code)
     printf("%d: ", code);
     switch (code)
     {
+    case 200:
+        printf("Command okay.\n");
+        break;
     case 230:
         printf("User logged in, proceed.\n");
         printf("For FTP command help, use \"%s\"\n", CMD_HELP);
@@ -178,6 +236,9 @@ int print_code(int code)
     case 502:
         printf("Command not implemented.\n");
         break;
+    case 421:
+        printf("Service not available, closing control connection.\n");
+        return -1;
 
     case 125:
         printf("Data connection already open; transfer starting.\n");
@@ -185,6 +246,15 @@ int print_code(int code)
     case 226:
         printf("Closing data connection. Requested file action successful.\n");
         break;
+    case 213:
+        printf("File status okay; the data follows inline.\n");
+        break;
+    case 552:
+        printf("Requested file action aborted. Exceeded storage allocation.\n");
+        break;
+    case 350:
+        printf("Requested file action pending further information.\n");
+        break;
     default:
         error_handling("Invalid code.\n");
         return -1;
@@ -195,39 +265,138 @@ int print_code(int code)
 
 int user_input_command(char *command)
 {
+    int id;
     int i;
 
     printf("ftp> ");
     fflush(stdout);
 
-    read_input(command, BUF_SIZE);
+    read_input(command, COMMAND_INPUT_SIZE);
 
     for (i = 0; i < CMD_LEN; i++)
         command[i] = toupper(command[i]);
 
-    if (0 == strncmp(command, CMD_LIST, CMD_LEN) ||
-        0 == strncmp(command, CMD_HELP, CMD_LEN) ||
-        0 == strncmp(command, CMD_QUIT, CMD_LEN) ||
-        0 == strncmp(command, CMD_RETR, CMD_LEN) ||
-        0 == strncmp(command, CMD_STOR, CMD_LEN) ||
-        0 == strncmp(command, CMD_APPE, CMD_LEN) ||
-        0 == strncmp(command, CMD_DELE, CMD_LEN) ||
-        0 == strncmp(command, CMD_MKD, CMD_LEN) ||
-        0 == strncmp(command, CMD_RMD, CMD_LEN) ||
-        0 == strncmp(command, CMD_CWD, CMD_LEN))
-        return 0;
-    else
+    id = command_lookup(command);
+
+    /* the options are negotiated by the client, a typed one would desync it */
+    if (id < 0 || (command_specs[id].flags & COMMAND_INTERNAL))
     {
         error_handling("invalid command");
         return -1;
     }
+
+    return id;
 }
 
-int send_command(int command_sockfd, const char *command)
+int negotiate_varlen(int command_sockfd)
 {
+    char buffer[BUF_SIZE];
     int result;
+    int code;
+
+    control_encode(buffer, BUF_SIZE, 0, CMD_OPTS, OPTS_VARLEN);
+
+    result = send(command_sockfd, buffer, BUF_SIZE, MSG_WAITALL);
+
+    if (result < 0)
+    {
+        perror("send() error");
+        return -1;
+    }
+
+    result = recv_code(command_sockfd, &code);
+
+    if (result < 0)
+    {
+        error_handling("recv_code() error");
+        return -1;
+    }
+
+    return 200 == code ? 1 : 0;
+}
+
+int negotiate_tls(int command_sockfd, const char *host)
+{
+    char buffer[BUF_SIZE];
+    int result;
+    int code;
+
+    control_encode(buffer, BUF_SIZE, 0, CMD_OPTS, OPTS_TLS);
+
+    result = send(command_sockfd, buffer, BUF_SIZE, MSG_WAITALL);
+
+    if (result < 0)
+    {
+        perror("send() error");
+        return -1;
+    }
+
+    result = recv_code(command_sockfd, &code);
+
+    if (result < 0)
+    {
+        error_handling("recv_code() error");
+        return -1;
+    }
+
+    if (code != 200)
+        return 0;
+
+    result = tls_connect(command_sockfd, host);
+
+    if (result < 0)
+    {
+        error_handling("tls_connect() error");
+        return -1;
+    }
+
+    return 1;
+}
+
+int negotiate_inline(int command_sockfd, int varlen)
+{
+    char buffer[BUF_SIZE];
+    int length;
+    int result;
+    int code;
+
+    length = control_encode(buffer, BUF_SIZE, varlen, CMD_OPTS, OPTS_INLINE);
+
+    result = send(command_sockfd, buffer, length, MSG_WAITALL);
+
+    if (result < 0)
+    {
+        perror("send() error");
+        return -1;
+    }
+
+    result = recv_code(command_sockfd, &code);
+
+    if (result < 0)
+    {
+        error_handling("recv_code() error");
+        return -1;
+    }
+
+    return 200 == code ? 1 : 0;
+}
+
+int send_command(int command_sockfd, const char *command, int varlen)
+{
+    char buffer[CONTROL_MESSAGE_MAX];
+    int length;
+    int result;
+
+    /* the command is a standard buffer, its argument at CMD_LEN */
+    length = control_encode(buffer, sizeof(buffer), varlen, command, command + CMD_LEN);
+
+    if (length < 0)
+    {
+        error_handling("control_encode() error");
+        return -1;
+    }
 
-    result = send(command_sockfd, command, BUF_SIZE, MSG_WAITALL);
+    result = send(command_sockfd, buffer, length, MSG_WAITALL);
 
     if (result < 0)
     {
@@ -260,20 +429,40 @@ int recv_file(int data_sockfd, const char *command)
 {
     char buffer[BUF_SIZE];
     int size;
-    char arg[ARG_LEN];
+    const char *arg = command + CMD_LEN;
     FILE *fd;
 
     int size_of_file = 0;
 
-    memcpy(arg, command + CMD_LEN, ARG_LEN);
+    long long transfer_start;
+    long long io_start;
+
+    transfer_start = trace_begin();
+
     fd = fopen(arg, "w");
 
-    while ((size = recv(data_sockfd, buffer, BUF_SIZE, MSG_WAITALL)) > 0)
+    while (1)
     {
+        io_start = trace_begin();
+        size = recv(data_sockfd, buffer, BUF_SIZE, MSG_WAITALL);
+        trace_io(TRACE_NET_RECV, io_start);
+
+        if (size <= 0)
+        {
+            size = tls_recv_end(data_sockfd, size);
+            break;
+        }
+
         size_of_file += size;
+
+        io_start = trace_begin();
         fwrite(buffer, 1, size, fd);
+        trace_io(TRACE_DISK_WRITE, io_start);
     }
 
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, arg, size_of_file);
+
     printf("received %d bytes of file\n", size_of_file);
 
     if (size < 0)
@@ -287,10 +476,105 @@ int recv_file(int data_sockfd, const char *command)
     return 0;
 }
 
+int recv_inline_file(int command_sockfd, const char *command)
+{
+    char buffer[INLINE_LIMIT];
+    const char *arg = command + CMD_LEN;
+    int recv_length;
+    int length;
+    int result;
+    FILE *fd;
+
+    long long transfer_start;
+
+    transfer_start = trace_begin();
+
+    result = recv(command_sockfd, &recv_length, sizeof(recv_length), MSG_WAITALL);
+
+    if (result != (int)sizeof(recv_length))
+    {
+        perror("recv() error");
+        return -1;
+    }
+
+    length = ntohl(recv_length);
+
+    if (length < 0 || length > INLINE_LIMIT)
+    {
+        error_handling("invalid inline length");
+        return -1;
+    }
+
+    if (length > 0)
+    {
+        result = recv(command_sockfd, buffer, length, MSG_WAITALL);
+
+        if (result != length)
+        {
+            perror("recv() error");
+            return -1;
+        }
+    }
+
+    fd = fopen(arg, "w");
+
+    if (!fd)
+    {
+        perror("fopen() error");
+        return -1;
+    }
+
+    fwrite(buffer, 1, length, fd);
+    fclose(fd);
+
+    trace_end(TRACE_TRANSFER, transfer_start, arg, length);
+
+    printf("received %d bytes of file\n", length);
+
+    return 0;
+}
+
+int recv_inline_text(int command_sockfd)
+{
+    char buffer[INLINE_LIMIT + 1];
+    int recv_length;
+    int length;
+    int result;
+
+    result = recv(command_sockfd, &recv_length, sizeof(recv_length), MSG_WAITALL);
+
+    if (result != (int)sizeof(recv_length))
+    {
+        perror("recv() error");
+        return -1;
+    }
+
+    length = ntohl(recv_length);
+
+    if (length < 0 || length > INLINE_LIMIT)
+    {
+        error_handling("invalid inline length");
+        return -1;
+    }
+
+    result = recv(command_sockfd, buffer, length, MSG_WAITALL);
+
+    if (result != length)
+    {
+        perror("recv() error");
+        return -1;
+    }
+
+    buffer[length] = '\0';
+    printf("%s", buffer);
+
+    return 0;
+}
+
 int send_file(int data_sockfd, const char *command)
 {
-    char buffer[BUF_SIZE];
-    char filename[ARG_LEN];
+    char buffer[SEND_BUF_SIZE];
+    const char *filename = command + CMD_LEN;
 
     int result;
     int size;
@@ -298,26 +582,46 @@ int send_file(int data_sockfd, const char *command)
 
     int size_of_file = 0;
 
-    memcpy(filename, command + CMD_LEN, ARG_LEN - 1);
+    long long transfer_start;
+    long long io_start;
+
+    transfer_start = trace_begin();
+
     fd = fopen(filename, "r");
 
-    fseek(fd, SEEK_SET, 0);
+    if (!fd)
+    {
+        perror("fopen() error");
+        return -1;
+    }
 
-    memset(buffer, 0, BUF_SIZE);
-    while ((size = fread(buffer, 1, BUF_SIZE - 1, fd)) > 0)
+    /* the bytes of the file only, the server writes what it receives */
+    while (1)
     {
+        io_start = trace_begin();
+        size = fread(buffer, 1, SEND_BUF_SIZE, fd);
+        trace_io(TRACE_DISK_READ, io_start);
+
+        if (size <= 0)
+            break;
+
         size_of_file += size;
-        buffer[size] = '\0';
-        result = send(data_sockfd, buffer, size + 1, 0);
+
+        io_start = trace_begin();
+        result = send(data_sockfd, buffer, size, 0);
+        trace_io(TRACE_NET_SEND, io_start);
+
         if (result < 0)
         {
             perror("send() error");
+            fclose(fd);
             return -1;
         }
-
-        memset(buffer, 0, BUF_SIZE);
     }
 
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, filename, size_of_file);
+
     printf("sent file: %d bytes\n", size_of_file);
 
     fclose(fd);
@@ -332,16 +636,34 @@ int recv_list(int command_sockfd, int data_sockfd)
 
     int size_of_list = 0;
 
+    long long transfer_start;
+    long long io_start;
+
+    transfer_start = trace_begin();
+
     printf("\nLIST: \n");
 
     memset(buffer, 0, sizeof(buffer));
-    while ((size = recv(data_sockfd, buffer, BUF_SIZE, MSG_WAITALL)) > 0)
+    while (1)
     {
+        io_start = trace_begin();
+        size = recv(data_sockfd, buffer, BUF_SIZE, MSG_WAITALL);
+        trace_io(TRACE_NET_RECV, io_start);
+
+        if (size <= 0)
+        {
+            size = tls_recv_end(data_sockfd, size);
+            break;
+        }
+
         printf("%s", buffer);
         memset(buffer, 0, sizeof(buffer));
         size_of_list += size;
     }
 
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, "text", size_of_list);
+
     printf("\nreceived %d bytes of list\n", size_of_list);
 
     if (size < 0)
@@ -352,6 +674,28 @@ int recv_list(int command_sockfd, int data_sockfd)
     return 0;
 }
 
+int recv_events(int data_sockfd)
+{
+    char buffer[BUF_SIZE];
+    int size;
+
+    /* not MSG_WAITALL like a list, an event is printed when it comes */
+    while ((size = recv(data_sockfd, buffer, BUF_SIZE, 0)) > 0)
+    {
+        fwrite(buffer, 1, size, stdout);
+        fflush(stdout);
+    }
+
+    size = tls_recv_end(data_sockfd, size);
+
+    if (size < 0)
+    {
+        perror("recv() error");
+        return -1;
+    }
+    return 0;
+}
+
 void read_input(char *buffer, int buf_size)
 {
     char *nl = NULL;
@@ -392,6 +736,13 @@ void print_help_information()
     printf("%s <path>:\tmake dir on server\n", CMD_MKD);
     printf("%s <path>:\tremove dir on server\n", CMD_RMD);
     printf("%s <path>:\tchange working dir\n", CMD_CWD);
+    printf("%s <path>:\tname the file to rename or copy\n", CMD_RNFR);
+    printf("%s <path>:\trename it to path\n", CMD_RNTO);
+    printf("%s <path>:\tcopy it to path on server\n", CMD_COPY);
+    printf("%-11s:\tprint the server metrics\n", CMD_STAT);
+    printf("%-11s:\tprint your disk usage and quota\n", CMD_DUSG);
+    printf("%s <pattern>:\tfind paths, with size>N size<N mtime>T mtime<T type:f|d\n", CMD_SRCH);
+    printf("%s [dir] [seq]:\tfollow the changes under dir, after the event seq\n", CMD_SUBS);
     printf("%-11s:\tprint help information\n", CMD_HELP);
     printf("%-11s:\tclose the client\n", CMD_QUIT);
 }
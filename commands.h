@@ -0,0 +1,151 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+/**
+ * --- commands.h defines ---
+ * the registry of the commands, shared by the server and the client
+ *
+ * Every command is one line of COMMAND_REGISTRY: its id, its name, the
+ * chars of the name and its flags. The ids index the handlers of the
+ * server, the metrics of every command and the checks of the client, so a
+ * new command is a line here and a handler in server.c.
+ *
+ * A command is found by a perfect hash of its 4 chars read as one word:
+ * a multiply and a shift give its slot in command_slots, which is built by
+ * the compiler, and one compare of the word confirms it. The static assert
+ * below fails the build if two commands share a slot; another
+ * COMMAND_HASH_MULTIPLIER is then found by trying odd numbers until the
+ * slots of all the words differ. The name and its chars are written apart,
+ * so the server and the client check at start that every name is found
+ * with its own id.
+ *
+ * The functions are static inline so that a program and the library it
+ * links can both include this file.
+ */
+
+#include "base.h"
+
+/**
+ * the flags of a command
+ */
+#define COMMAND_DATA 0x01     /* replies 120, the data port and 125, moves data, then 226 */
+#define COMMAND_QUOTA 0x02    /* refused with 552 when the user is over the quota */
+#define COMMAND_SEARCH 0x04   /* needs the search indexer of the server */
+#define COMMAND_ENDS 0x08     /* the session ends after its reply */
+#define COMMAND_LOCAL 0x10    /* answered by the client, never sent */
+#define COMMAND_INTERNAL 0x20 /* sent by the client itself, not typed */
+
+/**
+ * X(id, name, c0, c1, c2, c3, flags), the chars are those of the name
+ */
+#define COMMAND_REGISTRY(X)                                                   \
+    X(LIST, CMD_LIST, 'L', 'I', 'S', 'T', COMMAND_DATA)                      \
+    X(RETR, CMD_RETR, 'R', 'E', 'T', 'R', COMMAND_DATA)                      \
+    X(STOR, CMD_STOR, 'S', 'T', 'O', 'R', COMMAND_DATA | COMMAND_QUOTA)      \
+    X(STAT, CMD_STAT, 'S', 'T', 'A', 'T', COMMAND_DATA)                      \
+    X(SRCH, CMD_SRCH, 'S', 'R', 'C', 'H', COMMAND_DATA | COMMAND_SEARCH)     \
+    X(SUBS, CMD_SUBS, 'S', 'U', 'B', 'S', COMMAND_DATA | COMMAND_SEARCH)     \
+    X(APPE, CMD_APPE, 'A', 'P', 'P', 'E', 0)                                 \
+    X(DELE, CMD_DELE, 'D', 'E', 'L', 'E', 0)                                 \
+    X(MKD, CMD_MKD, 'M', 'K', 'D', 'R', 0)                                   \
+    X(RMD, CMD_RMD, 'R', 'M', 'D', 'R', 0)                                   \
+    X(CWD, CMD_CWD, 'C', 'W', 'D', 'R', 0)                                   \
+    X(RNFR, CMD_RNFR, 'R', 'N', 'F', 'R', 0)                                 \
+    X(RNTO, CMD_RNTO, 'R', 'N', 'T', 'O', 0)                                 \
+    X(COPY, CMD_COPY, 'C', 'O', 'P', 'Y', COMMAND_QUOTA)                     \
+    X(DUSG, CMD_DUSG, 'D', 'U', 'S', 'G', 0)                                 \
+    X(OPTS, CMD_OPTS, 'O', 'P', 'T', 'S', COMMAND_INTERNAL)                  \
+    X(HELP, CMD_HELP, 'H', 'E', 'L', 'P', COMMAND_LOCAL)                     \
+    X(QUIT, CMD_QUIT, 'Q', 'U', 'I', 'T', COMMAND_ENDS)
+
+#define COMMAND_ID(id, name, c0, c1, c2, c3, flags) COMMAND_##id,
+
+enum command_id
+{
+    COMMAND_REGISTRY(COMMAND_ID)
+    COMMAND_COUNT
+};
+
+struct command_spec
+{
+    const char *name;
+    unsigned int word;
+    int flags;
+};
+
+/**
+ * the 4 chars of a name as one word, the same on every byte order
+ */
+#define COMMAND_WORD(c0, c1, c2, c3) \
+    ((unsigned int)(c0) | (unsigned int)(c1) << 8 | (unsigned int)(c2) << 16 | (unsigned int)(c3) << 24)
+
+#define COMMAND_HASH_BITS 6
+#define COMMAND_HASH_MULTIPLIER 0x7589a82bU
+#define COMMAND_HASH(word) ((unsigned int)((word) * COMMAND_HASH_MULTIPLIER) >> (32 - COMMAND_HASH_BITS))
+
+#define COMMAND_SPEC(id, name, c0, c1, c2, c3, flags) {name, COMMAND_WORD(c0, c1, c2, c3), flags},
+#define COMMAND_SLOT(id, name, c0, c1, c2, c3, flags) [COMMAND_HASH(COMMAND_WORD(c0, c1, c2, c3))] = COMMAND_##id + 1,
+#define COMMAND_SLOT_OR(id, name, c0, c1, c2, c3, flags) | 1ULL << COMMAND_HASH(COMMAND_WORD(c0, c1, c2, c3))
+#define COMMAND_SLOT_SUM(id, name, c0, c1, c2, c3, flags) + (1ULL << COMMAND_HASH(COMMAND_WORD(c0, c1, c2, c3)))
+
+/* the bits of the slots only add up to their or when no two are the same */
+_Static_assert((0 COMMAND_REGISTRY(COMMAND_SLOT_OR)) == (0 COMMAND_REGISTRY(COMMAND_SLOT_SUM)),
+               "two commands share a slot, change COMMAND_HASH_MULTIPLIER");
+
+static const struct command_spec command_specs[COMMAND_COUNT] = {COMMAND_REGISTRY(COMMAND_SPEC)};
+
+/**
+ * the id + 1 of the command in every slot of the hash, 0 if it is empty
+ */
+static const unsigned char command_slots[1 << COMMAND_HASH_BITS] = {COMMAND_REGISTRY(COMMAND_SLOT)};
+
+/**
+ * find the command named cmd
+ * return its id or -1 if there is none
+ */
+static inline int command_lookup(const char *cmd)
+{
+    unsigned int word;
+    int id;
+    int i;
+
+    /* every name has CMD_LEN - 1 chars */
+    word = 0;
+    for (i = 0; i < CMD_LEN - 1 && cmd[i] != '\0'; i++)
+        word |= (unsigned int)(unsigned char)cmd[i] << (8 * i);
+
+    if (i < CMD_LEN - 1 || cmd[i] != '\0')
+        return -1;
+
+    id = command_slots[COMMAND_HASH(word)] - 1;
+
+    if (id < 0 || command_specs[id].word != word)
+        return -1;
+
+    return id;
+}
+
+/**
+ * check that every name of the registry is found with its own id, a name
+ * out of step with its chars would leave its command unreachable
+ * return 0 if success or -1 if error
+ */
+static inline int command_registry_check(void)
+{
+    char message[64];
+    int i;
+
+    for (i = 0; i < COMMAND_COUNT; i++)
+    {
+        if (command_lookup(command_specs[i].name) != i)
+        {
+            snprintf(message, sizeof(message), "the chars of command %s differ from its name", command_specs[i].name);
+            error_handling(message);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/**
+ * --- control.h defines ---
+ * the encodings of the messages on the command connection
+ * and an incremental reader of them
+ *
+ * A session starts in the fixed encoding: every message is a standard
+ * buffer of BUF_SIZE chars, the command at 0 and its argument at CMD_LEN.
+ * After the client sends CMD_OPTS with the argument OPTS_VARLEN and the
+ * server replies 200, both sides use the variable encoding: a length of 2
+ * bytes in network order, then that many bytes holding the command, '\0',
+ * the argument and '\0'. A LIST is 7 bytes instead of 128 and an argument
+ * may be as long as a path, CONTROL_ARG_MAX chars with its '\0'.
+ * The replies of the server are the same in both encodings.
+ *
+ * With OPTS_INLINE a RETR of a file up to the threshold of the server is
+ * answered by one reply holding the file instead of a data connection.
+ * With OPTS_TLS the bytes of both encodings go through TLS.
+ *
+ * The reader parses the messages in place in its buffer and hands out
+ * pointers into it, nothing is copied. It only reads what the socket has,
+ * so it works with blocking and non-blocking sockets alike.
+ *
+ * The functions are static inline so that a program and the library it
+ * links can both include this file.
+ */
+
+#include "base.h"
+#include <errno.h>
+#include <limits.h>
+
+/**
+ * the argument of CMD_OPTS switching to the variable encoding
+ */
+#define OPTS_VARLEN "VARLEN"
+
+/**
+ * the argument of CMD_OPTS asking the server to reply to RETR of a small
+ * file with 213, the length of 4 bytes in network order and the file,
+ * all on the command connection
+ */
+#define OPTS_INLINE "INLINE"
+
+/**
+ * the argument of CMD_OPTS starting TLS on the command connection once
+ * the server replies 200, and on every data connection after it (tls.h)
+ */
+#define OPTS_TLS "TLS"
+
+/**
+ * the longest file a server sends inline
+ */
+#define INLINE_LIMIT (64 * 1024)
+
+/**
+ * the longest argument of the variable encoding, with its '\0'
+ */
+#define CONTROL_ARG_MAX PATH_MAX
+
+/**
+ * the longest message of the variable encoding, with its length
+ */
+#define CONTROL_MESSAGE_MAX (2 + CMD_LEN + CONTROL_ARG_MAX)
+
+/**
+ * the buffer of a reader holds a whole message and what follows it
+ */
+#define CONTROL_BUF_SIZE (2 * CONTROL_MESSAGE_MAX)
+
+struct control_reader
+{
+    int sockfd;
+    int varlen; /* 1 once the variable encoding was negotiated */
+    int start;  /* the first byte not parsed */
+    int end;    /* the end of the bytes received */
+    char buffer[CONTROL_BUF_SIZE];
+};
+
+/**
+ * start a reader of sockfd in the fixed encoding
+ */
+static inline void control_reader_initialize(struct control_reader *reader, int sockfd)
+{
+    reader->sockfd = sockfd;
+    reader->varlen = 0;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+/**
+ * parse the next message in the buffer of reader without reading the socket,
+ * cmd and arg point into the buffer until the next call
+ * return 1 if a message was parsed, 0 if more bytes are needed
+ * or -1 if the message is malformed
+ */
+static inline int control_parse(struct control_reader *reader, char **cmd, char **arg)
+{
+    char *message;
+    int available;
+    int length;
+    int i;
+
+    message = reader->buffer + reader->start;
+    available = reader->end - reader->start;
+
+    if (!reader->varlen)
+    {
+        if (available < BUF_SIZE)
+            return 0;
+
+        message[CMD_LEN - 1] = '\0';
+        message[BUF_SIZE - 1] = '\0';
+
+        *cmd = message;
+        *arg = message + CMD_LEN;
+        reader->start += BUF_SIZE;
+
+        return 1;
+    }
+
+    if (available < 2)
+        return 0;
+
+    length = ((unsigned char)message[0] << 8) | (unsigned char)message[1];
+
+    if (length < 2 || length > CONTROL_MESSAGE_MAX - 2)
+        return -1;
+
+    if (available < 2 + length)
+        return 0;
+
+    message += 2;
+
+    if (message[length - 1] != '\0')
+        return -1;
+
+    for (i = 0; i < CMD_LEN && message[i] != '\0'; i++)
+        ;
+
+    /* the command needs its '\0' and the argument its own */
+    if (i == CMD_LEN || i >= length - 1)
+        return -1;
+
+    *cmd = message;
+    *arg = message + i + 1;
+    reader->start += 2 + length;
+
+    return 1;
+}
+
+/**
+ * parse the next message of reader, reading the socket while it is not whole,
+ * cmd and arg point into the buffer until the next call
+ * return 1 if a message was parsed, 0 if a non-blocking socket has no more
+ * bytes or -1 if error, errno is ECONNRESET when the peer closed
+ */
+static inline int control_next(struct control_reader *reader, char **cmd, char **arg)
+{
+    ssize_t size;
+    int result;
+
+    while (1)
+    {
+        result = control_parse(reader, cmd, arg);
+
+        if (result != 0)
+        {
+            if (result < 0)
+                errno = EPROTO;
+            return result;
+        }
+
+        /* the part of a message left is moved to the front for the rest */
+        if (reader->start == reader->end)
+        {
+            reader->start = reader->end = 0;
+        }
+        else if (CONTROL_BUF_SIZE == reader->end)
+        {
+            memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+
+        size = recv(reader->sockfd, reader->buffer + reader->end, CONTROL_BUF_SIZE - reader->end, 0);
+
+        if (size > 0)
+        {
+            reader->end += size;
+            continue;
+        }
+
+        if (0 == size)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        if (EINTR == errno)
+            continue;
+
+        if (EAGAIN == errno || EWOULDBLOCK == errno)
+            return 0;
+
+        return -1;
+    }
+}
+
+/**
+ * encode the message of cmd and arg, or NULL, into buffer of size chars
+ * in the variable encoding if varlen or else the fixed one
+ * return the length of the message or -1 if it does not fit
+ */
+static inline int control_encode(char *buffer, int size, int varlen, const char *cmd, const char *arg)
+{
+    int cmd_length;
+    int arg_length;
+    int length;
+
+    if (!arg)
+        arg = "";
+
+    cmd_length = strlen(cmd);
+    arg_length = strlen(arg);
+
+    if (cmd_length >= CMD_LEN)
+        return -1;
+
+    if (!varlen)
+    {
+        if (size < BUF_SIZE || arg_length >= ARG_LEN)
+            return -1;
+
+        memset(buffer, 0, BUF_SIZE);
+        memcpy(buffer, cmd, cmd_length);
+        memcpy(buffer + CMD_LEN, arg, arg_length);
+
+        return BUF_SIZE;
+    }
+
+    length = cmd_length + 1 + arg_length + 1;
+
+    if (arg_length >= CONTROL_ARG_MAX || size < 2 + length)
+        return -1;
+
+    buffer[0] = (char)(length >> 8);
+    buffer[1] = (char)(length & 0xff);
+    memcpy(buffer + 2, cmd, cmd_length + 1);
+    memcpy(buffer + 2 + cmd_length + 1, arg, arg_length + 1);
+
+    return 2 + length;
+}
+
+#endif
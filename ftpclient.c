@@ -0,0 +1,915 @@
+/**
+ * libftpclient
+ * the asynchronous client of ftpclient.h
+ *
+ * Every operation is a small state machine on the non-blocking command
+ * and data connections of the client. ftp_client_process() moves it as far
+ * as the sockets allow and calls the callback when it is done.
+ */
+
+#define BASE_DECLARATIONS_ONLY
+#include "base.h"
+#include "control.h"
+#include "ftpclient.h"
+#include <errno.h>
+
+#define FTP_DATA_BUF_SIZE (64 * 1024)
+
+enum ftp_op
+{
+    FTP_OP_NONE,
+    FTP_OP_CONNECT,
+    FTP_OP_LOGIN,
+    FTP_OP_COMMAND,
+    FTP_OP_RETRIEVE,
+    FTP_OP_STORE,
+    FTP_OP_LIST,
+    FTP_OP_QUIT
+};
+
+/**
+ * the steps of an operation
+ */
+enum ftp_step
+{
+    FTP_STEP_CONNECT, /* command connection in progress */
+    FTP_STEP_REPLY,   /* waiting for the reply of the command */
+    FTP_STEP_OPTIONS, /* logged in, waiting for the reply of OPTS VARLEN */
+    FTP_STEP_PORT,    /* waiting for the data port */
+    FTP_STEP_DATA     /* data connection open, waiting for 125 and 226 */
+};
+
+struct ftp_client
+{
+    int op;
+    int step;
+    int cmd_sockfd;
+    int data_sockfd;
+    struct sockaddr_in address;
+
+    char tx[CONTROL_MESSAGE_MAX + BUF_SIZE * 2];
+    int tx_len;
+    int tx_off;
+    int varlen;
+
+    unsigned char rx[4];
+    int rx_len;
+
+    int data_connected;
+    int data_done;
+    int got_125;
+    int got_226;
+
+    int local_fd;
+    char *data;
+    int data_len;
+    int data_off;
+    int local_eof;
+    long long bytes;
+
+    int code;
+    int sys_errno;
+
+    ftp_callback callback;
+    void *user;
+};
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static long long clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * check a non-blocking connect() on sockfd
+ * return 1 if connected, 0 if in progress or -1 with errno if it failed
+ */
+static int check_connected(int sockfd)
+{
+    struct sockaddr_in address;
+    socklen_t len;
+    int error;
+
+    len = sizeof(error);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        return -1;
+
+    if (error)
+    {
+        errno = error;
+        return -1;
+    }
+
+    len = sizeof(address);
+    if (getpeername(sockfd, (struct sockaddr *)&address, &len) < 0)
+        return ENOTCONN == errno ? 0 : -1;
+
+    return 1;
+}
+
+ftp_client *ftp_client_new(void)
+{
+    ftp_client *client;
+
+    client = calloc(1, sizeof(*client));
+    if (!client)
+        return NULL;
+
+    client->data = malloc(FTP_DATA_BUF_SIZE);
+    if (!client->data)
+    {
+        free(client);
+        return NULL;
+    }
+
+    client->cmd_sockfd = -1;
+    client->data_sockfd = -1;
+    client->local_fd = -1;
+
+    return client;
+}
+
+static void close_data(ftp_client *client)
+{
+    if (client->data_sockfd >= 0)
+    {
+        close(client->data_sockfd);
+        client->data_sockfd = -1;
+    }
+}
+
+static void close_all(ftp_client *client)
+{
+    close_data(client);
+
+    if (client->cmd_sockfd >= 0)
+    {
+        close(client->cmd_sockfd);
+        client->cmd_sockfd = -1;
+    }
+
+    client->tx_len = client->tx_off = 0;
+    client->rx_len = 0;
+    client->varlen = 0;
+}
+
+void ftp_client_free(ftp_client *client)
+{
+    if (!client)
+        return;
+
+    close_all(client);
+    free(client->data);
+    free(client);
+}
+
+/**
+ * end the running operation with status and call its callback
+ * the connections are closed if the session can not go on
+ */
+static int complete(ftp_client *client, int status)
+{
+    ftp_callback callback;
+    void *user;
+
+    switch (status)
+    {
+    case FTP_OK:
+    case FTP_ERR_REFUSED:
+        close_data(client);
+        break;
+    default:
+        close_all(client);
+        break;
+    }
+
+    if (FTP_OP_QUIT == client->op)
+        close_all(client);
+
+    callback = client->callback;
+    user = client->user;
+
+    client->op = FTP_OP_NONE;
+    client->callback = NULL;
+    client->user = NULL;
+    client->local_fd = -1;
+
+    if (callback)
+        callback(client, status, client->code, user);
+
+    return status;
+}
+
+static int system_error(ftp_client *client)
+{
+    client->sys_errno = errno;
+
+    return complete(client, FTP_ERR_SYSTEM);
+}
+
+/**
+ * start a non-blocking connect() to port at the address of client
+ * return the sock fd or -1 if error
+ */
+static int connect_nonblocking(ftp_client *client, int port)
+{
+    struct sockaddr_in address;
+    int sockfd;
+    int result;
+
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0)
+        return -1;
+
+    address = client->address;
+    address.sin_port = htons(port);
+
+    result = connect(sockfd, (struct sockaddr *)&address, sizeof(address));
+
+    if (result < 0 && errno != EINPROGRESS)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * send as much of the queued command as the socket takes
+ * return 0 if success or -1 if error
+ */
+static int flush_command(ftp_client *client)
+{
+    int result;
+
+    while (client->tx_off < client->tx_len)
+    {
+        result = send(client->cmd_sockfd, client->tx + client->tx_off,
+                      client->tx_len - client->tx_off, MSG_NOSIGNAL);
+
+        if (result < 0)
+            return EAGAIN == errno ? 0 : -1;
+
+        client->tx_off += result;
+    }
+
+    client->tx_len = client->tx_off = 0;
+
+    return 0;
+}
+
+/**
+ * check that an operation can start and take its callback
+ * return FTP_OK or an error
+ */
+static int begin(ftp_client *client, int op, ftp_callback callback, void *user)
+{
+    if (client->op != FTP_OP_NONE)
+        return FTP_ERR_BUSY;
+
+    if ((FTP_OP_CONNECT == op) != (client->cmd_sockfd < 0))
+        return FTP_ERR_STATE;
+
+    client->op = op;
+    client->step = FTP_STEP_REPLY;
+    client->code = 0;
+    client->callback = callback;
+    client->user = user;
+
+    return FTP_OK;
+}
+
+/**
+ * queue the message of command and arg in the encoding of the session
+ * and start sending it
+ * return FTP_OK or an error
+ */
+static int send_request(ftp_client *client, const char *command, const char *arg)
+{
+    int length;
+
+    length = control_encode(client->tx + client->tx_len, sizeof(client->tx) - client->tx_len,
+                            client->varlen, command, arg);
+
+    if (length < 0)
+    {
+        client->op = FTP_OP_NONE;
+        client->tx_len = client->tx_off = 0;
+        return FTP_ERR_ARGUMENT;
+    }
+
+    client->tx_len += length;
+
+    if (FTP_STEP_CONNECT == client->step)
+        return FTP_OK;
+
+    if (flush_command(client) < 0)
+    {
+        client->sys_errno = errno;
+        client->op = FTP_OP_NONE;
+        close_all(client);
+        return FTP_ERR_SYSTEM;
+    }
+
+    return FTP_OK;
+}
+
+int ftp_connect(ftp_client *client, const char *host, int port, ftp_callback callback, void *user)
+{
+    struct sockaddr_in address;
+    int result;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+
+    if (!inet_aton(host, &address.sin_addr) || port <= 0 || port > 65535)
+        return FTP_ERR_ARGUMENT;
+
+    result = begin(client, FTP_OP_CONNECT, callback, user);
+    if (result != FTP_OK)
+        return result;
+
+    client->address = address;
+
+    client->step = FTP_STEP_CONNECT;
+    client->cmd_sockfd = connect_nonblocking(client, port);
+
+    if (client->cmd_sockfd < 0)
+    {
+        client->sys_errno = errno;
+        client->op = FTP_OP_NONE;
+        return FTP_ERR_SYSTEM;
+    }
+
+    return FTP_OK;
+}
+
+int ftp_login(ftp_client *client, const char *user, const char *password,
+              ftp_callback callback, void *user_data)
+{
+    int result;
+
+    if (strlen(user) >= ARG_LEN || strlen(password) >= ARG_LEN)
+        return FTP_ERR_ARGUMENT;
+
+    result = begin(client, FTP_OP_LOGIN, callback, user_data);
+    if (result != FTP_OK)
+        return result;
+
+    /*
+     * the password and the OPTS asking for the variable encoding go out
+     * with the user name, the server replies to the login and then to OPTS
+     */
+    client->tx_len = control_encode(client->tx, sizeof(client->tx), 0, CMD_ACCT, user);
+    client->tx_len += control_encode(client->tx + client->tx_len, sizeof(client->tx) - client->tx_len,
+                                     0, CMD_ADAT, password);
+
+    return send_request(client, CMD_OPTS, OPTS_VARLEN);
+}
+
+int ftp_command(ftp_client *client, const char *command, const char *arg,
+                ftp_callback callback, void *user)
+{
+    int result;
+
+    result = begin(client, FTP_OP_COMMAND, callback, user);
+    if (result != FTP_OK)
+        return result;
+
+    return send_request(client, command, arg);
+}
+
+/**
+ * start a command with a data connection
+ */
+static int begin_transfer(ftp_client *client, int op, const char *command, const char *arg, int fd,
+                          ftp_callback callback, void *user)
+{
+    int result;
+
+    result = begin(client, op, callback, user);
+    if (result != FTP_OK)
+        return result;
+
+    client->local_fd = fd;
+    client->bytes = 0;
+    client->data_len = client->data_off = 0;
+    client->local_eof = 0;
+    client->data_connected = client->data_done = 0;
+    client->got_125 = client->got_226 = 0;
+
+    return send_request(client, command, arg);
+}
+
+int ftp_retrieve(ftp_client *client, const char *remote, int fd, ftp_callback callback, void *user)
+{
+    return begin_transfer(client, FTP_OP_RETRIEVE, CMD_RETR, remote, fd, callback, user);
+}
+
+int ftp_store(ftp_client *client, const char *remote, int fd, ftp_callback callback, void *user)
+{
+    return begin_transfer(client, FTP_OP_STORE, CMD_STOR, remote, fd, callback, user);
+}
+
+int ftp_list(ftp_client *client, const char *command, int fd, ftp_callback callback, void *user)
+{
+    if (strcmp(command, CMD_LIST) != 0 && strcmp(command, CMD_STAT) != 0)
+        return FTP_ERR_ARGUMENT;
+
+    return begin_transfer(client, FTP_OP_LIST, command, NULL, fd, callback, user);
+}
+
+int ftp_quit(ftp_client *client, ftp_callback callback, void *user)
+{
+    int result;
+
+    result = begin(client, FTP_OP_QUIT, callback, user);
+    if (result != FTP_OK)
+        return result;
+
+    return send_request(client, CMD_QUIT, NULL);
+}
+
+/**
+ * complete a transfer once both its data and its 226 arrived
+ */
+static int transfer_done(ftp_client *client)
+{
+    if (client->data_done && client->got_226)
+        return complete(client, FTP_OK);
+
+    return FTP_OK;
+}
+
+/**
+ * handle a reply of the server
+ * return FTP_OK or the status the operation completed with
+ */
+static int handle_code(ftp_client *client, int code)
+{
+    int op;
+
+    op = client->op;
+
+    /* the data port is not a reply code */
+    if (client->step != FTP_STEP_PORT)
+    {
+        client->code = code;
+
+        if (421 == code)
+            return complete(client, FTP_ERR_REJECTED);
+    }
+
+    switch (client->step)
+    {
+    case FTP_STEP_REPLY:
+        if (FTP_OP_LOGIN == op)
+        {
+            if (230 == code)
+            {
+                client->step = FTP_STEP_OPTIONS;
+                return FTP_OK;
+            }
+            if (430 == code)
+                return complete(client, FTP_ERR_LOGIN);
+        }
+        else if (FTP_OP_QUIT == op)
+        {
+            if (221 == code)
+                return complete(client, FTP_OK);
+        }
+        else if (120 == code)
+        {
+            if (FTP_OP_COMMAND == op)
+                return complete(client, FTP_OK);
+
+            client->step = FTP_STEP_PORT;
+            return FTP_OK;
+        }
+        else if (502 == code)
+        {
+            return complete(client, FTP_ERR_REFUSED);
+        }
+
+        return complete(client, FTP_ERR_PROTOCOL);
+
+    case FTP_STEP_OPTIONS:
+        /* a server without the variable encoding refuses it */
+        if (code != 200 && code != 502)
+            return complete(client, FTP_ERR_PROTOCOL);
+
+        client->varlen = 200 == code;
+        client->code = 230;
+        return complete(client, FTP_OK);
+
+    case FTP_STEP_PORT:
+        if (code <= 0 || code > 65535)
+            return complete(client, FTP_ERR_PROTOCOL);
+
+        client->data_sockfd = connect_nonblocking(client, code);
+        if (client->data_sockfd < 0)
+            return system_error(client);
+
+        client->step = FTP_STEP_DATA;
+        return FTP_OK;
+
+    case FTP_STEP_DATA:
+        if (125 == code && !client->got_125)
+        {
+            client->got_125 = 1;
+            return FTP_OK;
+        }
+
+        if (226 == code && client->got_125)
+        {
+            client->got_226 = 1;
+            return transfer_done(client);
+        }
+
+        return complete(client, FTP_ERR_PROTOCOL);
+
+    default:
+        return complete(client, FTP_ERR_PROTOCOL);
+    }
+}
+
+/**
+ * make progress on the command connection
+ * return FTP_OK or the status the operation completed with
+ */
+static int process_command(ftp_client *client)
+{
+    int result;
+    int code;
+    int op;
+
+    if (FTP_STEP_CONNECT == client->step)
+    {
+        result = check_connected(client->cmd_sockfd);
+
+        if (0 == result)
+            return FTP_OK;
+
+        if (result < 0)
+        {
+            client->sys_errno = errno;
+            return complete(client, FTP_ERR_CONNECT);
+        }
+
+        client->step = FTP_STEP_REPLY;
+
+        if (FTP_OP_CONNECT == client->op)
+            return complete(client, FTP_OK);
+    }
+
+    if (flush_command(client) < 0)
+        return system_error(client);
+
+    op = client->op;
+
+    while (client->op == op && client->cmd_sockfd >= 0)
+    {
+        result = recv(client->cmd_sockfd, client->rx + client->rx_len,
+                      sizeof(client->rx) - client->rx_len, 0);
+
+        if (result < 0)
+            return EAGAIN == errno ? FTP_OK : system_error(client);
+
+        if (0 == result)
+            return complete(client, FTP_ERR_CLOSED);
+
+        client->rx_len += result;
+        if (client->rx_len < (int)sizeof(client->rx))
+            continue;
+
+        memcpy(&code, client->rx, sizeof(code));
+        client->rx_len = 0;
+
+        result = handle_code(client, ntohl(code));
+        if (result != FTP_OK || client->op != op)
+            return result;
+    }
+
+    return FTP_OK;
+}
+
+/**
+ * write the received bytes into the local file,
+ * the NULs that end the chunks of a text are dropped
+ * return 0 if success or -1 if error
+ */
+static int write_local(ftp_client *client, const char *data, int size)
+{
+    const char *end;
+    int chunk;
+    int result;
+
+    end = data + size;
+
+    while (data < end)
+    {
+        chunk = end - data;
+
+        if (FTP_OP_LIST == client->op)
+        {
+            while (data < end && '\0' == *data)
+                data++;
+
+            chunk = strnlen(data, end - data);
+            if (0 == chunk)
+                break;
+        }
+
+        result = write(client->local_fd, data, chunk);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+
+        data += result;
+    }
+
+    return 0;
+}
+
+/**
+ * make progress on the data connection
+ * return FTP_OK or the status the operation completed with
+ */
+static int process_data(ftp_client *client)
+{
+    int result;
+
+    if (!client->data_connected)
+    {
+        result = check_connected(client->data_sockfd);
+
+        if (0 == result)
+            return FTP_OK;
+
+        if (result < 0)
+        {
+            client->sys_errno = errno;
+            return complete(client, FTP_ERR_CONNECT);
+        }
+
+        client->data_connected = 1;
+    }
+
+    if (FTP_OP_STORE == client->op)
+    {
+        while (1)
+        {
+            if (client->data_off == client->data_len && !client->local_eof)
+            {
+                result = read(client->local_fd, client->data, FTP_DATA_BUF_SIZE);
+                if (result < 0)
+                {
+                    if (EINTR == errno)
+                        continue;
+                    return system_error(client);
+                }
+
+                client->data_off = 0;
+                client->data_len = result;
+                if (0 == result)
+                    client->local_eof = 1;
+            }
+
+            if (client->data_off == client->data_len)
+                break;
+
+            result = send(client->data_sockfd, client->data + client->data_off,
+                          client->data_len - client->data_off, MSG_NOSIGNAL);
+
+            if (result < 0)
+                return EAGAIN == errno ? FTP_OK : system_error(client);
+
+            client->data_off += result;
+            client->bytes += result;
+        }
+    }
+    else
+    {
+        while (1)
+        {
+            result = recv(client->data_sockfd, client->data, FTP_DATA_BUF_SIZE, 0);
+
+            if (result < 0)
+                return EAGAIN == errno ? FTP_OK : system_error(client);
+
+            if (0 == result)
+                break;
+
+            client->bytes += result;
+
+            if (write_local(client, client->data, result) < 0)
+                return system_error(client);
+        }
+    }
+
+    /* the end of the data is the close of the data connection */
+    close_data(client);
+    client->data_done = 1;
+
+    return transfer_done(client);
+}
+
+int ftp_client_process(ftp_client *client)
+{
+    int result;
+    int op;
+
+    op = client->op;
+    if (FTP_OP_NONE == op)
+        return FTP_OK;
+
+    result = process_command(client);
+    if (result != FTP_OK || client->op != op)
+        return result;
+
+    if (FTP_STEP_DATA == client->step && client->data_sockfd >= 0)
+        return process_data(client);
+
+    return FTP_OK;
+}
+
+int ftp_client_poll_fds(ftp_client *client, struct pollfd *fds)
+{
+    int count;
+
+    count = 0;
+
+    if (FTP_OP_NONE == client->op || client->cmd_sockfd < 0)
+        return 0;
+
+    fds[count].fd = client->cmd_sockfd;
+    fds[count].events = POLLIN;
+    fds[count].revents = 0;
+    if (FTP_STEP_CONNECT == client->step || client->tx_off < client->tx_len)
+        fds[count].events |= POLLOUT;
+    count++;
+
+    if (FTP_STEP_DATA == client->step && client->data_sockfd >= 0)
+    {
+        fds[count].fd = client->data_sockfd;
+        fds[count].events = (!client->data_connected || FTP_OP_STORE == client->op) ? POLLOUT : POLLIN;
+        fds[count].revents = 0;
+        count++;
+    }
+
+    return count;
+}
+
+int ftp_client_run(ftp_client *client, int timeout_ms)
+{
+    struct pollfd fds[2];
+    long long start;
+    long long left;
+    int count;
+    int wait;
+
+    start = clock_ns();
+
+    while (client->op != FTP_OP_NONE)
+    {
+        count = ftp_client_poll_fds(client, fds);
+
+        wait = -1;
+        if (timeout_ms >= 0)
+        {
+            left = start + timeout_ms * 1000000LL - clock_ns();
+            if (left <= 0)
+                return FTP_ERR_TIMEOUT;
+            wait = (int)((left + 999999) / 1000000);
+        }
+
+        if (poll(fds, count, wait) < 0 && errno != EINTR)
+        {
+            client->sys_errno = errno;
+            return FTP_ERR_SYSTEM;
+        }
+
+        ftp_client_process(client);
+    }
+
+    return FTP_OK;
+}
+
+int ftp_client_attach(ftp_client *client, int sockfd, int varlen)
+{
+    socklen_t len;
+    int flags;
+
+    if (client->op != FTP_OP_NONE)
+        return FTP_ERR_BUSY;
+
+    if (client->cmd_sockfd >= 0)
+        return FTP_ERR_STATE;
+
+    /* the data connections go to the same server */
+    len = sizeof(client->address);
+    if (getpeername(sockfd, (struct sockaddr *)&client->address, &len) < 0 ||
+        client->address.sin_family != AF_INET)
+        return FTP_ERR_ARGUMENT;
+
+    flags = fcntl(sockfd, F_GETFL);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        client->sys_errno = errno;
+        return FTP_ERR_SYSTEM;
+    }
+
+    client->cmd_sockfd = sockfd;
+    client->varlen = varlen;
+    client->step = FTP_STEP_REPLY;
+
+    return FTP_OK;
+}
+
+int ftp_client_detach(ftp_client *client, int *varlen)
+{
+    int sockfd;
+    int flags;
+
+    if (client->op != FTP_OP_NONE)
+        return FTP_ERR_BUSY;
+
+    if (client->cmd_sockfd < 0)
+        return FTP_ERR_STATE;
+
+    /* the flag belongs to the open socket, shared with whoever gets it */
+    sockfd = client->cmd_sockfd;
+    flags = fcntl(sockfd, F_GETFL);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    {
+        client->sys_errno = errno;
+        return FTP_ERR_SYSTEM;
+    }
+
+    *varlen = client->varlen;
+
+    client->cmd_sockfd = -1;
+    close_all(client);
+
+    return sockfd;
+}
+
+int ftp_client_busy(ftp_client *client)
+{
+    return client->op != FTP_OP_NONE;
+}
+
+long long ftp_client_bytes(ftp_client *client)
+{
+    return client->bytes;
+}
+
+int ftp_client_errno(ftp_client *client)
+{
+    return client->sys_errno;
+}
+
+const char *ftp_strerror(int status)
+{
+    switch (status)
+    {
+    case FTP_OK:
+        return "success";
+    case FTP_ERR_SYSTEM:
+        return "system error";
+    case FTP_ERR_BUSY:
+        return "an operation is running";
+    case FTP_ERR_STATE:
+        return "not connected or already connected";
+    case FTP_ERR_ARGUMENT:
+        return "invalid argument";
+    case FTP_ERR_CONNECT:
+        return "connection failed";
+    case FTP_ERR_LOGIN:
+        return "invalid username or password";
+    case FTP_ERR_REJECTED:
+        return "service not available";
+    case FTP_ERR_REFUSED:
+        return "command failed or not implemented";
+    case FTP_ERR_PROTOCOL:
+        return "unexpected reply";
+    case FTP_ERR_CLOSED:
+        return "connection closed by the server";
+    case FTP_ERR_TIMEOUT:
+        return "timed out";
+    default:
+        return "unknown error";
+    }
+}
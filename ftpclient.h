@@ -0,0 +1,174 @@
+#ifndef FTPCLIENT_H
+#define FTPCLIENT_H
+
+/**
+ * --- ftpclient.h defines ---
+ * libftpclient, the embeddable asynchronous client of the ftp server
+ *
+ * A client is one session. Every operation (connect, login, command,
+ * transfer, quit) only starts when it is called and returns at once; it
+ * completes later in ftp_client_process() by calling its callback with a
+ * status and the last reply code. One operation runs at a time, the next
+ * one may be started from the callback of the last.
+ *
+ * The library never blocks, prints or exits. An event loop gets the
+ * descriptors of a client with ftp_client_poll_fds(), waits on them with
+ * poll(), epoll or anything else, and calls ftp_client_process() when one
+ * is ready. ftp_client_run() does that loop for a single client.
+ *
+ * Local files are given as descriptors and read or written with blocking
+ * calls, so they should be regular files.
+ */
+
+#include <poll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * the status of an operation, FTP_OK or a negative error
+ */
+enum ftp_status
+{
+    FTP_OK = 0,
+    FTP_ERR_SYSTEM = -1,   /* a system call failed, see ftp_client_errno() */
+    FTP_ERR_BUSY = -2,     /* an operation is running */
+    FTP_ERR_STATE = -3,    /* not connected, or already connected */
+    FTP_ERR_ARGUMENT = -4, /* a bad address or a name too long */
+    FTP_ERR_CONNECT = -5,  /* the connection failed */
+    FTP_ERR_LOGIN = -6,    /* invalid user name or password, 430 */
+    FTP_ERR_REJECTED = -7, /* the server is not available, 421 */
+    FTP_ERR_REFUSED = -8,  /* the command failed or is not implemented, 502 */
+    FTP_ERR_PROTOCOL = -9, /* an unexpected reply */
+    FTP_ERR_CLOSED = -10,  /* the server closed the connection */
+    FTP_ERR_TIMEOUT = -11  /* ftp_client_run() timed out */
+};
+
+typedef struct ftp_client ftp_client;
+
+/**
+ * called when an operation completes, status is an enum ftp_status
+ * and code the last reply of the server or 0
+ */
+typedef void (*ftp_callback)(ftp_client *client, int status, int code, void *user);
+
+/**
+ * create a client
+ * return the client or NULL if out of memory
+ */
+ftp_client *ftp_client_new(void);
+
+/**
+ * close the connections of client and free it,
+ * not to be called from a callback of client
+ */
+void ftp_client_free(ftp_client *client);
+
+/**
+ * connect to the server at the IPv4 address host and its command port
+ * return FTP_OK if started or an error
+ */
+int ftp_connect(ftp_client *client, const char *host, int port, ftp_callback callback, void *user);
+
+/**
+ * log in with user and password and ask for the variable control encoding,
+ * which lets the names of later commands be as long as a path;
+ * the server closes the connection after a failed login
+ * return FTP_OK if started or an error
+ */
+int ftp_login(ftp_client *client, const char *user, const char *password,
+              ftp_callback callback, void *user_data);
+
+/**
+ * run a command without data, like "DELE", "MKDR", "RMDR", "CWDR" or "APPE",
+ * with its argument arg or NULL
+ * return FTP_OK if started or an error
+ */
+int ftp_command(ftp_client *client, const char *command, const char *arg,
+                ftp_callback callback, void *user);
+
+/**
+ * fetch the file remote of the server into the descriptor fd
+ * return FTP_OK if started or an error
+ */
+int ftp_retrieve(ftp_client *client, const char *remote, int fd, ftp_callback callback, void *user);
+
+/**
+ * send the content of the descriptor fd to the file remote of the server
+ * return FTP_OK if started or an error
+ */
+int ftp_store(ftp_client *client, const char *remote, int fd, ftp_callback callback, void *user);
+
+/**
+ * write the text of command, "LIST" or "STAT", into the descriptor fd
+ * return FTP_OK if started or an error
+ */
+int ftp_list(ftp_client *client, const char *command, int fd, ftp_callback callback, void *user);
+
+/**
+ * end the session, the connection is closed when it completes
+ * return FTP_OK if started or an error
+ */
+int ftp_quit(ftp_client *client, ftp_callback callback, void *user);
+
+/**
+ * take over sockfd, the command connection of a session that is logged in,
+ * like one from ftp_client_detach() of another process, where varlen is
+ * the control encoding it uses
+ * return FTP_OK or an error
+ */
+int ftp_client_attach(ftp_client *client, int sockfd, int varlen);
+
+/**
+ * give up the command connection of client without ending its session,
+ * client is left unconnected and varlen gets the control encoding
+ * return the sock fd, blocking again, or an error
+ */
+int ftp_client_detach(ftp_client *client, int *varlen);
+
+/**
+ * fill fds with the descriptors client waits on and their events
+ * return the number of descriptors, 0 to 2
+ */
+int ftp_client_poll_fds(ftp_client *client, struct pollfd *fds);
+
+/**
+ * make progress on the running operation without blocking,
+ * its callback is called when it completes
+ * return FTP_OK or an error of the client
+ */
+int ftp_client_process(ftp_client *client);
+
+/**
+ * wait for the running operation to complete, at most timeout_ms
+ * milliseconds or forever if it is negative
+ * return FTP_OK, FTP_ERR_TIMEOUT or FTP_ERR_SYSTEM
+ */
+int ftp_client_run(ftp_client *client, int timeout_ms);
+
+/**
+ * return 1 if an operation is running or 0 if not
+ */
+int ftp_client_busy(ftp_client *client);
+
+/**
+ * return the bytes moved by the running or the last transfer
+ */
+long long ftp_client_bytes(ftp_client *client);
+
+/**
+ * return the errno of the last FTP_ERR_SYSTEM
+ */
+int ftp_client_errno(ftp_client *client);
+
+/**
+ * return a message for status
+ */
+const char *ftp_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/**
+ * --- histogram.h defines ---
+ * HDR style log-linear latency histograms
+ *
+ * Every power of two is split into HIST_SUB_COUNT linear buckets, so the
+ * relative error of a recorded value is below 1 / HIST_SUB_COUNT over the
+ * whole range. A histogram has a single writer; it adds with a relaxed load
+ * and store instead of a locked instruction, and readers in other processes
+ * see every bucket with at most one update of lag.
+ */
+
+#include <stdatomic.h>
+
+/**
+ * the linear buckets in every power of two
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+
+/**
+ * the histograms count values up to 2^HIST_MAX_BITS,
+ * about 18 minutes in nanoseconds, larger ones go to the last bucket
+ */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef _Atomic unsigned long long metric_counter;
+
+struct histogram
+{
+    metric_counter count;
+    metric_counter sum;
+    metric_counter buckets[HIST_BUCKETS];
+};
+
+/**
+ * add n to a counter that only the calling process writes
+ */
+void metric_add(metric_counter *counter, unsigned long long n);
+
+/**
+ * read a counter written by any process
+ */
+unsigned long long metric_read(metric_counter *counter);
+
+/**
+ * record value in histogram
+ */
+void histogram_record(struct histogram *histogram, unsigned long long value);
+
+/**
+ * add all the counts of from into to
+ */
+void histogram_merge(struct histogram *to, struct histogram *from);
+
+/**
+ * get the bucket of value
+ */
+int histogram_index(unsigned long long value);
+
+/**
+ * get the largest value counted in bucket index
+ */
+unsigned long long histogram_upper(int index);
+
+/**
+ * get the value under which quantile (0.0 to 1.0) of the records fall
+ * return the value or 0 if the histogram is empty
+ */
+unsigned long long histogram_quantile(struct histogram *histogram, double quantile);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+void metric_add(metric_counter *counter, unsigned long long n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+unsigned long long metric_read(metric_counter *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+int histogram_index(unsigned long long value)
+{
+    int msb;
+    int shift;
+
+    if (value < HIST_SUB_COUNT)
+        return (int)value;
+
+    msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+
+    shift = msb - HIST_SUB_BITS;
+
+    return (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+unsigned long long histogram_upper(int index)
+{
+    int shift;
+    unsigned long long sub;
+
+    if (index < HIST_SUB_COUNT)
+        return (unsigned long long)index;
+
+    shift = index / HIST_SUB_COUNT - 1;
+    sub = index % HIST_SUB_COUNT;
+
+    return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram *histogram, unsigned long long value)
+{
+    metric_add(&histogram->buckets[histogram_index(value)], 1);
+    metric_add(&histogram->sum, value);
+    metric_add(&histogram->count, 1);
+}
+
+void histogram_merge(struct histogram *to, struct histogram *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        metric_add(&to->buckets[i], metric_read(&from->buckets[i]));
+
+    metric_add(&to->sum, metric_read(&from->sum));
+    metric_add(&to->count, metric_read(&from->count));
+}
+
+unsigned long long histogram_quantile(struct histogram *histogram, double quantile)
+{
+    unsigned long long total;
+    unsigned long long rank;
+    unsigned long long seen;
+    int i;
+
+    total = 0;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        total += metric_read(&histogram->buckets[i]);
+
+    if (0 == total)
+        return 0;
+
+    rank = (unsigned long long)(quantile * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    seen = 0;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += metric_read(&histogram->buckets[i]);
+        if (seen > rank)
+            return histogram_upper(i);
+    }
+
+    return histogram_upper(HIST_BUCKETS - 1);
+}
+
+#endif
@@ -0,0 +1,950 @@
+/**
+ * the load generator
+ * drives many concurrent sessions against a server from one process
+ *
+ * Every session is a small state machine on non-blocking sockets, all of
+ * them multiplexed by one epoll instance, so thousands of sessions cost
+ * two descriptors each and no thread. After its login a session draws its
+ * operations from a weighted mix until the run is over, then quits. The
+ * latencies go to the histograms of histogram.h and the result is printed
+ * as one JSON line.
+ *
+ * usage: ./loadgen [options] host port
+ */
+
+#include "base.h"
+#include "control.h"
+#include "histogram.h"
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define DEFAULT_SESSIONS 100
+#define DEFAULT_DURATION 10
+#define DEFAULT_USER ANONYMOUS
+#define DEFAULT_RETR_FILE "small.bin"
+#define DEFAULT_STOR_SIZE (1024 * 1024)
+
+/**
+ * how long a session waits before it reconnects after an error
+ */
+#define RETRY_DELAY_NS (10 * 1000000LL)
+
+/**
+ * how long the sessions may take to finish after the end of the run
+ */
+#define DRAIN_NS (30 * 1000000000LL)
+
+#define EPOLL_EVENTS 256
+#define DATA_BUF_SIZE (64 * 1024)
+
+/**
+ * the operations of a mix, a login op quits and logs in again
+ */
+enum loadgen_op
+{
+    OP_LOGIN,
+    OP_LIST,
+    OP_RETR,
+    OP_STOR,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {"login", "list", "retr", "stor"};
+
+/**
+ * the named mixes, weights in the order of enum loadgen_op
+ */
+struct loadgen_mix
+{
+    const char *name;
+    int weights[OP_COUNT];
+};
+
+static const struct loadgen_mix mixes[] = {
+    {"login", {1, 0, 0, 0}},
+    {"list", {0, 1, 0, 0}},
+    {"retr", {0, 0, 1, 0}},
+    {"stor", {0, 0, 0, 1}},
+    {"mixed", {1, 2, 6, 1}},
+};
+
+enum session_state
+{
+    STATE_IDLE,       /* waiting to reconnect */
+    STATE_CONNECT,    /* command connection in progress */
+    STATE_LOGIN,      /* login sent, waiting for 230 */
+    STATE_OPTIONS,    /* logged in, waiting for 200 of OPTS VARLEN */
+    STATE_COMMAND,    /* command sent, waiting for 120 */
+    STATE_PORT,       /* waiting for the data port */
+    STATE_DATA,       /* data connection open, waiting for 125 and 226 */
+    STATE_QUIT,       /* QUIT sent, waiting for 221 */
+    STATE_FINISHED
+};
+
+struct session
+{
+    int index;
+    int state;
+    int op;
+    int cmd_sockfd;
+    int data_sockfd;
+
+    char tx[BUF_SIZE * 3];
+    int tx_len;
+    int tx_off;
+
+    unsigned char rx[4];
+    int rx_len;
+
+    int data_connected;
+    int data_done;
+    int got_125;
+    int got_226;
+    int relogin;
+
+    long long connect_start;
+    long long op_start;
+    long long retry_at;
+    long long left;
+    long long bytes;
+};
+
+struct op_stats
+{
+    struct histogram latency;
+    long long count;
+    long long errors;
+    long long bytes;
+};
+
+static struct session *sessions;
+static struct op_stats stats[OP_COUNT];
+static long long rejected = 0;
+
+static int epoll_fd;
+static struct sockaddr_in server_address;
+static char login_buffer[BUF_SIZE * 3];
+static int login_len;
+static int control_varlen = 0;
+static char retr_file[ARG_LEN];
+static long long stor_size = DEFAULT_STOR_SIZE;
+static int mix_weights[OP_COUNT];
+static int mix_total = 0;
+static long long deadline;
+static char data_buffer[DATA_BUF_SIZE];
+
+/**
+ * print the options
+ */
+void usage(void);
+
+/**
+ * parse a mix, a preset name or a list like list=3,retr=1
+ * return 0 if success or -1 if error
+ */
+int parse_mix(const char *str);
+
+/**
+ * start a non-blocking connect() to port of the server
+ * return the sock fd or -1 if error
+ */
+int connect_nonblocking(int port);
+
+/**
+ * open the command connection of session and send the login
+ */
+void session_start(struct session *session, long long now);
+
+/**
+ * close the connections of session after an error in its current op
+ */
+void session_fail(struct session *session, long long now);
+
+/**
+ * send the next command of session, or QUIT after the end of the run
+ */
+void session_next(struct session *session, long long now);
+
+/**
+ * handle a code received on the command connection of session
+ */
+void session_code(struct session *session, int code, long long now);
+
+/**
+ * handle an epoll event on the command connection of session
+ */
+void session_command_event(struct session *session, unsigned int events, long long now);
+
+/**
+ * handle an epoll event on the data connection of session
+ */
+void session_data_event(struct session *session, unsigned int events, long long now);
+
+/**
+ * print the result of the run as a JSON line
+ */
+void report(FILE *out, const char *mix, int nsessions, double elapsed);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+void usage(void)
+{
+    error_handling("usage: ./loadgen [options] host port\n"
+                   "  -c num   concurrent sessions (100)\n"
+                   "  -d sec   length of the run in seconds (10)\n"
+                   "  -m mix   login, list, retr, stor, mixed or weights like list=3,retr=1\n"
+                   "  -u name  user name (anonymous)\n"
+                   "  -p word  password\n"
+                   "  -f file  file of the server fetched by RETR (small.bin)\n"
+                   "  -s size  bytes sent by STOR (1m, k, m, g suffixes)\n"
+                   "  -V       use the variable control encoding after the login"
+                   "  -o path  append the JSON result to path instead of stdout");
+}
+
+int parse_mix(const char *str)
+{
+    char buffer[BUF_SIZE];
+    char *item;
+    char *value;
+    char *save;
+    unsigned i;
+    int op;
+
+    memset(mix_weights, 0, sizeof(mix_weights));
+
+    for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++)
+    {
+        if (0 == strcmp(str, mixes[i].name))
+        {
+            memcpy(mix_weights, mixes[i].weights, sizeof(mix_weights));
+            goto total;
+        }
+    }
+
+    snprintf(buffer, sizeof(buffer), "%s", str);
+
+    for (item = strtok_r(buffer, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        value = strchr(item, '=');
+        if (!value)
+            return -1;
+        *value++ = '\0';
+
+        for (op = 0; op < OP_COUNT; op++)
+            if (0 == strcmp(item, op_names[op]))
+                break;
+
+        if (op == OP_COUNT || atoi(value) < 0)
+            return -1;
+
+        mix_weights[op] = atoi(value);
+    }
+
+total:
+    mix_total = 0;
+    for (op = 0; op < OP_COUNT; op++)
+        mix_total += mix_weights[op];
+
+    return mix_total > 0 ? 0 : -1;
+}
+
+int connect_nonblocking(int port)
+{
+    struct sockaddr_in address;
+    int sockfd;
+    int result;
+
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sockfd < 0)
+    {
+        perror("socket() error");
+        return -1;
+    }
+
+    address = server_address;
+    address.sin_port = htons(port);
+
+    result = connect(sockfd, (struct sockaddr *)&address, sizeof(address));
+
+    if (result < 0 && errno != EINPROGRESS)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * queue len bytes on the command connection and send what the socket takes
+ * return 0 if success or -1 if error
+ */
+static int session_send(struct session *session, const char *data, int len)
+{
+    struct epoll_event event;
+    int result;
+
+    memcpy(session->tx + session->tx_len, data, len);
+    session->tx_len += len;
+
+    if (STATE_CONNECT == session->state)
+        return 0;
+
+    while (session->tx_off < session->tx_len)
+    {
+        result = send(session->cmd_sockfd, session->tx + session->tx_off,
+                      session->tx_len - session->tx_off, MSG_NOSIGNAL);
+
+        if (result < 0)
+        {
+            if (EAGAIN == errno)
+                break;
+            return -1;
+        }
+
+        session->tx_off += result;
+    }
+
+    event.data.u64 = (unsigned long long)session->index << 1;
+    event.events = EPOLLIN;
+
+    if (session->tx_off < session->tx_len)
+        event.events |= EPOLLOUT;
+    else
+        session->tx_len = session->tx_off = 0;
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->cmd_sockfd, &event);
+}
+
+static void session_close(struct session *session)
+{
+    if (session->data_sockfd >= 0)
+    {
+        close(session->data_sockfd);
+        session->data_sockfd = -1;
+    }
+
+    if (session->cmd_sockfd >= 0)
+    {
+        close(session->cmd_sockfd);
+        session->cmd_sockfd = -1;
+    }
+
+    session->tx_len = session->tx_off = 0;
+    session->rx_len = 0;
+}
+
+void session_start(struct session *session, long long now)
+{
+    struct epoll_event event;
+
+    if (now >= deadline)
+    {
+        session->state = STATE_FINISHED;
+        return;
+    }
+
+    session->cmd_sockfd = connect_nonblocking(ntohs(server_address.sin_port));
+
+    if (session->cmd_sockfd < 0)
+    {
+        stats[OP_LOGIN].errors++;
+        session->state = STATE_IDLE;
+        session->retry_at = now + RETRY_DELAY_NS;
+        return;
+    }
+
+    session->state = STATE_CONNECT;
+    session->op = OP_LOGIN;
+    session->relogin = 0;
+    session->connect_start = now;
+
+    event.data.u64 = (unsigned long long)session->index << 1;
+    event.events = EPOLLOUT;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->cmd_sockfd, &event);
+
+    /* the login goes out as soon as the connection is up */
+    session_send(session, login_buffer, login_len);
+}
+
+void session_fail(struct session *session, long long now)
+{
+    stats[session->op].errors++;
+
+    session_close(session);
+
+    session->state = STATE_IDLE;
+    session->retry_at = now + RETRY_DELAY_NS;
+}
+
+void session_next(struct session *session, long long now)
+{
+    char command[BUF_SIZE];
+    char name[BUF_SIZE];
+    int length;
+    int pick;
+    int op;
+
+    if (now >= deadline)
+    {
+        session->relogin = 0;
+        goto quit;
+    }
+
+    pick = rand() % mix_total;
+    for (op = 0; pick >= mix_weights[op]; op++)
+        pick -= mix_weights[op];
+
+    session->op = op;
+    session->op_start = now;
+
+    if (OP_LOGIN == op)
+    {
+        session->relogin = 1;
+        goto quit;
+    }
+
+    session->state = STATE_COMMAND;
+    session->data_connected = session->data_done = 0;
+    session->got_125 = session->got_226 = 0;
+    session->bytes = 0;
+
+    switch (op)
+    {
+    case OP_LIST:
+        length = control_encode(command, BUF_SIZE, control_varlen, CMD_LIST, NULL);
+        break;
+    case OP_RETR:
+        length = control_encode(command, BUF_SIZE, control_varlen, CMD_RETR, retr_file);
+        break;
+    default:
+        snprintf(name, sizeof(name), "loadgen.%d", session->index);
+        length = control_encode(command, BUF_SIZE, control_varlen, CMD_STOR, name);
+        session->left = stor_size;
+        break;
+    }
+
+    if (session_send(session, command, length) < 0)
+        session_fail(session, now);
+
+    return;
+
+quit:
+    session->state = STATE_QUIT;
+    length = control_encode(command, BUF_SIZE, control_varlen, CMD_QUIT, NULL);
+
+    if (session_send(session, command, length) < 0)
+        session_fail(session, now);
+}
+
+/**
+ * record the op of session if both its data and its 226 arrived
+ */
+static void session_complete(struct session *session, long long now)
+{
+    struct op_stats *op;
+
+    if (!session->data_done || !session->got_226)
+        return;
+
+    op = &stats[session->op];
+    histogram_record(&op->latency, now - session->op_start);
+    op->count++;
+    op->bytes += session->bytes;
+
+    session_next(session, now);
+}
+
+void session_code(struct session *session, int code, long long now)
+{
+    struct epoll_event event;
+
+    switch (session->state)
+    {
+    case STATE_LOGIN:
+        if (421 == code)
+        {
+            rejected++;
+            session_fail(session, now);
+            return;
+        }
+
+        if (code != 230)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        /* the OPTS went out with the login, its reply follows */
+        if (control_varlen)
+        {
+            session->state = STATE_OPTIONS;
+            return;
+        }
+
+        histogram_record(&stats[OP_LOGIN].latency, now - session->connect_start);
+        stats[OP_LOGIN].count++;
+
+        session_next(session, now);
+        return;
+
+    case STATE_OPTIONS:
+        if (code != 200)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        histogram_record(&stats[OP_LOGIN].latency, now - session->connect_start);
+        stats[OP_LOGIN].count++;
+
+        session_next(session, now);
+        return;
+
+    case STATE_COMMAND:
+        if (code != 120)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        session->state = STATE_PORT;
+        return;
+
+    case STATE_PORT:
+        session->data_sockfd = connect_nonblocking(code);
+
+        if (session->data_sockfd < 0)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        session->state = STATE_DATA;
+
+        event.data.u64 = ((unsigned long long)session->index << 1) | 1;
+        event.events = EPOLLOUT;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->data_sockfd, &event);
+        return;
+
+    case STATE_DATA:
+        if (125 == code && !session->got_125)
+        {
+            session->got_125 = 1;
+            return;
+        }
+
+        if (226 == code && session->got_125)
+        {
+            session->got_226 = 1;
+            session_complete(session, now);
+            return;
+        }
+
+        session_fail(session, now);
+        return;
+
+    case STATE_QUIT:
+        session_close(session);
+
+        if (code != 221)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        session->state = STATE_IDLE;
+        session->retry_at = now;
+
+        /* a login op counts from QUIT to the 230 of the next connection */
+        if (session->relogin)
+        {
+            session_start(session, now);
+            if (STATE_CONNECT == session->state)
+            {
+                session->connect_start = session->op_start;
+                session->relogin = 1;
+            }
+        }
+        else
+        {
+            session->state = STATE_FINISHED;
+        }
+        return;
+
+    default:
+        session_fail(session, now);
+        return;
+    }
+}
+
+void session_command_event(struct session *session, unsigned int events, long long now)
+{
+    int error;
+    socklen_t len;
+    int result;
+    int code;
+
+    if (STATE_CONNECT == session->state)
+    {
+        len = sizeof(error);
+        getsockopt(session->cmd_sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+        if (error)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        session->state = STATE_LOGIN;
+        if (session_send(session, "", 0) < 0)
+            session_fail(session, now);
+        return;
+    }
+
+    if (events & EPOLLOUT)
+    {
+        if (session_send(session, "", 0) < 0)
+        {
+            session_fail(session, now);
+            return;
+        }
+    }
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        return;
+
+    while (session->cmd_sockfd >= 0)
+    {
+        result = recv(session->cmd_sockfd, session->rx + session->rx_len,
+                      sizeof(session->rx) - session->rx_len, 0);
+
+        if (result < 0 && EAGAIN == errno)
+            return;
+
+        if (result <= 0)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        session->rx_len += result;
+
+        if (session->rx_len < (int)sizeof(session->rx))
+            continue;
+
+        memcpy(&code, session->rx, sizeof(code));
+        session->rx_len = 0;
+
+        session_code(session, ntohl(code), now);
+
+        /* the session may have moved on to a new connection */
+        if (STATE_IDLE == session->state || STATE_FINISHED == session->state ||
+            STATE_CONNECT == session->state)
+            return;
+    }
+}
+
+void session_data_event(struct session *session, unsigned int events, long long now)
+{
+    struct epoll_event event;
+    socklen_t len;
+    int error;
+    int result;
+    int size;
+
+    if (session->data_sockfd < 0)
+        return;
+
+    if (!session->data_connected)
+    {
+        len = sizeof(error);
+        getsockopt(session->data_sockfd, SOL_SOCKET, SO_ERROR, &error, &len);
+
+        if (error)
+        {
+            session_fail(session, now);
+            return;
+        }
+
+        session->data_connected = 1;
+
+        if (session->op != OP_STOR)
+        {
+            event.data.u64 = ((unsigned long long)session->index << 1) | 1;
+            event.events = EPOLLIN;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->data_sockfd, &event);
+            return;
+        }
+    }
+
+    if (OP_STOR == session->op)
+    {
+        while (session->left > 0)
+        {
+            size = session->left < DATA_BUF_SIZE ? session->left : DATA_BUF_SIZE;
+            result = send(session->data_sockfd, data_buffer, size, MSG_NOSIGNAL);
+
+            if (result < 0 && EAGAIN == errno)
+                return;
+
+            if (result < 0)
+            {
+                session_fail(session, now);
+                return;
+            }
+
+            session->left -= result;
+            session->bytes += result;
+        }
+    }
+    else
+    {
+        while (1)
+        {
+            result = recv(session->data_sockfd, data_buffer, DATA_BUF_SIZE, 0);
+
+            if (result < 0 && EAGAIN == errno)
+                return;
+
+            if (result < 0)
+            {
+                session_fail(session, now);
+                return;
+            }
+
+            if (0 == result)
+                break;
+
+            session->bytes += result;
+        }
+    }
+
+    close(session->data_sockfd);
+    session->data_sockfd = -1;
+    session->data_done = 1;
+
+    session_complete(session, now);
+}
+
+void report(FILE *out, const char *mix, int nsessions, double elapsed)
+{
+    struct op_stats *op;
+    long long total;
+    int i;
+
+    total = 0;
+    for (i = 0; i < OP_COUNT; i++)
+        total += stats[i].count;
+
+    fprintf(out, "{\"mix\":\"%s\",\"sessions\":%d,\"elapsed_s\":%.3f,\"ops\":%lld,\"ops_per_s\":%.1f,"
+                 "\"rejected\":%lld",
+            mix, nsessions, elapsed, total, total / elapsed, rejected);
+
+    for (i = 0; i < OP_COUNT; i++)
+    {
+        op = &stats[i];
+
+        if (0 == op->count && 0 == op->errors)
+            continue;
+
+        fprintf(out, ",\"%s\":{\"count\":%lld,\"errors\":%lld,\"ops_per_s\":%.1f,\"bytes\":%lld,"
+                     "\"mib_per_s\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}",
+                op_names[i], op->count, op->errors, op->count / elapsed, op->bytes,
+                op->bytes / elapsed / (1024.0 * 1024.0),
+                histogram_quantile(&op->latency, 0.5) / 1000.0,
+                histogram_quantile(&op->latency, 0.99) / 1000.0,
+                histogram_quantile(&op->latency, 0.999) / 1000.0);
+    }
+
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event events[EPOLL_EVENTS];
+    struct session *session;
+    struct rlimit limit;
+    const char *user = DEFAULT_USER;
+    const char *password = "";
+    const char *mix = "mixed";
+    const char *output = NULL;
+    long long start;
+    long long now;
+    int nsessions = DEFAULT_SESSIONS;
+    int duration = DEFAULT_DURATION;
+    int active;
+    int option;
+    int count;
+    int i;
+    FILE *out;
+
+    snprintf(retr_file, sizeof(retr_file), "%s", DEFAULT_RETR_FILE);
+
+    while ((option = getopt(argc, argv, "c:d:m:u:p:f:s:o:V")) != -1)
+    {
+        switch (option)
+        {
+        case 'c':
+            nsessions = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'u':
+            user = optarg;
+            break;
+        case 'p':
+            password = optarg;
+            break;
+        case 'f':
+            snprintf(retr_file, sizeof(retr_file), "%s", optarg);
+            break;
+        case 's':
+            stor_size = parse_size(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'V':
+            control_varlen = 1;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if (argc - optind != 2 || nsessions <= 0 || duration <= 0 || stor_size < 0 ||
+        parse_mix(mix) < 0)
+    {
+        usage();
+        exit(1);
+    }
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = inet_addr(argv[optind]);
+    server_address.sin_port = htons(atoi(argv[optind + 1]));
+
+    memcpy(login_buffer, CMD_ACCT, CMD_LEN);
+    snprintf(login_buffer + CMD_LEN, ARG_LEN, "%s", user);
+    memcpy(login_buffer + BUF_SIZE, CMD_ADAT, CMD_LEN);
+    snprintf(login_buffer + BUF_SIZE + CMD_LEN, ARG_LEN, "%s", password);
+    login_len = BUF_SIZE * 2;
+
+    if (control_varlen)
+        login_len += control_encode(login_buffer + login_len, BUF_SIZE, 0, CMD_OPTS, OPTS_VARLEN);
+
+    /* two descriptors a session */
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if ((rlim_t)nsessions * 2 + 16 > limit.rlim_cur)
+    {
+        error_handling("too many sessions for the limit of open files");
+        exit(1);
+    }
+
+    sessions = calloc(nsessions, sizeof(struct session));
+
+    if (!sessions)
+    {
+        perror("calloc() error");
+        exit(1);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epoll_fd < 0)
+    {
+        perror("epoll_create1() error");
+        exit(1);
+    }
+
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    memset(data_buffer, 'x', sizeof(data_buffer));
+
+    start = monotonic_ns();
+    deadline = start + duration * 1000000000LL;
+
+    for (i = 0; i < nsessions; i++)
+    {
+        sessions[i].index = i;
+        sessions[i].cmd_sockfd = -1;
+        sessions[i].data_sockfd = -1;
+        session_start(&sessions[i], start);
+    }
+
+    while (1)
+    {
+        count = epoll_wait(epoll_fd, events, EPOLL_EVENTS, 10);
+
+        if (count < 0 && errno != EINTR)
+        {
+            perror("epoll_wait() error");
+            exit(1);
+        }
+
+        now = monotonic_ns();
+
+        for (i = 0; i < count; i++)
+        {
+            session = &sessions[events[i].data.u64 >> 1];
+
+            if (events[i].data.u64 & 1)
+                session_data_event(session, events[i].events, now);
+            else
+                session_command_event(session, events[i].events, now);
+        }
+
+        active = 0;
+        for (i = 0; i < nsessions; i++)
+        {
+            session = &sessions[i];
+
+            if (STATE_IDLE == session->state && session->retry_at <= now)
+                session_start(session, now);
+
+            if (session->state != STATE_FINISHED)
+                active++;
+        }
+
+        if (0 == active || now >= deadline + DRAIN_NS)
+            break;
+    }
+
+    out = stdout;
+
+    if (output)
+    {
+        out = fopen(output, "a");
+        if (!out)
+        {
+            perror("fopen() error");
+            exit(1);
+        }
+    }
+
+    report(out, mix, nsessions, (monotonic_ns() - start) / 1e9);
+
+    if (out != stdout)
+        fclose(out);
+
+    if (active > 0)
+        fprintf(stderr, "%d sessions did not finish\n", active);
+
+    exit(0);
+}
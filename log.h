@@ -0,0 +1,712 @@
+#ifndef LOG_H
+#define LOG_H
+
+/**
+ * --- log.h defines ---
+ * structured asynchronous logging of the server
+ *
+ * A log call does not format anything. It copies the format pointer and the
+ * arguments (strings by value) into a slot of a lock-free ring owned by the
+ * process, and a flusher thread of the same process formats the records as
+ * JSON lines and writes them in batches. The flusher sleeps on a condition
+ * variable between batches; a record that fills LOG_WAKE_RECORDS slots
+ * wakes it early, so an idle process wakes LOG_FLUSH_INTERVAL_MS apart and
+ * a busy one never lets the ring fill. A level disabled at run time costs
+ * one compare, a level below LOG_COMPILE_LEVEL is compiled out. When the ring
+ * is full the record is dropped and counted, the caller never blocks.
+ *
+ * The format must be a string literal, it is read later by the flusher.
+ * Arguments are integers, doubles or strings; %s copies up to the space
+ * left in the record.
+ */
+
+#include "base.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_OFF 4
+
+/**
+ * the levels below this one are not compiled in
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/**
+ * slots in the ring of a process, a power of two
+ */
+#define LOG_RING_SIZE 1024
+
+/**
+ * arguments of a record, the format counts as the first one
+ */
+#define LOG_MAX_ARGS 8
+
+/**
+ * bytes of a record kept for the copies of %s arguments
+ */
+#define LOG_STRING_SPACE 160
+
+/**
+ * how long the flusher sleeps when the ring is empty and nobody wakes it
+ */
+#define LOG_FLUSH_INTERVAL_MS 50
+
+/**
+ * every this many records a sleeping flusher is woken, a power of two
+ * well under LOG_RING_SIZE
+ */
+#define LOG_WAKE_RECORDS (LOG_RING_SIZE / 4)
+
+/**
+ * size of the buffer the flusher fills before a write()
+ */
+#define LOG_WRITE_BUF_SIZE (64 * 1024)
+
+/**
+ * the longest JSON line of a record
+ */
+#define LOG_LINE_MAX (8 * 1024)
+
+#define LOG_ARG_INT 0
+#define LOG_ARG_UNSIGNED 1
+#define LOG_ARG_DOUBLE 2
+#define LOG_ARG_STRING 3
+#define LOG_ARG_POINTER 4
+
+struct log_arg
+{
+    int type;
+    union
+    {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+    } value;
+};
+
+struct log_record
+{
+    long long timestamp;
+    const char *format;
+    unsigned char level;
+    unsigned char nargs;
+    unsigned char types[LOG_MAX_ARGS];
+    union
+    {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+        int offset;
+    } args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_SPACE];
+};
+
+struct log_slot
+{
+    _Atomic unsigned long seq;
+    struct log_record record;
+};
+
+static struct log_slot log_ring[LOG_RING_SIZE];
+static _Atomic unsigned long log_head = 0;
+static unsigned long log_tail = 0;
+static _Atomic unsigned long log_dropped = 0;
+static _Atomic int log_stop = 0;
+static _Atomic int log_sleeping = 0;
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+static int log_level = LOG_LEVEL_INFO;
+static int log_fd = STDOUT_FILENO;
+static pid_t log_flusher_pid = 0;
+static pthread_t log_flusher;
+
+static const char *log_level_names[] = {"debug", "info", "warn", "error", "off"};
+
+/**
+ * turn every log argument into a struct log_arg at the call site
+ */
+#define LOG_VALUE(x) _Generic((x),                   \
+    char *: log_arg_string,                          \
+    const char *: log_arg_string,                    \
+    void *: log_arg_pointer,                         \
+    const void *: log_arg_pointer,                   \
+    float: log_arg_double,                           \
+    double: log_arg_double,                          \
+    unsigned int: log_arg_unsigned,                  \
+    unsigned long: log_arg_unsigned,                 \
+    unsigned long long: log_arg_unsigned,            \
+    default: log_arg_int)(x)
+
+#define LOG_NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_CONCAT_(a, b) a##b
+#define LOG_CONCAT(a, b) LOG_CONCAT_(a, b)
+#define LOG_MAP_1(f, x) f(x)
+#define LOG_MAP_2(f, x, ...) f(x), LOG_MAP_1(f, __VA_ARGS__)
+#define LOG_MAP_3(f, x, ...) f(x), LOG_MAP_2(f, __VA_ARGS__)
+#define LOG_MAP_4(f, x, ...) f(x), LOG_MAP_3(f, __VA_ARGS__)
+#define LOG_MAP_5(f, x, ...) f(x), LOG_MAP_4(f, __VA_ARGS__)
+#define LOG_MAP_6(f, x, ...) f(x), LOG_MAP_5(f, __VA_ARGS__)
+#define LOG_MAP_7(f, x, ...) f(x), LOG_MAP_6(f, __VA_ARGS__)
+#define LOG_MAP_8(f, x, ...) f(x), LOG_MAP_7(f, __VA_ARGS__)
+#define LOG_MAP(f, ...) LOG_CONCAT(LOG_MAP_, LOG_NARGS(__VA_ARGS__))(f, __VA_ARGS__)
+
+/**
+ * log a format and its arguments at level
+ */
+#define log_at(level, ...)                                                      \
+    do                                                                          \
+    {                                                                           \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_level)               \
+        {                                                                       \
+            struct log_arg log_args_[] = {LOG_MAP(LOG_VALUE, __VA_ARGS__)};     \
+            log_push((level), sizeof(log_args_) / sizeof(log_args_[0]),         \
+                     log_args_);                                                \
+        }                                                                       \
+    } while (0)
+
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/**
+ * set the level and the output file (NULL for stdout) and start the flusher
+ * return 0 if success or -1 if error
+ */
+int log_initialize(const char *level, const char *path);
+
+/**
+ * drop the records inherited from the parent and start the flusher
+ * of the new process, called in the child after fork()
+ * return 0 if success or -1 if error
+ */
+int log_after_fork(void);
+
+/**
+ * stop the flusher after it wrote every record, registered with atexit()
+ */
+void log_shutdown(void);
+
+/**
+ * copy a record into the ring, args[0] is the format
+ */
+void log_push(int level, int nargs, const struct log_arg *args);
+
+/**
+ * get the level called name
+ * return the level or -1 if error
+ */
+int log_parse_level(const char *name);
+
+static inline struct log_arg log_arg_int(long long value)
+{
+    struct log_arg arg;
+
+    arg.type = LOG_ARG_INT;
+    arg.value.i = value;
+
+    return arg;
+}
+
+static inline struct log_arg log_arg_unsigned(unsigned long long value)
+{
+    struct log_arg arg;
+
+    arg.type = LOG_ARG_UNSIGNED;
+    arg.value.u = value;
+
+    return arg;
+}
+
+static inline struct log_arg log_arg_double(double value)
+{
+    struct log_arg arg;
+
+    arg.type = LOG_ARG_DOUBLE;
+    arg.value.d = value;
+
+    return arg;
+}
+
+static inline struct log_arg log_arg_string(const char *value)
+{
+    struct log_arg arg;
+
+    arg.type = LOG_ARG_STRING;
+    arg.value.p = value;
+
+    return arg;
+}
+
+static inline struct log_arg log_arg_pointer(const void *value)
+{
+    struct log_arg arg;
+
+    arg.type = LOG_ARG_POINTER;
+    arg.value.p = value;
+
+    return arg;
+}
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+void log_push(int level, int nargs, const struct log_arg *args)
+{
+    struct log_slot *slot;
+    struct log_record *record;
+    const char *str;
+    unsigned long pos;
+    unsigned long seq;
+    long diff;
+    struct timespec ts;
+    size_t used;
+    size_t len;
+    int i;
+
+    pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+
+    while (1)
+    {
+        slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (long)(seq - pos);
+
+        if (0 == diff)
+        {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    record = &slot->record;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->timestamp = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    record->level = level;
+    record->format = args[0].value.p;
+
+    if (nargs > LOG_MAX_ARGS)
+        nargs = LOG_MAX_ARGS;
+    record->nargs = nargs;
+
+    used = 0;
+    for (i = 1; i < nargs; i++)
+    {
+        record->types[i] = args[i].type;
+
+        if (LOG_ARG_STRING == args[i].type)
+        {
+            /* the last byte of a full string space is always a '\0' */
+            if (used >= LOG_STRING_SPACE)
+            {
+                record->args[i].offset = LOG_STRING_SPACE - 1;
+                continue;
+            }
+
+            record->args[i].offset = used;
+
+            str = args[i].value.p ? args[i].value.p : "(null)";
+
+            len = strnlen(str, LOG_STRING_SPACE);
+            if (len > LOG_STRING_SPACE - used - 1)
+                len = LOG_STRING_SPACE - used - 1;
+
+            memcpy(record->strings + used, str, len);
+            record->strings[used + len] = '\0';
+            used += len + 1;
+        }
+        else
+        {
+            record->args[i].u = args[i].value.u;
+        }
+    }
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    if (0 == ((pos + 1) & (LOG_WAKE_RECORDS - 1)) &&
+        atomic_load_explicit(&log_sleeping, memory_order_acquire))
+    {
+        pthread_mutex_lock(&log_wake_lock);
+        pthread_cond_signal(&log_wake);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+}
+
+/**
+ * append the JSON escape of str to out
+ * return the length appended
+ */
+static int log_escape(char *out, int space, const char *str)
+{
+    int n;
+
+    n = 0;
+    for (; *str && n < space - 6; str++)
+    {
+        if ('"' == *str || '\\' == *str)
+        {
+            out[n++] = '\\';
+            out[n++] = *str;
+        }
+        else if ((unsigned char)*str < 0x20)
+        {
+            n += snprintf(out + n, space - n, "\\u%04x", (unsigned char)*str);
+        }
+        else
+        {
+            out[n++] = *str;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * format the message of record into out
+ */
+static void log_format_message(struct log_record *record, char *out, int space)
+{
+    const char *p;
+    char spec[32];
+    int spec_len;
+    int arg;
+    int n;
+
+    n = 0;
+    arg = 1;
+
+    for (p = record->format; *p && n < space - 1; p++)
+    {
+        if ('%' != *p)
+        {
+            out[n++] = *p;
+            continue;
+        }
+
+        if ('%' == p[1])
+        {
+            out[n++] = '%';
+            p++;
+            continue;
+        }
+
+        /* copy flags, width and precision, drop the length modifiers */
+        spec_len = 0;
+        spec[spec_len++] = *p++;
+        while (*p && strchr("-+ #0123456789.", *p) && spec_len < 20)
+            spec[spec_len++] = *p++;
+        while (*p && strchr("hlLqjzt", *p))
+            p++;
+
+        if (!*p)
+            break;
+
+        if (arg >= record->nargs)
+        {
+            n += snprintf(out + n, space - n, "%%!%c", *p);
+        }
+        else if (strchr("diouxXc", *p))
+        {
+            if ('c' != *p)
+            {
+                spec[spec_len++] = 'l';
+                spec[spec_len++] = 'l';
+            }
+            spec[spec_len++] = *p;
+            spec[spec_len] = '\0';
+
+            if ('c' == *p)
+                n += snprintf(out + n, space - n, spec, (int)record->args[arg].i);
+            else if ('d' == *p || 'i' == *p)
+                n += snprintf(out + n, space - n, spec, record->args[arg].i);
+            else
+                n += snprintf(out + n, space - n, spec, record->args[arg].u);
+            arg++;
+        }
+        else if (strchr("feEgGaA", *p))
+        {
+            spec[spec_len++] = *p;
+            spec[spec_len] = '\0';
+            n += snprintf(out + n, space - n, spec, record->args[arg++].d);
+        }
+        else if ('s' == *p)
+        {
+            spec[spec_len++] = 's';
+            spec[spec_len] = '\0';
+            if (LOG_ARG_STRING == record->types[arg])
+                n += snprintf(out + n, space - n, spec, record->strings + record->args[arg].offset);
+            else
+                n += snprintf(out + n, space - n, "%%!s");
+            arg++;
+        }
+        else if ('p' == *p)
+        {
+            n += snprintf(out + n, space - n, "%p", record->args[arg++].p);
+        }
+
+        if (n > space - 1)
+            n = space - 1;
+    }
+
+    out[n] = '\0';
+}
+
+/**
+ * format record as a JSON line into out
+ * return the length of the line
+ */
+static int log_format_record(struct log_record *record, char *out, int space)
+{
+    char message[LOG_STRING_SPACE * 4];
+    struct tm tm;
+    time_t seconds;
+    int n;
+
+    log_format_message(record, message, sizeof(message));
+
+    seconds = record->timestamp / 1000000000LL;
+    gmtime_r(&seconds, &tm);
+
+    n = snprintf(out, space, "{\"ts\":\"%04d-%02d-%02dT%02d:%02d:%02d.%06lldZ\",\"level\":\"%s\",\"pid\":%d,\"msg\":\"",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 record->timestamp % 1000000000LL / 1000, log_level_names[record->level], (int)getpid());
+    n += log_escape(out + n, space - n - 3, message);
+    out[n++] = '"';
+    out[n++] = '}';
+    out[n++] = '\n';
+
+    return n;
+}
+
+static void log_write_all(const char *buffer, int size)
+{
+    int result;
+
+    while (size > 0)
+    {
+        result = write(log_fd, buffer, size);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return;
+        }
+
+        buffer += result;
+        size -= result;
+    }
+}
+
+/**
+ * move every record of the ring into the output
+ * return the number of records written
+ */
+static int log_drain(char *buffer)
+{
+    struct log_slot *slot;
+    struct log_record record;
+    unsigned long dropped;
+    int used;
+    int count;
+
+    used = 0;
+    count = 0;
+
+    dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if (dropped > 0)
+        used += snprintf(buffer, LOG_WRITE_BUF_SIZE,
+                         "{\"level\":\"warn\",\"pid\":%d,\"msg\":\"%lu log records dropped\"}\n",
+                         (int)getpid(), dropped);
+
+    while (1)
+    {
+        slot = &log_ring[log_tail & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != log_tail + 1)
+            break;
+
+        memcpy(&record, &slot->record, sizeof(record));
+        atomic_store_explicit(&slot->seq, log_tail + LOG_RING_SIZE, memory_order_release);
+        log_tail++;
+
+        if (used > LOG_WRITE_BUF_SIZE - LOG_LINE_MAX)
+        {
+            log_write_all(buffer, used);
+            used = 0;
+        }
+
+        used += log_format_record(&record, buffer + used, LOG_WRITE_BUF_SIZE - used);
+        count++;
+    }
+
+    if (used > 0)
+        log_write_all(buffer, used);
+
+    return count;
+}
+
+static void *log_flusher_main(void *unused)
+{
+    char *buffer;
+    struct timespec deadline;
+
+    (void)unused;
+
+    buffer = malloc(LOG_WRITE_BUF_SIZE);
+    if (!buffer)
+        return NULL;
+
+    while (!atomic_load_explicit(&log_stop, memory_order_acquire))
+    {
+        if (log_drain(buffer) > 0)
+            continue;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&log_wake_lock);
+        atomic_store_explicit(&log_sleeping, 1, memory_order_release);
+        if (!atomic_load_explicit(&log_stop, memory_order_acquire))
+            pthread_cond_timedwait(&log_wake, &log_wake_lock, &deadline);
+        atomic_store_explicit(&log_sleeping, 0, memory_order_relaxed);
+        pthread_mutex_unlock(&log_wake_lock);
+    }
+
+    log_drain(buffer);
+    free(buffer);
+
+    return NULL;
+}
+
+static void log_ring_reset(void)
+{
+    int i;
+
+    for (i = 0; i < LOG_RING_SIZE; i++)
+        atomic_store_explicit(&log_ring[i].seq, i, memory_order_relaxed);
+
+    atomic_store_explicit(&log_head, 0, memory_order_relaxed);
+    atomic_store_explicit(&log_dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&log_stop, 0, memory_order_relaxed);
+    atomic_store_explicit(&log_sleeping, 0, memory_order_relaxed);
+    log_tail = 0;
+
+    /* a thread of the parent may have held them at fork() */
+    pthread_mutex_init(&log_wake_lock, NULL);
+    pthread_cond_init(&log_wake, NULL);
+}
+
+static int log_start_flusher(void)
+{
+    int result;
+
+    result = pthread_create(&log_flusher, NULL, log_flusher_main, NULL);
+
+    if (result != 0)
+    {
+        errno = result;
+        perror("pthread_create() error");
+        return -1;
+    }
+
+    log_flusher_pid = getpid();
+
+    return 0;
+}
+
+int log_parse_level(const char *name)
+{
+    int i;
+
+    for (i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_OFF; i++)
+    {
+        if (0 == strcmp(name, log_level_names[i]))
+            return i;
+    }
+
+    return -1;
+}
+
+int log_initialize(const char *level, const char *path)
+{
+    if (level)
+    {
+        log_level = log_parse_level(level);
+        if (log_level < 0)
+        {
+            error_handling("invalid log level");
+            return -1;
+        }
+    }
+
+    if (path)
+    {
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (log_fd < 0)
+        {
+            perror("open() error");
+            return -1;
+        }
+    }
+
+    log_ring_reset();
+
+    if (log_start_flusher() < 0)
+        return -1;
+
+    atexit(log_shutdown);
+
+    return 0;
+}
+
+int log_after_fork(void)
+{
+    if (0 == log_flusher_pid)
+        return 0;
+
+    log_ring_reset();
+
+    return log_start_flusher();
+}
+
+void log_shutdown(void)
+{
+    /* the flusher only runs in the process that started it */
+    if (log_flusher_pid != getpid())
+        return;
+
+    pthread_mutex_lock(&log_wake_lock);
+    atomic_store_explicit(&log_stop, 1, memory_order_release);
+    pthread_cond_signal(&log_wake);
+    pthread_mutex_unlock(&log_wake_lock);
+
+    pthread_join(log_flusher, NULL);
+    log_flusher_pid = 0;
+}
+
+#endif
@@ -0,0 +1,757 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/**
+ * --- metrics.h defines ---
+ * counters and latency histograms of the server,
+ * written lock-free by every session and read in Prometheus text format
+ *
+ * Each forked session owns one slot of a MAP_SHARED mapping, indexed by its
+ * admission slot, and is the only writer of it. When a session exits the
+ * listening process folds its slot into the retired totals under a sequence
+ * counter; a reader sums the retired totals and the live slots and retries
+ * if a fold ran meanwhile, so the counters never go backwards.
+ */
+
+#include "base.h"
+#include "cache.h"
+#include "commands.h"
+#include "histogram.h"
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+
+/**
+ * the number of users whose bytes are kept after their sessions exit
+ */
+#define METRICS_USER_SLOTS 64
+
+/**
+ * how long the metrics endpoint waits for an HTTP request line
+ */
+#define METRICS_REQUEST_TIMEOUT_MS 100
+
+/**
+ * the commands timed by the server, every command of commands.h by its id
+ * and the unknown ones in the last
+ */
+#define METRICS_OTHER COMMAND_COUNT
+#define METRICS_COMMANDS (COMMAND_COUNT + 1)
+
+/**
+ * the phases of a session and its transfers
+ */
+enum metrics_phase
+{
+    METRICS_LOGIN,      /* accept() to the login code sent */
+    METRICS_PORT_SETUP, /* choosing, listening on and sending a data port */
+    METRICS_ACCEPT,     /* waiting for the client to connect the data port */
+    METRICS_FIRST_BYTE, /* transfer start to the first byte moved */
+    METRICS_COMPLETION, /* transfer start to the last byte moved */
+    METRICS_PHASES
+};
+
+struct metrics_data
+{
+    metric_counter bytes_sent;
+    metric_counter bytes_received;
+    metric_counter logins;
+    metric_counter login_failures;
+    struct histogram commands[METRICS_COMMANDS];
+    struct histogram phases[METRICS_PHASES];
+};
+
+struct metrics_slot
+{
+    _Atomic int live;
+    _Atomic int named;
+    char user[BUF_SIZE];
+    struct metrics_data data;
+};
+
+struct metrics_user
+{
+    char name[BUF_SIZE];
+    metric_counter bytes_sent;
+    metric_counter bytes_received;
+};
+
+struct metrics_shared
+{
+    _Atomic unsigned int fold_seq;
+    metric_counter sessions;
+    metric_counter rejected;
+    int user_count;
+    int slot_count;
+    struct metrics_data retired;
+    struct metrics_user users[METRICS_USER_SLOTS];
+    struct metrics_slot slots[];
+};
+
+static const char *metrics_phase_names[METRICS_PHASES] = {
+    "login", "port_setup", "accept", "first_byte", "completion"};
+
+static struct metrics_shared *metrics_shared = NULL;
+static struct metrics_slot *metrics_slot = NULL;
+static long long metrics_session_start = 0;
+static long long metrics_transfer_start = 0;
+static int metrics_first_byte = 0;
+
+/**
+ * map the slots of max_sessions sessions before any session is forked
+ * return 0 if success or -1 if error
+ */
+int metrics_initialize(int max_sessions);
+
+/**
+ * start writing the metrics of a new session into slot
+ */
+void metrics_session_begin(int slot);
+
+/**
+ * fold the slot of an exited session into the retired totals,
+ * called by the listening process only
+ */
+void metrics_retire(int slot);
+
+/**
+ * count a connection rejected by admission control,
+ * called by the listening process only
+ */
+void metrics_rejected(void);
+
+/**
+ * record a login of user_name, succeed is 1 or 0
+ */
+void metrics_login(const char *user_name, int succeed);
+
+/**
+ * record the latency of the command of id received at start_ns,
+ * id is -1 for a command that is not in commands.h
+ */
+void metrics_command(int id, long long start_ns);
+
+/**
+ * record the latency of phase started at start_ns
+ */
+void metrics_phase(int phase, long long start_ns);
+
+/**
+ * start timing the first byte and completion of a transfer
+ */
+void metrics_transfer_begin(void);
+
+/**
+ * count the bytes moved by the current transfer
+ */
+void metrics_transfer_bytes(long long sent, long long received);
+
+/**
+ * record the completion of the current transfer
+ */
+void metrics_transfer_end(void);
+
+/**
+ * write all the metrics in Prometheus text format into out
+ * return 0 if success or -1 if error
+ */
+int metrics_write(FILE *out);
+
+/**
+ * send all the metrics in Prometheus text format via sock fd
+ * return 0 if success or -1 if error
+ */
+int send_metrics(int sockfd);
+
+/**
+ * create a unix socket serving the metrics at path
+ * return the listening sock fd or -1 if error
+ */
+int metrics_listen(const char *path);
+
+/**
+ * accept the scrapers waiting on listen_sockfd and serve each one in a child
+ * return 0 if success or -1 if error
+ */
+int metrics_serve(int listen_sockfd);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+int metrics_initialize(int max_sessions)
+{
+    struct metrics_shared *shared;
+    size_t size;
+
+    size = sizeof(struct metrics_shared) + max_sessions * sizeof(struct metrics_slot);
+
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == shared)
+    {
+        perror("mmap() error");
+        return -1;
+    }
+
+    shared->slot_count = max_sessions;
+    shared->user_count = 0;
+
+    metrics_shared = shared;
+
+    return 0;
+}
+
+void metrics_session_begin(int slot)
+{
+    if (!metrics_shared)
+        return;
+
+    metrics_slot = &metrics_shared->slots[slot];
+    metrics_session_start = monotonic_ns();
+    atomic_store_explicit(&metrics_slot->live, 1, memory_order_release);
+}
+
+static struct metrics_user *metrics_find_user(const char *user_name)
+{
+    struct metrics_user *user;
+    int i;
+
+    for (i = 0; i < metrics_shared->user_count; i++)
+    {
+        if (0 == strcmp(metrics_shared->users[i].name, user_name))
+            return &metrics_shared->users[i];
+    }
+
+    /* the last slot collects every user beyond the table */
+    if (metrics_shared->user_count == METRICS_USER_SLOTS)
+        return &metrics_shared->users[METRICS_USER_SLOTS - 1];
+
+    user = &metrics_shared->users[metrics_shared->user_count];
+    strncpy(user->name, user_name, BUF_SIZE - 1);
+    if (metrics_shared->user_count == METRICS_USER_SLOTS - 1)
+        strcpy(user->name, "(other)");
+
+    metrics_shared->user_count++;
+
+    return user;
+}
+
+static void metrics_data_merge(struct metrics_data *to, struct metrics_data *from)
+{
+    int i;
+
+    metric_add(&to->bytes_sent, metric_read(&from->bytes_sent));
+    metric_add(&to->bytes_received, metric_read(&from->bytes_received));
+    metric_add(&to->logins, metric_read(&from->logins));
+    metric_add(&to->login_failures, metric_read(&from->login_failures));
+
+    for (i = 0; i < METRICS_COMMANDS; i++)
+        histogram_merge(&to->commands[i], &from->commands[i]);
+
+    for (i = 0; i < METRICS_PHASES; i++)
+        histogram_merge(&to->phases[i], &from->phases[i]);
+}
+
+void metrics_retire(int slot)
+{
+    struct metrics_slot *retiring;
+    struct metrics_user *user;
+
+    if (!metrics_shared)
+        return;
+
+    retiring = &metrics_shared->slots[slot];
+
+    if (!atomic_load_explicit(&retiring->live, memory_order_acquire))
+        return;
+
+    atomic_fetch_add_explicit(&metrics_shared->fold_seq, 1, memory_order_acq_rel);
+
+    metrics_data_merge(&metrics_shared->retired, &retiring->data);
+    metric_add(&metrics_shared->sessions, 1);
+
+    if (atomic_load_explicit(&retiring->named, memory_order_acquire))
+    {
+        user = metrics_find_user(retiring->user);
+        metric_add(&user->bytes_sent, metric_read(&retiring->data.bytes_sent));
+        metric_add(&user->bytes_received, metric_read(&retiring->data.bytes_received));
+    }
+
+    memset(&retiring->data, 0, sizeof(retiring->data));
+    atomic_store_explicit(&retiring->named, 0, memory_order_relaxed);
+    atomic_store_explicit(&retiring->live, 0, memory_order_release);
+
+    atomic_fetch_add_explicit(&metrics_shared->fold_seq, 1, memory_order_acq_rel);
+}
+
+void metrics_rejected(void)
+{
+    if (!metrics_shared)
+        return;
+
+    metric_add(&metrics_shared->rejected, 1);
+}
+
+void metrics_login(const char *user_name, int succeed)
+{
+    if (!metrics_slot)
+        return;
+
+    if (!succeed)
+    {
+        metric_add(&metrics_slot->data.login_failures, 1);
+        return;
+    }
+
+    memset(metrics_slot->user, 0, BUF_SIZE);
+    strncpy(metrics_slot->user, user_name, BUF_SIZE - 1);
+    atomic_store_explicit(&metrics_slot->named, 1, memory_order_release);
+
+    metric_add(&metrics_slot->data.logins, 1);
+    metrics_phase(METRICS_LOGIN, metrics_session_start);
+}
+
+void metrics_command(int id, long long start_ns)
+{
+    if (!metrics_slot)
+        return;
+
+    histogram_record(&metrics_slot->data.commands[id < 0 ? METRICS_OTHER : id], monotonic_ns() - start_ns);
+}
+
+void metrics_phase(int phase, long long start_ns)
+{
+    if (!metrics_slot)
+        return;
+
+    histogram_record(&metrics_slot->data.phases[phase], monotonic_ns() - start_ns);
+}
+
+void metrics_transfer_begin(void)
+{
+    metrics_transfer_start = monotonic_ns();
+    metrics_first_byte = 0;
+}
+
+void metrics_transfer_bytes(long long sent, long long received)
+{
+    if (!metrics_slot)
+        return;
+
+    if (!metrics_first_byte)
+    {
+        metrics_first_byte = 1;
+        metrics_phase(METRICS_FIRST_BYTE, metrics_transfer_start);
+    }
+
+    if (sent > 0)
+        metric_add(&metrics_slot->data.bytes_sent, sent);
+    if (received > 0)
+        metric_add(&metrics_slot->data.bytes_received, received);
+}
+
+void metrics_transfer_end(void)
+{
+    metrics_phase(METRICS_COMPLETION, metrics_transfer_start);
+}
+
+/**
+ * the bytes of one user summed over the retired totals and the live slots
+ */
+struct metrics_user_sum
+{
+    char name[BUF_SIZE];
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+};
+
+static void metrics_user_sum_add(struct metrics_user_sum *sums, int *count, const char *name,
+                                 unsigned long long sent, unsigned long long received)
+{
+    int i;
+
+    for (i = 0; i < *count; i++)
+    {
+        if (0 == strcmp(sums[i].name, name))
+            break;
+    }
+
+    if (i == *count)
+    {
+        strcpy(sums[i].name, name);
+        sums[i].bytes_sent = 0;
+        sums[i].bytes_received = 0;
+        (*count)++;
+    }
+
+    sums[i].bytes_sent += sent;
+    sums[i].bytes_received += received;
+}
+
+/**
+ * take a consistent snapshot of all the metrics
+ * return the number of live sessions
+ */
+static int metrics_snapshot(struct metrics_data *total, struct metrics_user_sum *sums, int *sum_count,
+                            unsigned long long *sessions, unsigned long long *rejected)
+{
+    struct metrics_slot *slot;
+    unsigned int seq;
+    int live;
+    int i;
+
+    while (1)
+    {
+        seq = atomic_load_explicit(&metrics_shared->fold_seq, memory_order_acquire);
+        if (seq & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        memset(total, 0, sizeof(*total));
+        *sum_count = 0;
+        live = 0;
+
+        metrics_data_merge(total, &metrics_shared->retired);
+        *sessions = metric_read(&metrics_shared->sessions);
+        *rejected = metric_read(&metrics_shared->rejected);
+
+        for (i = 0; i < metrics_shared->user_count; i++)
+            metrics_user_sum_add(sums, sum_count, metrics_shared->users[i].name,
+                                 metric_read(&metrics_shared->users[i].bytes_sent),
+                                 metric_read(&metrics_shared->users[i].bytes_received));
+
+        for (i = 0; i < metrics_shared->slot_count; i++)
+        {
+            slot = &metrics_shared->slots[i];
+            if (!atomic_load_explicit(&slot->live, memory_order_acquire))
+                continue;
+
+            live++;
+            metrics_data_merge(total, &slot->data);
+
+            if (atomic_load_explicit(&slot->named, memory_order_acquire))
+                metrics_user_sum_add(sums, sum_count, slot->user,
+                                     metric_read(&slot->data.bytes_sent),
+                                     metric_read(&slot->data.bytes_received));
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (seq == atomic_load_explicit(&metrics_shared->fold_seq, memory_order_relaxed))
+            return live;
+    }
+}
+
+static void metrics_write_histogram(FILE *out, const char *metric, const char *label,
+                                    const char *value, struct histogram *histogram)
+{
+    unsigned long long cumulative;
+    unsigned long long bound;
+    int i;
+    int k;
+
+    /* Prometheus buckets at every power of two from about 1us to 68s */
+    cumulative = 0;
+    i = 0;
+    for (k = 10; k <= 36; k++)
+    {
+        bound = 1ULL << k;
+        while (i < HIST_BUCKETS && histogram_upper(i) < bound)
+            cumulative += metric_read(&histogram->buckets[i++]);
+
+        fprintf(out, "%s_bucket{%s=\"%s\",le=\"%.9g\"} %llu\n",
+                metric, label, value, bound / 1e9, cumulative);
+    }
+
+    fprintf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n",
+            metric, label, value, metric_read(&histogram->count));
+    fprintf(out, "%s_sum{%s=\"%s\"} %.9f\n",
+            metric, label, value, metric_read(&histogram->sum) / 1e9);
+    fprintf(out, "%s_count{%s=\"%s\"} %llu\n",
+            metric, label, value, metric_read(&histogram->count));
+}
+
+static void metrics_write_quantiles(FILE *out, const char *metric, const char *label,
+                                    const char *value, struct histogram *histogram)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    int i;
+
+    for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); i++)
+        fprintf(out, "%s{%s=\"%s\",quantile=\"%g\"} %.9f\n", metric, label, value,
+                quantiles[i], histogram_quantile(histogram, quantiles[i]) / 1e9);
+}
+
+int metrics_write(FILE *out)
+{
+    struct metrics_data *total;
+    struct metrics_user_sum *sums;
+    struct cache_stats cache;
+    unsigned long long sessions;
+    unsigned long long rejected;
+    unsigned long long lookups;
+    int sum_count;
+    int live;
+    int i;
+
+    if (!metrics_shared)
+    {
+        error_handling("metrics are not initialized");
+        return -1;
+    }
+
+    total = malloc(sizeof(struct metrics_data));
+    sums = malloc((METRICS_USER_SLOTS + metrics_shared->slot_count) * sizeof(struct metrics_user_sum));
+
+    if (!total || !sums)
+    {
+        free(total);
+        free(sums);
+        perror("malloc() error");
+        return -1;
+    }
+
+    live = metrics_snapshot(total, sums, &sum_count, &sessions, &rejected);
+
+    fprintf(out, "# HELP ftp_sessions_active Sessions being served.\n");
+    fprintf(out, "# TYPE ftp_sessions_active gauge\n");
+    fprintf(out, "ftp_sessions_active %d\n", live);
+    fprintf(out, "# HELP ftp_sessions_total Sessions finished.\n");
+    fprintf(out, "# TYPE ftp_sessions_total counter\n");
+    fprintf(out, "ftp_sessions_total %llu\n", sessions);
+    fprintf(out, "# HELP ftp_connections_rejected_total Connections rejected by admission control.\n");
+    fprintf(out, "# TYPE ftp_connections_rejected_total counter\n");
+    fprintf(out, "ftp_connections_rejected_total %llu\n", rejected);
+
+    fprintf(out, "# HELP ftp_logins_total Login attempts.\n");
+    fprintf(out, "# TYPE ftp_logins_total counter\n");
+    fprintf(out, "ftp_logins_total{result=\"success\"} %llu\n", metric_read(&total->logins));
+    fprintf(out, "ftp_logins_total{result=\"failure\"} %llu\n", metric_read(&total->login_failures));
+
+    fprintf(out, "# HELP ftp_bytes_sent_total Bytes sent on data connections.\n");
+    fprintf(out, "# TYPE ftp_bytes_sent_total counter\n");
+    fprintf(out, "ftp_bytes_sent_total %llu\n", metric_read(&total->bytes_sent));
+    fprintf(out, "# HELP ftp_bytes_received_total Bytes received on data connections.\n");
+    fprintf(out, "# TYPE ftp_bytes_received_total counter\n");
+    fprintf(out, "ftp_bytes_received_total %llu\n", metric_read(&total->bytes_received));
+
+    fprintf(out, "# HELP ftp_user_bytes_sent_total Bytes sent to each user.\n");
+    fprintf(out, "# TYPE ftp_user_bytes_sent_total counter\n");
+    for (i = 0; i < sum_count; i++)
+        fprintf(out, "ftp_user_bytes_sent_total{user=\"%s\"} %llu\n", sums[i].name, sums[i].bytes_sent);
+    fprintf(out, "# HELP ftp_user_bytes_received_total Bytes received from each user.\n");
+    fprintf(out, "# TYPE ftp_user_bytes_received_total counter\n");
+    for (i = 0; i < sum_count; i++)
+        fprintf(out, "ftp_user_bytes_received_total{user=\"%s\"} %llu\n", sums[i].name, sums[i].bytes_received);
+
+    fprintf(out, "# HELP ftp_command_duration_seconds Time from receiving a command to its last reply.\n");
+    fprintf(out, "# TYPE ftp_command_duration_seconds histogram\n");
+    for (i = 0; i < METRICS_COMMANDS; i++)
+    {
+        /* the client answers these itself */
+        if (i < COMMAND_COUNT && (command_specs[i].flags & COMMAND_LOCAL))
+            continue;
+
+        metrics_write_histogram(out, "ftp_command_duration_seconds", "command",
+                                i < COMMAND_COUNT ? command_specs[i].name : "OTHER", &total->commands[i]);
+    }
+
+    fprintf(out, "# HELP ftp_command_duration_quantile_seconds Quantiles of ftp_command_duration_seconds.\n");
+    fprintf(out, "# TYPE ftp_command_duration_quantile_seconds gauge\n");
+    for (i = 0; i < METRICS_COMMANDS; i++)
+    {
+        if (i < COMMAND_COUNT && (command_specs[i].flags & COMMAND_LOCAL))
+            continue;
+
+        metrics_write_quantiles(out, "ftp_command_duration_quantile_seconds", "command",
+                                i < COMMAND_COUNT ? command_specs[i].name : "OTHER", &total->commands[i]);
+    }
+
+    fprintf(out, "# HELP ftp_phase_duration_seconds Time spent in the phases of logins and transfers.\n");
+    fprintf(out, "# TYPE ftp_phase_duration_seconds histogram\n");
+    for (i = 0; i < METRICS_PHASES; i++)
+        metrics_write_histogram(out, "ftp_phase_duration_seconds", "phase",
+                                metrics_phase_names[i], &total->phases[i]);
+
+    fprintf(out, "# HELP ftp_phase_duration_quantile_seconds Quantiles of ftp_phase_duration_seconds.\n");
+    fprintf(out, "# TYPE ftp_phase_duration_quantile_seconds gauge\n");
+    for (i = 0; i < METRICS_PHASES; i++)
+        metrics_write_quantiles(out, "ftp_phase_duration_quantile_seconds", "phase",
+                                metrics_phase_names[i], &total->phases[i]);
+
+    if (0 == cache_read_stats(&cache))
+    {
+        lookups = cache.hits + cache.misses;
+
+        fprintf(out, "# HELP ftp_cache_lookups_total Files sent by RETR looked up in the hot-file cache.\n");
+        fprintf(out, "# TYPE ftp_cache_lookups_total counter\n");
+        fprintf(out, "ftp_cache_lookups_total{result=\"hit\"} %llu\n", cache.hits);
+        fprintf(out, "ftp_cache_lookups_total{result=\"miss\"} %llu\n", cache.misses);
+        fprintf(out, "# HELP ftp_cache_hit_ratio Part of the lookups served from the cache.\n");
+        fprintf(out, "# TYPE ftp_cache_hit_ratio gauge\n");
+        fprintf(out, "ftp_cache_hit_ratio %.6f\n", lookups ? (double)cache.hits / lookups : 0.0);
+        fprintf(out, "# HELP ftp_cache_bytes_served_total Bytes sent from the cache.\n");
+        fprintf(out, "# TYPE ftp_cache_bytes_served_total counter\n");
+        fprintf(out, "ftp_cache_bytes_served_total %llu\n", cache.bytes_served);
+        fprintf(out, "# HELP ftp_cache_insertions_total Files read into the cache.\n");
+        fprintf(out, "# TYPE ftp_cache_insertions_total counter\n");
+        fprintf(out, "ftp_cache_insertions_total %llu\n", cache.insertions);
+        fprintf(out, "# HELP ftp_cache_evictions_total Files evicted to make room.\n");
+        fprintf(out, "# TYPE ftp_cache_evictions_total counter\n");
+        fprintf(out, "ftp_cache_evictions_total %llu\n", cache.evictions);
+        fprintf(out, "# HELP ftp_cache_stale_total Files dropped because they changed.\n");
+        fprintf(out, "# TYPE ftp_cache_stale_total counter\n");
+        fprintf(out, "ftp_cache_stale_total %llu\n", cache.stale);
+        fprintf(out, "# HELP ftp_cache_entries Files in the cache.\n");
+        fprintf(out, "# TYPE ftp_cache_entries gauge\n");
+        fprintf(out, "ftp_cache_entries %d\n", cache.entries);
+        fprintf(out, "# HELP ftp_cache_bytes Bytes of the files in the cache.\n");
+        fprintf(out, "# TYPE ftp_cache_bytes gauge\n");
+        fprintf(out, "ftp_cache_bytes %lld\n", cache.bytes);
+    }
+
+    free(total);
+    free(sums);
+
+    return 0;
+}
+
+int send_metrics(int sockfd)
+{
+    char *text;
+    size_t size;
+    size_t offset;
+    int result;
+    FILE *out;
+
+    out = open_memstream(&text, &size);
+
+    if (!out)
+    {
+        perror("open_memstream() error");
+        return -1;
+    }
+
+    result = metrics_write(out);
+    fclose(out);
+
+    if (result < 0)
+    {
+        free(text);
+        error_handling("metrics_write() error");
+        return -1;
+    }
+
+    for (offset = 0; offset < size; offset += result)
+    {
+        result = send(sockfd, text + offset, size - offset, MSG_NOSIGNAL);
+        if (result < 0)
+        {
+            free(text);
+            perror("send() error");
+            return -1;
+        }
+    }
+
+    free(text);
+
+    return 0;
+}
+
+int metrics_listen(const char *path)
+{
+    int sockfd;
+    int result;
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        error_handling("metrics socket path is too long");
+        return -1;
+    }
+
+    sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sockfd < 0)
+    {
+        perror("socket() error");
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    unlink(path);
+    result = bind(sockfd, (struct sockaddr *)&address, sizeof(address));
+
+    if (result < 0)
+    {
+        close(sockfd);
+        perror("bind() error");
+        return -1;
+    }
+
+    result = listen(sockfd, 16);
+
+    if (result < 0)
+    {
+        close(sockfd);
+        perror("listen() error");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+int metrics_serve(int listen_sockfd)
+{
+    static const char header[] = "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Connection: close\r\n\r\n";
+    char request[BUF_SIZE];
+    struct pollfd request_pollfd;
+    int sockfd;
+    int pid;
+
+    while ((sockfd = accept4(listen_sockfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        pid = fork();
+
+        if (0 == pid)
+        {
+            /* answer HTTP scrapers with a header and plain readers with the text only */
+            request_pollfd.fd = sockfd;
+            request_pollfd.events = POLLIN;
+            if (poll(&request_pollfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0 &&
+                recv(sockfd, request, sizeof(request), 0) >= 3 &&
+                0 == strncmp(request, "GET", 3))
+                send(sockfd, header, sizeof(header) - 1, MSG_NOSIGNAL);
+
+            send_metrics(sockfd);
+            close(sockfd);
+            exit(0);
+        }
+        else if (pid < 0)
+        {
+            perror("fork() error");
+        }
+
+        close(sockfd);
+    }
+
+    if (EAGAIN != errno && EINTR != errno)
+    {
+        perror("accept4() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,613 @@
+/**
+ * the microbenchmarks
+ * time the small helpers of the command and transfer paths in isolation
+ *
+ * Every benchmark is calibrated to run for about MB_REP_NS a repetition,
+ * warmed up once and then repeated; the median and the spread of the
+ * repetitions are reported in nanoseconds and in cycles per command or per
+ * byte. A run can be saved as a baseline and later runs compared with it.
+ *
+ * Before any timing the helpers whose results are easy to get wrong are
+ * checked, and a failed check exits with 1.
+ *
+ * usage: ./microbench [-r repetitions] [-f filter] [-s save] [-b baseline]
+ */
+
+#include "server.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MB_HAVE_TSC 1
+#else
+#define MB_HAVE_TSC 0
+#endif
+
+#define MB_DEFAULT_REPS 15
+#define MB_MAX_REPS 101
+#define MB_REP_NS 20000000LL
+#define MB_MAX_BENCHES 16
+
+/**
+ * a change against the baseline under this many percent is reported as noise
+ */
+#define MB_NOISE_PERCENT 3.0
+
+/**
+ * the size of the text sent by send_text(), its chunks all fit in the
+ * buffer of a socket pair
+ */
+#define MB_TEXT_SIZE (8 * 1024)
+
+/**
+ * keep the compiler from dropping the work of a benchmark
+ */
+#define mb_clobber() __asm__ volatile("" ::: "memory")
+
+/**
+ * a benchmark runs iterations of its body, unit is the bytes
+ * of one iteration or 0 to report per call
+ */
+struct microbench
+{
+    const char *name;
+    void (*setup)(void);
+    void (*run)(long long iterations);
+    void (*teardown)(void);
+    int unit;
+};
+
+/**
+ * the result of a benchmark, per iteration
+ */
+struct mb_result
+{
+    char name[32];
+    double ns;
+    double cycles;
+    double spread; /* median absolute deviation over the median, in percent */
+    int unit;
+};
+
+static struct mb_result results[MB_MAX_BENCHES];
+static int result_count = 0;
+
+/**
+ * the data the benchmarks work on
+ */
+static char command_buffer[BUF_SIZE];
+static char cmd_buffer[CMD_LEN];
+static char arg_buffer[ARG_LEN];
+static char space_buffer[BUF_SIZE];
+static char text_drain[2 * MB_TEXT_SIZE];
+static FILE *text_file = NULL;
+static int pair[2] = {-1, -1};
+static struct control_reader reader;
+static char message_buffer[CONTROL_MESSAGE_MAX];
+static int message_len;
+static volatile int sink;
+
+static const char *dispatch_commands[] = {
+    CMD_LIST, CMD_RETR, CMD_STOR, CMD_STAT, CMD_APPE,
+    CMD_DELE, CMD_MKD, CMD_RMD, CMD_CWD, CMD_QUIT};
+
+#define DISPATCH_COMMANDS (int)(sizeof(dispatch_commands) / sizeof(dispatch_commands[0]))
+
+/**
+ * get a timestamp in cycles of the time stamp counter, or 0 without one
+ */
+static inline unsigned long long mb_cycles(void)
+{
+#if MB_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static void analyse_command_setup(void)
+{
+    memset(command_buffer, 0, BUF_SIZE);
+    memcpy(command_buffer, CMD_RETR, CMD_LEN);
+    strcpy(command_buffer + CMD_LEN, "some/directory/file.bin");
+}
+
+static void analyse_command_run(long long iterations)
+{
+    while (iterations--)
+    {
+        analyse_command(command_buffer, cmd_buffer, arg_buffer);
+        mb_clobber();
+    }
+}
+
+static void handle_space_setup(void)
+{
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++)
+        space_buffer[i] = 'a' + i % 26;
+}
+
+static void handle_space_run(long long iterations)
+{
+    while (iterations--)
+    {
+        /* the line of .accounts is scanned to its end every time */
+        space_buffer[BUF_SIZE - 2] = '\n';
+        handle_space(space_buffer, BUF_SIZE);
+        mb_clobber();
+    }
+}
+
+static void recv_buffer_setup(void)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        perror("socketpair() error");
+        exit(1);
+    }
+
+    memset(command_buffer, 'x', BUF_SIZE);
+}
+
+static void recv_buffer_run(long long iterations)
+{
+    char buffer[BUF_SIZE];
+
+    while (iterations--)
+    {
+        if (send(pair[0], command_buffer, BUF_SIZE, 0) != BUF_SIZE ||
+            recv_buffer(pair[1], buffer) != BUF_SIZE)
+        {
+            error_handling("recv_buffer() benchmark error");
+            exit(1);
+        }
+        mb_clobber();
+    }
+}
+
+static void recv_buffer_teardown(void)
+{
+    close(pair[0]);
+    close(pair[1]);
+}
+
+/**
+ * a RETR message goes through a socket pair into a reader in the encoding
+ */
+static void control_setup(int varlen)
+{
+    recv_buffer_setup();
+
+    control_reader_initialize(&reader, pair[1]);
+    reader.varlen = varlen;
+    message_len = control_encode(message_buffer, sizeof(message_buffer), varlen,
+                                 CMD_RETR, "some/directory/file.bin");
+}
+
+static void control_fixed_setup(void)
+{
+    control_setup(0);
+}
+
+static void control_varlen_setup(void)
+{
+    control_setup(1);
+}
+
+static void control_run(long long iterations)
+{
+    char *cmd;
+    char *arg;
+
+    while (iterations--)
+    {
+        if (send(pair[0], message_buffer, message_len, 0) != message_len ||
+            control_next(&reader, &cmd, &arg) != 1)
+        {
+            error_handling("control_next() benchmark error");
+            exit(1);
+        }
+        mb_clobber();
+    }
+}
+
+static void control_parse_setup(void)
+{
+    control_reader_initialize(&reader, -1);
+    reader.varlen = 1;
+    message_len = control_encode(reader.buffer, CONTROL_BUF_SIZE, 1, CMD_RETR, "some/directory/file.bin");
+}
+
+static void control_parse_run(long long iterations)
+{
+    char *cmd;
+    char *arg;
+
+    while (iterations--)
+    {
+        /* the same message is parsed again in place */
+        reader.start = 0;
+        reader.end = message_len;
+        sink = control_parse(&reader, &cmd, &arg);
+        mb_clobber();
+    }
+}
+
+static void send_text_setup(void)
+{
+    int i;
+
+    recv_buffer_setup();
+
+    /* a chunk that does not fit fails send_text() instead of blocking */
+    fcntl(pair[0], F_SETFL, O_NONBLOCK);
+
+    text_file = tmpfile();
+    if (!text_file)
+    {
+        perror("tmpfile() error");
+        exit(1);
+    }
+
+    for (i = 0; i < MB_TEXT_SIZE; i++)
+        fputc('a' + i % 26, text_file);
+    fflush(text_file);
+}
+
+/**
+ * send_text() of the file, chunks of BUF_SIZE - 1 bytes and their NUL,
+ * then the socket pair is drained
+ */
+static void send_text_run(long long iterations)
+{
+    while (iterations--)
+    {
+        if (send_text(pair[0], text_file) < 0)
+        {
+            error_handling("send_text() benchmark error");
+            exit(1);
+        }
+
+        while (recv(pair[1], text_drain, sizeof(text_drain), MSG_DONTWAIT) > 0)
+            mb_clobber();
+    }
+}
+
+static void send_text_teardown(void)
+{
+    recv_buffer_teardown();
+    fclose(text_file);
+}
+
+/**
+ * the lookup of child_process(), the id of the command and its flags
+ */
+static int dispatch(const char *cmd)
+{
+    int id;
+
+    id = command_lookup(cmd);
+
+    return id < 0 ? -1 : command_specs[id].flags;
+}
+
+static void dispatch_run(long long iterations)
+{
+    char cmds[DISPATCH_COMMANDS][CMD_LEN];
+    int i;
+
+    /* the names are copied so the compiler can not fold the compares */
+    for (i = 0; i < DISPATCH_COMMANDS; i++)
+        memcpy(cmds[i], dispatch_commands[i], CMD_LEN);
+    mb_clobber();
+
+    i = 0;
+    while (iterations--)
+    {
+        sink = dispatch(cmds[i]);
+        if (++i == DISPATCH_COMMANDS)
+            i = 0;
+    }
+}
+
+/**
+ * a bucket that rested an hour at 100 MB/s, past the point where the
+ * product of its rest and its rate overflowed, refills to its burst
+ * return 0 if it does or -1 if not
+ */
+static int check_token_bucket(void)
+{
+    struct token_bucket bucket;
+    long long now;
+
+    now = monotonic_ns();
+    token_bucket_initialize(&bucket, 100000000LL);
+
+    bucket.tokens = -bucket.burst;
+    bucket.stamp = now - 3600 * 1000000000LL;
+
+    if (token_bucket_take(&bucket, 1, now) != 0 || bucket.tokens != bucket.burst - 1)
+    {
+        error_handling("check failed: token_bucket_refill() after a long rest");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int (*const checks[])(void) = {
+    command_registry_check,
+    check_token_bucket,
+};
+
+#define MB_CHECKS (int)(sizeof(checks) / sizeof(checks[0]))
+
+static const struct microbench benches[] = {
+    {"analyse_command", analyse_command_setup, analyse_command_run, NULL, 0},
+    {"handle_space", handle_space_setup, handle_space_run, NULL, BUF_SIZE},
+    {"recv_buffer", recv_buffer_setup, recv_buffer_run, recv_buffer_teardown, 0},
+    {"control_parse", control_parse_setup, control_parse_run, NULL, 0},
+    {"control_fixed", control_fixed_setup, control_run, recv_buffer_teardown, 0},
+    {"control_varlen", control_varlen_setup, control_run, recv_buffer_teardown, 0},
+    {"send_text", send_text_setup, send_text_run, send_text_teardown, MB_TEXT_SIZE},
+    {"dispatch", NULL, dispatch_run, NULL, 0},
+};
+
+#define MB_BENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int n)
+{
+    qsort(values, n, sizeof(double), compare_double);
+
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+/**
+ * run bench with reps repetitions and add its result
+ */
+static void run_bench(const struct microbench *bench, int reps)
+{
+    double ns[MB_MAX_REPS];
+    double cycles[MB_MAX_REPS];
+    double deviation[MB_MAX_REPS];
+    struct mb_result *result;
+    long long iterations;
+    long long start;
+    long long elapsed;
+    unsigned long long cycle_start;
+    int i;
+
+    if (bench->setup)
+        bench->setup();
+
+    /* double the iterations until a repetition is long enough, this warms up too */
+    iterations = 1;
+    while (1)
+    {
+        start = monotonic_ns();
+        bench->run(iterations);
+        elapsed = monotonic_ns() - start;
+
+        if (elapsed >= MB_REP_NS / 4)
+            break;
+
+        iterations *= 2;
+    }
+
+    iterations = iterations * MB_REP_NS / (elapsed > 0 ? elapsed : 1);
+    if (iterations < 1)
+        iterations = 1;
+
+    bench->run(iterations);
+
+    for (i = 0; i < reps; i++)
+    {
+        cycle_start = mb_cycles();
+        start = monotonic_ns();
+        bench->run(iterations);
+        elapsed = monotonic_ns() - start;
+
+        ns[i] = (double)elapsed / iterations;
+        cycles[i] = (double)(mb_cycles() - cycle_start) / iterations;
+    }
+
+    if (bench->teardown)
+        bench->teardown();
+
+    result = &results[result_count++];
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+    result->unit = bench->unit;
+    result->ns = median(ns, reps);
+    result->cycles = median(cycles, reps);
+
+    for (i = 0; i < reps; i++)
+        deviation[i] = ns[i] > result->ns ? ns[i] - result->ns : result->ns - ns[i];
+
+    result->spread = result->ns > 0 ? 100.0 * median(deviation, reps) / result->ns : 0;
+}
+
+/**
+ * save the results in path, one benchmark a line
+ * return 0 if success or -1 if error
+ */
+static int save_baseline(const char *path)
+{
+    FILE *fd;
+    int i;
+
+    fd = fopen(path, "w");
+
+    if (!fd)
+    {
+        perror("fopen() error");
+        return -1;
+    }
+
+    for (i = 0; i < result_count; i++)
+        fprintf(fd, "%s %.4f %.4f %.2f\n", results[i].name, results[i].ns,
+                results[i].cycles, results[i].spread);
+
+    fclose(fd);
+
+    return 0;
+}
+
+/**
+ * find the ns of the benchmark name in the baseline fd
+ * return 0 if found or -1 if not
+ */
+static int find_baseline(FILE *fd, const char *name, double *ns, double *spread)
+{
+    char line[BUF_SIZE];
+    char entry[32];
+    double cycles;
+
+    rewind(fd);
+
+    while (fgets(line, sizeof(line), fd))
+    {
+        if (4 == sscanf(line, "%31s %lf %lf %lf", entry, ns, &cycles, spread) &&
+            0 == strcmp(entry, name))
+            return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * print the results, compared with the baseline fd if it is not NULL
+ */
+static void print_results(FILE *baseline)
+{
+    struct mb_result *result;
+    double base_ns;
+    double base_spread;
+    double change;
+    double noise;
+    int i;
+
+    printf("%-16s %12s %12s %12s %8s", "benchmark", "ns/op", MB_HAVE_TSC ? "cycles/op" : "",
+           MB_HAVE_TSC ? "cycles/byte" : "", "spread");
+    if (baseline)
+        printf(" %10s", "baseline");
+    printf("\n");
+
+    for (i = 0; i < result_count; i++)
+    {
+        result = &results[i];
+
+        printf("%-16s %12.2f", result->name, result->ns);
+
+        if (MB_HAVE_TSC)
+        {
+            printf(" %12.1f", result->cycles);
+            if (result->unit)
+                printf(" %12.3f", result->cycles / result->unit);
+            else
+                printf(" %12s", "-");
+        }
+        else
+        {
+            printf(" %12s %12s", "", "");
+        }
+
+        printf(" %7.1f%%", result->spread);
+
+        if (baseline && 0 == find_baseline(baseline, result->name, &base_ns, &base_spread))
+        {
+            change = 100.0 * (result->ns - base_ns) / base_ns;
+            noise = MB_NOISE_PERCENT + result->spread + base_spread;
+            printf(" %+9.1f%%%s", change,
+                   change > noise ? " slower" : change < -noise ? " faster" : "");
+        }
+
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = NULL;
+    const char *save = NULL;
+    const char *compare = NULL;
+    FILE *baseline = NULL;
+    int reps = MB_DEFAULT_REPS;
+    int option;
+    int i;
+
+    while ((option = getopt(argc, argv, "r:f:s:b:")) != -1)
+    {
+        switch (option)
+        {
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 's':
+            save = optarg;
+            break;
+        case 'b':
+            compare = optarg;
+            break;
+        default:
+            error_handling("usage: ./microbench [-r repetitions] [-f filter] [-s save] [-b baseline]");
+            exit(1);
+        }
+    }
+
+    if (reps < 1 || reps > MB_MAX_REPS)
+    {
+        error_handling("repetitions must be between 1 and 101");
+        exit(1);
+    }
+
+    if (compare)
+    {
+        baseline = fopen(compare, "r");
+        if (!baseline)
+        {
+            perror("fopen() error");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < MB_CHECKS; i++)
+    {
+        if (checks[i]() < 0)
+            exit(1);
+    }
+
+    for (i = 0; i < MB_BENCHES; i++)
+    {
+        if (filter && !strstr(benches[i].name, filter))
+            continue;
+
+        run_bench(&benches[i], reps);
+    }
+
+    print_results(baseline);
+
+    if (baseline)
+        fclose(baseline);
+
+    if (save && save_baseline(save) < 0)
+        exit(1);
+
+    exit(0);
+}
@@ -0,0 +1,593 @@
+#ifndef NETEM_H
+#define NETEM_H
+
+/**
+ * --- netem.h defines ---
+ * an emulated wide area link under the sockets of base.h, for benchmarks
+ *
+ * When the environment has FTP_NETEM, for example
+ *
+ *     FTP_NETEM="delay=50ms,jitter=5ms,rate=119m,loss=0.001,stall=200ms"
+ *
+ * every connection made by client_socket_connect() or accepted by
+ * server_socket_accept(), and the command connections of the server, is
+ * given to the program as one end of a loopback TCP pair. A relay thread
+ * moves the bytes between the other end and the real socket and holds them
+ * back in both directions:
+ *
+ *     delay   the one way latency added, so twice it is added to the RTT
+ *     jitter  a uniform ±jitter on every delay, the bytes keep their order
+ *     rate    the bandwidth of the link in bytes/s (k, m, g suffixes)
+ *     loss    the chance of a lost packet of NETEM_MSS bytes...
+ *     stall   ...which holds the stream back this long, like a TCP timeout
+ *
+ * Times are in ms unless they end with us or s. A direction queues at most
+ * twice the bytes the link carries in a delay, then stops reading and TCP
+ * pushes back. The program keeps real TCP sockets, so its socket options
+ * still work, and no root or netem is needed. Set it on one side only.
+ *
+ * At exit() the relays are woken and waited for, at most NETEM_FINISH_MS
+ * past the link delays, until what the program sent has gone out.
+ */
+
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#define NETEM_ENV "FTP_NETEM"
+
+/**
+ * the bytes of a packet for loss and of the largest read into a queue
+ */
+#define NETEM_MSS 1460
+#define NETEM_READ_SIZE (64 * 1024)
+
+/**
+ * the bounds of the bytes queued in a direction and its reads in flight
+ */
+#define NETEM_MIN_QUEUE (256 * 1024)
+#define NETEM_MAX_QUEUE (64 * 1024 * 1024)
+#define NETEM_DEFAULT_QUEUE (8 * 1024 * 1024)
+#define NETEM_CHUNKS 4096
+
+#define NETEM_DEFAULT_STALL_NS (200 * 1000000LL)
+
+#define NETEM_FINISH_MS 5000
+
+struct netem_config
+{
+    long long delay_ns;
+    long long jitter_ns;
+    long long rate;
+    double loss;
+    long long stall_ns;
+};
+
+/**
+ * a read from one socket, sent on the other at due
+ */
+struct netem_chunk
+{
+    long long due;
+    unsigned long long end; /* the tail of the queue after it */
+};
+
+/**
+ * one direction of a relay, the bytes from head to tail in a ring
+ */
+struct netem_link
+{
+    int from;
+    int to;
+    char *ring;
+    unsigned long long size;
+    unsigned long long head;
+    unsigned long long tail;
+    struct netem_chunk chunks[NETEM_CHUNKS];
+    int chunk_head;
+    int chunk_count;
+    long long link_free; /* when the link has sent what is queued */
+    long long last_due;
+    int eof; /* from has ended */
+    int shut; /* to was shut down after the last byte */
+};
+
+struct netem_relay
+{
+    struct netem_link out; /* from the program to the real socket */
+    struct netem_link in;  /* from the real socket to the program */
+    unsigned int seed;
+};
+
+static struct netem_config netem_config;
+static int netem_state = 0; /* 0 not read yet, 1 off, 2 on */
+static int netem_relays = 0;
+static int netem_exiting = 0;
+static int netem_wake_fd = -1; /* readable once the process exits */
+static pthread_mutex_t netem_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t netem_idle = PTHREAD_COND_INITIALIZER;
+
+/**
+ * hand sockfd to a relay emulating the link of FTP_NETEM
+ * return the sock fd the program uses instead, sockfd itself when
+ * FTP_NETEM is not set, or -1 if error
+ */
+int netem_wrap(int sockfd);
+
+/**
+ * wait for the relays to send what they hold, run at exit()
+ */
+void netem_finish(void);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+/**
+ * parse a time like 50, 50ms, 500us or 1s
+ * return it in ns or -1 if error
+ */
+static long long netem_parse_time(const char *str)
+{
+    char *end;
+    double value;
+
+    value = strtod(str, &end);
+    if (end == str || value < 0)
+        return -1;
+
+    if ('\0' == *end || 0 == strcmp(end, "ms"))
+        return (long long)(value * 1000000);
+    if (0 == strcmp(end, "us"))
+        return (long long)(value * 1000);
+    if (0 == strcmp(end, "s"))
+        return (long long)(value * 1000000000);
+
+    return -1;
+}
+
+/**
+ * read FTP_NETEM into netem_config
+ * return 0 if it is set and valid or -1 if not
+ */
+static int netem_parse(void)
+{
+    char buffer[256];
+    const char *env;
+    char *token;
+    char *value;
+    char *save;
+    long long *field;
+
+    env = getenv(NETEM_ENV);
+    if (!env || '\0' == env[0])
+        return -1;
+
+    memset(&netem_config, 0, sizeof(netem_config));
+    netem_config.stall_ns = NETEM_DEFAULT_STALL_NS;
+
+    snprintf(buffer, sizeof(buffer), "%s", env);
+
+    for (token = strtok_r(buffer, ",", &save); token; token = strtok_r(NULL, ",", &save))
+    {
+        value = strchr(token, '=');
+        if (!value)
+            goto invalid;
+        *value++ = '\0';
+
+        field = NULL;
+        if (0 == strcmp(token, "delay"))
+            field = &netem_config.delay_ns;
+        else if (0 == strcmp(token, "jitter"))
+            field = &netem_config.jitter_ns;
+        else if (0 == strcmp(token, "stall"))
+            field = &netem_config.stall_ns;
+
+        if (field)
+        {
+            *field = netem_parse_time(value);
+            if (*field < 0)
+                goto invalid;
+        }
+        else if (0 == strcmp(token, "rate"))
+        {
+            netem_config.rate = parse_size(value);
+            if (netem_config.rate < 0)
+                goto invalid;
+        }
+        else if (0 == strcmp(token, "loss"))
+        {
+            netem_config.loss = atof(value);
+            if (netem_config.loss < 0 || netem_config.loss >= 1)
+                goto invalid;
+        }
+        else
+        {
+            goto invalid;
+        }
+    }
+
+    return 0;
+
+invalid:
+    error_handling("invalid " NETEM_ENV ", the link is not emulated");
+    return -1;
+}
+
+/**
+ * make a connected pair of loopback TCP sockets
+ * return 0 if success or -1 if error
+ */
+static int netem_pair(int fds[2])
+{
+    struct sockaddr_in address;
+    socklen_t len;
+    int listen_sockfd;
+
+    listen_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_sockfd < 0)
+        return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(address);
+
+    fds[0] = -1;
+    fds[1] = -1;
+
+    if (bind(listen_sockfd, (struct sockaddr *)&address, len) < 0 || listen(listen_sockfd, 1) < 0 ||
+        getsockname(listen_sockfd, (struct sockaddr *)&address, &len) < 0)
+        goto error;
+
+    fds[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fds[0] < 0 || connect(fds[0], (struct sockaddr *)&address, len) < 0)
+        goto error;
+
+    fds[1] = accept4(listen_sockfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fds[1] < 0)
+        goto error;
+
+    close(listen_sockfd);
+
+    return 0;
+
+error:
+    if (fds[0] >= 0)
+        close(fds[0]);
+    close(listen_sockfd);
+    return -1;
+}
+
+/**
+ * the bytes a direction may queue, twice what the link carries in a delay
+ */
+static unsigned long long netem_queue_size(void)
+{
+    long long size;
+
+    if (0 == netem_config.rate)
+        return NETEM_DEFAULT_QUEUE;
+
+    size = 2 * netem_config.rate * ((netem_config.delay_ns + netem_config.jitter_ns) / 1000000 + 1) / 1000;
+    if (size < NETEM_MIN_QUEUE)
+        size = NETEM_MIN_QUEUE;
+    if (size > NETEM_MAX_QUEUE)
+        size = NETEM_MAX_QUEUE;
+
+    return size;
+}
+
+/**
+ * read what from has into the queue of link and give it its due time
+ * return 0 if success or -1 if error
+ */
+static int netem_read(struct netem_link *link, unsigned int *seed)
+{
+    struct netem_chunk *chunk;
+    unsigned long long space;
+    unsigned long long offset;
+    long long due;
+    long long now;
+    ssize_t size;
+    int packets;
+    int i;
+
+    offset = link->tail % link->size;
+    space = link->size - (link->tail - link->head);
+    if (space > link->size - offset)
+        space = link->size - offset;
+    if (space > NETEM_READ_SIZE)
+        space = NETEM_READ_SIZE;
+
+    size = recv(link->from, link->ring + offset, space, MSG_DONTWAIT);
+    if (size < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno))
+        return 0;
+    if (size <= 0)
+    {
+        /* a reset ends the direction like a close */
+        link->eof = 1;
+        return 0;
+    }
+
+    now = monotonic_ns();
+
+    /* the link sends one chunk after the other at its rate */
+    if (link->link_free < now)
+        link->link_free = now;
+    if (netem_config.rate > 0)
+        link->link_free += size * 1000000000LL / netem_config.rate;
+
+    due = link->link_free + netem_config.delay_ns;
+    if (netem_config.jitter_ns > 0)
+        due += (long long)((2.0 * rand_r(seed) / RAND_MAX - 1.0) * netem_config.jitter_ns);
+
+    if (netem_config.loss > 0)
+    {
+        packets = (size + NETEM_MSS - 1) / NETEM_MSS;
+        for (i = 0; i < packets; i++)
+        {
+            if ((double)rand_r(seed) / RAND_MAX < netem_config.loss)
+            {
+                due += netem_config.stall_ns;
+                break;
+            }
+        }
+    }
+
+    /* TCP delivers in order, a late chunk holds back the ones after it */
+    if (due < link->last_due)
+        due = link->last_due;
+    link->last_due = due;
+
+    link->tail += size;
+
+    chunk = &link->chunks[(link->chunk_head + link->chunk_count) % NETEM_CHUNKS];
+    chunk->due = due;
+    chunk->end = link->tail;
+    link->chunk_count++;
+
+    return 0;
+}
+
+/**
+ * send the chunks of link that are due
+ * return 0 if success or -1 if error
+ */
+static int netem_write(struct netem_link *link, long long now)
+{
+    struct netem_chunk *chunk;
+    unsigned long long offset;
+    unsigned long long length;
+    ssize_t size;
+
+    while (link->chunk_count > 0)
+    {
+        chunk = &link->chunks[link->chunk_head];
+        if (chunk->due > now)
+            break;
+
+        offset = link->head % link->size;
+        length = chunk->end - link->head;
+        if (length > link->size - offset)
+            length = link->size - offset;
+
+        size = send(link->to, link->ring + offset, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (size < 0)
+            return EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno ? 0 : -1;
+
+        link->head += size;
+
+        if (link->head == chunk->end)
+        {
+            link->chunk_head = (link->chunk_head + 1) % NETEM_CHUNKS;
+            link->chunk_count--;
+        }
+    }
+
+    if (link->eof && 0 == link->chunk_count && !link->shut)
+    {
+        shutdown(link->to, SHUT_WR);
+        link->shut = 1;
+    }
+
+    return 0;
+}
+
+/**
+ * fill the poll entries of link and lower *timeout to its next due chunk
+ */
+static void netem_poll_events(struct netem_link *link, struct pollfd *from, struct pollfd *to, long long now,
+                              long long *timeout)
+{
+    long long wait;
+
+    if (!link->eof && link->chunk_count < NETEM_CHUNKS && link->tail - link->head < link->size)
+        from->events |= POLLIN;
+
+    if (link->chunk_count > 0)
+    {
+        wait = link->chunks[link->chunk_head].due - now;
+        if (wait <= 0)
+            to->events |= POLLOUT;
+        else if (wait < *timeout)
+            *timeout = wait;
+    }
+}
+
+static void *netem_relay_main(void *arg)
+{
+    struct netem_relay *relay = arg;
+    struct pollfd pollfds[3];
+    struct timespec ts;
+    long long timeout;
+    long long now;
+
+    /* the program closed its end and all it sent is out */
+    while (!relay->out.shut)
+    {
+        now = monotonic_ns();
+
+        pollfds[0].fd = relay->out.from;
+        pollfds[1].fd = relay->in.from;
+        pollfds[2].fd = netem_wake_fd;
+        pollfds[0].events = pollfds[1].events = 0;
+        pollfds[2].events = __atomic_load_n(&netem_exiting, __ATOMIC_ACQUIRE) ? 0 : POLLIN;
+
+        timeout = 1000000000LL;
+        netem_poll_events(&relay->out, &pollfds[0], &pollfds[1], now, &timeout);
+        netem_poll_events(&relay->in, &pollfds[1], &pollfds[0], now, &timeout);
+
+        ts.tv_sec = timeout / 1000000000LL;
+        ts.tv_nsec = timeout % 1000000000LL;
+
+        if (ppoll(pollfds, 3, &ts, NULL) < 0 && errno != EINTR)
+            break;
+
+        pollfds[0].revents &= pollfds[0].events | POLLHUP | POLLERR;
+
+        if ((pollfds[0].revents & (POLLIN | POLLHUP | POLLERR)) && (pollfds[0].events & POLLIN))
+            netem_read(&relay->out, &relay->seed);
+        else if ((pollfds[0].events & POLLIN) && __atomic_load_n(&netem_exiting, __ATOMIC_ACQUIRE))
+            relay->out.eof = 1; /* the program exits and has nothing more to send */
+        if ((pollfds[1].revents & (POLLIN | POLLHUP | POLLERR)) && (pollfds[1].events & POLLIN))
+            netem_read(&relay->in, &relay->seed);
+
+        now = monotonic_ns();
+
+        /* the program or the peer is gone, what is queued for it is dropped */
+        if (netem_write(&relay->out, now) < 0 || netem_write(&relay->in, now) < 0)
+            break;
+    }
+
+    close(relay->out.from);
+    close(relay->out.to);
+    free(relay->out.ring);
+    free(relay->in.ring);
+    free(relay);
+
+    pthread_mutex_lock(&netem_lock);
+    netem_relays--;
+    pthread_cond_broadcast(&netem_idle);
+    pthread_mutex_unlock(&netem_lock);
+
+    return NULL;
+}
+
+int netem_wrap(int sockfd)
+{
+    struct netem_relay *relay;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int enable;
+    int fds[2];
+
+    if (0 == netem_state)
+    {
+        netem_state = 0 == netem_parse() ? 2 : 1;
+        if (2 == netem_state)
+        {
+            netem_wake_fd = eventfd(0, EFD_CLOEXEC);
+            if (netem_wake_fd < 0)
+            {
+                perror("eventfd() error");
+                netem_state = 1;
+            }
+            else
+            {
+                atexit(netem_finish);
+            }
+        }
+    }
+
+    if (netem_state != 2)
+        return sockfd;
+
+    relay = calloc(1, sizeof(struct netem_relay));
+    if (!relay)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    relay->out.size = relay->in.size = netem_queue_size();
+    relay->out.ring = malloc(relay->out.size);
+    relay->in.ring = malloc(relay->in.size);
+
+    if (!relay->out.ring || !relay->in.ring || netem_pair(fds) < 0)
+    {
+        perror("netem_wrap() error");
+        free(relay->out.ring);
+        free(relay->in.ring);
+        free(relay);
+        close(sockfd);
+        return -1;
+    }
+
+    /* the emulated link does the holding back, not Nagle */
+    enable = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    relay->out.from = relay->in.to = fds[1];
+    relay->out.to = relay->in.from = sockfd;
+    relay->seed = (unsigned int)(monotonic_ns() ^ sockfd);
+
+    pthread_mutex_lock(&netem_lock);
+    netem_relays++;
+    pthread_mutex_unlock(&netem_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attr, netem_relay_main, relay) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        error_handling("pthread_create() error");
+        pthread_mutex_lock(&netem_lock);
+        netem_relays--;
+        pthread_mutex_unlock(&netem_lock);
+        close(fds[0]);
+        close(fds[1]);
+        close(sockfd);
+        free(relay->out.ring);
+        free(relay->in.ring);
+        free(relay);
+        return -1;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return fds[0];
+}
+
+void netem_finish(void)
+{
+    unsigned long long one = 1;
+    struct timespec deadline;
+    long long wait_ns;
+
+    __atomic_store_n(&netem_exiting, 1, __ATOMIC_RELEASE);
+    if (write(netem_wake_fd, &one, sizeof(one)) < 0)
+        perror("write() error");
+
+    /* a peer that stopped reading must not keep the process forever */
+    wait_ns = 2 * (netem_config.delay_ns + netem_config.jitter_ns + netem_config.stall_ns) +
+              NETEM_FINISH_MS * 1000000LL;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (deadline.tv_nsec + wait_ns) / 1000000000LL;
+    deadline.tv_nsec = (deadline.tv_nsec + wait_ns) % 1000000000LL;
+
+    pthread_mutex_lock(&netem_lock);
+    while (netem_relays > 0)
+    {
+        if (ETIMEDOUT == pthread_cond_timedwait(&netem_idle, &netem_lock, &deadline))
+            break;
+    }
+    pthread_mutex_unlock(&netem_lock);
+}
+
+#endif
@@ -0,0 +1,720 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/**
+ * --- parallel.h defines ---
+ * the batch mode of the client, many files moved
+ * over a pool of sessions at the same time
+ *
+ * Every worker thread owns one session of libftpclient and a deque of
+ * transfers. The files are sorted from the largest down and dealt to the
+ * deques in turn; a worker takes its own work from the head, the largest
+ * first, and an idle worker steals from the tail of the others, so a few
+ * big files do not leave the rest of the pool waiting. A failed transfer
+ * gets a new session and goes back to its deque until PARALLEL_ATTEMPTS.
+ *
+ * With a pool (see poold.c) the sessions are borrowed logged in and given
+ * back at the end instead of being opened and ended with QUIT.
+ */
+
+#include "base.h"
+#include "control.h"
+#include "ftpclient.h"
+#include "pool.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <pthread.h>
+
+#define PARALLEL_DEFAULT_SESSIONS 4
+#define PARALLEL_MAX_SESSIONS 64
+
+/**
+ * the attempts of a transfer before it is reported as failed
+ */
+#define PARALLEL_ATTEMPTS 3
+
+/**
+ * the wait before a retry, times the attempts already made
+ */
+#define PARALLEL_RETRY_MS 200
+
+struct parallel_job
+{
+    char name[CONTROL_ARG_MAX];
+    long long size; /* 0 when unknown */
+    int attempts;
+};
+
+/**
+ * a deque of jobs, the owner takes from head and thieves from tail
+ */
+struct parallel_deque
+{
+    pthread_mutex_t lock;
+    struct parallel_job **jobs;
+    int capacity;
+    int head;
+    int count;
+};
+
+struct parallel_batch;
+
+struct parallel_worker
+{
+    int index;
+    pthread_t thread;
+    struct parallel_deque deque;
+    struct parallel_batch *batch;
+    ftp_client *client;
+
+    int status; /* of the last operation */
+    int files;
+    int retries;
+    int steals;
+    long long bytes;
+};
+
+struct parallel_batch
+{
+    const char *host;
+    int port;
+    const char *user;
+    const char *password;
+    const char *pool; /* the unix socket of poold or NULL */
+    int upload;
+
+    struct parallel_job *jobs;
+    int job_count;
+    int job_capacity;
+
+    struct parallel_worker *workers;
+    int worker_count;
+
+    pthread_mutex_t report_lock;
+    int failed;
+};
+
+/**
+ * add the files matching pattern to batch, local files for an upload,
+ * kept by their absolute path, or the names of the LIST of the server for
+ * a download
+ * return the number of the files added or -1 if error
+ */
+int parallel_add(struct parallel_batch *batch, const char *pattern);
+
+/**
+ * add the patterns in the file path, one a line, "-" for stdin
+ * return the number of the files added or -1 if error
+ */
+int parallel_add_list(struct parallel_batch *batch, const char *path);
+
+/**
+ * move all the files of batch over sessions sessions and print a summary,
+ * refusing a batch where two files have the same name on the server
+ * return 0 if every file is moved or -1 if not
+ */
+int parallel_run(struct parallel_batch *batch, int sessions);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static void parallel_done(ftp_client *client, int status, int code, void *user)
+{
+    struct parallel_worker *worker = user;
+
+    (void)client;
+    (void)code;
+
+    worker->status = status;
+}
+
+/**
+ * wait for the operation of worker whose start returned status
+ * return FTP_OK or the error of the operation
+ */
+static int parallel_call(struct parallel_worker *worker, int status)
+{
+    worker->status = status;
+
+    if (FTP_OK == status)
+        ftp_client_run(worker->client, -1);
+
+    return worker->status;
+}
+
+/**
+ * borrow a session for worker from the pool, or open and log in one
+ * return FTP_OK or an error
+ */
+static int parallel_session(struct parallel_worker *worker)
+{
+    struct parallel_batch *batch = worker->batch;
+    int sockfd;
+    int varlen;
+    int status;
+
+    worker->client = ftp_client_new();
+    if (!worker->client)
+        return FTP_ERR_SYSTEM;
+
+    if (batch->pool)
+    {
+        sockfd = pool_checkout(batch->pool, batch->host, batch->port, batch->user, &varlen);
+        if (sockfd >= 0)
+        {
+            if (FTP_OK == ftp_client_attach(worker->client, sockfd, varlen))
+                return FTP_OK;
+            close(sockfd);
+        }
+    }
+
+    status = parallel_call(worker, ftp_connect(worker->client, batch->host, batch->port,
+                                               parallel_done, worker));
+    if (FTP_OK == status)
+        status = parallel_call(worker, ftp_login(worker->client, batch->user, batch->password,
+                                                 parallel_done, worker));
+
+    if (status != FTP_OK)
+    {
+        ftp_client_free(worker->client);
+        worker->client = NULL;
+    }
+
+    return status;
+}
+
+/**
+ * give the session of worker back to the pool, or end it with QUIT
+ */
+static void parallel_session_end(struct parallel_worker *worker)
+{
+    struct parallel_batch *batch = worker->batch;
+    int sockfd;
+    int varlen;
+
+    sockfd = batch->pool ? ftp_client_detach(worker->client, &varlen) : -1;
+
+    if (sockfd >= 0)
+        pool_checkin(batch->pool, sockfd, batch->host, batch->port, batch->user, varlen);
+    else
+        parallel_call(worker, ftp_quit(worker->client, parallel_done, worker));
+
+    ftp_client_free(worker->client);
+    worker->client = NULL;
+}
+
+static int parallel_add_job(struct parallel_batch *batch, const char *name, long long size)
+{
+    struct parallel_job *jobs;
+
+    if (strlen(name) >= CONTROL_ARG_MAX)
+    {
+        fprintf(stderr, "%s: name too long\n", name);
+        return -1;
+    }
+
+    if (batch->job_count == batch->job_capacity)
+    {
+        batch->job_capacity = batch->job_capacity ? batch->job_capacity * 2 : 64;
+        jobs = realloc(batch->jobs, batch->job_capacity * sizeof(struct parallel_job));
+        if (!jobs)
+        {
+            perror("realloc() error");
+            return -1;
+        }
+        batch->jobs = jobs;
+    }
+
+    memset(&batch->jobs[batch->job_count], 0, sizeof(struct parallel_job));
+    strcpy(batch->jobs[batch->job_count].name, name);
+    batch->jobs[batch->job_count].size = size;
+    batch->job_count++;
+
+    return 0;
+}
+
+/**
+ * get the LIST of the server into a temporary file
+ * return the file or NULL if error
+ */
+static FILE *parallel_remote_list(struct parallel_batch *batch)
+{
+    struct parallel_worker worker;
+    FILE *fd;
+    int status;
+
+    fd = tmpfile();
+    if (!fd)
+    {
+        perror("tmpfile() error");
+        return NULL;
+    }
+
+    memset(&worker, 0, sizeof(worker));
+    worker.batch = batch;
+
+    status = parallel_session(&worker);
+    if (FTP_OK == status)
+    {
+        status = parallel_call(&worker, ftp_list(worker.client, CMD_LIST, fileno(fd),
+                                                 parallel_done, &worker));
+        parallel_session_end(&worker);
+    }
+
+    if (status != FTP_OK)
+    {
+        fprintf(stderr, "LIST: %s\n", ftp_strerror(status));
+        fclose(fd);
+        return NULL;
+    }
+
+    rewind(fd);
+
+    return fd;
+}
+
+int parallel_add(struct parallel_batch *batch, const char *pattern)
+{
+    struct stat statbuf;
+    char path[PATH_MAX];
+    char line[CONTROL_ARG_MAX + 2];
+    glob_t found;
+    size_t i;
+    int count;
+    FILE *fd;
+
+    count = 0;
+
+    if (batch->upload)
+    {
+        if (glob(pattern, 0, NULL, &found) != 0)
+        {
+            fprintf(stderr, "%s: no such file\n", pattern);
+            return -1;
+        }
+
+        for (i = 0; i < found.gl_pathc; i++)
+        {
+            if (stat(found.gl_pathv[i], &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+                continue;
+
+            /* the work directory of the batch is not where the names were given */
+            if (!realpath(found.gl_pathv[i], path))
+            {
+                perror(found.gl_pathv[i]);
+                globfree(&found);
+                return -1;
+            }
+
+            if (parallel_add_job(batch, path, statbuf.st_size) < 0)
+            {
+                globfree(&found);
+                return -1;
+            }
+            count++;
+        }
+
+        globfree(&found);
+        return count;
+    }
+
+    /* a plain name is fetched as it is, a pattern is matched against LIST */
+    if (!strpbrk(pattern, "*?["))
+        return parallel_add_job(batch, pattern, 0) < 0 ? -1 : 1;
+
+    fd = parallel_remote_list(batch);
+    if (!fd)
+        return -1;
+
+    while (fgets(line, sizeof(line), fd))
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        /* directories end with '/' */
+        if ('\0' == line[0] || '/' == line[strlen(line) - 1])
+            continue;
+
+        if (0 == fnmatch(pattern, line, 0))
+        {
+            if (parallel_add_job(batch, line, 0) < 0)
+            {
+                fclose(fd);
+                return -1;
+            }
+            count++;
+        }
+    }
+
+    fclose(fd);
+
+    if (0 == count)
+        fprintf(stderr, "%s: no such file on the server\n", pattern);
+
+    return count;
+}
+
+int parallel_add_list(struct parallel_batch *batch, const char *path)
+{
+    char line[CONTROL_ARG_MAX + 2];
+    FILE *fd;
+    int count;
+    int result;
+
+    fd = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!fd)
+    {
+        perror("fopen() error");
+        return -1;
+    }
+
+    count = 0;
+
+    while (fgets(line, sizeof(line), fd))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if ('\0' == line[0])
+            continue;
+
+        result = parallel_add(batch, line);
+        if (result < 0)
+        {
+            count = -1;
+            break;
+        }
+        count += result;
+    }
+
+    if (fd != stdin)
+        fclose(fd);
+
+    return count;
+}
+
+/**
+ * take a job from the head of the deque of worker,
+ * or steal one from the tail of another deque
+ * return the job or NULL if there is no work left
+ */
+static struct parallel_job *parallel_take(struct parallel_worker *worker)
+{
+    struct parallel_batch *batch = worker->batch;
+    struct parallel_deque *deque;
+    struct parallel_job *job;
+    int i;
+
+    deque = &worker->deque;
+    job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0)
+    {
+        job = deque->jobs[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if (job)
+        return job;
+
+    for (i = 1; i < batch->worker_count && !job; i++)
+    {
+        deque = &batch->workers[(worker->index + i) % batch->worker_count].deque;
+
+        pthread_mutex_lock(&deque->lock);
+        if (deque->count > 0)
+        {
+            deque->count--;
+            job = deque->jobs[(deque->head + deque->count) % deque->capacity];
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    if (job)
+        worker->steals++;
+
+    return job;
+}
+
+/**
+ * put job back at the head of the deque of worker for a retry
+ */
+static void parallel_retry(struct parallel_worker *worker, struct parallel_job *job)
+{
+    struct parallel_deque *deque = &worker->deque;
+
+    pthread_mutex_lock(&deque->lock);
+    deque->head = (deque->head + deque->capacity - 1) % deque->capacity;
+    deque->jobs[deque->head] = job;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * return the name of job on the server, an upload is stored under its base name
+ */
+static const char *parallel_remote_name(struct parallel_batch *batch, struct parallel_job *job)
+{
+    if (batch->upload && strrchr(job->name, '/'))
+        return strrchr(job->name, '/') + 1;
+
+    return job->name;
+}
+
+/**
+ * move one file on the session of worker
+ * return FTP_OK or an error
+ */
+static int parallel_transfer(struct parallel_worker *worker, struct parallel_job *job)
+{
+    const char *remote;
+    int status;
+    int fd;
+
+    if (!worker->client)
+    {
+        status = parallel_session(worker);
+        if (status != FTP_OK)
+            return status;
+    }
+
+    if (worker->batch->upload)
+        fd = open(job->name, O_RDONLY | O_CLOEXEC);
+    else
+        fd = open(job->name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    remote = parallel_remote_name(worker->batch, job);
+
+    if (fd < 0)
+    {
+        perror(job->name);
+        return FTP_ERR_ARGUMENT;
+    }
+
+    if (worker->batch->upload)
+        status = parallel_call(worker, ftp_store(worker->client, remote, fd, parallel_done, worker));
+    else
+        status = parallel_call(worker, ftp_retrieve(worker->client, remote, fd, parallel_done, worker));
+
+    close(fd);
+
+    if (FTP_OK == status)
+        worker->bytes += ftp_client_bytes(worker->client);
+
+    return status;
+}
+
+static void *parallel_worker_main(void *arg)
+{
+    struct parallel_worker *worker = arg;
+    struct parallel_batch *batch = worker->batch;
+    struct parallel_job *job;
+    struct timespec ts;
+    int status;
+
+    while ((job = parallel_take(worker)) != NULL)
+    {
+        status = parallel_transfer(worker, job);
+
+        if (FTP_OK == status)
+        {
+            worker->files++;
+            continue;
+        }
+
+        /* a session that failed is not trusted for the next transfer */
+        if (worker->client && status != FTP_ERR_REFUSED && status != FTP_ERR_ARGUMENT)
+        {
+            ftp_client_free(worker->client);
+            worker->client = NULL;
+        }
+
+        job->attempts++;
+
+        if (job->attempts < PARALLEL_ATTEMPTS && status != FTP_ERR_LOGIN &&
+            status != FTP_ERR_ARGUMENT)
+        {
+            worker->retries++;
+            ts.tv_sec = 0;
+            ts.tv_nsec = PARALLEL_RETRY_MS * 1000000L * job->attempts;
+            nanosleep(&ts, NULL);
+            parallel_retry(worker, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&batch->report_lock);
+        batch->failed++;
+        fprintf(stderr, "%s: %s\n", job->name, ftp_strerror(status));
+        pthread_mutex_unlock(&batch->report_lock);
+    }
+
+    if (worker->client)
+        parallel_session_end(worker);
+
+    return NULL;
+}
+
+static int parallel_compare_size(const void *a, const void *b)
+{
+    const struct parallel_job *x = a;
+    const struct parallel_job *y = b;
+
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+static int parallel_compare_remote(const void *a, const void *b, void *batch)
+{
+    return strcmp(parallel_remote_name(batch, *(struct parallel_job **)a),
+                  parallel_remote_name(batch, *(struct parallel_job **)b));
+}
+
+/**
+ * two files with the same name on the server would overwrite each other
+ * return 0 if every name is unique or -1 if not
+ */
+static int parallel_check_names(struct parallel_batch *batch)
+{
+    struct parallel_job **sorted;
+    int result;
+    int i;
+
+    sorted = malloc(batch->job_count * sizeof(struct parallel_job *));
+    if (!sorted)
+    {
+        perror("malloc() error");
+        return -1;
+    }
+
+    for (i = 0; i < batch->job_count; i++)
+        sorted[i] = &batch->jobs[i];
+
+    qsort_r(sorted, batch->job_count, sizeof(struct parallel_job *), parallel_compare_remote, batch);
+
+    result = 0;
+    for (i = 1; i < batch->job_count; i++)
+    {
+        if (0 == parallel_compare_remote(&sorted[i - 1], &sorted[i], batch))
+        {
+            fprintf(stderr, "%s and %s: the same name %s on the server\n", sorted[i - 1]->name,
+                    sorted[i]->name, parallel_remote_name(batch, sorted[i]));
+            result = -1;
+        }
+    }
+
+    free(sorted);
+
+    return result;
+}
+
+int parallel_run(struct parallel_batch *batch, int sessions)
+{
+    struct parallel_worker *worker;
+    long long start;
+    long long bytes;
+    double seconds;
+    int files;
+    int steals;
+    int retries;
+    int i;
+
+    if (0 == batch->job_count)
+    {
+        error_handling("no files to transfer");
+        return -1;
+    }
+
+    if (parallel_check_names(batch) < 0)
+        return -1;
+
+    if (sessions > batch->job_count)
+        sessions = batch->job_count;
+
+    batch->workers = calloc(sessions, sizeof(struct parallel_worker));
+    if (!batch->workers)
+    {
+        perror("calloc() error");
+        return -1;
+    }
+
+    batch->worker_count = sessions;
+    batch->failed = 0;
+    pthread_mutex_init(&batch->report_lock, NULL);
+
+    qsort(batch->jobs, batch->job_count, sizeof(struct parallel_job), parallel_compare_size);
+
+    for (i = 0; i < sessions; i++)
+    {
+        worker = &batch->workers[i];
+        worker->index = i;
+        worker->batch = batch;
+
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.capacity = batch->job_count;
+        worker->deque.jobs = calloc(batch->job_count, sizeof(struct parallel_job *));
+        if (!worker->deque.jobs)
+        {
+            perror("calloc() error");
+            return -1;
+        }
+    }
+
+    /* dealt in turn, every deque starts with a share of the large files */
+    for (i = 0; i < batch->job_count; i++)
+    {
+        worker = &batch->workers[i % sessions];
+        worker->deque.jobs[worker->deque.count++] = &batch->jobs[i];
+    }
+
+    start = monotonic_ns();
+
+    for (i = 0; i < sessions; i++)
+    {
+        if (pthread_create(&batch->workers[i].thread, NULL, parallel_worker_main, &batch->workers[i]) != 0)
+        {
+            error_handling("pthread_create() error");
+            exit(1);
+        }
+    }
+
+    files = steals = retries = 0;
+    bytes = 0;
+
+    for (i = 0; i < sessions; i++)
+    {
+        worker = &batch->workers[i];
+        pthread_join(worker->thread, NULL);
+
+        files += worker->files;
+        bytes += worker->bytes;
+        steals += worker->steals;
+        retries += worker->retries;
+    }
+
+    seconds = (monotonic_ns() - start) / 1e9;
+
+    for (i = 0; i < sessions; i++)
+    {
+        worker = &batch->workers[i];
+        printf("session %d: %d files, %.2f MiB, %d stolen, %d retried\n", i, worker->files,
+               worker->bytes / (1024.0 * 1024.0), worker->steals, worker->retries);
+        free(worker->deque.jobs);
+        pthread_mutex_destroy(&worker->deque.lock);
+    }
+
+    printf("%s %d of %d files, %.2f MiB in %.3f s, %.2f MiB/s over %d sessions, "
+           "%d stolen, %d retried, %d failed\n",
+           batch->upload ? "stored" : "retrieved", files, batch->job_count,
+           bytes / (1024.0 * 1024.0), seconds, bytes / (1024.0 * 1024.0) / seconds,
+           sessions, steals, retries, batch->failed);
+
+    pthread_mutex_destroy(&batch->report_lock);
+    free(batch->workers);
+    batch->workers = NULL;
+
+    return batch->failed ? -1 : 0;
+}
+
+#endif
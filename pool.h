@@ -0,0 +1,290 @@
+#ifndef POOL_H
+#define POOL_H
+
+/**
+ * --- pool.h defines ---
+ * the protocol between the session pool daemon poold and its clients
+ *
+ * poold keeps sessions logged in to the servers it is given and lends them
+ * over a unix socket. A client connects, sends one pool_message and reads
+ * one back; the command connection of a session travels with the message
+ * as SCM_RIGHTS, to the client by POOL_CHECKOUT and back by POOL_CHECKIN.
+ * A session is only given back if nothing changed its state on the server,
+ * like its work directory.
+ */
+
+#include "base.h"
+#include "control.h"
+#include <sys/un.h>
+
+/**
+ * the unix socket of poold when FTP_POOL is not set
+ */
+#define POOL_DEFAULT_SOCKET "/tmp/ftp-pool.sock"
+
+/**
+ * the environment variable naming the unix socket of poold
+ */
+#define POOL_ENV "FTP_POOL"
+
+/**
+ * a client waits this long for poold before going on without it
+ */
+#define POOL_TIMEOUT_MS 1000
+
+#define POOL_HOST_LEN 64
+
+enum pool_op
+{
+    POOL_CHECKOUT = 1, /* borrow a session, status 0 and its sock fd or -1 */
+    POOL_CHECKIN = 2   /* give back the sock fd of a session */
+};
+
+/**
+ * the request and the reply, a session is named by host, port and user
+ */
+struct pool_message
+{
+    int op;
+    int status;
+    int port;
+    int varlen; /* the control encoding of the session */
+    char host[POOL_HOST_LEN];
+    char user[BUF_SIZE];
+};
+
+/**
+ * send message on sockfd with the descriptor fd or -1 for none
+ * return 0 if success or -1 if error
+ */
+int pool_send_message(int sockfd, const struct pool_message *message, int fd);
+
+/**
+ * receive a message from sockfd, fd gets the descriptor sent with it or -1
+ * return 0 if success or -1 if error
+ */
+int pool_recv_message(int sockfd, struct pool_message *message, int *fd);
+
+/**
+ * borrow a session to host and port logged in as user from the poold of path
+ * return the sock fd of its command connection, varlen getting its encoding,
+ * or -1 if poold has none
+ */
+int pool_checkout(const char *path, const char *host, int port, const char *user, int *varlen);
+
+/**
+ * give the session of sockfd back to the poold of path, or end it with
+ * QUIT if poold does not take it; sockfd is closed
+ * return 0 if success or -1 if error
+ */
+int pool_checkin(const char *path, int sockfd, const char *host, int port, const char *user, int varlen);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+int pool_send_message(int sockfd, const struct pool_message *message, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)message;
+    iov.iov_len = sizeof(*message);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(*message))
+    {
+        perror("sendmsg() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int pool_recv_message(int sockfd, struct pool_message *message, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t size;
+
+    *fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = message;
+    iov.iov_len = sizeof(*message);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    size = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (size != (ssize_t)sizeof(*message))
+    {
+        if (*fd >= 0)
+            close(*fd);
+        *fd = -1;
+
+        if (size < 0)
+            perror("recvmsg() error");
+        return -1;
+    }
+
+    message->host[POOL_HOST_LEN - 1] = '\0';
+    message->user[BUF_SIZE - 1] = '\0';
+
+    return 0;
+}
+
+/**
+ * connect to the poold of path
+ * return the sock fd or -1 if error
+ */
+static int pool_connect(const char *path)
+{
+    struct sockaddr_un address;
+    struct timeval timeout;
+    int sockfd;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+
+    sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sockfd < 0)
+        return -1;
+
+    timeout.tv_sec = POOL_TIMEOUT_MS / 1000;
+    timeout.tv_usec = POOL_TIMEOUT_MS % 1000 * 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    if (connect(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * send a request of op to the poold of path and receive its reply
+ * return 0 if success or -1 if error
+ */
+static int pool_request(const char *path, struct pool_message *message, int fd, int *reply_fd)
+{
+    int sockfd;
+    int result;
+
+    sockfd = pool_connect(path);
+    if (sockfd < 0)
+        return -1;
+
+    result = pool_send_message(sockfd, message, fd);
+    if (0 == result)
+        result = pool_recv_message(sockfd, message, reply_fd);
+
+    close(sockfd);
+
+    return result;
+}
+
+int pool_checkout(const char *path, const char *host, int port, const char *user, int *varlen)
+{
+    struct pool_message message;
+    int sockfd;
+
+    if (strlen(host) >= POOL_HOST_LEN || strlen(user) >= BUF_SIZE)
+        return -1;
+
+    memset(&message, 0, sizeof(message));
+    message.op = POOL_CHECKOUT;
+    message.port = port;
+    strcpy(message.host, host);
+    strcpy(message.user, user);
+
+    if (pool_request(path, &message, -1, &sockfd) < 0)
+        return -1;
+
+    if (message.status < 0 || sockfd < 0)
+    {
+        if (sockfd >= 0)
+            close(sockfd);
+        return -1;
+    }
+
+    *varlen = message.varlen;
+
+    return sockfd;
+}
+
+int pool_checkin(const char *path, int sockfd, const char *host, int port, const char *user, int varlen)
+{
+    struct pool_message message;
+    char buffer[BUF_SIZE];
+    int reply_fd;
+    int length;
+    int result;
+
+    result = -1;
+    reply_fd = -1;
+
+    if (strlen(host) < POOL_HOST_LEN && strlen(user) < BUF_SIZE)
+    {
+        memset(&message, 0, sizeof(message));
+        message.op = POOL_CHECKIN;
+        message.port = port;
+        message.varlen = varlen;
+        strcpy(message.host, host);
+        strcpy(message.user, user);
+
+        result = pool_request(path, &message, sockfd, &reply_fd);
+        if (reply_fd >= 0)
+            close(reply_fd);
+        if (0 == result)
+            result = message.status;
+    }
+
+    /* the reply is not waited for, the server ends the session either way */
+    if (result < 0)
+    {
+        length = control_encode(buffer, BUF_SIZE, varlen, CMD_QUIT, NULL);
+        send(sockfd, buffer, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+
+    close(sockfd);
+
+    return result;
+}
+
+#endif
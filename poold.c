@@ -0,0 +1,691 @@
+/**
+ * poold
+ * keep sessions logged in to ftp servers and lend them to clients
+ *
+ * Every target user[:password]@host:port gets sessions sessions connected
+ * and logged in ahead of time with libftpclient, all driven by one poll()
+ * loop. A client borrows one over the unix socket of pool.h and starts its
+ * transfer at once, without the connect and the login. Sessions lent out
+ * count as the target's until they come back, but one is always kept
+ * ready; one given back is kept if the target is short of sessions and
+ * ended with QUIT if not. An idle session that becomes readable was closed
+ * by the server and is dropped.
+ *
+ * usage: ./poold [-n sessions] [-s socket] target...
+ */
+
+#include "base.h"
+#include "control.h"
+#include "ftpclient.h"
+#include "pool.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+#define POOL_DEFAULT_SESSIONS 4
+#define POOL_MAX_SESSIONS 64
+#define POOL_MAX_TARGETS 16
+
+/**
+ * the wait before a target whose login failed is tried again
+ */
+#define POOL_RETRY_MS 1000
+
+/**
+ * the steps of a session being warmed
+ */
+enum pool_warm_step
+{
+    POOL_WARM_CONNECT, /* connecting */
+    POOL_WARM_LOGIN    /* logging in */
+};
+
+/**
+ * a session being connected and logged in, free while client is NULL;
+ * it is the argument of the callbacks, so it never moves
+ */
+struct pool_warming
+{
+    ftp_client *client;
+    int step;
+    int done;   /* the running operation completed */
+    int status; /* with this status */
+};
+
+struct pool_target
+{
+    char host[POOL_HOST_LEN];
+    int port;
+    char user[BUF_SIZE];
+    char password[BUF_SIZE];
+
+    int idle[POOL_MAX_SESSIONS]; /* sock fds of the sessions ready */
+    int idle_varlen[POOL_MAX_SESSIONS];
+    int idle_count;
+
+    struct pool_warming warming[POOL_MAX_SESSIONS];
+    int warming_count;
+
+    int lent; /* sessions borrowed and not given back yet */
+    long long retry_at;
+};
+
+/**
+ * what a descriptor of the poll() set belongs to
+ */
+enum pool_slot_kind
+{
+    POOL_SLOT_LISTEN,
+    POOL_SLOT_IDLE,
+    POOL_SLOT_WARMING
+};
+
+struct pool_slot
+{
+    int kind;
+    struct pool_target *target;
+    int index;
+};
+
+#define POOL_MAX_FDS (1 + POOL_MAX_TARGETS * POOL_MAX_SESSIONS * 3)
+
+static struct pool_target targets[POOL_MAX_TARGETS];
+static int target_count = 0;
+static int sessions = POOL_DEFAULT_SESSIONS;
+static volatile sig_atomic_t stopping = 0;
+
+/**
+ * print the options
+ */
+void usage(void);
+
+/**
+ * parse a target user[:password]@host:port into targets
+ * return 0 if success or -1 if error
+ */
+int parse_target(const char *str);
+
+/**
+ * create the non-blocking unix socket of path, usable by this user only
+ * return the sock fd or -1 if error
+ */
+int pool_socket_initialize(const char *path);
+
+/**
+ * start warming new sessions of target until it has sessions of them,
+ * counting the ones lent, or at least one ready
+ */
+void target_refill(struct pool_target *target, long long now);
+
+/**
+ * move on the session of target warmed at index once its operation completed
+ */
+void target_warming_step(struct pool_target *target, int index, long long now);
+
+/**
+ * end the session of sockfd with QUIT, not waiting for the reply
+ */
+void session_end(int sockfd, int varlen);
+
+/**
+ * check that sockfd is a quiet session with the server of target
+ * return 0 if it is or -1 if not
+ */
+int session_check(struct pool_target *target, int sockfd);
+
+/**
+ * answer the requests waiting on the listen socket
+ */
+void pool_serve(int listen_sockfd);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+void usage(void)
+{
+    error_handling("usage: ./poold [options] user[:password]@host:port...\n"
+                   "  -n num   sessions kept ready for each target (4)\n"
+                   "  -s path  unix socket of the pool ($" POOL_ENV " or " POOL_DEFAULT_SOCKET ")");
+}
+
+int parse_target(const char *str)
+{
+    struct pool_target *target;
+    struct in_addr address;
+    const char *at;
+    const char *colon;
+    const char *separator;
+    int user_len;
+
+    if (POOL_MAX_TARGETS == target_count)
+        return -1;
+
+    target = &targets[target_count];
+    memset(target, 0, sizeof(*target));
+
+    at = strrchr(str, '@');
+    colon = at ? strchr(at, ':') : NULL;
+    if (!colon)
+        return -1;
+
+    separator = memchr(str, ':', at - str);
+    user_len = (separator ? separator : at) - str;
+
+    if (user_len <= 0 || user_len >= ARG_LEN || colon - at - 1 >= POOL_HOST_LEN)
+        return -1;
+
+    memcpy(target->user, str, user_len);
+
+    if (separator)
+    {
+        if (at - separator - 1 >= ARG_LEN)
+            return -1;
+        memcpy(target->password, separator + 1, at - separator - 1);
+    }
+
+    memcpy(target->host, at + 1, colon - at - 1);
+    target->port = atoi(colon + 1);
+
+    if (!inet_aton(target->host, &address) || target->port <= 0 || target->port > 65535)
+        return -1;
+
+    target_count++;
+
+    return 0;
+}
+
+int pool_socket_initialize(const char *path)
+{
+    struct sockaddr_un address;
+    int sockfd;
+    int result;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        error_handling("the socket path is too long");
+        return -1;
+    }
+
+    sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0)
+    {
+        perror("socket() error");
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    /* a socket left by a pool that died is replaced */
+    unlink(path);
+
+    result = bind(sockfd, (struct sockaddr *)&address, sizeof(address));
+    if (result < 0)
+    {
+        close(sockfd);
+        perror("bind() error");
+        return -1;
+    }
+
+    result = chmod(path, 0600);
+    if (result < 0)
+    {
+        close(sockfd);
+        perror("chmod() error");
+        return -1;
+    }
+
+    result = listen(sockfd, SOMAXCONN);
+    if (result < 0)
+    {
+        close(sockfd);
+        perror("listen() error");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+static void pool_done(ftp_client *client, int status, int code, void *user)
+{
+    struct pool_warming *warming = user;
+
+    (void)client;
+    (void)code;
+
+    warming->done = 1;
+    warming->status = status;
+}
+
+/**
+ * drop the session of target warmed at index after status,
+ * the target waits POOL_RETRY_MS before the next one
+ */
+static void target_warming_fail(struct pool_target *target, int index, int status, long long now)
+{
+    struct pool_warming *warming = &target->warming[index];
+
+    if (FTP_ERR_SYSTEM == status || FTP_ERR_CONNECT == status)
+        fprintf(stderr, "%s@%s:%d: %s: %s\n", target->user, target->host, target->port,
+                ftp_strerror(status), strerror(ftp_client_errno(warming->client)));
+    else
+        fprintf(stderr, "%s@%s:%d: %s\n", target->user, target->host, target->port, ftp_strerror(status));
+
+    ftp_client_free(warming->client);
+    warming->client = NULL;
+    target->warming_count--;
+    target->retry_at = now + POOL_RETRY_MS * 1000000LL;
+}
+
+void target_refill(struct pool_target *target, long long now)
+{
+    struct pool_warming *warming;
+    int wanted;
+    int status;
+    int i;
+
+    wanted = sessions - target->lent > 1 ? sessions - target->lent : 1;
+
+    for (i = 0; i < POOL_MAX_SESSIONS; i++)
+    {
+        if (target->idle_count + target->warming_count >= wanted || now < target->retry_at)
+            return;
+
+        warming = &target->warming[i];
+        if (warming->client)
+            continue;
+
+        warming->client = ftp_client_new();
+        if (!warming->client)
+        {
+            error_handling("ftp_client_new() error");
+            return;
+        }
+
+        warming->step = POOL_WARM_CONNECT;
+        warming->done = 0;
+        target->warming_count++;
+
+        status = ftp_connect(warming->client, target->host, target->port, pool_done, warming);
+        if (status != FTP_OK)
+            target_warming_fail(target, i, status, now);
+    }
+}
+
+void target_warming_step(struct pool_target *target, int index, long long now)
+{
+    struct pool_warming *warming;
+    int sockfd;
+    int varlen;
+    int status;
+
+    warming = &target->warming[index];
+
+    if (!warming->client || !warming->done)
+        return;
+
+    warming->done = 0;
+
+    if (warming->status != FTP_OK)
+    {
+        target_warming_fail(target, index, warming->status, now);
+        return;
+    }
+
+    if (POOL_WARM_CONNECT == warming->step)
+    {
+        warming->step = POOL_WARM_LOGIN;
+
+        status = ftp_login(warming->client, target->user, target->password, pool_done, warming);
+        if (status != FTP_OK)
+            target_warming_fail(target, index, status, now);
+        return;
+    }
+
+    sockfd = ftp_client_detach(warming->client, &varlen);
+    if (sockfd < 0)
+    {
+        target_warming_fail(target, index, sockfd, now);
+        return;
+    }
+
+    ftp_client_free(warming->client);
+    warming->client = NULL;
+    target->warming_count--;
+
+    target->idle[target->idle_count] = sockfd;
+    target->idle_varlen[target->idle_count] = varlen;
+    target->idle_count++;
+}
+
+void session_end(int sockfd, int varlen)
+{
+    char buffer[BUF_SIZE];
+    int length;
+
+    length = control_encode(buffer, BUF_SIZE, varlen, CMD_QUIT, NULL);
+    send(sockfd, buffer, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(sockfd);
+}
+
+int session_check(struct pool_target *target, int sockfd)
+{
+    struct sockaddr_in address;
+    struct pollfd pfd;
+    socklen_t len;
+
+    len = sizeof(address);
+    if (getpeername(sockfd, (struct sockaddr *)&address, &len) < 0 ||
+        address.sin_family != AF_INET ||
+        address.sin_addr.s_addr != inet_addr(target->host) ||
+        ntohs(address.sin_port) != target->port)
+        return -1;
+
+    /* the server only talks when asked, anything to read is a close or junk */
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, 0) != 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * find the target of message
+ * return the target or NULL if none
+ */
+static struct pool_target *pool_find(const struct pool_message *message)
+{
+    int i;
+
+    for (i = 0; i < target_count; i++)
+    {
+        if (targets[i].port == message->port &&
+            0 == strcmp(targets[i].host, message->host) &&
+            0 == strcmp(targets[i].user, message->user))
+            return &targets[i];
+    }
+
+    return NULL;
+}
+
+void pool_serve(int listen_sockfd)
+{
+    struct pool_message message;
+    struct pool_target *target;
+    struct timeval timeout;
+    struct ucred credentials;
+    socklen_t len;
+    int sockfd;
+    int fd;
+    int index;
+
+    while ((sockfd = accept4(listen_sockfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        /* a client that connects and says nothing does not hold the pool */
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 100000;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        len = sizeof(credentials);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &credentials, &len) < 0 ||
+            credentials.uid != getuid() ||
+            pool_recv_message(sockfd, &message, &fd) < 0)
+        {
+            close(sockfd);
+            continue;
+        }
+
+        target = pool_find(&message);
+        message.status = -1;
+
+        if (POOL_CHECKOUT == message.op && target && target->idle_count > 0)
+        {
+            index = --target->idle_count;
+            message.status = 0;
+            message.varlen = target->idle_varlen[index];
+
+            /* a client gone before the reply leaves the session here */
+            if (pool_send_message(sockfd, &message, target->idle[index]) < 0)
+            {
+                target->idle_count++;
+            }
+            else
+            {
+                close(target->idle[index]);
+                target->lent++;
+            }
+
+            close(sockfd);
+            continue;
+        }
+
+        if (POOL_CHECKIN == message.op && fd >= 0)
+        {
+            if (target && target->lent > 0)
+                target->lent--;
+
+            if (target && target->idle_count + target->warming_count < sessions &&
+                0 == session_check(target, fd))
+            {
+                target->idle[target->idle_count] = fd;
+                target->idle_varlen[target->idle_count] = message.varlen;
+                target->idle_count++;
+                message.status = 0;
+            }
+            else
+            {
+                session_end(fd, message.varlen);
+            }
+        }
+        else if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        pool_send_message(sockfd, &message, -1);
+        close(sockfd);
+    }
+}
+
+static void pool_stop(int signal)
+{
+    (void)signal;
+
+    stopping = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct pollfd fds[POOL_MAX_FDS];
+    static struct pool_slot slots[POOL_MAX_FDS];
+    struct pool_target *target;
+    struct pool_slot *slot;
+    struct sigaction action;
+    const char *path;
+    long long now;
+    int listen_sockfd;
+    int listen_ready;
+    int timeout;
+    int option;
+    int count;
+    int found;
+    int result;
+    int i;
+    int j;
+
+    path = getenv(POOL_ENV) ? getenv(POOL_ENV) : POOL_DEFAULT_SOCKET;
+
+    while ((option = getopt(argc, argv, "n:s:")) != -1)
+    {
+        switch (option)
+        {
+        case 'n':
+            sessions = atoi(optarg);
+            break;
+        case 's':
+            path = optarg;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
+
+    if (optind == argc || sessions <= 0 || sessions > POOL_MAX_SESSIONS)
+    {
+        usage();
+        exit(1);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        if (parse_target(argv[i]) < 0)
+        {
+            fprintf(stderr, "%s: invalid target\n", argv[i]);
+            usage();
+            exit(1);
+        }
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = pool_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    listen_sockfd = pool_socket_initialize(path);
+    if (listen_sockfd < 0)
+    {
+        error_handling("pool_socket_initialize() error");
+        exit(1);
+    }
+
+    while (!stopping)
+    {
+        now = monotonic_ns();
+        timeout = -1;
+
+        fds[0].fd = listen_sockfd;
+        fds[0].events = POLLIN;
+        slots[0].kind = POOL_SLOT_LISTEN;
+        count = 1;
+
+        for (i = 0; i < target_count; i++)
+        {
+            target = &targets[i];
+            target_refill(target, now);
+
+            /* a target waiting to retry wakes the loop up */
+            if (now < target->retry_at)
+                timeout = POOL_RETRY_MS;
+
+            for (j = 0; j < target->idle_count; j++)
+            {
+                fds[count].fd = target->idle[j];
+                fds[count].events = POLLIN;
+                slots[count].kind = POOL_SLOT_IDLE;
+                slots[count].target = target;
+                slots[count].index = j;
+                count++;
+            }
+
+            for (j = 0; j < POOL_MAX_SESSIONS; j++)
+            {
+                if (!target->warming[j].client)
+                    continue;
+
+                found = ftp_client_poll_fds(target->warming[j].client, fds + count);
+                while (found--)
+                {
+                    slots[count].kind = POOL_SLOT_WARMING;
+                    slots[count].target = target;
+                    slots[count].index = j;
+                    count++;
+                }
+            }
+        }
+
+        result = poll(fds, count, timeout);
+        if (result < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            perror("poll() error");
+            break;
+        }
+
+        now = monotonic_ns();
+        listen_ready = 0;
+
+        for (i = 0; i < count; i++)
+        {
+            if (!fds[i].revents)
+                continue;
+
+            slot = &slots[i];
+            target = slot->target;
+
+            switch (slot->kind)
+            {
+            case POOL_SLOT_LISTEN:
+                listen_ready = 1;
+                break;
+            case POOL_SLOT_IDLE:
+                /* closed by the server, dropped below */
+                close(target->idle[slot->index]);
+                target->idle[slot->index] = -1;
+                break;
+            case POOL_SLOT_WARMING:
+                if (target->warming[slot->index].client)
+                {
+                    ftp_client_process(target->warming[slot->index].client);
+                    target_warming_step(target, slot->index, now);
+                }
+                break;
+            }
+        }
+
+        for (i = 0; i < target_count; i++)
+        {
+            target = &targets[i];
+
+            for (j = 0; j < target->idle_count;)
+            {
+                if (target->idle[j] >= 0)
+                {
+                    j++;
+                    continue;
+                }
+
+                target->idle_count--;
+                target->idle[j] = target->idle[target->idle_count];
+                target->idle_varlen[j] = target->idle_varlen[target->idle_count];
+            }
+        }
+
+        if (listen_ready)
+            pool_serve(listen_sockfd);
+    }
+
+    for (i = 0; i < target_count; i++)
+    {
+        target = &targets[i];
+
+        for (j = 0; j < target->idle_count; j++)
+            session_end(target->idle[j], target->idle_varlen[j]);
+
+        for (j = 0; j < POOL_MAX_SESSIONS; j++)
+            ftp_client_free(target->warming[j].client);
+    }
+
+    close(listen_sockfd);
+    unlink(path);
+
+    return 0;
+}
@@ -0,0 +1,490 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/**
+ * --- ratelimit.h defines ---
+ * token buckets shared by all the forked sessions,
+ * global, per user and per session bandwidth shaping
+ *
+ * The shared buckets live in an anonymous MAP_SHARED mapping that the
+ * server creates before fork(), so every child sees the same tokens.
+ * Its locks are robust, a session killed holding one does not stall the
+ * others. A session gives its place in the bucket of its user back when
+ * it exits, and the listener gives it back for a session that was killed,
+ * from the user slot recorded under its admission slot.
+ * A bucket may go into debt: a sender always takes its tokens and then
+ * sleeps until the debt is paid back, which paces the transfer smoothly.
+ *
+ * The global rate is split into a reserve for interactive transfers and
+ * the rest for bulk ones. A transfer is interactive until it has moved
+ * RATE_INTERACTIVE_BYTES; interactive chunks are paid from the reserve
+ * first, so a bulk download can never starve them below the reserve.
+ */
+
+#include "base.h"
+#include <errno.h>
+#include <sys/mman.h>
+
+/**
+ * the number of users that can be shaped at the same time
+ */
+#define RATE_USER_SLOTS 64
+
+/**
+ * a transfer is interactive until it has moved this many bytes
+ */
+#define RATE_INTERACTIVE_BYTES (1 << 20)
+
+/**
+ * the burst of a bucket is the tokens earned in this many milliseconds,
+ * but never less than RATE_MIN_BURST bytes
+ */
+#define RATE_BURST_MS 100
+#define RATE_MIN_BURST (64 * 1024)
+
+/**
+ * the highest rate in bytes per second, a second of it times the
+ * nanoseconds of a second still fits in a long long
+ */
+#define RATE_MAX (1LL << 33)
+
+/**
+ * a token bucket, rate is in bytes per second and 0 means unlimited
+ */
+struct token_bucket
+{
+    pthread_mutex_t lock;
+    long long rate;
+    long long burst;
+    long long tokens;
+    long long stamp; /* CLOCK_MONOTONIC nanoseconds of the last refill */
+};
+
+/**
+ * the bucket shared by all the sessions of a user
+ */
+struct rate_user
+{
+    char name[BUF_SIZE];
+    int sessions;
+    struct token_bucket bucket;
+};
+
+/**
+ * the buckets shared by all the sessions of the server
+ */
+struct rate_shared
+{
+    pthread_mutex_t users_lock;
+    long long user_rate;
+    long long session_rate;
+    struct token_bucket bulk;
+    struct token_bucket interactive;
+    struct rate_user users[RATE_USER_SLOTS];
+    int slot_count;
+    int owners[]; /* the user slot of every admission slot, -1 for none */
+};
+
+static struct rate_shared *rate_shared = NULL;
+static size_t rate_shared_size = 0;
+static struct rate_user *rate_user = NULL;
+static int rate_slot = -1; /* the admission slot of the session */
+static struct token_bucket rate_session;
+static long long rate_transfer_bytes = 0;
+
+/**
+ * map the shared buckets before any session is forked
+ * global_rate, user_rate and session_rate are bytes per second (0 unlimited),
+ * reserve is the part of global_rate guaranteed to interactive transfers,
+ * max_sessions is the number of admission slots
+ * return 0 if success or -1 if error
+ */
+int rate_limit_initialize(long long global_rate, long long user_rate,
+                          long long session_rate, long long reserve, int max_sessions);
+
+/**
+ * remember the admission slot of the session, called in the child after
+ * fork()
+ */
+void rate_limit_session_slot(int slot);
+
+/**
+ * attach the current session to the bucket of user_name, it is detached
+ * again at exit()
+ * return 0 if success or -1 if error
+ */
+int rate_limit_session_begin(const char *user_name);
+
+/**
+ * detach the current session from its user bucket
+ */
+void rate_limit_session_end(void);
+
+/**
+ * detach the exited session of admission slot from its user bucket, if it
+ * did not do it itself, called by the listener when it frees the slot
+ */
+void rate_limit_retire(int slot);
+
+/**
+ * start shaping a new transfer on data_sockfd,
+ * set SO_MAX_PACING_RATE so the kernel paces the packets as well
+ */
+void rate_limit_transfer_begin(int data_sockfd);
+
+/**
+ * take size bytes of tokens and sleep until they are paid back
+ * return 0 if success or -1 if error
+ */
+int rate_limit_acquire(long long size);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static void token_bucket_initialize(struct token_bucket *bucket, long long rate)
+{
+    shared_mutex_initialize(&bucket->lock);
+    bucket->rate = rate;
+    bucket->burst = rate * RATE_BURST_MS / 1000;
+    if (bucket->burst < RATE_MIN_BURST)
+        bucket->burst = RATE_MIN_BURST;
+    bucket->tokens = bucket->burst;
+    bucket->stamp = monotonic_ns();
+}
+
+static void token_bucket_refill(struct token_bucket *bucket, long long now)
+{
+    long long elapsed;
+    long long seconds;
+    long long earned;
+
+    elapsed = now - bucket->stamp;
+    if (elapsed <= 0)
+        return;
+
+    /* a rest long enough to fill the bucket fills it, the products below stay small */
+    seconds = elapsed / 1000000000LL;
+    if (seconds > (bucket->burst - bucket->tokens) / bucket->rate)
+    {
+        bucket->tokens = bucket->burst;
+        bucket->stamp = now;
+        return;
+    }
+
+    earned = seconds * bucket->rate + elapsed % 1000000000LL * bucket->rate / 1000000000LL;
+    if (earned <= 0)
+        return;
+
+    bucket->tokens += earned;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->stamp = now;
+}
+
+/**
+ * take size tokens, going into debt if needed
+ * return the nanoseconds to wait until the debt is paid back
+ */
+static long long token_bucket_take(struct token_bucket *bucket, long long size, long long now)
+{
+    long long wait;
+
+    if (0 == bucket->rate)
+        return 0;
+
+    shared_mutex_lock(&bucket->lock);
+
+    token_bucket_refill(bucket, now);
+    bucket->tokens -= size;
+    wait = 0;
+    if (bucket->tokens < 0)
+        wait = -bucket->tokens * 1000000000LL / bucket->rate;
+
+    pthread_mutex_unlock(&bucket->lock);
+
+    return wait;
+}
+
+/**
+ * take size tokens only if the bucket holds them
+ * return 0 if taken or -1 if the bucket is short
+ */
+static int token_bucket_try_take(struct token_bucket *bucket, long long size, long long now)
+{
+    int result;
+
+    if (0 == bucket->rate)
+        return -1;
+
+    shared_mutex_lock(&bucket->lock);
+
+    token_bucket_refill(bucket, now);
+    result = -1;
+    if (bucket->tokens >= size)
+    {
+        bucket->tokens -= size;
+        result = 0;
+    }
+
+    pthread_mutex_unlock(&bucket->lock);
+
+    return result;
+}
+
+int rate_limit_initialize(long long global_rate, long long user_rate,
+                          long long session_rate, long long reserve, int max_sessions)
+{
+    struct rate_shared *shared;
+    int i;
+
+    if (global_rate < 0 || user_rate < 0 || session_rate < 0 || reserve < 0)
+    {
+        error_handling("negative rate");
+        return -1;
+    }
+
+    if (global_rate > RATE_MAX || user_rate > RATE_MAX || session_rate > RATE_MAX)
+    {
+        error_handling("the rates can not be above 8g");
+        return -1;
+    }
+
+    if (global_rate > 0 && reserve >= global_rate)
+    {
+        error_handling("the interactive reserve must be less than the global rate");
+        return -1;
+    }
+
+    if (max_sessions <= 0)
+    {
+        error_handling("invalid session limits");
+        return -1;
+    }
+
+    rate_shared_size = sizeof(struct rate_shared) + (size_t)max_sessions * sizeof(int);
+    shared = mmap(NULL, rate_shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == shared)
+    {
+        perror("mmap() error");
+        return -1;
+    }
+
+    if (shared_mutex_initialize(&shared->users_lock) < 0)
+    {
+        munmap(shared, rate_shared_size);
+        return -1;
+    }
+
+    shared->user_rate = user_rate;
+    shared->session_rate = session_rate;
+
+    if (global_rate > 0)
+    {
+        token_bucket_initialize(&shared->bulk, global_rate - reserve);
+        token_bucket_initialize(&shared->interactive, reserve);
+    }
+    else
+    {
+        token_bucket_initialize(&shared->bulk, 0);
+        token_bucket_initialize(&shared->interactive, 0);
+    }
+
+    for (i = 0; i < RATE_USER_SLOTS; i++)
+        shared->users[i].sessions = 0;
+
+    shared->slot_count = max_sessions;
+    for (i = 0; i < max_sessions; i++)
+        shared->owners[i] = -1;
+
+    rate_shared = shared;
+
+    return 0;
+}
+
+void rate_limit_session_slot(int slot)
+{
+    rate_slot = slot;
+}
+
+/**
+ * give the place of admission slot in its user bucket back, under
+ * users_lock
+ */
+static void rate_limit_release_owner(int slot)
+{
+    int owner;
+
+    if (slot < 0 || slot >= rate_shared->slot_count)
+        return;
+
+    owner = rate_shared->owners[slot];
+    if (owner < 0)
+        return;
+
+    rate_shared->users[owner].sessions--;
+    rate_shared->owners[slot] = -1;
+}
+
+int rate_limit_session_begin(const char *user_name)
+{
+    struct rate_user *free_slot;
+    int i;
+
+    if (!rate_shared)
+        return 0;
+
+    token_bucket_initialize(&rate_session, rate_shared->session_rate);
+
+    if (0 == rate_shared->user_rate)
+        return 0;
+
+    free_slot = NULL;
+    rate_user = NULL;
+
+    shared_mutex_lock(&rate_shared->users_lock);
+
+    for (i = 0; i < RATE_USER_SLOTS; i++)
+    {
+        if (rate_shared->users[i].sessions > 0 &&
+            0 == strcmp(rate_shared->users[i].name, user_name))
+        {
+            rate_user = &rate_shared->users[i];
+            break;
+        }
+
+        if (!free_slot && 0 == rate_shared->users[i].sessions)
+            free_slot = &rate_shared->users[i];
+    }
+
+    if (!rate_user && free_slot)
+    {
+        rate_user = free_slot;
+        memset(rate_user->name, 0, BUF_SIZE);
+        strncpy(rate_user->name, user_name, BUF_SIZE - 1);
+        token_bucket_initialize(&rate_user->bucket, rate_shared->user_rate);
+    }
+
+    if (rate_user)
+    {
+        rate_user->sessions++;
+        if (rate_slot >= 0 && rate_slot < rate_shared->slot_count)
+            rate_shared->owners[rate_slot] = rate_user - rate_shared->users;
+    }
+
+    pthread_mutex_unlock(&rate_shared->users_lock);
+
+    if (!rate_user)
+    {
+        error_handling("no free rate limit user slot");
+        return -1;
+    }
+
+    /* a session that fails or loses its client leaves through exit() too */
+    atexit(rate_limit_session_end);
+
+    return 0;
+}
+
+void rate_limit_session_end(void)
+{
+    if (!rate_shared || !rate_user)
+        return;
+
+    shared_mutex_lock(&rate_shared->users_lock);
+    if (rate_slot >= 0 && rate_slot < rate_shared->slot_count && rate_shared->owners[rate_slot] >= 0)
+        rate_limit_release_owner(rate_slot);
+    else
+        rate_user->sessions--;
+    pthread_mutex_unlock(&rate_shared->users_lock);
+
+    rate_user = NULL;
+}
+
+void rate_limit_retire(int slot)
+{
+    if (!rate_shared)
+        return;
+
+    shared_mutex_lock(&rate_shared->users_lock);
+    rate_limit_release_owner(slot);
+    pthread_mutex_unlock(&rate_shared->users_lock);
+}
+
+void rate_limit_transfer_begin(int data_sockfd)
+{
+    long long rate;
+
+    rate_transfer_bytes = 0;
+
+    if (!rate_shared)
+        return;
+
+    rate = rate_session.rate;
+    if (rate_user && (0 == rate || rate_user->bucket.rate < rate))
+        rate = rate_user->bucket.rate;
+
+#ifdef SO_MAX_PACING_RATE
+    if (rate > 0)
+    {
+        unsigned int pacing;
+
+        pacing = rate > 0xffffffffLL ? 0xffffffffU : (unsigned int)rate;
+        if (setsockopt(data_sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing, sizeof(pacing)) < 0)
+            perror("setsockopt() SO_MAX_PACING_RATE error");
+    }
+#endif
+}
+
+int rate_limit_acquire(long long size)
+{
+    struct timespec ts;
+    long long now;
+    long long wait;
+    long long temp;
+
+    if (!rate_shared)
+        return 0;
+
+    now = monotonic_ns();
+
+    wait = token_bucket_take(&rate_session, size, now);
+
+    if (rate_user)
+    {
+        temp = token_bucket_take(&rate_user->bucket, size, now);
+        if (temp > wait)
+            wait = temp;
+    }
+
+    if (rate_transfer_bytes >= RATE_INTERACTIVE_BYTES ||
+        token_bucket_try_take(&rate_shared->interactive, size, now) < 0)
+    {
+        temp = token_bucket_take(&rate_shared->bulk, size, now);
+        if (temp > wait)
+            wait = temp;
+    }
+
+    rate_transfer_bytes += size;
+
+    if (wait <= 0)
+        return 0;
+
+    ts.tv_sec = wait / 1000000000LL;
+    ts.tv_nsec = wait % 1000000000LL;
+
+    while (nanosleep(&ts, &ts) < 0)
+    {
+        if (EINTR != errno)
+        {
+            perror("nanosleep() error");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
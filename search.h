@@ -0,0 +1,1518 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+/**
+ * --- search.h defines ---
+ * the index of the paths under the work directory of the server and the
+ * search of SRCH
+ *
+ * search_start() forks an indexer before the sessions. The server reaps it
+ * with the sessions and hands it to search_exited(), which logs how it
+ * ended and starts a new one, unless it died within SEARCH_RESTART_SECONDS
+ * of its start and would only die again. It walks the tree
+ * once, then keeps the index up to date from inotify and from the notes
+ * the sessions send after they make, write, rename or remove a file; a
+ * note goes on the same connection as the searches of the session, so a
+ * session always finds what it just stored. The index is in the memory of
+ * the indexer: the entries with their size and mtime, a hash of the paths
+ * and, for every trigram of the lowercased paths, the sorted list of the
+ * entries holding it.
+ *
+ * A search takes the trigrams of the literal parts of its pattern,
+ * intersects their lists starting from the shortest and checks only the
+ * entries left, so its cost follows the matches rather than the tree. A
+ * pattern without a trigram scans all the entries. The results are
+ * written to a memfd that travels back to the session as SCM_RIGHTS, the
+ * session sends it on the data connection like a LIST.
+ *
+ * Removed paths stay in the lists until there are more of them than live
+ * ones, then the tree is walked again; so is it when inotify overflows.
+ *
+ * Every change the indexer sees after its first walk is also an event of
+ * the change feed of SUBS: a path made, modified or deleted, numbered by a
+ * sequence that starts from the clock when the indexer starts, so it keeps
+ * growing across restarts. The last SEARCH_EVENTS events stay in a ring. A
+ * session subscribes on its connection with a subtree and the last number
+ * it saw, and the indexer pushes the events after it as they come; a
+ * subscriber that asks for events no longer in the ring, or a walk that
+ * may have missed some, gets a reset event, after which it should LIST
+ * again.
+ */
+
+#include "base.h"
+#include "log.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/**
+ * the results of one search, the rest is cut
+ */
+#define SEARCH_MAX_RESULTS 1000
+
+/**
+ * the events kept for subscribers that resume
+ */
+#define SEARCH_EVENTS 16384
+
+/**
+ * a session waits this long for the indexer to answer a search
+ */
+#define SEARCH_TIMEOUT_MS 5000
+
+/**
+ * an indexer that dies sooner after its start is not started again
+ */
+#define SEARCH_RESTART_SECONDS 10
+
+#define SEARCH_INOTIFY_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | \
+                             IN_MOVED_TO | IN_DONT_FOLLOW | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+enum search_op
+{
+    SEARCH_UPDATE = 1,    /* look at a path again, no reply */
+    SEARCH_QUERY = 2,     /* search, the reply carries the memfd of the results */
+    SEARCH_SUBSCRIBE = 3, /* stream the events of a subtree after seq */
+    SEARCH_EVENT = 4      /* an event pushed to a subscriber */
+};
+
+enum search_event_type
+{
+    SEARCH_CREATED = 'C',
+    SEARCH_MODIFIED = 'M',
+    SEARCH_DELETED = 'D',
+    SEARCH_RESET = 'R' /* events were lost, the subscriber should list again */
+};
+
+enum search_type
+{
+    SEARCH_ANY,
+    SEARCH_FILE,
+    SEARCH_DIR
+};
+
+/**
+ * a note, a search or a subscription from a session or an event pushed to
+ * it, the bounds are -1 when not given
+ */
+struct search_message
+{
+    int op;
+    int status;
+    int type;
+    int glob; /* the pattern has * ? or [ and is matched with fnmatch() */
+    long long min_size;
+    long long max_size;
+    long long min_mtime;
+    long long max_mtime;
+    long long seq;   /* of the event, or the last one seen by a subscriber */
+    int event;       /* a search_event_type */
+    int dir;
+    long long size;
+    long long mtime;
+    char text[PATH_MAX]; /* the path relative to the root or the pattern */
+};
+
+/**
+ * an entry of the index, its path in search_paths
+ */
+struct search_entry
+{
+    size_t path;
+    int length;
+    int dir;
+    int live;
+    int next; /* the next entry in the bucket of its path */
+    long long size;
+    long long mtime;
+};
+
+/**
+ * an event of the change feed, its path allocated
+ */
+struct search_event
+{
+    long long seq;
+    int type;
+    int dir;
+    long long size;
+    long long mtime;
+    char *path;
+};
+
+/**
+ * a connection of a session to the indexer
+ */
+struct search_client
+{
+    int closed;
+    int subscribed;
+    long long next_seq; /* the next event to push */
+    char *prefix;       /* the subtree subscribed, "" for all */
+};
+
+/**
+ * the entries holding a trigram, ascending
+ */
+struct search_posting
+{
+    unsigned int trigram; /* 0 for an empty slot */
+    int count;
+    int capacity;
+    int *ids;
+};
+
+/* shared by the server and the indexer */
+static char search_root[PATH_MAX];
+static int search_root_length = 0;
+static struct sockaddr_un search_address;
+static socklen_t search_address_length;
+
+/* the indexer, in the server */
+static pid_t search_pid = -1;
+static time_t search_started = 0;
+
+/* the connection of a session to the indexer */
+static int search_sockfd = -1;
+
+/* the index, only in the indexer */
+static struct search_entry *search_entries = NULL;
+static int search_entry_count = 0;
+static int search_entry_capacity = 0;
+static int search_live = 0;
+static char *search_paths = NULL;
+static size_t search_paths_size = 0;
+static size_t search_paths_capacity = 0;
+static int *search_buckets = NULL;
+static int search_bucket_count = 0;
+static struct search_posting *search_postings = NULL;
+static int search_posting_count = 0;
+static int search_posting_capacity = 0;
+static char **search_watches = NULL;
+static int search_watch_count = 0;
+static int search_inotify_fd = -1;
+static struct search_event search_events[SEARCH_EVENTS];
+static long long search_first_seq = 0;
+static long long search_next_seq = 0;
+static int search_feeding = 0; /* the changes seen are events */
+
+/**
+ * fork the indexer of the tree under root, before any session
+ * return 0 if success or -1 if error
+ */
+int search_start(const char *root);
+
+/**
+ * log the exit of pid with status if it is the indexer and start it again
+ * return 1 if pid was the indexer or 0 if not
+ */
+int search_exited(pid_t pid, int status);
+
+/**
+ * tell the indexer that name, relative to the work directory, was made,
+ * written or removed; nothing is waited for
+ */
+void search_notify(const char *name);
+
+/**
+ * parse the argument of SRCH, a pattern and the predicates size>N, size<N,
+ * mtime>T, mtime<T (T in seconds since the epoch, or before now if it
+ * starts with -) and type:f or type:d, into message
+ * return 0 if success or -1 if it is malformed
+ */
+int search_parse(const char *arg, struct search_message *message);
+
+/**
+ * run the search of message in the indexer
+ * return the fd of a file holding the results or -1 if error
+ */
+int search_query(struct search_message *message);
+
+/**
+ * subscribe to the events under name, relative to the work directory,
+ * after the event seq or from now if it is 0
+ * return the sock fd the events of SEARCH_EVENT arrive on or -1 if error
+ */
+int search_subscribe(const char *name, long long seq);
+
+/**
+ * receive the next event of the subscription into message
+ * return 0 if success or -1 if error
+ */
+int search_recv_event(struct search_message *message);
+
+/**
+ * end the subscription, the connection is dropped with what is in flight
+ */
+void search_unsubscribe(void);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static int search_send_message(int sockfd, const struct search_message *message, int fd, int flags)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)message;
+    iov.iov_len = sizeof(*message);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sockfd, &msg, MSG_NOSIGNAL | flags) != (ssize_t)sizeof(*message))
+        return -1;
+
+    return 0;
+}
+
+static int search_recv_message(int sockfd, struct search_message *message, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t size;
+
+    *fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = message;
+    iov.iov_len = sizeof(*message);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    size = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (size != (ssize_t)sizeof(*message))
+    {
+        if (*fd >= 0)
+            close(*fd);
+        *fd = -1;
+        return -1;
+    }
+
+    message->text[PATH_MAX - 1] = '\0';
+
+    return 0;
+}
+
+static unsigned int search_hash(const char *path)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*path)
+        hash = (hash ^ (unsigned char)*path++) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * return the live entry of path or -1
+ */
+static int search_lookup(const char *path)
+{
+    int id;
+
+    if (0 == search_bucket_count)
+        return -1;
+
+    for (id = search_buckets[search_hash(path) & (search_bucket_count - 1)]; id >= 0; id = search_entries[id].next)
+    {
+        if (0 == strcmp(search_paths + search_entries[id].path, path))
+            return id;
+    }
+
+    return -1;
+}
+
+static void search_bucket_insert(int id)
+{
+    int bucket;
+
+    bucket = search_hash(search_paths + search_entries[id].path) & (search_bucket_count - 1);
+    search_entries[id].next = search_buckets[bucket];
+    search_buckets[bucket] = id;
+}
+
+/**
+ * return the slot of trigram in the postings, or the empty slot where it goes
+ */
+static int search_posting_slot(unsigned int trigram)
+{
+    int slot;
+
+    slot = (trigram * 2654435761u >> 8) & (search_posting_capacity - 1);
+
+    while (search_postings[slot].trigram && search_postings[slot].trigram != trigram)
+        slot = (slot + 1) & (search_posting_capacity - 1);
+
+    return slot;
+}
+
+static int search_posting_add(unsigned int trigram, int id)
+{
+    struct search_posting *posting;
+    struct search_posting *old;
+    int old_capacity;
+    int *ids;
+    int slot;
+    int i;
+
+    /* kept at most half full */
+    if (2 * (search_posting_count + 1) > search_posting_capacity)
+    {
+        old = search_postings;
+        old_capacity = search_posting_capacity;
+
+        search_posting_capacity = old_capacity ? 2 * old_capacity : 4096;
+        search_postings = calloc(search_posting_capacity, sizeof(struct search_posting));
+        if (!search_postings)
+        {
+            search_postings = old;
+            search_posting_capacity = old_capacity;
+            return -1;
+        }
+
+        for (i = 0; i < old_capacity; i++)
+        {
+            if (old[i].trigram)
+                search_postings[search_posting_slot(old[i].trigram)] = old[i];
+        }
+
+        free(old);
+    }
+
+    slot = search_posting_slot(trigram);
+    posting = &search_postings[slot];
+
+    if (!posting->trigram)
+    {
+        posting->trigram = trigram;
+        search_posting_count++;
+    }
+
+    /* the trigrams of an entry are added together, after those of the entries before */
+    if (posting->count > 0 && posting->ids[posting->count - 1] == id)
+        return 0;
+
+    if (posting->count == posting->capacity)
+    {
+        ids = realloc(posting->ids, (posting->capacity ? 2 * posting->capacity : 4) * sizeof(int));
+        if (!ids)
+            return -1;
+        posting->ids = ids;
+        posting->capacity = posting->capacity ? 2 * posting->capacity : 4;
+    }
+
+    posting->ids[posting->count++] = id;
+
+    return 0;
+}
+
+static unsigned int search_trigram(const char *text)
+{
+    return ((unsigned int)(unsigned char)tolower(text[0]) << 16 |
+            (unsigned int)(unsigned char)tolower(text[1]) << 8 |
+            (unsigned int)(unsigned char)tolower(text[2])) + 1;
+}
+
+/**
+ * append an event to the ring when feeding
+ */
+static void search_event_add(int type, const char *path, int dir, long long size, long long mtime)
+{
+    struct search_event *event;
+
+    if (!search_feeding)
+        return;
+
+    event = &search_events[search_next_seq % SEARCH_EVENTS];
+    free(event->path);
+
+    event->seq = search_next_seq++;
+    event->type = type;
+    event->dir = dir;
+    event->size = size;
+    event->mtime = mtime;
+    event->path = strdup(path);
+}
+
+/**
+ * bring the size and mtime of entry id to statbuf, a change is an event
+ */
+static void search_touch(int id, const struct stat *statbuf)
+{
+    struct search_entry *entry = &search_entries[id];
+    long long size;
+
+    size = S_ISREG(statbuf->st_mode) ? statbuf->st_size : 0;
+
+    if (entry->size == size && entry->mtime == statbuf->st_mtime)
+        return;
+
+    entry->size = size;
+    entry->mtime = statbuf->st_mtime;
+
+    search_event_add(SEARCH_MODIFIED, search_paths + entry->path, entry->dir, entry->size, entry->mtime);
+}
+
+/**
+ * add path with its stat to the index
+ * return the entry or -1 if error
+ */
+static int search_add(const char *path, const struct stat *statbuf)
+{
+    struct search_entry *entries;
+    int *buckets;
+    size_t length;
+    char *paths;
+    int id;
+    int i;
+
+    length = strlen(path);
+
+    if (search_paths_size + length + 1 > search_paths_capacity)
+    {
+        paths = realloc(search_paths, 2 * (search_paths_capacity + length + 1));
+        if (!paths)
+            return -1;
+        search_paths = paths;
+        search_paths_capacity = 2 * (search_paths_capacity + length + 1);
+    }
+
+    if (search_entry_count == search_entry_capacity)
+    {
+        entries = realloc(search_entries, (search_entry_capacity ? 2 * search_entry_capacity : 1024) *
+                                              sizeof(struct search_entry));
+        if (!entries)
+            return -1;
+        search_entries = entries;
+        search_entry_capacity = search_entry_capacity ? 2 * search_entry_capacity : 1024;
+    }
+
+    /* the buckets grow with the entries, only the live ones are hashed again */
+    if (search_live >= search_bucket_count)
+    {
+        buckets = malloc((search_bucket_count ? 2 * search_bucket_count : 1024) * sizeof(int));
+        if (!buckets)
+            return -1;
+        free(search_buckets);
+        search_buckets = buckets;
+        search_bucket_count = search_bucket_count ? 2 * search_bucket_count : 1024;
+
+        for (i = 0; i < search_bucket_count; i++)
+            search_buckets[i] = -1;
+        for (i = 0; i < search_entry_count; i++)
+        {
+            if (search_entries[i].live)
+                search_bucket_insert(i);
+        }
+    }
+
+    id = search_entry_count++;
+    memcpy(search_paths + search_paths_size, path, length + 1);
+
+    search_entries[id].path = search_paths_size;
+    search_entries[id].length = length;
+    search_entries[id].dir = S_ISDIR(statbuf->st_mode);
+    search_entries[id].live = 1;
+    search_entries[id].size = S_ISREG(statbuf->st_mode) ? statbuf->st_size : 0;
+    search_entries[id].mtime = statbuf->st_mtime;
+
+    search_paths_size += length + 1;
+    search_bucket_insert(id);
+    search_live++;
+
+    search_event_add(SEARCH_CREATED, path, search_entries[id].dir, search_entries[id].size,
+                     search_entries[id].mtime);
+
+    for (i = 0; i + 3 <= (int)length; i++)
+    {
+        if (search_posting_add(search_trigram(path + i), id) < 0)
+            return -1;
+    }
+
+    return id;
+}
+
+static void search_remove(int id)
+{
+    int *link;
+
+    link = &search_buckets[search_hash(search_paths + search_entries[id].path) & (search_bucket_count - 1)];
+    while (*link != id)
+        link = &search_entries[*link].next;
+    *link = search_entries[id].next;
+
+    search_entries[id].live = 0;
+    search_live--;
+
+    search_event_add(SEARCH_DELETED, search_paths + search_entries[id].path, search_entries[id].dir, 0,
+                     search_entries[id].mtime);
+}
+
+/**
+ * remove path and, if it is a directory, everything under it
+ */
+static void search_remove_tree(const char *path)
+{
+    size_t length;
+    const char *other;
+    int id;
+
+    id = search_lookup(path);
+    if (id < 0)
+        return;
+
+    if (search_entries[id].dir)
+    {
+        length = strlen(path);
+
+        for (id = 0; id < search_entry_count; id++)
+        {
+            other = search_paths + search_entries[id].path;
+            if (search_entries[id].live && 0 == strncmp(other, path, length) && '/' == other[length])
+                search_remove(id);
+        }
+
+        id = search_lookup(path);
+    }
+
+    search_remove(id);
+}
+
+static void search_walk(const char *path);
+
+/**
+ * look at path again and bring its entry up to date
+ */
+static void search_update(const char *path)
+{
+    char full[PATH_MAX];
+    struct stat statbuf;
+    int id;
+
+    if (snprintf(full, PATH_MAX, "%s/%s", search_root, path) >= PATH_MAX)
+        return;
+
+    id = search_lookup(path);
+
+    if (lstat(full, &statbuf) < 0)
+    {
+        search_remove_tree(path);
+        return;
+    }
+
+    if (id >= 0 && search_entries[id].dir == S_ISDIR(statbuf.st_mode))
+    {
+        search_touch(id, &statbuf);
+        return;
+    }
+
+    if (id >= 0)
+        search_remove_tree(path);
+
+    search_add(path, &statbuf);
+
+    /* what was made in it before its watch is found by the walk */
+    if (S_ISDIR(statbuf.st_mode))
+        search_walk(path);
+}
+
+/**
+ * watch the directory path and index what is in it, recursively
+ */
+static void search_walk(const char *path)
+{
+    char full[PATH_MAX];
+    char child[PATH_MAX];
+    struct dirent *dirent;
+    struct stat statbuf;
+    char **watches;
+    DIR *dir;
+    int wd;
+    int id;
+
+    if (snprintf(full, PATH_MAX, "%s/%s", search_root, path) >= PATH_MAX)
+        return;
+
+    wd = inotify_add_watch(search_inotify_fd, full, SEARCH_INOTIFY_MASK);
+
+    if (wd >= 0)
+    {
+        if (wd >= search_watch_count)
+        {
+            watches = realloc(search_watches, 2 * (wd + 1) * sizeof(char *));
+            if (!watches)
+                return;
+            memset(watches + search_watch_count, 0, (2 * (wd + 1) - search_watch_count) * sizeof(char *));
+            search_watches = watches;
+            search_watch_count = 2 * (wd + 1);
+        }
+
+        /* a directory moved keeps its watch, which gets the new path */
+        free(search_watches[wd]);
+        search_watches[wd] = strdup(path);
+    }
+
+    dir = opendir(full);
+    if (!dir)
+        return;
+
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (0 == strcmp(dirent->d_name, ".") || 0 == strcmp(dirent->d_name, ".."))
+            continue;
+
+        if (snprintf(child, PATH_MAX, "%s%s%s", path, path[0] ? "/" : "", dirent->d_name) >= PATH_MAX ||
+            snprintf(full, PATH_MAX, "%s/%s", search_root, child) >= PATH_MAX)
+            continue;
+
+        if (lstat(full, &statbuf) < 0)
+            continue;
+
+        id = search_lookup(child);
+
+        if (id >= 0 && search_entries[id].dir == S_ISDIR(statbuf.st_mode))
+            search_touch(id, &statbuf);
+        else
+        {
+            if (id >= 0)
+                search_remove_tree(child);
+            search_add(child, &statbuf);
+        }
+
+        if (S_ISDIR(statbuf.st_mode))
+            search_walk(child);
+    }
+
+    closedir(dir);
+}
+
+/**
+ * drop the whole index and walk the tree again
+ */
+static void search_rebuild(void)
+{
+    int feeding;
+    int i;
+
+    /* the walk finds the paths again, they are not news */
+    feeding = search_feeding;
+    search_feeding = 0;
+
+    for (i = 0; i < search_posting_capacity; i++)
+        free(search_postings[i].ids);
+    for (i = 0; i < search_watch_count; i++)
+        free(search_watches[i]);
+
+    free(search_postings);
+    free(search_watches);
+    free(search_buckets);
+
+    search_postings = NULL;
+    search_posting_count = search_posting_capacity = 0;
+    search_watches = NULL;
+    search_watch_count = 0;
+    search_buckets = NULL;
+    search_bucket_count = 0;
+    search_entry_count = search_live = 0;
+    search_paths_size = 0;
+
+    if (search_inotify_fd >= 0)
+        close(search_inotify_fd);
+
+    search_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (search_inotify_fd < 0)
+        perror("inotify_init1() error");
+
+    search_walk("");
+
+    log_info("search index built, %d paths.", search_live);
+
+    /* what changed while there was no watch is not known */
+    search_feeding = 1;
+    if (feeding)
+        search_event_add(SEARCH_RESET, "", 1, 0, time(NULL));
+}
+
+/**
+ * rebuild when the removed entries outnumber the live ones
+ */
+static void search_compact(void)
+{
+    if (search_entry_count - search_live > search_live + 4096)
+        search_rebuild();
+}
+
+static void search_handle_events(void)
+{
+    char buffer[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    char path[PATH_MAX];
+    ssize_t size;
+    char *next;
+
+    while ((size = read(search_inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (next = buffer; next < buffer + size; next += sizeof(struct inotify_event) + event->len)
+        {
+            event = (const struct inotify_event *)next;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                search_rebuild();
+                return;
+            }
+
+            if (event->wd < 0 || event->wd >= search_watch_count || !search_watches[event->wd])
+                continue;
+
+            if (event->mask & IN_IGNORED)
+            {
+                free(search_watches[event->wd]);
+                search_watches[event->wd] = NULL;
+                continue;
+            }
+
+            if (0 == event->len)
+                continue;
+
+            if (snprintf(path, PATH_MAX, "%s%s%s", search_watches[event->wd],
+                         search_watches[event->wd][0] ? "/" : "", event->name) >= PATH_MAX)
+                continue;
+
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                search_remove_tree(path);
+            else
+                search_update(path);
+        }
+    }
+
+    search_compact();
+}
+
+/**
+ * return 1 if the entry id matches the search of message or 0 if not
+ */
+static int search_match(const struct search_message *message, int id)
+{
+    const struct search_entry *entry = &search_entries[id];
+    const char *path;
+    const char *name;
+
+    if (!entry->live ||
+        (SEARCH_FILE == message->type && entry->dir) || (SEARCH_DIR == message->type && !entry->dir) ||
+        (message->min_size >= 0 && entry->size <= message->min_size) ||
+        (message->max_size >= 0 && entry->size >= message->max_size) ||
+        (message->min_mtime >= 0 && entry->mtime <= message->min_mtime) ||
+        (message->max_mtime >= 0 && entry->mtime >= message->max_mtime))
+        return 0;
+
+    if ('\0' == message->text[0])
+        return 1;
+
+    path = search_paths + entry->path;
+
+    if (!message->glob)
+        return strstr(path, message->text) != NULL;
+
+    /* a pattern without '/' is matched against the last name only */
+    name = strrchr(path, '/');
+    if (strchr(message->text, '/') || !name)
+        name = path;
+    else
+        name++;
+
+    return 0 == fnmatch(message->text, name, 0);
+}
+
+static int search_compare_postings(const void *a, const void *b)
+{
+    return (*(const struct search_posting **)a)->count - (*(const struct search_posting **)b)->count;
+}
+
+/**
+ * write the results of the search of message to out
+ */
+static void search_run(const struct search_message *message, FILE *out)
+{
+    struct search_posting **lists;
+    const char *text = message->text;
+    int list_count;
+    int *candidates;
+    int candidate_count;
+    int results;
+    int length;
+    int slot;
+    int i;
+    int j;
+    int k;
+    int n;
+
+    length = strlen(text);
+    lists = malloc((length + 1) * sizeof(struct search_posting *));
+    if (!lists)
+        return;
+
+    /* the trigrams of the runs of literal characters of the pattern */
+    list_count = 0;
+    for (i = 0; i < length; i = j + 1)
+    {
+        for (j = i; j < length && !(message->glob && strchr("*?[]\\", text[j])); j++)
+            ;
+
+        for (k = i; k + 3 <= j; k++)
+        {
+            slot = search_posting_capacity ? search_posting_slot(search_trigram(text + k)) : 0;
+
+            /* a trigram no path has, nothing can match */
+            if (0 == search_posting_capacity || !search_postings[slot].trigram)
+            {
+                free(lists);
+                fprintf(out, "no match\n");
+                return;
+            }
+
+            lists[list_count++] = &search_postings[slot];
+        }
+
+        /* the inside of a [] class is not literal */
+        if (message->glob && j < length && '[' == text[j])
+        {
+            for (j++; j < length && text[j] != ']'; j++)
+                ;
+        }
+    }
+
+    candidates = NULL;
+    candidate_count = search_entry_count;
+
+    if (list_count > 0)
+    {
+        qsort(lists, list_count, sizeof(struct search_posting *), search_compare_postings);
+
+        candidates = malloc(lists[0]->count * sizeof(int));
+        if (!candidates)
+        {
+            free(lists);
+            return;
+        }
+
+        memcpy(candidates, lists[0]->ids, lists[0]->count * sizeof(int));
+        candidate_count = lists[0]->count;
+
+        for (i = 1; i < list_count && candidate_count > 0; i++)
+        {
+            for (j = k = n = 0; j < candidate_count && k < lists[i]->count;)
+            {
+                if (candidates[j] < lists[i]->ids[k])
+                    j++;
+                else if (candidates[j] > lists[i]->ids[k])
+                    k++;
+                else
+                {
+                    candidates[n++] = candidates[j];
+                    j++;
+                    k++;
+                }
+            }
+            candidate_count = n;
+        }
+    }
+
+    results = 0;
+    for (i = 0; i < candidate_count; i++)
+    {
+        n = candidates ? candidates[i] : i;
+
+        if (!search_match(message, n))
+            continue;
+
+        if (results == SEARCH_MAX_RESULTS)
+        {
+            fprintf(out, "more than %d matches, only the first are shown\n", SEARCH_MAX_RESULTS);
+            break;
+        }
+
+        fprintf(out, "/%s%s\t%lld\n", search_paths + search_entries[n].path,
+                search_entries[n].dir ? "/" : "", search_entries[n].size);
+        results++;
+    }
+
+    if (0 == results)
+        fprintf(out, "no match\n");
+
+    free(candidates);
+    free(lists);
+}
+
+/**
+ * answer a search of a session with the memfd of its results
+ */
+static void search_answer(int sockfd, struct search_message *message)
+{
+    char *text;
+    size_t size;
+    FILE *out;
+    int fd;
+
+    text = NULL;
+    out = open_memstream(&text, &size);
+    if (!out)
+        return;
+
+    search_run(message, out);
+    fclose(out);
+
+    fd = memfd_create("search", MFD_CLOEXEC);
+
+    message->status = -1;
+    if (fd >= 0 && write(fd, text, size) == (ssize_t)size)
+        message->status = 0;
+
+    search_send_message(sockfd, message, message->status < 0 ? -1 : fd, MSG_DONTWAIT);
+
+    if (fd >= 0)
+        close(fd);
+    free(text);
+}
+
+/**
+ * handle a message from the session on sockfd, fd was passed with it
+ */
+static void search_request(int sockfd, struct search_client *client, struct search_message *message, int fd)
+{
+    if (fd >= 0)
+        close(fd);
+
+    /* a path from a session never leaves the root */
+    if ((SEARCH_UPDATE == message->op || SEARCH_SUBSCRIBE == message->op) &&
+        ('/' == message->text[0] || strstr(message->text, "..")))
+        return;
+
+    if (SEARCH_UPDATE == message->op)
+    {
+        search_update(message->text);
+        search_compact();
+    }
+    else if (SEARCH_QUERY == message->op)
+    {
+        search_answer(sockfd, message);
+    }
+    else if (SEARCH_SUBSCRIBE == message->op)
+    {
+        free(client->prefix);
+        client->prefix = strdup(message->text);
+        client->subscribed = client->prefix != NULL;
+        client->next_seq = message->seq > 0 ? message->seq + 1 : search_next_seq;
+    }
+}
+
+/**
+ * return 1 if path is prefix or under it or 0 if not
+ */
+static int search_under(const char *path, const char *prefix)
+{
+    size_t length = strlen(prefix);
+
+    return 0 == length || (0 == strncmp(path, prefix, length) && ('\0' == path[length] || '/' == path[length]));
+}
+
+/**
+ * push the events client has not seen on sockfd until it would block
+ * return 1 if all are pushed, 0 if it would block or -1 if error
+ */
+static int search_deliver(int sockfd, struct search_client *client)
+{
+    struct search_message message;
+    struct search_event *event;
+    long long oldest;
+
+    oldest = search_next_seq - SEARCH_EVENTS > search_first_seq ? search_next_seq - SEARCH_EVENTS : search_first_seq;
+
+    while (client->next_seq < search_next_seq)
+    {
+        memset(&message, 0, sizeof(message));
+        message.op = SEARCH_EVENT;
+
+        /* too far behind or ahead, the ring no longer has what it missed */
+        if (client->next_seq < oldest || client->next_seq > search_next_seq)
+        {
+            message.seq = oldest - 1;
+            message.event = SEARCH_RESET;
+            message.dir = 1;
+            message.mtime = time(NULL);
+        }
+        else
+        {
+            event = &search_events[client->next_seq % SEARCH_EVENTS];
+
+            if (!search_under(event->path, client->prefix) && event->type != SEARCH_RESET)
+            {
+                client->next_seq++;
+                continue;
+            }
+
+            message.seq = event->seq;
+            message.event = event->type;
+            message.dir = event->dir;
+            message.size = event->size;
+            message.mtime = event->mtime;
+            snprintf(message.text, PATH_MAX, "%s", event->path);
+        }
+
+        if (search_send_message(sockfd, &message, -1, MSG_DONTWAIT) < 0)
+            return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+
+        client->next_seq = message.seq + 1;
+    }
+
+    return 1;
+}
+
+/**
+ * the loop of the indexer, it never returns
+ */
+static void search_serve(int listen_sockfd)
+{
+    struct search_message message;
+    struct search_client *clients;
+    struct pollfd *pollfds;
+    void *more;
+    int capacity;
+    int count;
+    int status;
+    int fd;
+    int i;
+
+    capacity = 64;
+    pollfds = malloc(capacity * sizeof(struct pollfd));
+    clients = calloc(capacity, sizeof(struct search_client));
+    if (!pollfds || !clients)
+        exit(1);
+
+    /* from the clock, a restarted indexer never numbers an event twice */
+    search_first_seq = search_next_seq = (long long)time(NULL) * 1000000;
+
+    search_rebuild();
+
+    pollfds[0].fd = listen_sockfd;
+    pollfds[0].events = POLLIN;
+    pollfds[1].events = POLLIN;
+    count = 2;
+
+    while (1)
+    {
+        pollfds[1].fd = search_inotify_fd;
+
+        if (poll(pollfds, count, -1) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            perror("poll() error");
+            exit(1);
+        }
+
+        if (pollfds[1].revents & POLLIN)
+            search_handle_events();
+
+        for (i = 2; i < count; i++)
+        {
+            if (!(pollfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            if (search_recv_message(pollfds[i].fd, &message, &fd) < 0)
+                clients[i].closed = 1;
+            else
+                search_request(pollfds[i].fd, &clients[i], &message, fd);
+        }
+
+        /* after all the requests, so every subscriber has the events they made */
+        for (i = count - 1; i >= 2; i--)
+        {
+            status = clients[i].closed ? -1 : 1;
+
+            if (status > 0 && clients[i].subscribed)
+                status = search_deliver(pollfds[i].fd, &clients[i]);
+
+            if (status < 0)
+            {
+                close(pollfds[i].fd);
+                free(clients[i].prefix);
+                count--;
+                pollfds[i] = pollfds[count];
+                clients[i] = clients[count];
+                memset(&clients[count], 0, sizeof(struct search_client));
+                continue;
+            }
+
+            /* a subscriber that would block is pushed to when it drains */
+            pollfds[i].events = 0 == status ? POLLIN | POLLOUT : POLLIN;
+        }
+
+        if (pollfds[0].revents & POLLIN)
+        {
+            fd = accept4(listen_sockfd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+
+            if (count == capacity)
+            {
+                more = realloc(pollfds, 2 * capacity * sizeof(struct pollfd));
+                if (more)
+                    pollfds = more;
+                more = more ? realloc(clients, 2 * capacity * sizeof(struct search_client)) : NULL;
+                if (!more)
+                {
+                    close(fd);
+                    continue;
+                }
+                clients = more;
+                memset(&clients[capacity], 0, capacity * sizeof(struct search_client));
+                capacity *= 2;
+            }
+
+            pollfds[count].fd = fd;
+            pollfds[count].events = POLLIN;
+            count++;
+        }
+    }
+}
+
+int search_start(const char *root)
+{
+    int listen_sockfd;
+    pid_t pid;
+
+    if (!realpath(root, search_root))
+    {
+        perror("realpath() error");
+        return -1;
+    }
+
+    search_root_length = strlen(search_root);
+
+    /* an abstract address, nothing is left in the filesystem */
+    memset(&search_address, 0, sizeof(search_address));
+    search_address.sun_family = AF_UNIX;
+    snprintf(search_address.sun_path + 1, sizeof(search_address.sun_path) - 1, "ftp-search-%d", (int)getpid());
+    search_address_length = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(search_address.sun_path + 1);
+
+    listen_sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_sockfd < 0)
+    {
+        perror("socket() error");
+        return -1;
+    }
+
+    if (bind(listen_sockfd, (struct sockaddr *)&search_address, search_address_length) < 0 ||
+        listen(listen_sockfd, 64) < 0)
+    {
+        perror("bind() error");
+        close(listen_sockfd);
+        return -1;
+    }
+
+    pid = fork();
+
+    if (0 == pid)
+    {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_IGN);
+        log_after_fork();
+        search_serve(listen_sockfd);
+    }
+
+    close(listen_sockfd);
+
+    if (pid < 0)
+    {
+        perror("fork() error");
+        return -1;
+    }
+
+    search_pid = pid;
+    search_started = time(NULL);
+
+    return 0;
+}
+
+int search_exited(pid_t pid, int status)
+{
+    char root[PATH_MAX];
+
+    if (pid != search_pid)
+        return 0;
+
+    search_pid = -1;
+
+    if (WIFSIGNALED(status))
+        log_error("the indexer was killed by signal %d.", WTERMSIG(status));
+    else
+        log_error("the indexer exited with status %d.", WEXITSTATUS(status));
+
+    if (time(NULL) - search_started < SEARCH_RESTART_SECONDS)
+    {
+        log_error("the indexer died right after its start, SRCH and SUBS fail from now on.");
+        return 1;
+    }
+
+    /* search_start() resolves the root into search_root again */
+    snprintf(root, sizeof(root), "%s", search_root);
+    if (search_start(root) < 0)
+        error_handling("search_start() error");
+    else
+        log_info("the indexer is started again.");
+
+    return 1;
+}
+
+/**
+ * connect the session to the indexer once
+ * return 0 if success or -1 if error
+ */
+static int search_connect(void)
+{
+    struct timeval timeout;
+
+    if (search_sockfd >= 0)
+        return 0;
+
+    if (0 == search_root_length)
+        return -1;
+
+    search_sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (search_sockfd < 0)
+        return -1;
+
+    timeout.tv_sec = SEARCH_TIMEOUT_MS / 1000;
+    timeout.tv_usec = SEARCH_TIMEOUT_MS % 1000 * 1000;
+    setsockopt(search_sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(search_sockfd, (struct sockaddr *)&search_address, search_address_length) < 0)
+    {
+        close(search_sockfd);
+        search_sockfd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * write name, relative to the work directory, as a path relative to the
+ * root into path, "" being the root itself
+ * return 0 if success or -1 if it is out of the root
+ */
+static int search_relative(const char *name, char *path)
+{
+    char cwd[PATH_MAX];
+    const char *base;
+
+    if (!getcwd(cwd, PATH_MAX))
+        return -1;
+
+    /* a work directory out of the root has nothing indexed */
+    if (strncmp(cwd, search_root, search_root_length) != 0 ||
+        (cwd[search_root_length] != '/' && cwd[search_root_length] != '\0'))
+        return -1;
+
+    base = cwd + search_root_length + (cwd[search_root_length] ? 1 : 0);
+
+    if ('\0' == name[0])
+        return snprintf(path, PATH_MAX, "%s", base) < PATH_MAX ? 0 : -1;
+
+    if (snprintf(path, PATH_MAX, "%s%s%s", base, base[0] ? "/" : "", name) >= PATH_MAX)
+        return -1;
+
+    return 0;
+}
+
+void search_notify(const char *name)
+{
+    struct search_message message;
+
+    if (search_connect() < 0)
+        return;
+
+    memset(&message, 0, sizeof(message));
+    message.op = SEARCH_UPDATE;
+
+    if (search_relative(name, message.text) < 0)
+        return;
+
+    /* inotify sees it too if the indexer is too busy to take the note */
+    search_send_message(search_sockfd, &message, -1, MSG_DONTWAIT);
+}
+
+int search_parse(const char *arg, struct search_message *message)
+{
+    char buffer[PATH_MAX];
+    char *token;
+    char *save;
+    long long value;
+
+    memset(message, 0, sizeof(*message));
+    message->op = SEARCH_QUERY;
+    message->type = SEARCH_ANY;
+    message->min_size = message->max_size = -1;
+    message->min_mtime = message->max_mtime = -1;
+
+    snprintf(buffer, PATH_MAX, "%s", arg);
+
+    for (token = strtok_r(buffer, " \t\n", &save); token; token = strtok_r(NULL, " \t\n", &save))
+    {
+        if (0 == strncmp(token, "size>", 5) || 0 == strncmp(token, "size<", 5))
+        {
+            value = parse_size(token + 5);
+            if (value < 0)
+                return -1;
+            if ('>' == token[4])
+                message->min_size = value;
+            else
+                message->max_size = value;
+        }
+        else if (0 == strncmp(token, "mtime>", 6) || 0 == strncmp(token, "mtime<", 6))
+        {
+            value = atoll(token + 6);
+            if ('-' == token[6])
+                value += time(NULL);
+            if (value < 0)
+                return -1;
+            if ('>' == token[5])
+                message->min_mtime = value;
+            else
+                message->max_mtime = value;
+        }
+        else if (0 == strcmp(token, "type:f") || 0 == strcmp(token, "type:d"))
+        {
+            message->type = 'f' == token[5] ? SEARCH_FILE : SEARCH_DIR;
+        }
+        else if ('\0' == message->text[0])
+        {
+            strcpy(message->text, token);
+            message->glob = strpbrk(token, "*?[") != NULL;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int search_query(struct search_message *message)
+{
+    int fd;
+
+    if (search_connect() < 0)
+        return -1;
+
+    if (search_send_message(search_sockfd, message, -1, 0) < 0 ||
+        search_recv_message(search_sockfd, message, &fd) < 0)
+    {
+        /* a late answer must not be taken for the next one */
+        close(search_sockfd);
+        search_sockfd = -1;
+        return -1;
+    }
+
+    if (message->status < 0 || fd < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int search_subscribe(const char *name, long long seq)
+{
+    struct search_message message;
+    size_t length;
+
+    if (search_connect() < 0)
+        return -1;
+
+    memset(&message, 0, sizeof(message));
+    message.op = SEARCH_SUBSCRIBE;
+    message.seq = seq;
+
+    if (0 == strcmp(name, "."))
+        name = "";
+
+    if (search_relative(name, message.text) < 0)
+        return -1;
+
+    length = strlen(message.text);
+    while (length > 0 && '/' == message.text[length - 1])
+        message.text[--length] = '\0';
+
+    if (search_send_message(search_sockfd, &message, -1, 0) < 0)
+    {
+        search_unsubscribe();
+        return -1;
+    }
+
+    return search_sockfd;
+}
+
+int search_recv_event(struct search_message *message)
+{
+    int fd;
+
+    if (search_recv_message(search_sockfd, message, &fd) < 0)
+        return -1;
+
+    if (fd >= 0)
+        close(fd);
+
+    return SEARCH_EVENT == message->op ? 0 : -1;
+}
+
+void search_unsubscribe(void)
+{
+    if (search_sockfd >= 0)
+        close(search_sockfd);
+    search_sockfd = -1;
+}
+
+#endif
@@ -4,87 +4,830 @@
  */
 
 #include "server.h"
+#include "admission.h"
+#include "commands.h"
+#include "upgrade.h"
+
+/**
+ * what the handlers of the commands of a session work on
+ */
+struct session_context
+{
+    struct control_reader *reader;
+    int command_sockfd;
+    int data_sockfd; /* the data connection of a COMMAND_DATA command */
+    int data_port;
+    char *arg;
+    int previous; /* the id of the command before, -1 if unknown */
+    char rename_from[PATH_MAX]; /* the source named by RNFR */
+};
+
+/**
+ * handle a command of session, a COMMAND_DATA one on its data connection
+ * once the 125 is sent
+ * return the code to reply, 0 if it replied or -1 if the session ends
+ */
+typedef int (*command_handler)(struct session_context *session);
+
+struct command_handlers
+{
+    command_handler run;
+    command_handler shortcut; /* replies without a data connection if it can, 1 if it did */
+};
 
 /**
  * open a new process to deal with a client's request
  */
 int child_process(int command_sockfd);
 
+/**
+ * run the handler of the command of id in session and send its reply
+ * return 0 if success or -1 if the session ends
+ */
+int command_dispatch(struct session_context *session, int id);
+
+/**
+ * open a data connection and run handler on it
+ * return the code of handler to reply or -1 if error
+ */
+int data_command(struct session_context *session, command_handler handler);
+
+/**
+ * print the usage of server in stderr
+ */
+void usage(void);
+
+/**
+ * wake poll() when a child exits so that it is reaped at once
+ */
+void sigchld_handler(int signo);
+
+/**
+ * the pipe sigchld_handler() and SIGUSR2 write a byte on, polled by the
+ * main loop so a signal after its checks and before poll() is not missed
+ */
+static int wake_fds[2] = {-1, -1};
+
 int main(int argc, char *argv[])
 {
     int cmd_listen_sockfd, command_sockfd;
+    int inherited_sockfd;
+    int ready_fd = -1;
+    int draining = 0;
     int port;
     int pid;
     int result;
+    int opt;
+    int slot;
+    int i;
+
+    struct sockaddr_in address;
+    struct pollfd listen_pollfds[4];
+    char wake_bytes[64];
+    struct sigaction action;
+
+    int backlog = DEFAULT_LISTEN_BACKLOG;
+    int max_sessions = DEFAULT_MAX_SESSIONS;
+    int max_per_ip = 0;
+    char *metrics_path = NULL;
+    char *log_level_name = NULL;
+    char *log_path = NULL;
+    int metrics_sockfd = -1;
+
+    long long global_rate = 0;
+    long long user_rate = 0;
+    long long session_rate = 0;
+    long long reserve = 0;
+    long long cache_size = CACHE_DEFAULT_SIZE;
+    long long quota = 0;
+    char *usage_path = USAGE_DEFAULT_PATH;
+    char *storage_spec = "posix";
+    char *tls_path = NULL;
+    int search = 1;
+
+    if (command_registry_check() < 0)
+        exit(1);
+
+    while ((opt = getopt(argc, argv, "g:u:s:r:b:m:i:M:l:L:C:I:Q:X:D:S:T:n")) != -1)
+    {
+        switch (opt)
+        {
+        case 'g':
+            global_rate = parse_size(optarg);
+            break;
+        case 'u':
+            user_rate = parse_size(optarg);
+            break;
+        case 's':
+            session_rate = parse_size(optarg);
+            break;
+        case 'r':
+            reserve = parse_size(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'm':
+            max_sessions = atoi(optarg);
+            break;
+        case 'i':
+            max_per_ip = atoi(optarg);
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'l':
+            log_level_name = optarg;
+            break;
+        case 'L':
+            log_path = optarg;
+            break;
+        case 'C':
+            cache_size = parse_size(optarg);
+            break;
+        case 'I':
+            inline_max = parse_size(optarg);
+            if (inline_max < 0 || inline_max > INLINE_LIMIT)
+            {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'Q':
+            quota = parse_size(optarg);
+            break;
+        case 'D':
+            direct_min = parse_size(optarg);
+            if (direct_min < 0)
+            {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'X':
+            usage_path = optarg;
+            break;
+        case 'S':
+            storage_spec = optarg;
+            break;
+        case 'T':
+            tls_path = optarg;
+            break;
+        case 'n':
+            search = 0;
+            break;
+        default:
+            usage();
+            exit(1);
+        }
+    }
 
-    if (argc != 2)
+    if (optind != argc - 1)
     {
-        error_handling("command port number should be the only argument");
+        usage();
         exit(1);
     }
 
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
+
+    result = pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC);
+    if (result < 0)
+    {
+        perror("pipe2() error");
+        exit(1);
+    }
+
+    inherited_sockfd = upgrade_initialize(argv, wake_fds[1]);
+    if (-2 == inherited_sockfd)
+        exit(1);
+
+    result = log_initialize(log_level_name, log_path);
+    if (result < 0)
+    {
+        usage();
+        exit(1);
+    }
+
+    result = trace_initialize("server");
+    if (result < 0)
+    {
+        error_handling("trace_initialize() error");
+        exit(1);
+    }
+
+    result = rate_limit_initialize(global_rate, user_rate, session_rate, reserve, max_sessions);
+    if (result < 0)
+    {
+        usage();
+        exit(1);
+    }
+
+    result = admission_initialize(max_sessions, max_per_ip);
+    if (result < 0)
+    {
+        usage();
+        exit(1);
+    }
+
+    result = metrics_initialize(max_sessions);
+    if (result < 0)
+    {
+        error_handling("metrics_initialize() error");
+        exit(1);
+    }
+
+    /* before the sessions fork, they all share the certificate */
+    result = tls_path ? tls_server_initialize(tls_path) : 0;
+    if (result < 0)
+    {
+        usage();
+        exit(1);
+    }
+
+    result = storage_initialize(storage_spec, DEFAULT_SERVER_WORK_DIR);
+    if (result < 0)
+    {
+        usage();
+        exit(1);
+    }
+
+    /* the cache, the usage index and the indexer know only the disk */
+    if (!storage->fds)
+    {
+        if (quota > 0)
+        {
+            error_handling("-Q needs the posix storage");
+            exit(1);
+        }
+
+        cache_size = 0;
+        search = 0;
+    }
+
+    result = cache_initialize(cache_size, max_sessions);
+    if (result < 0)
+    {
+        usage();
+        exit(1);
+    }
+
+    result = storage->fds ? usage_initialize(usage_path, quota, inherited_sockfd >= 0) : 0;
+    if (result < 0)
+    {
+        usage();
+        exit(1);
+    }
 
-    cmd_listen_sockfd = server_socket_initialize(port);
+    if (search)
+    {
+        result = search_start(DEFAULT_SERVER_WORK_DIR);
+        if (result < 0)
+        {
+            error_handling("search_start() error");
+            exit(1);
+        }
+    }
+
+    if (metrics_path)
+    {
+        metrics_sockfd = metrics_listen(metrics_path);
+        if (metrics_sockfd < 0)
+        {
+            error_handling("metrics_listen() error");
+            exit(1);
+        }
+    }
+
+    /* after an upgrade the socket of the old server, nothing is refused meanwhile */
+    if (inherited_sockfd >= 0)
+        cmd_listen_sockfd = inherited_sockfd;
+    else
+        cmd_listen_sockfd = server_socket_initialize(port, backlog);
     if (cmd_listen_sockfd < 0)
     {
         error_handling("server_socket_initialize() error");
         exit(1);
     }
 
+    result = fcntl(cmd_listen_sockfd, F_SETFL, O_NONBLOCK);
+    if (result < 0)
+    {
+        close(cmd_listen_sockfd);
+        perror("fcntl() error");
+        exit(1);
+    }
+
+    /* a client vanishing must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* no SA_RESTART, an exited child interrupts poll() to be reaped */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
+    listen_pollfds[0].fd = cmd_listen_sockfd;
+    listen_pollfds[0].events = POLLIN;
+    listen_pollfds[1].fd = metrics_sockfd;
+    listen_pollfds[1].events = POLLIN;
+    listen_pollfds[2].fd = -1;
+    listen_pollfds[2].events = POLLIN;
+    listen_pollfds[3].fd = wake_fds[0];
+    listen_pollfds[3].events = POLLIN;
+
+    upgrade_ready();
+
     while (1)
     {
-        command_sockfd = server_socket_accept(cmd_listen_sockfd);
-        if (command_sockfd < 0)
+        admission_reap();
+
+        /* handed over, the old server ends with its last session */
+        if (draining && 0 == admission_active)
+            break;
+
+        if (upgrade_requested)
+        {
+            upgrade_requested = 0;
+            if (ready_fd < 0 && !draining)
+                ready_fd = upgrade_start(cmd_listen_sockfd);
+            listen_pollfds[2].fd = ready_fd;
+        }
+
+        /* the negative fds of a closed socket or of no upgrade are ignored */
+        result = poll(listen_pollfds, 4, -1);
+        if (result < 0)
         {
-            close(cmd_listen_sockfd);
-            error_handling("server_socket_accept() error");
+            if (EINTR == errno)
+                continue;
+
+            if (cmd_listen_sockfd >= 0)
+                close(cmd_listen_sockfd);
+            perror("poll() error");
             exit(1);
         }
 
-        pid = fork();
+        /* the children are reaped and the upgrade started at the top of the loop */
+        if (listen_pollfds[3].revents & POLLIN)
+        {
+            while (read(wake_fds[0], wake_bytes, sizeof(wake_bytes)) > 0)
+                ;
+        }
+
+        if (metrics_sockfd >= 0 && (listen_pollfds[1].revents & POLLIN))
+            metrics_serve(metrics_sockfd);
 
-        if (0 == pid)
+        if (ready_fd >= 0 && listen_pollfds[2].revents)
         {
-            close(cmd_listen_sockfd);
-            result = child_process(command_sockfd);
-            close(command_sockfd);
-            if (result < 0)
+            if (upgrade_finish(ready_fd))
             {
-                error_handling("child_process() error");
-                exit(1);
+                log_info("the new server accepts the connections, %d sessions left.", admission_active);
+
+                /* the new server owns the metrics path too */
+                close(cmd_listen_sockfd);
+                if (metrics_sockfd >= 0)
+                    close(metrics_sockfd);
+                cmd_listen_sockfd = metrics_sockfd = -1;
+                listen_pollfds[0].fd = listen_pollfds[1].fd = -1;
+                draining = 1;
+            }
+            else
+            {
+                log_error("the upgrade failed, the server goes on.");
             }
 
-            exit(0);
+            ready_fd = -1;
+            listen_pollfds[2].fd = -1;
         }
-        else if (pid < 0)
+
+        for (i = 0; !draining && i < ACCEPT_BATCH; i++)
         {
-            perror("fork() error");
-            exit(1);
-        }
+            command_sockfd = admission_accept(cmd_listen_sockfd, &address);
+            if (command_sockfd < 0)
+                break;
+
+            slot = admission_reserve(&address);
+            if (slot < 0)
+            {
+                log_info("connection from %s rejected.", inet_ntoa(address.sin_addr));
+                metrics_rejected();
+                admission_reject(command_sockfd);
+                continue;
+            }
+
+            pid = fork();
+
+            if (0 == pid)
+            {
+                close(cmd_listen_sockfd);
+                if (metrics_sockfd >= 0)
+                    close(metrics_sockfd);
+                signal(SIGCHLD, SIG_DFL);
+                close(wake_fds[0]);
+                close(wake_fds[1]);
+                log_after_fork();
+                trace_after_fork();
+                metrics_session_begin(slot);
+                cache_session_begin(slot);
+                rate_limit_session_slot(slot);
+
+                /* wrapped in the session, so no other session inherits its relay */
+                command_sockfd = netem_wrap(command_sockfd);
+                if (command_sockfd < 0)
+                    exit(1);
+
+                result = child_process(command_sockfd);
+                close(command_sockfd);
+                if (result < 0)
+                {
+                    error_handling("child_process() error");
+                    exit(1);
+                }
 
-        close(command_sockfd);
+                exit(0);
+            }
+            else if (pid < 0)
+            {
+                perror("fork() error");
+                admission_release(slot, -1);
+                metrics_rejected();
+                admission_reject(command_sockfd);
+                continue;
+            }
+
+            admission_commit(slot, pid);
+            close(command_sockfd);
+        }
     }
 
-    close(cmd_listen_sockfd);
+    log_info("the last session ended, the old server exits.");
+
     exit(0);
 }
 
-int child_process(int command_sockfd)
+void sigchld_handler(int signo)
 {
-    int data_listen_sockfd, data_sockfd;
+    int saved_errno;
 
-    int data_port;
+    (void)signo;
+
+    saved_errno = errno;
+    if (write(wake_fds[1], "", 1) < 0)
+    {
+        /* the pipe is full, the loop wakes anyway */
+    }
+    errno = saved_errno;
+}
+
+void usage(void)
+{
+    error_handling("usage: ./server [options] port\n"
+                   "  -g rate  bandwidth of the whole server in bytes/s (k, m, g suffixes)\n"
+                   "  -u rate  bandwidth of each user\n"
+                   "  -s rate  bandwidth of each session\n"
+                   "  -r rate  part of the global bandwidth reserved for interactive transfers\n"
+                   "  -b num   listen() backlog of the command port\n"
+                   "  -m num   sessions served at the same time\n"
+                   "  -i num   sessions of one IP address at the same time (0 no limit)\n"
+                   "  -M path  serve the metrics in Prometheus text format on a unix socket\n"
+                   "  -l level log level: debug, info, warn, error or off\n"
+                   "  -L path  append the JSON log lines to path instead of stdout\n"
+                   "  -C size  memory of the hot-file cache of RETR shared by the sessions (0 disables)\n"
+                   "  -I size  largest file RETR sends in its reply after OPTS INLINE (0 disables)\n"
+                   "  -D size  smallest file kept out of the page cache by RETR and STOR, 256m by default (0 never)\n"
+                   "  -Q size  disk quota of each user, STOR is refused with 552 over it\n"
+                   "  -X path  the persistent disk usage index (" USAGE_DEFAULT_PATH ")\n"
+                   "  -S spec  where the files are: posix, the work directory, or memory[:size] loaded from it (1g)\n"
+                   "  -T path  offer TLS after OPTS TLS with the certificate and key in the PEM file path\n"
+                   "  -n       do not index the files, SRCH and SUBS are refused\n"
+                   "SIGUSR2 execs the binary again on the same listening socket, the sessions finish");
+}
+
+/**
+ * the reply of a change of the files that returned result, 0 if done
+ */
+static int command_reply(int result, const char *error)
+{
+    if (result < 0)
+    {
+        error_handling(error);
+        return -1;
+    }
+
+    return 0 == result ? 120 : 502;
+}
+
+/**
+ * the reply of a transfer that returned result, 0 if done
+ */
+static int transfer_reply(int result, const char *error)
+{
+    if (result < 0)
+    {
+        error_handling(error);
+        return -1;
+    }
+
+    return 226;
+}
+
+static int handle_list(struct session_context *session)
+{
+    return transfer_reply(send_list(session->data_sockfd), "send_list() error");
+}
+
+static int handle_retr(struct session_context *session)
+{
+    return transfer_reply(send_file(session->data_sockfd, session->arg), "send_file() error");
+}
+
+/**
+ * send a small file in the reply after OPTS_INLINE
+ */
+static int handle_retr_inline(struct session_context *session)
+{
     int result;
 
+    if (!inline_enabled)
+        return 0;
+
+    result = send_inline_file(session->command_sockfd, session->arg);
+    if (result < 0)
+        error_handling("send_inline_file() error");
+
+    return result;
+}
+
+static int handle_stor(struct session_context *session)
+{
+    return transfer_reply(recv_file(session->data_sockfd, session->arg), "recv_file() error");
+}
+
+static int handle_stat(struct session_context *session)
+{
+    return transfer_reply(send_stat(session->data_sockfd), "send_stat() error");
+}
+
+static int handle_srch(struct session_context *session)
+{
+    return transfer_reply(send_search(session->data_sockfd, session->arg), "send_search() error");
+}
+
+static int handle_subs(struct session_context *session)
+{
+    return transfer_reply(send_events(session->command_sockfd, session->data_sockfd, session->arg),
+                          "send_events() error");
+}
+
+static int handle_appe(struct session_context *session)
+{
+    return command_reply(create_file(session->arg), "create_file() error");
+}
+
+static int handle_dele(struct session_context *session)
+{
+    return command_reply(delete_file(session->arg), "delete_file() error");
+}
+
+static int handle_mkd(struct session_context *session)
+{
+    return command_reply(make_directory(session->arg), "make_directory() error");
+}
+
+static int handle_rmd(struct session_context *session)
+{
+    return command_reply(remove_directory(session->arg), "remove_directory() error");
+}
+
+static int handle_cwd(struct session_context *session)
+{
+    return command_reply(change_work_directory(session->arg), "change_work_directory() error");
+}
+
+static int handle_rnfr(struct session_context *session)
+{
+    if (check_source(session->arg) != 0)
+    {
+        session->rename_from[0] = '\0';
+        return 502;
+    }
+
+    snprintf(session->rename_from, PATH_MAX, "%s", session->arg);
+
+    return 350;
+}
+
+/**
+ * RNTO and COPY, the source is the name of the RNFR right before
+ */
+static int handle_rnto(struct session_context *session)
+{
+    if (session->previous != COMMAND_RNFR || '\0' == session->rename_from[0])
+        return 502;
+
+    return 0 == rename_file(session->rename_from, session->arg) ? 120 : 502;
+}
+
+static int handle_copy(struct session_context *session)
+{
+    if (session->previous != COMMAND_RNFR || '\0' == session->rename_from[0])
+        return 502;
+
+    return 0 == copy_file(session->rename_from, session->arg) ? 120 : 502;
+}
+
+static int handle_dusg(struct session_context *session)
+{
+    if (send_usage(session->command_sockfd) < 0)
+    {
+        error_handling("send_usage() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int handle_opts(struct session_context *session)
+{
+    if (handle_options(session->reader, session->arg) < 0)
+    {
+        error_handling("handle_options() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int handle_quit(struct session_context *session)
+{
+    (void)session;
+    return 221;
+}
+
+/**
+ * the handlers by the ids of commands.h, a command without one gets 502
+ */
+static const struct command_handlers command_handlers[COMMAND_COUNT] = {
+    [COMMAND_LIST] = {handle_list, NULL},
+    [COMMAND_RETR] = {handle_retr, handle_retr_inline},
+    [COMMAND_STOR] = {handle_stor, NULL},
+    [COMMAND_STAT] = {handle_stat, NULL},
+    [COMMAND_SRCH] = {handle_srch, NULL},
+    [COMMAND_SUBS] = {handle_subs, NULL},
+    [COMMAND_APPE] = {handle_appe, NULL},
+    [COMMAND_DELE] = {handle_dele, NULL},
+    [COMMAND_MKD] = {handle_mkd, NULL},
+    [COMMAND_RMD] = {handle_rmd, NULL},
+    [COMMAND_CWD] = {handle_cwd, NULL},
+    [COMMAND_RNFR] = {handle_rnfr, NULL},
+    [COMMAND_RNTO] = {handle_rnto, NULL},
+    [COMMAND_COPY] = {handle_copy, NULL},
+    [COMMAND_DUSG] = {handle_dusg, NULL},
+    [COMMAND_OPTS] = {handle_opts, NULL},
+    [COMMAND_QUIT] = {handle_quit, NULL},
+};
+
+int command_dispatch(struct session_context *session, int id)
+{
+    int flags;
+    int code;
+
+    flags = id >= 0 ? command_specs[id].flags : 0;
+
+    if (id < 0 || !command_handlers[id].run || ((flags & COMMAND_SEARCH) && 0 == search_root_length))
+        code = 502;
+    else if ((flags & COMMAND_QUOTA) && usage_over_quota())
+        code = 552;
+    else if (command_handlers[id].shortcut && (code = command_handlers[id].shortcut(session)) != 0)
+        code = code < 0 ? -1 : 0; /* answered on the command connection */
+    else if (flags & COMMAND_DATA)
+        code = data_command(session, command_handlers[id].run);
+    else
+        code = command_handlers[id].run(session);
+
+    if (code <= 0)
+        return code;
+
+    if (send_code(session->command_sockfd, code) < 0)
+    {
+        error_handling("send_code() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int data_command(struct session_context *session, command_handler handler)
+{
+    int data_listen_sockfd;
+    int result;
+
+    long long phase_start;
+
+    result = send_code(session->command_sockfd, 120);
+    if (result < 0)
+    {
+        error_handling("send_code() error");
+        return -1;
+    }
+
+    phase_start = monotonic_ns();
+
+    data_listen_sockfd = data_socket_initialize(&session->data_port);
+    if (data_listen_sockfd < 0)
+    {
+        error_handling("data_socket_initialize() error");
+        return -1;
+    }
+
+    result = send_data_port(session->command_sockfd, session->data_port);
+    if (result < 0)
+    {
+        close(data_listen_sockfd);
+        error_handling("send_data_port() error");
+        return -1;
+    }
+
+    metrics_phase(METRICS_PORT_SETUP, phase_start);
+    trace_end(TRACE_PORT_SETUP, phase_start, NULL, session->data_port);
+    phase_start = monotonic_ns();
+
+    session->data_sockfd = server_socket_accept(data_listen_sockfd);
+    if (session->data_sockfd < 0)
+    {
+        close(data_listen_sockfd);
+        error_handling("server_socket_accept() error");
+        return -1;
+    }
+
+    /* the handshake resumes the TLS session of the command connection */
+    if (tls_enabled && tls_accept(session->data_sockfd, 1) < 0)
+    {
+        close(session->data_sockfd);
+        close(data_listen_sockfd);
+        error_handling("tls_accept() error");
+        return -1;
+    }
+
+    metrics_phase(METRICS_ACCEPT, phase_start);
+    trace_end(TRACE_DATA_ACCEPT, phase_start, NULL, session->data_port);
+
+    result = send_code(session->command_sockfd, 125);
+    if (result < 0)
+    {
+        close(session->data_sockfd);
+        close(data_listen_sockfd);
+        error_handling("send_code() error");
+        return -1;
+    }
+
+    metrics_transfer_begin();
+
+    result = handler(session);
+    if (result >= 0)
+        metrics_transfer_end();
+
+    /* the peer takes the end of the data for a truncation without it */
+    if (result >= 0 && tls_enabled && tls_close_notify(session->data_sockfd) < 0)
+        result = -1;
+
+    close(session->data_sockfd);
+    close(data_listen_sockfd);
+    session->data_sockfd = -1;
+
+    return result;
+}
+
+int child_process(int command_sockfd)
+{
+    int result;
+    int enable;
+    int id;
+
+    long long command_start;
+    long long session_start;
+
     char user_name[BUF_SIZE];
     char password[BUF_SIZE];
 
-    char command[BUF_SIZE];
-    char cmd[CMD_LEN];
-    char arg[ARG_LEN];
+    /* cmd and arg point into the buffer of reader, no copies are made */
+    struct control_reader reader;
+    char *cmd;
+    char *arg;
+
+    struct session_context session;
+
+    session_start = monotonic_ns();
 
-    result = login(command_sockfd, user_name, password);
+    /*
+     * the codes and the data port are small separate sends, Nagle would hold
+     * one back for the delayed ACK of the client on a session kept warm
+     */
+    enable = 1;
+    setsockopt(command_sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    control_reader_initialize(&reader, command_sockfd);
+
+    result = login(&reader, user_name, password);
     if (result < 0)
     {
         error_handling("login() error");
@@ -95,6 +838,8 @@ int child_process(int command_sockfd)
 
     if (result < 0)
     {
+        metrics_login(user_name + CMD_LEN, 0);
+
         result = send_code(command_sockfd, 430);
         if (result < 0)
         {
@@ -112,10 +857,31 @@ int child_process(int command_sockfd)
         return -1;
     }
 
-    srand((unsigned)time(NULL));
-    data_port = rand() % (DATA_PORT_CEIL - DATA_PORT_FLOOR) + DATA_PORT_FLOOR;
+    metrics_login(user_name + CMD_LEN, 1);
+    trace_end(TRACE_LOGIN, session_start, user_name + CMD_LEN, 0);
 
-    result = chdir(DEFAULT_SERVER_WORK_DIR);
+    result = rate_limit_session_begin(user_name + CMD_LEN);
+    if (result < 0)
+    {
+        error_handling("rate_limit_session_begin() error");
+        return -1;
+    }
+
+    /* a user the index has no room for is served without a quota */
+    result = usage_session_begin(user_name + CMD_LEN);
+    if (result < 0)
+        log_warn("no usage is kept for user %s.", user_name + CMD_LEN);
+
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());
+
+    session.reader = &reader;
+    session.command_sockfd = command_sockfd;
+    session.data_sockfd = -1;
+    session.data_port = rand() % (DATA_PORT_CEIL - DATA_PORT_FLOOR) + DATA_PORT_FLOOR;
+    session.previous = -1;
+    session.rename_from[0] = '\0';
+
+    result = storage->session_begin(&session_storage);
     if (result < 0)
     {
         error_handling("The DEFAULT_SERVER_WORK_DIR is unavailable");
@@ -125,245 +891,37 @@ int child_process(int command_sockfd)
 
     while (1)
     {
-        result = recv_buffer(command_sockfd, command);
-        if (result < 0)
-        {
-            error_handling("recv_buffer() error");
-            return -1;
-        }
-
-        result = analyse_command(command, cmd, arg);
-        if (result < 0)
+        result = control_next(&reader, &cmd, &arg);
+        if (result <= 0) /* the command socket blocks, 0 is not returned */
         {
-            error_handling("analyse_command() error");
+            perror("control_next() error");
             return -1;
         }
 
-        if (0 == strcmp(cmd, CMD_LIST) ||
-            0 == strcmp(cmd, CMD_RETR) ||
-            0 == strcmp(cmd, CMD_STOR))
-        {
-            result = send_code(command_sockfd, 120);
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-
-            data_port = get_new_data_port(data_port);
-            if (data_port < 0)
-            {
-                close(command_sockfd);
-                error_handling("get_new_data_port() error");
-                return -1;
-            }
-
-            data_listen_sockfd = server_socket_initialize(data_port);
-            if (data_listen_sockfd < 0)
-            {
-                close(command_sockfd);
-                error_handling("server_socket_initialize() error");
-                return -1;
-            }
-
-            result = send_data_port(command_sockfd, data_port);
-            if (result < 0)
-            {
-                close(data_listen_sockfd);
-                close(command_sockfd);
-                error_handling("send_data_port() error");
-                return -1;
-            }
-
-            data_sockfd = server_socket_accept(data_listen_sockfd);
-            if (data_sockfd < 0)
-            {
-                close(data_listen_sockfd);
-                close(command_sockfd);
-                error_handling("server_socket_accept() error");
-                return -1;
-            }
-
-            result = send_code(command_sockfd, 125);
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-
-            if (0 == strcmp(cmd, CMD_RETR))
-            {
-                result = send_file(data_sockfd, arg);
-                if (result < 0)
-                {
-                    close(data_sockfd);
-                    close(data_listen_sockfd);
-                    close(command_sockfd);
-                    error_handling("send_file() error");
-                    return -1;
-                }
-            }
-            else if (0 == strcmp(cmd, CMD_STOR))
-            {
-                result = recv_file(data_sockfd, arg);
-                if (result < 0)
-                {
-                    close(data_sockfd);
-                    close(data_listen_sockfd);
-                    close(command_sockfd);
-                    error_handling("recv_file() error");
-                    return -1;
-                }
-            }
-            else if (0 == strcmp(cmd, CMD_LIST))
-            {
-                result = send_list(data_sockfd);
-                if (result < 0)
-                {
-                    close(data_sockfd);
-                    close(data_listen_sockfd);
-                    close(command_sockfd);
-                    error_handling("send_list() error");
-                    return -1;
-                }
-            }
-
-            close(data_sockfd);
-            close(data_listen_sockfd);
-
-            result = send_code(command_sockfd, 226);
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-        }
-        else if (0 == strcmp(cmd, CMD_APPE))
-        {
-            result = create_file(arg);
-            if (result < 0)
-            {
-                close(command_sockfd);
-                error_handling("create_file() error");
-                return -1;
-            }
-
-            if (0 == result)
-                result = send_code(command_sockfd, 120);
-            else
-                result = send_code(command_sockfd, 502);
+        command_start = monotonic_ns();
 
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-        }
-        else if (0 == strcmp(cmd, CMD_DELE))
-        {
-            result = delete_file(arg);
-            if (result < 0)
-            {
-                close(command_sockfd);
-                error_handling("delete_file() error");
-                return -1;
-            }
+        id = command_lookup(cmd);
+        session.arg = arg;
 
-            if (0 == result)
-                result = send_code(command_sockfd, 120);
-            else
-                result = send_code(command_sockfd, 502);
-
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-        }
-        else if (0 == strcmp(cmd, CMD_MKD))
-        {
-            result = make_directory(arg);
-            if (result < 0)
-            {
-                close(command_sockfd);
-                error_handling("make_directory() error");
-                return -1;
-            }
-
-            if (0 == result)
-                result = send_code(command_sockfd, 120);
-            else
-                result = send_code(command_sockfd, 502);
-
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-        }
-        else if (0 == strcmp(cmd, CMD_RMD))
+        result = command_dispatch(&session, id);
+        if (result < 0)
         {
-            result = remove_directory(arg);
-            if (result < 0)
-            {
-                close(command_sockfd);
-                error_handling("remove_directory() error");
-                return -1;
-            }
-
-            if (0 == result)
-                result = send_code(command_sockfd, 120);
-            else
-                result = send_code(command_sockfd, 502);
-
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
+            error_handling("command_dispatch() error");
+            return -1;
         }
-        else if (0 == strcmp(cmd, CMD_CWD))
-        {
-            result = change_work_directory(arg);
-            if (result < 0)
-            {
-                close(command_sockfd);
-                error_handling("change_work_directory() error");
-                return -1;
-            }
 
-            if (0 == result)
-                result = send_code(command_sockfd, 120);
-            else
-                result = send_code(command_sockfd, 502);
+        session.previous = id;
 
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-        }
-        else if (0 == strcmp(cmd, CMD_QUIT))
-        {
-            result = send_code(command_sockfd, 221);
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
+        metrics_command(id, command_start);
+        trace_end(TRACE_COMMAND, command_start, cmd, 0);
 
+        if (id >= 0 && (command_specs[id].flags & COMMAND_ENDS))
             break;
-        }
-        else
-        {
-            result = send_code(command_sockfd, 502);
-            if (result < 0)
-            {
-                error_handling("send_code() error");
-                return -1;
-            }
-        }
     }
 
+    storage->session_end(&session_storage);
+    rate_limit_session_end();
+    trace_end(TRACE_SESSION, session_start, user_name + CMD_LEN, 0);
+
     return 0;
-}
\ No newline at end of file
+}
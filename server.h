@@ -9,6 +9,20 @@
  */
 
 #include "base.h"
+#include "cache.h"
+#include "control.h"
+#include "log.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "search.h"
+#include "storage.h"
+#include "tls.h"
+#include "trace.h"
+#include "usage.h"
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
 
 /**
  * the lower bound of random data port
@@ -21,10 +35,103 @@
 #define DATA_PORT_CEIL 8950
 
 /**
- * receive the user name and password from client
+ * the size of the buffer moving file data on the data connection
+ */
+#define TRANSFER_BUF_SIZE (16 * 1024)
+
+/**
+ * the ring of a pipeline, filled from the data connection while a writer
+ * thread drains it to the disk or filled by a reader thread ahead of the
+ * data connection, so at most PIPELINE_BUFFERS * PIPELINE_BUF_SIZE bytes
+ * are in flight; the buffers are aligned for O_DIRECT
+ */
+#define PIPELINE_BUFFERS 4
+#define PIPELINE_BUF_SIZE (1024 * 1024)
+#define PIPELINE_ALIGN 4096
+
+/**
+ * the default smallest file kept out of the page cache, -D of the server
+ */
+#define DIRECT_DEFAULT_MIN (256LL * 1024 * 1024)
+
+/**
+ * listen() backlog of a data port, only the client of the session connects
+ */
+#define DATA_LISTEN_BACKLOG 1
+
+/**
+ * the default largest file sent inline, -I of the server
+ */
+#define INLINE_DEFAULT_MAX (16 * 1024)
+
+/**
+ * the largest file sent inline, 0 refuses OPTS_INLINE
+ */
+static long long inline_max = INLINE_DEFAULT_MAX;
+
+/**
+ * 1 once the client of the session asked for OPTS_INLINE
+ */
+static int inline_enabled = 0;
+
+/**
+ * 1 once the command connection of the session went through TLS after
+ * OPTS_TLS, the data connections of the session do too
+ */
+static int tls_enabled = 0;
+
+/**
+ * the work directory of the session and its cache of directories
+ */
+static struct storage_session session_storage;
+
+/**
+ * a RETR of a file of at least this many bytes reads it with O_DIRECT, or
+ * drops it from the page cache behind the reads where O_DIRECT is not
+ * supported, and a STOR drops what it wrote once it passes this size; a
+ * backup then does not push the hot files out of memory, 0 never does it
+ */
+static long long direct_min = DIRECT_DEFAULT_MIN;
+
+/**
+ * the pipeline of a transfer, the filled buffers are the count ones from
+ * head; an upload fills the one after them from the data connection and
+ * its writer thread writes from head, a download has a reader thread
+ * filling them from the file and sends from head
+ */
+struct transfer_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  /* a buffer was filled, or done */
+    pthread_cond_t drained; /* a buffer was emptied, or error */
+    pthread_t thread;
+    int started; /* the thread runs, an upload of one buffer never starts it */
+    char *buffers;
+    int sizes[PIPELINE_BUFFERS];
+    int head;
+    int count;
+    int done;  /* no buffer follows */
+    int error; /* errno of the failed read or write */
+    int fd;
+    int direct;                 /* fd has O_DIRECT */
+    long long offset;           /* of the file, in the thread */
+    struct trace_io_total disk; /* the disk time of the thread */
+};
+
+/**
+ * receive the user name and password from client into standard buffers,
+ * options asked before them are handled on the way
+ * return 0 if success or -1 if error
+ */
+int login(struct control_reader *reader, char *user_name, char *password);
+
+/**
+ * handle the CMD_OPTS argument arg, switching reader to the variable
+ * encoding for OPTS_VARLEN, turning on the inline RETR for OPTS_INLINE or
+ * starting TLS on the command connection for OPTS_TLS, and send 200 or 502
  * return 0 if success or -1 if error
  */
-int login(int sockfd, char *user_name, char *password);
+int handle_options(struct control_reader *reader, const char *arg);
 
 /**
  * check the user's validity using user name and password
@@ -50,6 +157,13 @@ int send_code(int command_sockfd, int code);
  */
 int get_new_data_port(int old_data_port);
 
+/**
+ * listen on the first free data port after *data_port,
+ * trying the whole range before it gives up, *data_port is set to the port
+ * return the listening sock fd or -1 if error
+ */
+int data_socket_initialize(int *data_port);
+
 /**
  * send a data port to client via command sock fd
  * return 0 if success or -1 if error
@@ -68,18 +182,115 @@ int recv_buffer(int sockfd, char *buffer);
  */
 int send_file(int data_sockfd, const char *filename);
 
+/**
+ * send a file of at most inline_max bytes in the 213 reply on the command
+ * sock fd, from the hot-file cache if it is there
+ * return 1 if it was sent, 0 if it needs a data connection or -1 if error
+ */
+int send_inline_file(int command_sockfd, const char *filename);
+
+/**
+ * send a file pinned in the hot-file cache via data sock fd, unpinning it
+ * return 0 if success or -1 if error
+ */
+int send_cached_file(int data_sockfd, const char *filename, struct cache_file *cached, long long transfer_start);
+
 /**
  * receive a file from client via data sock fd
  * return 0 if success or -1 if error
  */
 int recv_file(int data_sockfd, const char *filename);
 
+/**
+ * set up the pipeline of an upload to fd
+ * return the first buffer to fill or NULL if error
+ */
+char *upload_begin(struct transfer_pipeline *pipeline, int fd);
+
+/**
+ * hand the filled buffer of size bytes to the writer, waiting while all the
+ * buffers are full
+ * return the next buffer to fill or NULL if a write failed
+ */
+char *upload_push(struct transfer_pipeline *pipeline, int size);
+
+/**
+ * write the last buffer of size bytes, wait for the writer and free the
+ * pipeline, the fd stays open
+ * return 0 if success or -1 if a write failed
+ */
+int upload_end(struct transfer_pipeline *pipeline, int size);
+
+/**
+ * send a file of at least direct_min bytes via data sock fd, read ahead
+ * by a thread and kept out of the page cache
+ * return 0 if success or -1 if error
+ */
+int send_bulk_file(int data_sockfd, const char *filename, long long transfer_start);
+
+/**
+ * start a thread reading fd ahead into the pipeline, read with O_DIRECT
+ * if fd has it, else dropped from the page cache behind the reads
+ * return 0 if success or -1 if error
+ */
+int download_begin(struct transfer_pipeline *pipeline, int fd);
+
+/**
+ * wait for the next buffer read ahead, of *size bytes, the last one is
+ * shorter than PIPELINE_BUF_SIZE
+ * return the buffer or NULL if a read failed
+ */
+char *download_next(struct transfer_pipeline *pipeline, int *size);
+
+/**
+ * give the buffer of download_next() back to the reader
+ */
+void download_release(struct transfer_pipeline *pipeline);
+
+/**
+ * stop the reader and free the pipeline, the fd stays open
+ */
+void download_end(struct transfer_pipeline *pipeline);
+
 /**
  * send the file list in arg directory
  * return 0 if success or -1 if error
  */
 int send_list(int data_sockfd);
 
+/**
+ * send the metrics of the server as the text of a list
+ * return 0 if success or -1 if error
+ */
+int send_stat(int data_sockfd);
+
+/**
+ * send the disk usage of the user in a 213 reply on the command sock fd
+ * return 0 if success or -1 if error
+ */
+int send_usage(int command_sockfd);
+
+/**
+ * send the results of the search of arg as the text of a list
+ * return 0 if success or -1 if error
+ */
+int send_search(int data_sockfd, const char *arg);
+
+/**
+ * stream the events under the directory of arg, after the sequence number
+ * that may follow it, as lines "seq\ttype\t/path[/]\tsize\n" until the
+ * client closes the data connection or sends a new command
+ * return 0 if success or -1 if error
+ */
+int send_events(int command_sockfd, int data_sockfd, const char *arg);
+
+/**
+ * send the text in fd in the chunks of a list,
+ * every chunk ends with '\0' so the client can print it as a string
+ * return 0 if success or -1 if error
+ */
+int send_text(int data_sockfd, FILE *fd);
+
 /**
  * make a new file in current work directory
  * return 0 if success or -1 if error
@@ -104,6 +315,25 @@ int make_directory(char *name);
  */
 int remove_directory(char *name);
 
+/**
+ * check that name exists and may be the source of a rename or a copy
+ * return 0 if it may, 1 if not
+ */
+int check_source(char *name);
+
+/**
+ * rename from to a new name, never replacing a file
+ * return 0 if success or 1 if refused
+ */
+int rename_file(const char *from, char *to);
+
+/**
+ * copy the file from to a new file on the server, sharing its blocks
+ * when the filesystem can reflink, else with copy_file_range()
+ * return 0 if success or 1 if refused
+ */
+int copy_file(const char *from, char *to);
+
 /**
  * change the current server's work directory
  * return 0 if success or -1 if error
@@ -120,27 +350,103 @@ void handle_space(char *str, int n);
  * --------------------------------------------------------------------------
  */
 
-int login(int sockfd, char *user_name, char *password)
+int login(struct control_reader *reader, char *user_name, char *password)
 {
+    char *buffers[2];
+    char *cmd;
+    char *arg;
     int result;
+    int i;
 
-    memset(user_name, 0, BUF_SIZE);
-    result = recv_buffer(sockfd, user_name);
+    buffers[0] = user_name;
+    buffers[1] = password;
 
-    if (result < 0)
+    for (i = 0; i < 2;)
     {
-        error_handling("recv_buffer() error");
-        return -1;
+        result = control_next(reader, &cmd, &arg);
+        if (result <= 0)
+        {
+            perror("control_next() error");
+            return -1;
+        }
+
+        if (0 == strcmp(cmd, CMD_OPTS))
+        {
+            result = handle_options(reader, arg);
+            if (result < 0)
+            {
+                error_handling("handle_options() error");
+                return -1;
+            }
+            continue;
+        }
+
+        /* validate_user() reads the name at CMD_LEN of a standard buffer */
+        memset(buffers[i], 0, BUF_SIZE);
+        memcpy(buffers[i], cmd, strlen(cmd));
+        snprintf(buffers[i] + CMD_LEN, ARG_LEN, "%s", arg);
+        i++;
+    }
+
+    return 0;
+}
+
+int handle_options(struct control_reader *reader, const char *arg)
+{
+    int starttls;
+    int result;
+
+    starttls = 0;
+
+    if (0 == strcmp(arg, OPTS_VARLEN))
+    {
+        result = send_code(reader->sockfd, 200);
+        reader->varlen = 1;
+
+        log_debug("control encoding switched to %s.", OPTS_VARLEN);
+    }
+    else if (0 == strcmp(arg, OPTS_INLINE) && inline_max > 0)
+    {
+        result = send_code(reader->sockfd, 200);
+        inline_enabled = 1;
+    }
+    else if (0 == strcmp(arg, OPTS_TLS) && tls_configured && !tls_enabled)
+    {
+        /* a command sent in the clear behind it would pass for one sent over TLS */
+        if (reader->start != reader->end)
+        {
+            error_handling("commands follow OPTS TLS before the handshake");
+            return -1;
+        }
+
+        result = send_code(reader->sockfd, 200);
+        starttls = 1;
+    }
+    else
+    {
+        result = send_code(reader->sockfd, 502);
     }
 
-    memset(password, 0, BUF_SIZE);
-    result = recv_buffer(sockfd, password);
     if (result < 0)
     {
-        error_handling("recv_buffer() error");
+        error_handling("send_code() error");
         return -1;
     }
 
+    if (starttls)
+    {
+        result = tls_accept(reader->sockfd, 0);
+        if (result < 0)
+        {
+            error_handling("tls_accept() error");
+            return -1;
+        }
+
+        tls_enabled = 1;
+
+        log_info("command connection switched to TLS, records done %s.", result ? "by the kernel" : "in user space");
+    }
+
     return 0;
 }
 
@@ -169,13 +475,16 @@ int validate_user(const char *user_name, const char *password)
     while (fgets(buffer, BUF_SIZE, fd))
     {
         pch = strtok(buffer, " ");
+        if (NULL == pch)
+            continue;
         strcpy(uname, pch);
+        handle_space(uname, strlen(uname));
 
+        /* a user without a password, like anonymous, has no second field */
+        pword[0] = '\0';
+        pch = strtok(NULL, " ");
         if (pch != NULL)
-        {
-            pch = strtok(NULL, " ");
             strcpy(pword, pch);
-        }
 
         handle_space(pword, strlen(pword)); /* remove end of line and whitespace */
 
@@ -183,7 +492,7 @@ int validate_user(const char *user_name, const char *password)
         {
             fclose(fd);
 
-            printf("user %s login succeed.\n", uname);
+            log_info("user %s login succeed.", uname);
 
             return 0;
         }
@@ -191,7 +500,7 @@ int validate_user(const char *user_name, const char *password)
         {
             fclose(fd);
 
-            printf("user %s login succeed.\n", ANONYMOUS);
+            log_info("user %s login succeed.", ANONYMOUS);
 
             return 0;
         }
@@ -224,7 +533,7 @@ int send_code(int command_sockfd, int code)
         return -1;
     }
 
-    printf("code %d sent.\n", code);
+    log_info("code %d sent.", code);
 
     return 0;
 }
@@ -242,6 +551,68 @@ int get_new_data_port(int old_data_port)
     return new_data_port;
 }
 
+int data_socket_initialize(int *data_port)
+{
+    struct sockaddr_in address;
+    int sockfd;
+    int result;
+    int enable;
+    int i;
+
+    /* concurrent sessions share the range, a port in use is skipped */
+    for (i = 0; i < DATA_PORT_CEIL - DATA_PORT_FLOOR; i++)
+    {
+        *data_port = get_new_data_port(*data_port);
+
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (sockfd < 0)
+        {
+            perror("socket() error");
+            return -1;
+        }
+
+        enable = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(*data_port);
+
+        result = bind(sockfd, (struct sockaddr *)&address, sizeof(address));
+
+        if (result < 0)
+        {
+            close(sockfd);
+
+            if (EADDRINUSE == errno)
+                continue;
+
+            perror("bind() error");
+            return -1;
+        }
+
+        /* with SO_REUSEADDR two sockets can bind a port, only one listens */
+        result = listen(sockfd, DATA_LISTEN_BACKLOG);
+
+        if (result < 0)
+        {
+            close(sockfd);
+
+            if (EADDRINUSE == errno)
+                continue;
+
+            perror("listen() error");
+            return -1;
+        }
+
+        return sockfd;
+    }
+
+    error_handling("no free data port");
+    return -1;
+}
+
 int send_data_port(int command_sockfd, int data_port)
 {
     int result;
@@ -257,7 +628,7 @@ int send_data_port(int command_sockfd, int data_port)
         return -1;
     }
 
-    printf("data port %d sent.\n", data_port);
+    log_info("data port %d sent.", data_port);
 
     return 0;
 }
@@ -277,130 +648,1170 @@ int recv_buffer(int sockfd, char *buffer)
     return size;
 }
 
-int send_file(int data_sockfd, const char *filename)
+/**
+ * send the file fd of the storage on data_sockfd with sendfile(), the
+ * kernel moving it from the page cache to a plain or kTLS socket, and add
+ * the bytes sent to *total
+ * return 0 if success, 1 if sendfile() does not take the file and nothing
+ * was sent or -1 if error
+ */
+static int send_file_kernel(int data_sockfd, int fd, long long *total)
 {
-    char buffer[BUF_SIZE];
-    int result;
-    int size;
-    FILE *fd;
+    long long io_start;
+    ssize_t size;
 
-    fd = fopen(filename, "r");
+    while (1)
+    {
+        io_start = trace_begin();
+        size = sendfile(data_sockfd, fd, NULL, TRANSFER_BUF_SIZE);
+        trace_io(TRACE_NET_SEND, io_start);
 
-    fseek(fd, SEEK_SET, 0);
+        if (size < 0 && EINTR == errno)
+            continue;
 
-    memset(buffer, 0, BUF_SIZE);
-    while ((size = fread(buffer, 1, BUF_SIZE - 1, fd)) > 0)
-    {
-        buffer[size] = '\0';
-        result = send(data_sockfd, buffer, size + 1, 0);
-        if (result < 0)
+        if (size < 0 && 0 == *total && (EINVAL == errno || ENOSYS == errno))
+            return 1;
+
+        if (size < 0)
         {
-            perror("send() error");
+            perror("sendfile() error");
             return -1;
         }
 
-        memset(buffer, 0, BUF_SIZE);
-    }
-
-    fclose(fd);
+        if (0 == size)
+            return 0;
 
-    printf("file %s sent.\n", filename);
+        /* the size is only known once sent, the tokens are paid after */
+        if (rate_limit_acquire(size) < 0)
+        {
+            error_handling("rate_limit_acquire() error");
+            return -1;
+        }
 
-    return 0;
+        metrics_transfer_bytes(size, 0);
+        *total += size;
+    }
 }
 
-int recv_file(int data_sockfd, const char *filename)
+int send_file(int data_sockfd, const char *filename)
 {
-    char buffer[BUF_SIZE];
+    char buffer[TRANSFER_BUF_SIZE];
+    char path[PATH_MAX];
+    struct cache_file cached;
+    struct stat statbuf;
+    int result;
     int size;
-    FILE *fd;
+    int copy;
+    int fd;
 
-    fd = fopen(filename, "w");
+    long long transfer_start;
+    long long io_start;
+    long long total = 0;
 
-    while ((size = recv_buffer(data_sockfd, buffer)) > 0)
-    {
-        fwrite(buffer, 1, size, fd);
-    }
+    transfer_start = trace_begin();
 
-    if (size < 0)
+    /* the cache and the page cache only know the files on the disk, by path */
+    if (storage->fds && 0 == storage->stat(&session_storage, filename, &statbuf) && S_ISREG(statbuf.st_mode) &&
+        0 == storage_path(&session_storage, filename, path))
     {
-        perror("recv_data() error");
-        return -1;
-    }
-
-    fclose(fd);
-
-    printf("file %s received.\n", filename);
-
-    return 0;
-}
-
-int send_list(int data_sockfd)
-{
-    DIR *dp;
-    struct dirent *entry;
-    struct stat statbuf;
-
-    char buffer[BUF_SIZE];
-    int size;
-    int result;
+        /* a hot file is sent from memory, the file is not even opened */
+        if (cache_open(path, &cached))
+            return send_cached_file(data_sockfd, filename, &cached, transfer_start);
 
-    FILE *fd;
+        if (direct_min > 0 && statbuf.st_size >= direct_min)
+            return send_bulk_file(data_sockfd, filename, transfer_start);
+    }
 
-    dp = opendir(".");
+    fd = storage->open(&session_storage, filename, O_RDONLY, 0);
 
-    if (!dp)
+    if (fd < 0)
     {
-        perror("opendir() error");
+        perror("open() error");
         return -1;
     }
 
-    fd = tmpfile();
+    rate_limit_transfer_begin(data_sockfd);
 
-    if (!fd)
+    /* a relay needs the bytes in the program, a plain or kTLS socket does not */
+    copy = 1;
+    if (storage->fds && (!tls_enabled || tls_kernel_records(data_sockfd)))
+        copy = send_file_kernel(data_sockfd, fd, &total);
+
+    if (copy < 0)
     {
-        perror("tmpfile() error");
+        storage->close(fd);
         return -1;
     }
 
-    while ((entry = readdir(dp)) != NULL)
+    while (copy)
     {
-        lstat(entry->d_name, &statbuf);
-        if (S_ISDIR(statbuf.st_mode))
-        {
-            if (0 == strncmp(".", entry->d_name, 1))
-                continue;
-            fprintf(fd, "%s/\n", entry->d_name);
-        }
-        else
+        io_start = trace_begin();
+        size = storage->read(fd, buffer, TRANSFER_BUF_SIZE);
+        trace_io(TRACE_DISK_READ, io_start);
+
+        if (size < 0 && EINTR == errno)
+            continue;
+
+        if (size < 0)
         {
-            if (0 == strncmp(".", entry->d_name, 1))
-                continue;
-            fprintf(fd, "%s\n", entry->d_name);
+            storage->close(fd);
+            perror("read() error");
+            return -1;
         }
-    }
-
-    closedir(dp);
 
-    fseek(fd, SEEK_SET, 0);
+        if (0 == size)
+            break;
 
-    memset(buffer, 0, BUF_SIZE);
-    while ((size = fread(buffer, 1, BUF_SIZE - 1, fd)) > 0)
-    {
-        buffer[size] = '\0';
-        result = send(data_sockfd, buffer, size + 1, 0);
+        result = rate_limit_acquire(size);
         if (result < 0)
+        {
+            storage->close(fd);
+            error_handling("rate_limit_acquire() error");
+            return -1;
+        }
+
+        io_start = trace_begin();
+        result = send(data_sockfd, buffer, size, 0);
+        trace_io(TRACE_NET_SEND, io_start);
+
+        if (result < 0)
+        {
+            storage->close(fd);
+            perror("send() error");
+            return -1;
+        }
+
+        metrics_transfer_bytes(size, 0);
+        total += size;
+    }
+
+    storage->close(fd);
+
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, filename, total);
+
+    log_info("file %s sent.", filename);
+
+    return 0;
+}
+
+/**
+ * send the count buffers of iov on sockfd until every byte is out, a short
+ * send going on from where it stopped; iov is changed
+ * return 0 if success or -1 if error
+ */
+static int send_iov(int sockfd, struct iovec *iov, int count)
+{
+    struct msghdr msg;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    while (msg.msg_iovlen > 0)
+    {
+        sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (EINTR == errno)
+                continue;
+
+            perror("sendmsg() error");
+            return -1;
+        }
+
+        while (msg.msg_iovlen > 0 && sent >= (ssize_t)msg.msg_iov->iov_len)
+        {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+int send_inline_file(int command_sockfd, const char *filename)
+{
+    char buffer[INLINE_LIMIT + 1];
+    char path[PATH_MAX];
+    struct iovec iov[1 + INLINE_LIMIT / CACHE_CHUNK_SIZE];
+    struct cache_file cached;
+    struct stat statbuf;
+    int header[2];
+    int cached_hit;
+    int result;
+    int count;
+    int size;
+    int fd;
+
+    long long transfer_start;
+
+    /* anything unusual, a missing file too, takes the usual way */
+    if (storage->stat(&session_storage, filename, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) ||
+        statbuf.st_size > inline_max)
+        return 0;
+
+    transfer_start = trace_begin();
+
+    cached_hit = storage->fds && 0 == storage_path(&session_storage, filename, path) && cache_open(path, &cached);
+
+    if (cached_hit)
+    {
+        size = cache_next(&cached, iov + 1, INLINE_LIMIT / CACHE_CHUNK_SIZE, &count);
+
+        /* it grew since the stat() */
+        if (cached.left > 0 || size > inline_max)
+        {
+            cache_close(&cached);
+            return 0;
+        }
+    }
+    else
+    {
+        fd = storage->open(&session_storage, filename, O_RDONLY, 0);
+        if (fd < 0)
+            return 0;
+
+        size = 0;
+        do
+        {
+            result = storage->read(fd, buffer + size, inline_max + 1 - size);
+            if (result > 0)
+                size += result;
+        } while (result > 0 && size <= inline_max);
+
+        storage->close(fd);
+
+        if (result < 0 || size > inline_max)
+            return 0;
+
+        iov[1].iov_base = buffer;
+        iov[1].iov_len = size;
+        count = 1;
+    }
+
+    header[0] = htonl(213);
+    header[1] = htonl(size);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+
+    metrics_transfer_begin();
+
+    /* a part of the reply left unsent would desync the commands, the session ends */
+    result = rate_limit_acquire(size);
+    if (result >= 0)
+        result = send_iov(command_sockfd, iov, 1 + count);
+
+    if (cached_hit)
+        cache_close(&cached);
+
+    if (result < 0)
+    {
+        error_handling("send_iov() error");
+        return -1;
+    }
+
+    metrics_transfer_bytes(size, 0);
+    metrics_transfer_end();
+
+    trace_end(TRACE_TRANSFER, transfer_start, filename, size);
+
+    log_info("file %s sent inline.", filename);
+
+    return 1;
+}
+
+int send_cached_file(int data_sockfd, const char *filename, struct cache_file *cached, long long transfer_start)
+{
+    struct iovec iov[TRANSFER_BUF_SIZE / CACHE_CHUNK_SIZE];
+    int result;
+    int count;
+    int size;
+
+    long long io_start;
+    long long total = 0;
+
+    rate_limit_transfer_begin(data_sockfd);
+
+    while ((size = cache_next(cached, iov, TRANSFER_BUF_SIZE / CACHE_CHUNK_SIZE, &count)) > 0)
+    {
+        result = rate_limit_acquire(size);
+        if (result < 0)
+        {
+            cache_close(cached);
+            error_handling("rate_limit_acquire() error");
+            return -1;
+        }
+
+        io_start = trace_begin();
+        result = send_iov(data_sockfd, iov, count);
+        trace_io(TRACE_NET_SEND, io_start);
+
+        if (result < 0)
+        {
+            cache_close(cached);
+            error_handling("send_iov() error");
+            return -1;
+        }
+
+        metrics_transfer_bytes(size, 0);
+        total += size;
+    }
+
+    cache_close(cached);
+
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, filename, total);
+
+    log_info("file %s sent from the cache.", filename);
+
+    return 0;
+}
+
+/**
+ * write size bytes of buffer to the file of pipeline, the disk time goes
+ * to pipeline->disk as the writer thread must not touch the trace
+ * return 0 if success or -1 if error
+ */
+static int upload_write(struct transfer_pipeline *pipeline, const char *buffer, int size)
+{
+    long long io_start;
+    ssize_t written;
+
+    while (size > 0)
+    {
+        io_start = trace_begin();
+        written = storage->write(pipeline->fd, buffer, size);
+        trace_io_thread(&pipeline->disk, io_start);
+
+        if (written < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+
+        buffer += written;
+        size -= written;
+    }
+
+    return 0;
+}
+
+/**
+ * start the writeback of the size bytes just written at start and drop
+ * everything before them from the page cache once it is on the disk
+ */
+static void upload_write_behind(int fd, long long start, int size)
+{
+    sync_file_range(fd, start, size, SYNC_FILE_RANGE_WRITE);
+
+    if (start > 0)
+    {
+        sync_file_range(fd, 0, start,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, 0, start, POSIX_FADV_DONTNEED);
+    }
+}
+
+static void *upload_writer_main(void *arg)
+{
+    struct transfer_pipeline *pipeline = arg;
+    char *buffer;
+    int size;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    while (1)
+    {
+        while (0 == pipeline->count && !pipeline->done)
+            pthread_cond_wait(&pipeline->filled, &pipeline->lock);
+
+        if (0 == pipeline->count)
+            break;
+
+        buffer = pipeline->buffers + (size_t)pipeline->head * PIPELINE_BUF_SIZE;
+        size = pipeline->sizes[pipeline->head];
+
+        /* the receiver goes on filling the other buffers meanwhile */
+        pthread_mutex_unlock(&pipeline->lock);
+        if (upload_write(pipeline, buffer, size) < 0)
+            size = -errno;
+        else
+            pipeline->offset += size;
+        if (size > 0 && storage->fds && direct_min > 0 && pipeline->offset >= direct_min)
+            upload_write_behind(pipeline->fd, pipeline->offset - size, size);
+        pthread_mutex_lock(&pipeline->lock);
+
+        if (size < 0)
+        {
+            pipeline->error = -size;
+            pthread_cond_signal(&pipeline->drained);
+            break;
+        }
+
+        pipeline->head = (pipeline->head + 1) % PIPELINE_BUFFERS;
+        pipeline->count--;
+        pthread_cond_signal(&pipeline->drained);
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+/**
+ * set up the buffers and the locks of pipeline for fd
+ * return 0 if success or -1 if error
+ */
+static int pipeline_initialize(struct transfer_pipeline *pipeline, int fd)
+{
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->fd = fd;
+    pipeline->direct = storage->fds && (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+
+    /* the pages are only touched as they are filled */
+    pipeline->buffers = aligned_alloc(PIPELINE_ALIGN, (size_t)PIPELINE_BUFFERS * PIPELINE_BUF_SIZE);
+    if (!pipeline->buffers)
+    {
+        perror("aligned_alloc() error");
+        return -1;
+    }
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->filled, NULL);
+    pthread_cond_init(&pipeline->drained, NULL);
+
+    return 0;
+}
+
+static void pipeline_destroy(struct transfer_pipeline *pipeline)
+{
+    pthread_cond_destroy(&pipeline->drained);
+    pthread_cond_destroy(&pipeline->filled);
+    pthread_mutex_destroy(&pipeline->lock);
+    free(pipeline->buffers);
+}
+
+char *upload_begin(struct transfer_pipeline *pipeline, int fd)
+{
+    if (pipeline_initialize(pipeline, fd) < 0)
+        return NULL;
+
+    return pipeline->buffers;
+}
+
+char *upload_push(struct transfer_pipeline *pipeline, int size)
+{
+    int index;
+
+    if (!pipeline->started)
+    {
+        if (pthread_create(&pipeline->thread, NULL, upload_writer_main, pipeline) != 0)
+        {
+            /* without a thread the upload goes on one buffer at a time */
+            if (upload_write(pipeline, pipeline->buffers, size) < 0)
+            {
+                pipeline->error = errno;
+                return NULL;
+            }
+            return pipeline->buffers;
+        }
+        pipeline->started = 1;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    pipeline->sizes[(pipeline->head + pipeline->count) % PIPELINE_BUFFERS] = size;
+    pipeline->count++;
+    pthread_cond_signal(&pipeline->filled);
+
+    while (PIPELINE_BUFFERS == pipeline->count && !pipeline->error)
+        pthread_cond_wait(&pipeline->drained, &pipeline->lock);
+
+    index = (pipeline->head + pipeline->count) % PIPELINE_BUFFERS;
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (pipeline->error)
+        return NULL;
+
+    return pipeline->buffers + (size_t)index * PIPELINE_BUF_SIZE;
+}
+
+int upload_end(struct transfer_pipeline *pipeline, int size)
+{
+    int index;
+
+    if (!pipeline->started)
+    {
+        if (!pipeline->error && size > 0 && upload_write(pipeline, pipeline->buffers, size) < 0)
+            pipeline->error = errno;
+    }
+    else
+    {
+        pthread_mutex_lock(&pipeline->lock);
+
+        if (size > 0 && !pipeline->error)
+        {
+            index = (pipeline->head + pipeline->count) % PIPELINE_BUFFERS;
+            pipeline->sizes[index] = size;
+            pipeline->count++;
+        }
+        pipeline->done = 1;
+        pthread_cond_signal(&pipeline->filled);
+
+        pthread_mutex_unlock(&pipeline->lock);
+
+        pthread_join(pipeline->thread, NULL);
+    }
+
+    trace_io_total_record(TRACE_DISK_WRITE, &pipeline->disk);
+    pipeline_destroy(pipeline);
+
+    if (pipeline->error)
+    {
+        errno = pipeline->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * read a buffer of the file of pipeline, full unless the file ends, on
+ * the reader thread so the disk time goes to pipeline->disk
+ * return the bytes read or -1 if error
+ */
+static int download_read(struct transfer_pipeline *pipeline, char *buffer)
+{
+    long long io_start;
+    ssize_t size;
+    int total;
+
+    total = 0;
+    while (total < PIPELINE_BUF_SIZE)
+    {
+        io_start = trace_begin();
+        size = read(pipeline->fd, buffer + total, PIPELINE_BUF_SIZE - total);
+        trace_io_thread(&pipeline->disk, io_start);
+
+        if (size < 0 && EINTR == errno)
+            continue;
+        if (size < 0)
+            return -1;
+
+        total += size;
+
+        /* a short read of O_DIRECT is the end, the offset is no longer aligned */
+        if (0 == size || pipeline->direct)
+            break;
+    }
+
+    /* without O_DIRECT what was read goes out of the page cache at once */
+    if (!pipeline->direct && total > 0)
+        posix_fadvise(pipeline->fd, pipeline->offset, total, POSIX_FADV_DONTNEED);
+    pipeline->offset += total;
+
+    return total;
+}
+
+static void *download_reader_main(void *arg)
+{
+    struct transfer_pipeline *pipeline = arg;
+    int index;
+    int size;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    while (!pipeline->done)
+    {
+        if (PIPELINE_BUFFERS == pipeline->count)
+        {
+            pthread_cond_wait(&pipeline->drained, &pipeline->lock);
+            continue;
+        }
+
+        index = (pipeline->head + pipeline->count) % PIPELINE_BUFFERS;
+
+        /* the session goes on sending the other buffers meanwhile */
+        pthread_mutex_unlock(&pipeline->lock);
+        size = download_read(pipeline, pipeline->buffers + (size_t)index * PIPELINE_BUF_SIZE);
+        if (size < 0)
+            size = -errno;
+        pthread_mutex_lock(&pipeline->lock);
+
+        if (size < 0)
+        {
+            pipeline->error = -size;
+            pthread_cond_signal(&pipeline->filled);
+            break;
+        }
+
+        pipeline->sizes[index] = size;
+        pipeline->count++;
+        pthread_cond_signal(&pipeline->filled);
+
+        if (size < PIPELINE_BUF_SIZE)
+            break;
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+int download_begin(struct transfer_pipeline *pipeline, int fd)
+{
+    if (pipeline_initialize(pipeline, fd) < 0)
+        return -1;
+
+    if (pthread_create(&pipeline->thread, NULL, download_reader_main, pipeline) != 0)
+    {
+        error_handling("pthread_create() error");
+        pipeline_destroy(pipeline);
+        return -1;
+    }
+    pipeline->started = 1;
+
+    return 0;
+}
+
+char *download_next(struct transfer_pipeline *pipeline, int *size)
+{
+    char *buffer;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    while (0 == pipeline->count && !pipeline->error)
+        pthread_cond_wait(&pipeline->filled, &pipeline->lock);
+
+    buffer = NULL;
+    if (pipeline->count > 0)
+    {
+        buffer = pipeline->buffers + (size_t)pipeline->head * PIPELINE_BUF_SIZE;
+        *size = pipeline->sizes[pipeline->head];
+    }
+    else
+    {
+        errno = pipeline->error;
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return buffer;
+}
+
+void download_release(struct transfer_pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+
+    pipeline->head = (pipeline->head + 1) % PIPELINE_BUFFERS;
+    pipeline->count--;
+    pthread_cond_signal(&pipeline->drained);
+
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+void download_end(struct transfer_pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->done = 1;
+    pthread_cond_signal(&pipeline->drained);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pthread_join(pipeline->thread, NULL);
+
+    trace_io_total_record(TRACE_DISK_READ, &pipeline->disk);
+    pipeline_destroy(pipeline);
+}
+
+int send_bulk_file(int data_sockfd, const char *filename, long long transfer_start)
+{
+    struct transfer_pipeline pipeline;
+    char *buffer;
+    int result;
+    int size;
+    int sent;
+    int part;
+    int fd;
+
+    long long io_start;
+    long long total = 0;
+
+    fd = storage->open(&session_storage, filename, O_RDONLY | O_DIRECT, 0);
+
+    /* tmpfs and some others have no O_DIRECT */
+    if (fd < 0 && EINVAL == errno)
+    {
+        fd = storage->open(&session_storage, filename, O_RDONLY, 0);
+        if (fd >= 0)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (fd < 0)
+    {
+        perror("open() error");
+        return -1;
+    }
+
+    if (download_begin(&pipeline, fd) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    rate_limit_transfer_begin(data_sockfd);
+
+    result = 0;
+    do
+    {
+        buffer = download_next(&pipeline, &size);
+        if (!buffer)
+        {
+            perror("read() error");
+            result = -1;
+            break;
+        }
+
+        for (sent = 0; sent < size && result >= 0; sent += part)
+        {
+            part = size - sent < TRANSFER_BUF_SIZE ? size - sent : TRANSFER_BUF_SIZE;
+
+            result = rate_limit_acquire(part);
+            if (result < 0)
+            {
+                error_handling("rate_limit_acquire() error");
+                break;
+            }
+
+            io_start = trace_begin();
+            result = send(data_sockfd, buffer + sent, part, 0);
+            trace_io(TRACE_NET_SEND, io_start);
+
+            if (result < 0)
+            {
+                perror("send() error");
+                break;
+            }
+
+            part = result;
+            metrics_transfer_bytes(part, 0);
+            total += part;
+        }
+
+        download_release(&pipeline);
+    } while (result >= 0 && PIPELINE_BUF_SIZE == size);
+
+    download_end(&pipeline);
+    close(fd);
+
+    if (result < 0)
+        return -1;
+
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, filename, total);
+
+    log_info("file %s sent past the page cache.", filename);
+
+    return 0;
+}
+
+/**
+ * tell the search indexer, and the usage index if made is 1, that name
+ * changed; they take the path from the root, the cwd of the process
+ */
+static void notify_change(const char *name, int made)
+{
+    char path[PATH_MAX];
+
+    if (storage_path(&session_storage, name, path) < 0)
+        return;
+
+    if (made)
+        usage_update(path);
+    search_notify(path);
+}
+
+int recv_file(int data_sockfd, const char *filename)
+{
+    struct transfer_pipeline pipeline;
+    char *buffer;
+    int result;
+    int filled;
+    int size;
+    int fd;
+
+    long long transfer_start;
+    long long io_start;
+    long long total = 0;
+
+    transfer_start = trace_begin();
+
+    fd = storage->open(&session_storage, filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0)
+    {
+        perror("open() error");
+        return -1;
+    }
+
+    buffer = upload_begin(&pipeline, fd);
+    if (!buffer)
+    {
+        storage->close(fd);
+        return -1;
+    }
+
+    rate_limit_transfer_begin(data_sockfd);
+
+    /* a buffer goes to the writer only when full, the disk sees large writes */
+    size = 0;
+    filled = 0;
+    while (buffer)
+    {
+        io_start = trace_begin();
+        size = recv(data_sockfd, buffer + filled, PIPELINE_BUF_SIZE - filled, 0);
+        trace_io(TRACE_NET_RECV, io_start);
+
+        if (size <= 0)
+        {
+            size = tls_recv_end(data_sockfd, size);
+            break;
+        }
+
+        metrics_transfer_bytes(0, size);
+        total += size;
+        filled += size;
+
+        result = rate_limit_acquire(size);
+        if (result < 0)
+        {
+            upload_end(&pipeline, 0);
+            storage->close(fd);
+            error_handling("rate_limit_acquire() error");
+            return -1;
+        }
+
+        if (PIPELINE_BUF_SIZE == filled)
+        {
+            buffer = upload_push(&pipeline, filled);
+            filled = 0;
+        }
+    }
+
+    result = upload_end(&pipeline, filled);
+    if (result < 0)
+        perror("write() error");
+
+    storage->close(fd);
+
+    notify_change(filename, 1);
+
+    if (size < 0 || result < 0)
+    {
+        if (size < 0)
+            perror("recv() error");
+        return -1;
+    }
+
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, filename, total);
+
+    log_info("file %s received.", filename);
+
+    return 0;
+}
+
+/**
+ * write an entry of the work directory as a line of the list
+ */
+static void list_entry(void *arg, const char *name, int dir)
+{
+    if (0 == strncmp(".", name, 1))
+        return;
+
+    fprintf(arg, dir ? "%s/\n" : "%s\n", name);
+}
+
+int send_list(int data_sockfd)
+{
+    int result;
+
+    FILE *fd;
+
+    fd = tmpfile();
+
+    if (!fd)
+    {
+        perror("tmpfile() error");
+        return -1;
+    }
+
+    result = storage->list(&session_storage, list_entry, fd);
+
+    if (result < 0)
+    {
+        fclose(fd);
+        perror("opendir() error");
+        return -1;
+    }
+
+    result = send_text(data_sockfd, fd);
+    fclose(fd);
+
+    if (result < 0)
+    {
+        error_handling("send_text() error");
+        return -1;
+    }
+
+    log_info("list sent.");
+
+    return 0;
+}
+
+int send_usage(int command_sockfd)
+{
+    char buffer[BUF_SIZE * 2];
+    struct iovec iov[2];
+    struct msghdr msg;
+    int header[2];
+    int length;
+
+    length = usage_write(buffer, sizeof(buffer));
+
+    header[0] = htonl(213);
+    header[1] = htonl(length);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = length;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (sendmsg(command_sockfd, &msg, MSG_NOSIGNAL) < 0)
+    {
+        perror("sendmsg() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int send_search(int data_sockfd, const char *arg)
+{
+    struct search_message message;
+    int results_fd;
+    int result;
+    FILE *fd;
+
+    results_fd = -1;
+
+    if (0 == search_parse(arg, &message))
+        results_fd = search_query(&message);
+
+    if (results_fd >= 0)
+    {
+        fd = fdopen(results_fd, "r");
+        if (!fd)
+            close(results_fd);
+    }
+    else
+    {
+        fd = tmpfile();
+        if (fd && 0 == search_parse(arg, &message))
+            fprintf(fd, "the search index is not available\n");
+        else if (fd)
+            fprintf(fd, "usage: %s [pattern] [size>N] [size<N] [mtime>T] [mtime<T] [type:f|type:d]\n", CMD_SRCH);
+    }
+
+    if (!fd)
+    {
+        perror("fdopen() error");
+        return -1;
+    }
+
+    result = send_text(data_sockfd, fd);
+    fclose(fd);
+
+    if (result < 0)
+    {
+        error_handling("send_text() error");
+        return -1;
+    }
+
+    log_info("search %s sent.", arg);
+
+    return 0;
+}
+
+int send_events(int command_sockfd, int data_sockfd, const char *arg)
+{
+    struct search_message message;
+    struct pollfd pollfds[3];
+    char directory[PATH_MAX];
+    char path[PATH_MAX];
+    char line[PATH_MAX + 64];
+    long long seq;
+    char extra;
+    int length;
+    int count;
+
+    /* "[directory] [seq]", a lone number is a directory */
+    seq = 0;
+    strcpy(directory, ".");
+    count = sscanf(arg, "%4095s %lld %c", directory, &seq, &extra);
+    if (count < 2 && 1 == sscanf(arg, "%*s %c", &extra))
+        count = 3;
+
+    if (count > 2 || seq < 0)
+        length = snprintf(line, sizeof(line), "usage: %s [directory] [seq]\n", CMD_SUBS);
+    else if (storage_path(&session_storage, directory, path) < 0 || (pollfds[0].fd = search_subscribe(path, seq)) < 0)
+        length = snprintf(line, sizeof(line), "the change feed is not available\n");
+    else
+        length = 0;
+
+    if (length > 0)
+    {
+        if (send(data_sockfd, line, length, MSG_NOSIGNAL) < 0)
         {
             perror("send() error");
             return -1;
         }
+        return 0;
+    }
+
+    log_info("subscribed to %s after %lld.", directory, seq);
+
+    pollfds[0].events = POLLIN;
+    pollfds[1].fd = data_sockfd;
+    pollfds[1].events = POLLIN;
+    pollfds[2].fd = command_sockfd;
+    pollfds[2].events = POLLIN;
+
+    while (1)
+    {
+        if (poll(pollfds, 3, -1) < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            perror("poll() error");
+            break;
+        }
 
-        memset(buffer, 0, BUF_SIZE);
+        /* the client hung up, or a new command ends the feed */
+        if (pollfds[1].revents || pollfds[2].revents)
+            break;
+
+        if (!pollfds[0].revents)
+            continue;
+
+        if (search_recv_event(&message) < 0)
+        {
+            error_handling("the search indexer is gone");
+            break;
+        }
+
+        length = snprintf(line, sizeof(line), "%lld\t%c\t/%s%s\t%lld\n", message.seq, message.event, message.text,
+                          message.dir && message.text[0] ? "/" : "", message.size);
+
+        if (send(data_sockfd, line, length, MSG_NOSIGNAL) < 0)
+            break;
+
+        metrics_transfer_bytes(length, 0);
+    }
+
+    /* what the indexer already pushed goes with the connection */
+    search_unsubscribe();
+
+    log_info("subscription to %s ended.", directory);
+
+    return 0;
+}
+
+int send_stat(int data_sockfd)
+{
+    int result;
+    FILE *fd;
+
+    fd = tmpfile();
+
+    if (!fd)
+    {
+        perror("tmpfile() error");
+        return -1;
     }
 
+    result = metrics_write(fd);
+    if (result < 0)
+    {
+        fclose(fd);
+        error_handling("metrics_write() error");
+        return -1;
+    }
+
+    result = send_text(data_sockfd, fd);
     fclose(fd);
 
-    printf("list sent.\n");
+    if (result < 0)
+    {
+        error_handling("send_text() error");
+        return -1;
+    }
+
+    log_info("stat sent.");
+
+    return 0;
+}
+
+int send_text(int data_sockfd, FILE *fd)
+{
+    char buffer[BUF_SIZE];
+    int size;
+    int result;
+
+    long long transfer_start;
+    long long io_start;
+    long long total = 0;
+
+    transfer_start = trace_begin();
+
+    fseek(fd, SEEK_SET, 0);
+
+    memset(buffer, 0, BUF_SIZE);
+    while ((size = fread(buffer, 1, BUF_SIZE - 1, fd)) > 0)
+    {
+        buffer[size] = '\0';
+
+        io_start = trace_begin();
+        result = send(data_sockfd, buffer, size + 1, 0);
+        trace_io(TRACE_NET_SEND, io_start);
+
+        if (result < 0)
+        {
+            perror("send() error");
+            return -1;
+        }
+
+        metrics_transfer_bytes(size + 1, 0);
+        total += size + 1;
+
+        memset(buffer, 0, BUF_SIZE);
+    }
+
+    trace_io_flush();
+    trace_end(TRACE_TRANSFER, transfer_start, "text", total);
 
     return 0;
 }
@@ -409,9 +1820,9 @@ int create_file(char *name)
 {
     int result;
 
-    handle_space(name, ARG_LEN);
+    handle_space(name, strlen(name));
 
-    result = creat(name, 0755);
+    result = storage->open(&session_storage, name, O_WRONLY | O_CREAT | O_TRUNC, 0755);
 
     if (result < 0)
     {
@@ -419,23 +1830,30 @@ int create_file(char *name)
         return -1;
     }
 
-    printf("file %s created.\n", name);
+    storage->close(result);
+    notify_change(name, 1);
+
+    log_info("file %s created.", name);
 
     return 0;
 }
 
 int delete_file(char *name)
 {
+    struct stat statbuf;
     int result;
 
-    handle_space(name, ARG_LEN);
+    handle_space(name, strlen(name));
 
     if (0 == strncmp(name, ".", 1))
     {
         return 1;
     }
 
-    result = unlink(name);
+    /* the inode is needed for the usage after the name is gone */
+    result = storage->stat(&session_storage, name, &statbuf);
+    if (0 == result)
+        result = storage->unlink(&session_storage, name);
 
     if (result < 0)
     {
@@ -443,7 +1861,10 @@ int delete_file(char *name)
         return -1;
     }
 
-    printf("file %s deleted.\n", name);
+    usage_forget(&statbuf);
+    notify_change(name, 0);
+
+    log_info("file %s deleted.", name);
 
     return 0;
 }
@@ -452,9 +1873,9 @@ int make_directory(char *name)
 {
     int result;
 
-    handle_space(name, ARG_LEN);
+    handle_space(name, strlen(name));
 
-    result = mkdir(name, 0755);
+    result = storage->mkdir(&session_storage, name, 0755);
 
     if (result < 0)
     {
@@ -462,23 +1883,28 @@ int make_directory(char *name)
         return -1;
     }
 
-    printf("directory %s made.\n", name);
+    notify_change(name, 1);
+
+    log_info("directory %s made.", name);
 
     return 0;
 }
 
 int remove_directory(char *name)
 {
+    struct stat statbuf;
     int result;
 
-    handle_space(name, ARG_LEN);
+    handle_space(name, strlen(name));
 
     if (0 == strncmp(name, ".", 1))
     {
         return 1;
     }
 
-    result = rmdir(name);
+    result = storage->stat(&session_storage, name, &statbuf);
+    if (0 == result)
+        result = storage->rmdir(&session_storage, name);
 
     if (result < 0)
     {
@@ -486,35 +1912,94 @@ int remove_directory(char *name)
         return -1;
     }
 
-    printf("directory %s removed.\n", name);
+    usage_forget(&statbuf);
+    notify_change(name, 0);
+
+    log_info("directory %s removed.", name);
 
     return 0;
 }
 
-int change_work_directory(char *path)
+int check_source(char *name)
+{
+    struct stat statbuf;
+
+    handle_space(name, strlen(name));
+
+    if (0 == strncmp(name, ".", 1) || strlen(name) >= PATH_MAX)
+        return 1;
+
+    if (storage->stat(&session_storage, name, &statbuf) < 0)
+    {
+        perror("lstat() error");
+        return 1;
+    }
+
+    return 0;
+}
+
+int rename_file(const char *from, char *to)
 {
     int result;
-    char *result_p;
-    char buffer[BUF_SIZE];
 
-    result = chdir(path);
+    handle_space(to, strlen(to));
+
+    if (0 == strncmp(to, ".", 1))
+        return 1;
+
+    result = storage->rename(&session_storage, from, to);
 
     if (result < 0)
     {
-        perror("chdir() error");
-        return -1;
+        perror("renameat2() error");
+        return 1;
     }
 
-    memset(buffer, 0, BUF_SIZE);
-    result_p = getcwd(buffer, BUF_SIZE);
+    notify_change(from, 0);
+    notify_change(to, 0);
+
+    log_info("%s renamed to %s.", from, to);
+
+    return 0;
+}
+
+int copy_file(const char *from, char *to)
+{
+    int result;
+
+    handle_space(to, strlen(to));
+
+    if (0 == strncmp(to, ".", 1))
+        return 1;
+
+    result = storage->copy(&session_storage, from, to);
+
+    if (result < 0)
+    {
+        perror("copy() error");
+        return 1;
+    }
+
+    notify_change(to, 1);
+
+    log_info("%s copied to %s.", from, to);
+
+    return 0;
+}
+
+int change_work_directory(char *path)
+{
+    int result;
+
+    result = storage->chdir(&session_storage, path);
 
-    if (!result_p)
+    if (result < 0)
     {
-        perror("getcwd() error");
+        perror("chdir() error");
         return -1;
     }
 
-    printf("work directory changed to %s.\n", buffer);
+    log_info("work directory changed to /%s.", session_storage.path);
 
     return 0;
 }
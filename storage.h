@@ -0,0 +1,1828 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+/**
+ * --- storage.h defines ---
+ * the storage backends the commands of a session go through
+ *
+ * A backend is a table of operations on names relative to the work
+ * directory of a session and on the handles of the files it opens,
+ * chosen by -S of the server. The state of a session, its work directory
+ * and its cache of directories, is a struct storage_session passed to
+ * every operation, so nothing depends on the cwd of the process and
+ * sessions could share a process.
+ *
+ * The posix backend is the work directory on the disk. A session holds a
+ * fd of its work directory and resolves a name from it, or for a name
+ * with ".." or '/', from the root through a small cache of directory fds;
+ * openat2() with RESOLVE_BENEATH keeps every name inside the root, through
+ * symbolic links too; on a kernel before 5.6 no link is followed at all.
+ * Its handles are file descriptors, so the hot-file cache, the search
+ * indexer, the usage index and the transfers past the page cache only
+ * work with it; they get the names from storage_path(), relative to the
+ * root, which is the cwd of a session process.
+ *
+ * The memory backend keeps the files in memory shared by the sessions,
+ * loaded from the work directory when the server starts and never
+ * written back, for scratch space, hot datasets and benchmarks of the
+ * protocol without a disk.
+ *
+ * A backend is added by filling a struct storage_backend and listing it in
+ * storage_backends, a local object store for one; every handler of
+ * server.h reaches the files only through storage.
+ */
+
+#include "base.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * the buffer of a copy that the backend can not do by itself
+ */
+#define STORAGE_COPY_BUF_SIZE (64 * 1024)
+
+/**
+ * the directory fds a session keeps besides its work directory
+ */
+#define STORAGE_DIR_CACHE 8
+
+/**
+ * called by list for every entry of the work directory
+ */
+typedef void (*storage_entry_fn)(void *arg, const char *name, int dir);
+
+struct storage_dir
+{
+    char path[PATH_MAX]; /* from the root, "" is the root */
+    int fd;              /* -1 if the slot is free */
+    unsigned long long used;
+};
+
+struct storage_session
+{
+    char path[PATH_MAX]; /* the work directory from the root */
+
+    /* posix */
+    int dirfd; /* the work directory */
+    struct storage_dir dirs[STORAGE_DIR_CACHE];
+    unsigned long long clock;
+    unsigned long long generation; /* of the directories the cache holds */
+
+    /* memory */
+    int node;
+    unsigned int node_generation;
+};
+
+struct storage_backend
+{
+    const char *name;
+
+    /* the handles are file descriptors of files on the disk */
+    int fds;
+
+    /* set up the backend for root before any session is forked, option
+     * is what followed ':' in -S or NULL; return 0 or -1 */
+    int (*initialize)(const char *root, const char *option);
+
+    /* make root the work directory of a new session; return 0 or -1 */
+    int (*session_begin)(struct storage_session *session);
+    void (*session_end)(struct storage_session *session);
+
+    /* like open(), a file opened for writing is written from its start;
+     * return the handle or -1 */
+    int (*open)(struct storage_session *session, const char *name, int flags, mode_t mode);
+    ssize_t (*read)(int handle, void *buffer, size_t size);
+    ssize_t (*write)(int handle, const void *buffer, size_t size);
+    int (*close)(int handle);
+
+    /* like lstat() and fstat() */
+    int (*stat)(struct storage_session *session, const char *name, struct stat *statbuf);
+    int (*fstat)(int handle, struct stat *statbuf);
+
+    int (*unlink)(struct storage_session *session, const char *name);
+    int (*mkdir)(struct storage_session *session, const char *name, mode_t mode);
+    int (*rmdir)(struct storage_session *session, const char *name);
+
+    /* never replace to; return 0 or -1 */
+    int (*rename)(struct storage_session *session, const char *from, const char *to);
+
+    /* copy the regular file from to the new file to; return 0 or -1 */
+    int (*copy)(struct storage_session *session, const char *from, const char *to);
+
+    int (*chdir)(struct storage_session *session, const char *path);
+
+    /* call fn for every entry of the work directory; return 0 or -1 */
+    int (*list)(struct storage_session *session, storage_entry_fn fn, void *arg);
+};
+
+/**
+ * the backend of the server, posix until storage_initialize() chooses
+ */
+static const struct storage_backend *storage;
+
+/**
+ * choose the backend of spec, "name" or "name:option", and set it up for
+ * the files under root
+ * return 0 if success or -1 if error
+ */
+int storage_initialize(const char *spec, const char *root);
+
+/**
+ * write name, relative to the work directory of session, into path as a
+ * path from the root without "." or ".." and without a leading '/',
+ * "" for the root itself
+ * return 0 if success or -1 if it is too long
+ */
+int storage_path(struct storage_session *session, const char *name, char *path);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+/**
+ * resolve name against the directory base from the root, both without a
+ * leading '/', into path; ".." stops at the root as it does at "/"
+ * return 0 if success or -1 if it is too long
+ */
+static int storage_normalize(const char *base, const char *name, char *path)
+{
+    const char *end;
+    size_t length;
+    size_t used;
+    char *slash;
+
+    used = 0;
+    path[0] = '\0';
+
+    if (name[0] != '/')
+    {
+        used = strlen(base);
+        if (used >= PATH_MAX)
+            goto too_long;
+        memcpy(path, base, used + 1);
+    }
+
+    while (1)
+    {
+        while ('/' == *name)
+            name++;
+        if ('\0' == *name)
+            break;
+
+        for (end = name; *end && *end != '/'; end++)
+            ;
+        length = end - name;
+
+        if (2 == length && 0 == strncmp(name, "..", 2))
+        {
+            slash = strrchr(path, '/');
+            used = slash ? (size_t)(slash - path) : 0;
+            path[used] = '\0';
+        }
+        else if (length != 1 || name[0] != '.')
+        {
+            if (used + (used > 0) + length >= PATH_MAX)
+                goto too_long;
+            if (used > 0)
+                path[used++] = '/';
+            memcpy(path + used, name, length);
+            used += length;
+            path[used] = '\0';
+        }
+
+        name = end;
+    }
+
+    return 0;
+
+too_long:
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+int storage_path(struct storage_session *session, const char *name, char *path)
+{
+    return storage_normalize(session->path, name, path);
+}
+
+/**
+ * --- the posix backend ---
+ */
+
+static int posix_root_fd = -1;
+
+/**
+ * grows when a session renames or removes a directory, the caches of
+ * directory fds of all the sessions are dropped
+ */
+static unsigned long long *posix_generation = NULL;
+
+/* set when the kernel has no openat2() */
+static int posix_no_openat2 = 0;
+
+/**
+ * openat() of name one component at a time, refusing every symbolic link
+ * with ELOOP, for the kernels before 5.6 without openat2(); a name never
+ * has ".." here, so it can not leave dirfd
+ */
+static int posix_openat_nofollow(int dirfd, const char *name, int flags, mode_t mode)
+{
+    char component[NAME_MAX + 1];
+    const char *slash;
+    size_t length;
+    int next;
+    int fd;
+
+    fd = dirfd;
+    while ((slash = strchr(name, '/')) != NULL)
+    {
+        length = slash - name;
+        if (length > NAME_MAX)
+        {
+            errno = ENAMETOOLONG;
+            next = -1;
+        }
+        else
+        {
+            memcpy(component, name, length);
+            component[length] = '\0';
+            next = openat(fd, component, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+
+        if (fd != dirfd)
+            close(fd);
+        if (next < 0)
+            return -1;
+
+        fd = next;
+        name = slash + 1;
+    }
+
+    next = openat(fd, name, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+
+    if (fd != dirfd)
+        close(fd);
+
+    return next;
+}
+
+/**
+ * openat() that never leaves dirfd, by ".." or a symbolic link
+ */
+static int posix_openat(int dirfd, const char *name, int flags, mode_t mode)
+{
+    struct open_how how;
+    int fd;
+
+    if (!posix_no_openat2)
+    {
+        memset(&how, 0, sizeof(how));
+        how.flags = flags | O_CLOEXEC;
+        how.mode = (flags & O_CREAT) ? mode : 0;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+        fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how));
+        if (fd >= 0 || errno != ENOSYS)
+            return fd;
+
+        posix_no_openat2 = 1;
+    }
+
+    /* before 5.6 only links could lead out, so none is followed */
+    return posix_openat_nofollow(dirfd, name, flags, mode);
+}
+
+static void posix_changed(void)
+{
+    __atomic_add_fetch(posix_generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * return a fd of the directory path from the root, owned by the cache of
+ * session, or -1 if error
+ */
+static int posix_directory(struct storage_session *session, const char *path)
+{
+    struct storage_dir *victim;
+    unsigned long long generation;
+    int fd;
+    int i;
+
+    if ('\0' == path[0])
+        return posix_root_fd;
+
+    if (0 == strcmp(path, session->path))
+        return session->dirfd;
+
+    generation = __atomic_load_n(posix_generation, __ATOMIC_ACQUIRE);
+    if (generation != session->generation)
+    {
+        for (i = 0; i < STORAGE_DIR_CACHE; i++)
+        {
+            if (session->dirs[i].fd >= 0)
+                close(session->dirs[i].fd);
+            session->dirs[i].fd = -1;
+        }
+        session->generation = generation;
+    }
+
+    victim = &session->dirs[0];
+    for (i = 0; i < STORAGE_DIR_CACHE; i++)
+    {
+        if (session->dirs[i].fd >= 0 && 0 == strcmp(session->dirs[i].path, path))
+        {
+            session->dirs[i].used = ++session->clock;
+            return session->dirs[i].fd;
+        }
+
+        if (session->dirs[i].fd < 0 || (victim->fd >= 0 && session->dirs[i].used < victim->used))
+            victim = &session->dirs[i];
+    }
+
+    fd = posix_openat(posix_root_fd, path, O_PATH | O_DIRECTORY, 0);
+    if (fd < 0)
+        return -1;
+
+    if (victim->fd >= 0)
+        close(victim->fd);
+
+    strcpy(victim->path, path);
+    victim->fd = fd;
+    victim->used = ++session->clock;
+
+    return fd;
+}
+
+/**
+ * find the directory holding name and its last component, copied into
+ * last; last is empty when name is the root
+ * return a fd of the directory, not to be closed, or -1 if error
+ */
+static int posix_parent(struct storage_session *session, const char *name, char *last)
+{
+    char path[PATH_MAX];
+    char *slash;
+
+    /* a plain name, the most of them, is in the work directory */
+    if (!strchr(name, '/') && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && name[0] != '\0')
+    {
+        if (strlen(name) > NAME_MAX)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        strcpy(last, name);
+        return session->dirfd;
+    }
+
+    if (storage_normalize(session->path, name, path) < 0)
+        return -1;
+
+    slash = strrchr(path, '/');
+    if (!slash)
+    {
+        strcpy(last, path);
+        return posix_root_fd;
+    }
+
+    *slash = '\0';
+    strcpy(last, slash + 1);
+
+    return posix_directory(session, path);
+}
+
+static int posix_initialize(const char *root, const char *option)
+{
+    if (option)
+    {
+        error_handling("the posix storage takes no option");
+        return -1;
+    }
+
+    posix_root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (posix_root_fd < 0)
+    {
+        error_handling("the work directory of the server is unavailable");
+        return -1;
+    }
+
+    posix_generation = mmap(NULL, sizeof(*posix_generation), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == posix_generation)
+    {
+        perror("mmap() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int posix_session_begin(struct storage_session *session)
+{
+    int i;
+
+    memset(session->path, 0, sizeof(session->path));
+    for (i = 0; i < STORAGE_DIR_CACHE; i++)
+        session->dirs[i].fd = -1;
+    session->clock = 0;
+    session->generation = __atomic_load_n(posix_generation, __ATOMIC_ACQUIRE);
+
+    session->dirfd = fcntl(posix_root_fd, F_DUPFD_CLOEXEC, 0);
+    if (session->dirfd < 0)
+        return -1;
+
+    /* once, for the subsystems that take the names of storage_path() */
+    return fchdir(posix_root_fd);
+}
+
+static void posix_session_end(struct storage_session *session)
+{
+    int i;
+
+    for (i = 0; i < STORAGE_DIR_CACHE; i++)
+    {
+        if (session->dirs[i].fd >= 0)
+            close(session->dirs[i].fd);
+        session->dirs[i].fd = -1;
+    }
+
+    if (session->dirfd >= 0)
+        close(session->dirfd);
+    session->dirfd = -1;
+}
+
+static int posix_open(struct storage_session *session, const char *name, int flags, mode_t mode)
+{
+    char last[NAME_MAX + 1];
+    int dirfd;
+
+    dirfd = posix_parent(session, name, last);
+    if (dirfd < 0)
+        return -1;
+
+    if ('\0' == last[0])
+    {
+        errno = EISDIR;
+        return -1;
+    }
+
+    return posix_openat(dirfd, last, flags, mode);
+}
+
+static ssize_t posix_read(int handle, void *buffer, size_t size)
+{
+    return read(handle, buffer, size);
+}
+
+static ssize_t posix_write(int handle, const void *buffer, size_t size)
+{
+    return write(handle, buffer, size);
+}
+
+static int posix_stat(struct storage_session *session, const char *name, struct stat *statbuf)
+{
+    char last[NAME_MAX + 1];
+    int dirfd;
+
+    dirfd = posix_parent(session, name, last);
+    if (dirfd < 0)
+        return -1;
+
+    return fstatat(dirfd, last, statbuf, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH);
+}
+
+static int posix_unlink(struct storage_session *session, const char *name)
+{
+    char last[NAME_MAX + 1];
+    int dirfd;
+
+    dirfd = posix_parent(session, name, last);
+    if (dirfd < 0)
+        return -1;
+
+    return unlinkat(dirfd, '\0' == last[0] ? "." : last, 0);
+}
+
+static int posix_mkdir(struct storage_session *session, const char *name, mode_t mode)
+{
+    char last[NAME_MAX + 1];
+    int dirfd;
+
+    dirfd = posix_parent(session, name, last);
+    if (dirfd < 0)
+        return -1;
+
+    return mkdirat(dirfd, '\0' == last[0] ? "." : last, mode);
+}
+
+static int posix_rmdir(struct storage_session *session, const char *name)
+{
+    char last[NAME_MAX + 1];
+    int dirfd;
+
+    dirfd = posix_parent(session, name, last);
+    if (dirfd < 0)
+        return -1;
+
+    if (unlinkat(dirfd, '\0' == last[0] ? "." : last, AT_REMOVEDIR) < 0)
+        return -1;
+
+    posix_changed();
+
+    return 0;
+}
+
+static int posix_rename(struct storage_session *session, const char *from, const char *to)
+{
+    char from_last[NAME_MAX + 1];
+    char to_last[NAME_MAX + 1];
+    struct stat statbuf;
+    int from_dirfd;
+    int to_dirfd;
+    int result;
+
+    /* the second lookup may empty the cache on a new generation and the
+     * number be reused, so the first fd is pinned by a copy of its own */
+    from_dirfd = posix_parent(session, from, from_last);
+    if (from_dirfd < 0)
+        return -1;
+
+    from_dirfd = fcntl(from_dirfd, F_DUPFD_CLOEXEC, 0);
+    if (from_dirfd < 0)
+        return -1;
+
+    to_dirfd = posix_parent(session, to, to_last);
+    if (to_dirfd < 0)
+    {
+        close(from_dirfd);
+        return -1;
+    }
+
+    if ('\0' == from_last[0] || '\0' == to_last[0])
+    {
+        close(from_dirfd);
+        errno = EBUSY;
+        return -1;
+    }
+
+    result = renameat2(from_dirfd, from_last, to_dirfd, to_last, RENAME_NOREPLACE);
+
+    /* a filesystem without RENAME_NOREPLACE */
+    if (result < 0 && EINVAL == errno)
+    {
+        result = linkat(from_dirfd, from_last, to_dirfd, to_last, 0);
+        if (0 == result)
+            result = unlinkat(from_dirfd, from_last, 0);
+    }
+
+    close(from_dirfd);
+
+    if (0 == result && 0 == fstatat(to_dirfd, to_last, &statbuf, AT_SYMLINK_NOFOLLOW) && S_ISDIR(statbuf.st_mode))
+        posix_changed();
+
+    return result;
+}
+
+/**
+ * copy from in_fd to out_fd in the kernel, or through a buffer when
+ * copy_file_range() can not do it between these files
+ * return 0 if success or -1 if error
+ */
+static int posix_copy_data(int in_fd, int out_fd)
+{
+    char buffer[STORAGE_COPY_BUF_SIZE];
+    ssize_t written;
+    ssize_t size;
+    ssize_t done;
+
+    while ((size = copy_file_range(in_fd, NULL, out_fd, NULL, SSIZE_MAX, 0)) > 0)
+        ;
+
+    if (0 == size)
+        return 0;
+
+    /* nothing was copied yet when these fail, the offsets are still 0 */
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+        return -1;
+
+    while ((size = read(in_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (done = 0; done < size; done += written)
+        {
+            written = write(out_fd, buffer + done, size - done);
+            if (written < 0)
+                return -1;
+        }
+    }
+
+    return size < 0 ? -1 : 0;
+}
+
+static int posix_copy(struct storage_session *session, const char *from, const char *to)
+{
+    struct stat statbuf;
+    int in_fd;
+    int out_fd;
+    int result;
+    int saved;
+
+    in_fd = posix_open(session, from, O_RDONLY, 0);
+    if (in_fd < 0)
+        return -1;
+
+    if (fstat(in_fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+    {
+        close(in_fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    out_fd = posix_open(session, to, O_WRONLY | O_CREAT | O_EXCL, statbuf.st_mode & 0777);
+    if (out_fd < 0)
+    {
+        saved = errno;
+        close(in_fd);
+        errno = saved;
+        return -1;
+    }
+
+    /* a reflink shares the blocks, the size of the file does not matter */
+    result = ioctl(out_fd, FICLONE, in_fd);
+    if (result < 0)
+        result = posix_copy_data(in_fd, out_fd);
+
+    saved = errno;
+    close(in_fd);
+
+    if (close(out_fd) < 0 && 0 == result)
+    {
+        saved = errno;
+        result = -1;
+    }
+
+    if (result < 0)
+    {
+        posix_unlink(session, to);
+        errno = saved;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int posix_chdir(struct storage_session *session, const char *path)
+{
+    char normalized[PATH_MAX];
+    int fd;
+
+    if (storage_normalize(session->path, path, normalized) < 0)
+        return -1;
+
+    fd = posix_directory(session, normalized);
+    if (fd < 0)
+        return -1;
+
+    /* the cache may close its fd, the work directory keeps its own */
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    close(session->dirfd);
+    session->dirfd = fd;
+    strcpy(session->path, normalized);
+
+    return 0;
+}
+
+static int posix_list(struct storage_session *session, storage_entry_fn fn, void *arg)
+{
+    struct dirent *entry;
+    struct stat statbuf;
+    DIR *dp;
+    int fd;
+
+    /* an O_PATH fd can not be read */
+    fd = openat(session->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    dp = fdopendir(fd);
+    if (!dp)
+    {
+        close(fd);
+        return -1;
+    }
+
+    while ((entry = readdir(dp)) != NULL)
+    {
+        if (fstatat(fd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        fn(arg, entry->d_name, S_ISDIR(statbuf.st_mode));
+    }
+
+    closedir(dp);
+
+    return 0;
+}
+
+static const struct storage_backend storage_posix = {
+    .name = "posix",
+    .fds = 1,
+    .initialize = posix_initialize,
+    .session_begin = posix_session_begin,
+    .session_end = posix_session_end,
+    .open = posix_open,
+    .read = posix_read,
+    .write = posix_write,
+    .close = close,
+    .stat = posix_stat,
+    .fstat = fstat,
+    .unlink = posix_unlink,
+    .mkdir = posix_mkdir,
+    .rmdir = posix_rmdir,
+    .rename = posix_rename,
+    .copy = posix_copy,
+    .chdir = posix_chdir,
+    .list = posix_list,
+};
+
+/**
+ * --- the memory backend ---
+ *
+ * The nodes and the blocks are in one MAP_SHARED mapping made before the
+ * sessions are forked, under one process-shared robust mutex like the
+ * usage index, so a session killed while holding it does not stall the
+ * others. Its chains and free lists may be half linked then, so the
+ * session that takes the lock over marks the storage broken, like the
+ * hot-file cache, and every later operation fails with EIO until the
+ * server is restarted. A node is
+ * a file or a directory, found by its parent and its name in a hash table;
+ * the data of a file is a chain of blocks. A file written again, or
+ * removed, while a session reads it becomes a new node, so the reader
+ * keeps the old data until it closes it. The handles are the slots of a
+ * table of the process, taken and given back under the lock.
+ */
+
+/**
+ * the memory of the files when -S memory has no size
+ */
+#define MEMORY_DEFAULT_SIZE (1LL << 30)
+
+#define MEMORY_BLOCK_SIZE (64 * 1024)
+#define MEMORY_NODES (1 << 15)
+#define MEMORY_NAME_LEN (NAME_MAX + 1)
+
+/**
+ * the files a session has open at the same time
+ */
+#define MEMORY_HANDLES 16
+
+/**
+ * st_dev of the nodes, the inode is the node
+ */
+#define MEMORY_DEV 0x6d656dULL
+
+struct memory_node
+{
+    char name[MEMORY_NAME_LEN];
+    int parent;    /* -1 once removed */
+    int next;      /* in the bucket, or in the free nodes */
+    int used;
+    int dir;
+    int opens;     /* the handles of all the sessions */
+    int unlinked;  /* freed by the last close */
+    unsigned int generation;
+    int first_block;
+    long long size;
+    long long mtime_ns;
+};
+
+struct memory_shared
+{
+    pthread_mutex_t lock;
+    int broken; /* a session died changing the tables */
+    int free_node;
+    int free_block;
+    int high; /* no node is used from here on */
+    int buckets[MEMORY_NODES];
+    struct memory_node nodes[MEMORY_NODES];
+    int next_block[]; /* the chains of the files and of the free blocks */
+};
+
+struct memory_handle
+{
+    int used;
+    int node;
+    int block; /* holding the byte before offset, -1 at the start */
+    long long offset;
+};
+
+static struct memory_shared *memory_shared = NULL;
+static char *memory_data = NULL;
+static int memory_blocks = 0;
+
+static struct memory_handle memory_handles[MEMORY_HANDLES];
+
+/**
+ * take the lock of the memory storage
+ * return 0 if its tables can be used, or -1 with EIO and the lock given
+ * back once a session died in the middle of changing them
+ */
+static int memory_lock(void)
+{
+    if (shared_mutex_lock(&memory_shared->lock) && !memory_shared->broken)
+    {
+        memory_shared->broken = 1;
+        error_handling("the memory storage is broken, its operations fail until a restart");
+    }
+
+    if (memory_shared->broken)
+    {
+        pthread_mutex_unlock(&memory_shared->lock);
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void memory_unlock(void)
+{
+    pthread_mutex_unlock(&memory_shared->lock);
+}
+
+static int memory_bucket(int parent, const char *name)
+{
+    unsigned int hash = 2166136261U ^ (unsigned int)parent;
+
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619U;
+    }
+
+    return hash & (MEMORY_NODES - 1);
+}
+
+/**
+ * return the node name in parent or -1, with the lock held
+ */
+static int memory_lookup(int parent, const char *name)
+{
+    int node;
+
+    for (node = memory_shared->buckets[memory_bucket(parent, name)]; node >= 0;
+         node = memory_shared->nodes[node].next)
+    {
+        if (memory_shared->nodes[node].parent == parent && 0 == strcmp(memory_shared->nodes[node].name, name))
+            return node;
+    }
+
+    return -1;
+}
+
+static void memory_hash_insert(int node)
+{
+    struct memory_node *entry = &memory_shared->nodes[node];
+    int bucket;
+
+    bucket = memory_bucket(entry->parent, entry->name);
+    entry->next = memory_shared->buckets[bucket];
+    memory_shared->buckets[bucket] = node;
+}
+
+static void memory_hash_remove(int node)
+{
+    struct memory_node *entry = &memory_shared->nodes[node];
+    int *link;
+
+    link = &memory_shared->buckets[memory_bucket(entry->parent, entry->name)];
+    while (*link != node)
+        link = &memory_shared->nodes[*link].next;
+    *link = entry->next;
+}
+
+static long long memory_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * make the node name in parent, with the lock held
+ * return the node or -1 if there is no room
+ */
+static int memory_new_node(int parent, const char *name, int dir)
+{
+    struct memory_node *entry;
+    int node;
+
+    node = memory_shared->free_node;
+    if (node < 0)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    entry = &memory_shared->nodes[node];
+    memory_shared->free_node = entry->next;
+    if (node >= memory_shared->high)
+        memory_shared->high = node + 1;
+
+    strcpy(entry->name, name);
+    entry->parent = parent;
+    entry->used = 1;
+    entry->dir = dir;
+    entry->opens = 0;
+    entry->unlinked = 0;
+    entry->first_block = -1;
+    entry->size = 0;
+    entry->mtime_ns = memory_now_ns();
+
+    memory_hash_insert(node);
+
+    return node;
+}
+
+/**
+ * give the blocks and the node back, with the lock held
+ */
+static void memory_free_node(int node)
+{
+    struct memory_node *entry = &memory_shared->nodes[node];
+    int block;
+    int next;
+
+    for (block = entry->first_block; block >= 0; block = next)
+    {
+        next = memory_shared->next_block[block];
+        memory_shared->next_block[block] = memory_shared->free_block;
+        memory_shared->free_block = block;
+    }
+
+    entry->used = 0;
+    entry->generation++;
+    entry->next = memory_shared->free_node;
+    memory_shared->free_node = node;
+}
+
+/**
+ * take the node out of its directory, freeing it unless it is open,
+ * with the lock held
+ */
+static void memory_detach(int node)
+{
+    memory_hash_remove(node);
+    memory_shared->nodes[node].parent = -1;
+
+    if (memory_shared->nodes[node].opens > 0)
+        memory_shared->nodes[node].unlinked = 1;
+    else
+        memory_free_node(node);
+}
+
+/**
+ * return 1 if the work directory of session was not removed, with the
+ * lock held
+ */
+static int memory_cwd_valid(struct storage_session *session)
+{
+    return memory_shared->nodes[session->node].used &&
+           memory_shared->nodes[session->node].generation == session->node_generation;
+}
+
+/**
+ * walk name to the directory holding its last component, copied into
+ * last; a name ending in "." or ".." leaves last empty and *parent is the
+ * node itself, with the lock held
+ * return 0 if success or -1 if error
+ */
+static int memory_walk(struct storage_session *session, const char *name, int *parent, char *last)
+{
+    const char *end;
+    const char *next;
+    int node;
+    int length;
+
+    if ('/' == name[0])
+    {
+        node = 0;
+    }
+    else
+    {
+        node = session->node;
+        if (!memory_cwd_valid(session))
+        {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    while (1)
+    {
+        while ('/' == *name)
+            name++;
+        if ('\0' == *name)
+            break;
+
+        for (end = name; *end && *end != '/'; end++)
+            ;
+        for (next = end; '/' == *next; next++)
+            ;
+
+        length = end - name;
+        if (length >= MEMORY_NAME_LEN)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        memcpy(last, name, length);
+        last[length] = '\0';
+        name = next;
+
+        if (0 == strcmp(last, "."))
+            continue;
+
+        if (0 == strcmp(last, ".."))
+        {
+            node = memory_shared->nodes[node].parent;
+            continue;
+        }
+
+        if ('\0' == *next)
+        {
+            *parent = node;
+            return 0;
+        }
+
+        node = memory_lookup(node, last);
+        if (node < 0 || !memory_shared->nodes[node].dir)
+        {
+            errno = node < 0 ? ENOENT : ENOTDIR;
+            return -1;
+        }
+    }
+
+    *parent = node;
+    last[0] = '\0';
+
+    return 0;
+}
+
+/**
+ * return the node of name or -1 if error, with the lock held
+ */
+static int memory_resolve(struct storage_session *session, const char *name)
+{
+    char last[MEMORY_NAME_LEN];
+    int parent;
+    int node;
+
+    if (memory_walk(session, name, &parent, last) < 0)
+        return -1;
+
+    if ('\0' == last[0])
+        return parent;
+
+    node = memory_lookup(parent, last);
+    if (node < 0)
+        errno = ENOENT;
+
+    return node;
+}
+
+static void memory_fill_stat(int node, struct stat *statbuf)
+{
+    struct memory_node *entry = &memory_shared->nodes[node];
+
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_dev = MEMORY_DEV;
+    statbuf->st_ino = node + 1;
+    statbuf->st_mode = entry->dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+    statbuf->st_nlink = 1;
+    statbuf->st_size = entry->size;
+    statbuf->st_blksize = MEMORY_BLOCK_SIZE;
+    statbuf->st_blocks = (entry->size + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE * (MEMORY_BLOCK_SIZE / 512);
+    statbuf->st_mtim.tv_sec = entry->mtime_ns / 1000000000LL;
+    statbuf->st_mtim.tv_nsec = entry->mtime_ns % 1000000000LL;
+    statbuf->st_atim = statbuf->st_mtim;
+    statbuf->st_ctim = statbuf->st_mtim;
+}
+
+/**
+ * open node in a free slot of the handles, with the lock held
+ * return the handle or -1 if all are used
+ */
+static int memory_claim(int node)
+{
+    int handle;
+
+    for (handle = 0; handle < MEMORY_HANDLES && memory_handles[handle].used; handle++)
+        ;
+    if (MEMORY_HANDLES == handle)
+    {
+        errno = EMFILE;
+        return -1;
+    }
+
+    memory_shared->nodes[node].opens++;
+
+    memory_handles[handle].used = 1;
+    memory_handles[handle].node = node;
+    memory_handles[handle].block = -1;
+    memory_handles[handle].offset = 0;
+
+    return handle;
+}
+
+static int memory_open(struct storage_session *session, const char *name, int flags, mode_t mode)
+{
+    char last[MEMORY_NAME_LEN];
+    int parent;
+    int handle;
+    int node;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    for (handle = 0; handle < MEMORY_HANDLES && memory_handles[handle].used; handle++)
+        ;
+    if (MEMORY_HANDLES == handle)
+    {
+        memory_unlock();
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (memory_walk(session, name, &parent, last) < 0)
+    {
+        memory_unlock();
+        return -1;
+    }
+
+    node = '\0' == last[0] ? parent : memory_lookup(parent, last);
+
+    if (O_RDONLY == (flags & O_ACCMODE))
+    {
+        if (node < 0 || memory_shared->nodes[node].dir)
+        {
+            memory_unlock();
+            errno = node < 0 ? ENOENT : EISDIR;
+            return -1;
+        }
+    }
+    else
+    {
+        if (node >= 0 && (flags & O_EXCL))
+            errno = EEXIST;
+        else if ((node >= 0 && memory_shared->nodes[node].dir) || '\0' == last[0])
+            errno = EISDIR;
+        else if (node < 0 && !(flags & O_CREAT))
+            errno = ENOENT;
+        else if (node >= 0 && !(flags & O_TRUNC))
+            errno = EINVAL;
+        else
+            errno = 0;
+
+        if (errno)
+        {
+            memory_unlock();
+            return -1;
+        }
+
+        /* the old data stays with the sessions reading it */
+        if (node >= 0)
+            memory_detach(node);
+
+        node = memory_new_node(parent, last, 0);
+        if (node < 0)
+        {
+            memory_unlock();
+            return -1;
+        }
+    }
+
+    /* a slot was free above, the lock was held since */
+    handle = memory_claim(node);
+
+    memory_unlock();
+
+    return handle;
+}
+
+static ssize_t memory_read(int handle, void *buffer, size_t size)
+{
+    struct memory_handle *file = &memory_handles[handle];
+    struct memory_node *entry = &memory_shared->nodes[file->node];
+    long long file_size;
+    size_t total;
+    size_t part;
+    int offset;
+
+    if (memory_lock() < 0)
+        return -1;
+    file_size = entry->size;
+    memory_unlock();
+
+    total = 0;
+    while (total < size && file->offset < file_size)
+    {
+        offset = file->offset % MEMORY_BLOCK_SIZE;
+
+        if (0 == offset)
+        {
+            if (memory_lock() < 0)
+                return -1;
+            file->block = file->block < 0 ? entry->first_block : memory_shared->next_block[file->block];
+            memory_unlock();
+        }
+
+        part = MEMORY_BLOCK_SIZE - offset;
+        if (part > size - total)
+            part = size - total;
+        if ((long long)part > file_size - file->offset)
+            part = file_size - file->offset;
+
+        memcpy((char *)buffer + total, memory_data + (size_t)file->block * MEMORY_BLOCK_SIZE + offset, part);
+
+        total += part;
+        file->offset += part;
+    }
+
+    return total;
+}
+
+static ssize_t memory_write(int handle, const void *buffer, size_t size)
+{
+    struct memory_handle *file = &memory_handles[handle];
+    struct memory_node *entry = &memory_shared->nodes[file->node];
+    size_t total;
+    size_t part;
+    int offset;
+    int block;
+
+    total = 0;
+    while (total < size)
+    {
+        offset = file->offset % MEMORY_BLOCK_SIZE;
+
+        if (0 == offset)
+        {
+            if (memory_lock() < 0)
+                return -1;
+
+            block = memory_shared->free_block;
+            if (block >= 0)
+            {
+                memory_shared->free_block = memory_shared->next_block[block];
+                memory_shared->next_block[block] = -1;
+
+                if (file->block < 0)
+                    entry->first_block = block;
+                else
+                    memory_shared->next_block[file->block] = block;
+            }
+
+            memory_unlock();
+
+            if (block < 0)
+            {
+                errno = ENOSPC;
+                break;
+            }
+
+            file->block = block;
+        }
+
+        part = MEMORY_BLOCK_SIZE - offset;
+        if (part > size - total)
+            part = size - total;
+
+        memcpy(memory_data + (size_t)file->block * MEMORY_BLOCK_SIZE + offset, (const char *)buffer + total, part);
+
+        total += part;
+        file->offset += part;
+    }
+
+    /* a reader sees the data only once it is copied */
+    if (memory_lock() < 0)
+        return -1;
+    entry->size = file->offset;
+    entry->mtime_ns = memory_now_ns();
+    memory_unlock();
+
+    if (0 == total && size > 0)
+        return -1;
+
+    return total;
+}
+
+static int memory_close(int handle)
+{
+    struct memory_node *entry = &memory_shared->nodes[memory_handles[handle].node];
+
+    if (memory_lock() < 0)
+    {
+        memory_handles[handle].used = 0;
+        return -1;
+    }
+
+    entry->opens--;
+    if (entry->unlinked && 0 == entry->opens)
+        memory_free_node(memory_handles[handle].node);
+
+    memory_handles[handle].used = 0;
+
+    memory_unlock();
+
+    return 0;
+}
+
+static int memory_stat(struct storage_session *session, const char *name, struct stat *statbuf)
+{
+    int node;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    node = memory_resolve(session, name);
+    if (node >= 0)
+        memory_fill_stat(node, statbuf);
+
+    memory_unlock();
+
+    return node < 0 ? -1 : 0;
+}
+
+static int memory_fstat(int handle, struct stat *statbuf)
+{
+    if (memory_lock() < 0)
+        return -1;
+    memory_fill_stat(memory_handles[handle].node, statbuf);
+    memory_unlock();
+
+    return 0;
+}
+
+static int memory_unlink(struct storage_session *session, const char *name)
+{
+    int node;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    node = memory_resolve(session, name);
+    if (node >= 0 && memory_shared->nodes[node].dir)
+    {
+        errno = EISDIR;
+        node = -1;
+    }
+
+    if (node >= 0)
+        memory_detach(node);
+
+    memory_unlock();
+
+    return node < 0 ? -1 : 0;
+}
+
+static int memory_mkdir(struct storage_session *session, const char *name, mode_t mode)
+{
+    char last[MEMORY_NAME_LEN];
+    int parent;
+    int node;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    node = -1;
+    if (memory_walk(session, name, &parent, last) < 0)
+        ;
+    else if ('\0' == last[0] || memory_lookup(parent, last) >= 0)
+        errno = EEXIST;
+    else
+        node = memory_new_node(parent, last, 1);
+
+    memory_unlock();
+
+    return node < 0 ? -1 : 0;
+}
+
+static int memory_rmdir(struct storage_session *session, const char *name)
+{
+    int result;
+    int node;
+    int i;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    result = -1;
+    node = memory_resolve(session, name);
+
+    if (node < 0)
+        ;
+    else if (!memory_shared->nodes[node].dir)
+        errno = ENOTDIR;
+    else if (0 == node)
+        errno = EBUSY;
+    else
+    {
+        for (i = 1; i < memory_shared->high; i++)
+        {
+            if (memory_shared->nodes[i].used && memory_shared->nodes[i].parent == node)
+                break;
+        }
+
+        if (i < memory_shared->high)
+            errno = ENOTEMPTY;
+        else
+        {
+            memory_detach(node);
+            result = 0;
+        }
+    }
+
+    memory_unlock();
+
+    return result;
+}
+
+static int memory_rename(struct storage_session *session, const char *from, const char *to)
+{
+    struct memory_node *entry;
+    char last[MEMORY_NAME_LEN];
+    int ancestor;
+    int parent;
+    int result;
+    int node;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    result = -1;
+    node = memory_resolve(session, from);
+
+    if (node < 0 || memory_walk(session, to, &parent, last) < 0)
+        ;
+    else if (0 == node)
+        errno = EBUSY;
+    else if ('\0' == last[0] || memory_lookup(parent, last) >= 0)
+        errno = EEXIST;
+    else
+    {
+        /* a directory can not go under itself */
+        for (ancestor = parent; ancestor != 0 && ancestor != node; ancestor = memory_shared->nodes[ancestor].parent)
+            ;
+
+        if (ancestor == node)
+            errno = EINVAL;
+        else
+        {
+            entry = &memory_shared->nodes[node];
+            memory_hash_remove(node);
+            strcpy(entry->name, last);
+            entry->parent = parent;
+            memory_hash_insert(node);
+            result = 0;
+        }
+    }
+
+    memory_unlock();
+
+    return result;
+}
+
+static int memory_copy(struct storage_session *session, const char *from, const char *to)
+{
+    char buffer[STORAGE_COPY_BUF_SIZE];
+    ssize_t size;
+    int in_handle;
+    int out_handle;
+    int saved;
+
+    in_handle = memory_open(session, from, O_RDONLY, 0);
+    if (in_handle < 0)
+        return -1;
+
+    out_handle = memory_open(session, to, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out_handle < 0)
+    {
+        saved = errno;
+        memory_close(in_handle);
+        errno = saved;
+        return -1;
+    }
+
+    while ((size = memory_read(in_handle, buffer, sizeof(buffer))) > 0)
+    {
+        if (memory_write(out_handle, buffer, size) != size)
+            break;
+    }
+
+    saved = errno;
+    memory_close(in_handle);
+    memory_close(out_handle);
+
+    if (size > 0)
+    {
+        memory_unlink(session, to);
+        errno = saved;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int memory_chdir(struct storage_session *session, const char *path)
+{
+    char normalized[PATH_MAX];
+    int node;
+
+    if (storage_normalize(session->path, path, normalized) < 0)
+        return -1;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    node = memory_resolve(session, path);
+    if (node >= 0 && !memory_shared->nodes[node].dir)
+    {
+        errno = ENOTDIR;
+        node = -1;
+    }
+
+    if (node >= 0)
+    {
+        session->node = node;
+        session->node_generation = memory_shared->nodes[node].generation;
+        strcpy(session->path, normalized);
+    }
+
+    memory_unlock();
+
+    return node < 0 ? -1 : 0;
+}
+
+static int memory_list(struct storage_session *session, storage_entry_fn fn, void *arg)
+{
+    int node;
+
+    if (memory_lock() < 0)
+        return -1;
+
+    if (!memory_cwd_valid(session))
+    {
+        memory_unlock();
+        errno = ENOENT;
+        return -1;
+    }
+
+    for (node = 1; node < memory_shared->high; node++)
+    {
+        if (memory_shared->nodes[node].used && memory_shared->nodes[node].parent == session->node)
+            fn(arg, memory_shared->nodes[node].name, memory_shared->nodes[node].dir);
+    }
+
+    memory_unlock();
+
+    return 0;
+}
+
+/**
+ * copy the files and the directories under path on the disk into the
+ * directory node, other kinds of files are left out
+ * return 0 if success or -1 if error
+ */
+static int memory_load(const char *path, int node, char *buffer)
+{
+    char child[PATH_MAX];
+    struct dirent *entry;
+    struct stat statbuf;
+    ssize_t size;
+    int result;
+    int handle;
+    int fd;
+    DIR *dp;
+
+    dp = opendir(path);
+    if (!dp)
+    {
+        perror("opendir() error");
+        return -1;
+    }
+
+    result = 0;
+    while (result >= 0 && (entry = readdir(dp)) != NULL)
+    {
+        if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, ".."))
+            continue;
+
+        if ((size_t)snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= sizeof(child) ||
+            lstat(child, &statbuf) < 0)
+            continue;
+
+        if (S_ISDIR(statbuf.st_mode))
+        {
+            result = memory_lock();
+            if (result >= 0)
+            {
+                result = memory_new_node(node, entry->d_name, 1);
+                memory_unlock();
+            }
+
+            if (result >= 0)
+                result = memory_load(child, result, buffer);
+        }
+        else if (S_ISREG(statbuf.st_mode))
+        {
+            fd = open(child, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+
+            handle = memory_lock();
+            if (handle >= 0)
+            {
+                handle = memory_new_node(node, entry->d_name, 0);
+                if (handle >= 0)
+                    handle = memory_claim(handle);
+                memory_unlock();
+            }
+
+            result = handle;
+
+            while (handle >= 0 && (size = read(fd, buffer, STORAGE_COPY_BUF_SIZE)) > 0)
+            {
+                if (memory_write(handle, buffer, size) != size)
+                {
+                    result = -1;
+                    break;
+                }
+            }
+
+            if (handle >= 0)
+                memory_close(handle);
+            close(fd);
+        }
+
+        if (result < 0)
+            perror(child);
+    }
+
+    closedir(dp);
+
+    return result < 0 ? -1 : 0;
+}
+
+static int memory_initialize(const char *root, const char *option)
+{
+    long long size = MEMORY_DEFAULT_SIZE;
+    size_t header;
+    char *buffer;
+    char *base;
+    int result;
+    int i;
+
+    if (option)
+        size = parse_size(option);
+
+    if (size < MEMORY_BLOCK_SIZE || size / MEMORY_BLOCK_SIZE > INT_MAX)
+    {
+        error_handling("invalid size of the memory storage");
+        return -1;
+    }
+
+    memory_blocks = size / MEMORY_BLOCK_SIZE;
+
+    header = sizeof(struct memory_shared) + (size_t)memory_blocks * sizeof(int);
+    header = (header + MEMORY_BLOCK_SIZE - 1) / MEMORY_BLOCK_SIZE * MEMORY_BLOCK_SIZE;
+
+    /* the pages are only touched as the files grow */
+    base = mmap(NULL, header + (size_t)memory_blocks * MEMORY_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == base)
+    {
+        perror("mmap() error");
+        return -1;
+    }
+
+    memory_shared = (struct memory_shared *)base;
+    memory_data = base + header;
+
+    if (shared_mutex_initialize(&memory_shared->lock) < 0)
+        return -1;
+
+    for (i = 0; i < MEMORY_NODES; i++)
+    {
+        memory_shared->buckets[i] = -1;
+        memory_shared->nodes[i].next = i + 1 < MEMORY_NODES ? i + 1 : -1;
+    }
+
+    for (i = 0; i < memory_blocks; i++)
+        memory_shared->next_block[i] = i + 1 < memory_blocks ? i + 1 : -1;
+
+    /* the root is its own parent and in no bucket */
+    memory_shared->nodes[0].used = 1;
+    memory_shared->nodes[0].dir = 1;
+    memory_shared->nodes[0].first_block = -1;
+    memory_shared->nodes[0].mtime_ns = memory_now_ns();
+    memory_shared->free_node = 1;
+    memory_shared->free_block = 0;
+    memory_shared->high = 1;
+
+    buffer = malloc(STORAGE_COPY_BUF_SIZE);
+    result = buffer ? memory_load(root, 0, buffer) : -1;
+    free(buffer);
+
+    if (result < 0)
+    {
+        error_handling("the work directory does not fit in the memory storage");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int memory_session_begin(struct storage_session *session)
+{
+    memset(session->path, 0, sizeof(session->path));
+    session->node = 0;
+    session->node_generation = memory_shared->nodes[0].generation;
+
+    return 0;
+}
+
+static void memory_session_end(struct storage_session *session)
+{
+}
+
+static const struct storage_backend storage_memory = {
+    .name = "memory",
+    .fds = 0,
+    .initialize = memory_initialize,
+    .session_begin = memory_session_begin,
+    .session_end = memory_session_end,
+    .open = memory_open,
+    .read = memory_read,
+    .write = memory_write,
+    .close = memory_close,
+    .stat = memory_stat,
+    .fstat = memory_fstat,
+    .unlink = memory_unlink,
+    .mkdir = memory_mkdir,
+    .rmdir = memory_rmdir,
+    .rename = memory_rename,
+    .copy = memory_copy,
+    .chdir = memory_chdir,
+    .list = memory_list,
+};
+
+/**
+ * the backends -S can choose
+ */
+static const struct storage_backend *storage_backends[] = {&storage_posix, &storage_memory, NULL};
+
+static const struct storage_backend *storage = &storage_posix;
+
+int storage_initialize(const char *spec, const char *root)
+{
+    const char *option;
+    size_t length;
+    int i;
+
+    option = strchr(spec, ':');
+    length = option ? (size_t)(option - spec) : strlen(spec);
+    if (option)
+        option++;
+
+    for (i = 0; storage_backends[i]; i++)
+    {
+        if (strlen(storage_backends[i]->name) == length && 0 == strncmp(storage_backends[i]->name, spec, length))
+            break;
+    }
+
+    if (!storage_backends[i])
+    {
+        error_handling("unknown storage, posix or memory[:size]");
+        return -1;
+    }
+
+    if (storage_backends[i]->initialize(root, option) < 0)
+        return -1;
+
+    storage = storage_backends[i];
+
+    return 0;
+}
+
+#endif
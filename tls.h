@@ -0,0 +1,779 @@
+#ifndef TLS_H
+#define TLS_H
+
+/**
+ * --- tls.h defines ---
+ * TLS on the command and data connections, with the records done by the
+ * kernel where it can, built with make TLS=1
+ *
+ * After OPTS_TLS is answered with 200 the client and the server run a TLS
+ * handshake with OpenSSL on the command connection, and from then on every
+ * data connection of the session runs one before its 125. A data
+ * connection must resume the TLS session of its command connection, so no
+ * other client can take the data port of a transfer: the server keeps the
+ * sessions in the process of the session only and gives no tickets.
+ *
+ * After the handshake the keys go to the kernel (kTLS) and the socket is
+ * given back to the program as it was: send(), sendmsg() and recv() move
+ * plaintext while the kernel makes and checks the records, so a transfer
+ * keeps the code paths and the copies of a plain one. Where the kernel
+ * takes only one direction or none, the program gets one end of a loopback
+ * TCP pair under the same fd number instead, and a relay thread moves the
+ * bytes between it and SSL_read() and SSL_write() on the real socket, like
+ * the relays of netem.h.
+ *
+ * The connections are TLS 1.2 with ECDHE and AES-GCM or ChaCha20, what
+ * OpenSSL 3.0 hands to the kernel in both directions. A command connection
+ * ends with the TCP close like a plain one, after QUIT. A data connection
+ * ends with a close_notify alert, sent by a relay once the program closes
+ * its end or by tls_close_notify() on a kTLS socket, and the receiver
+ * checks it with tls_recv_end(): a FIN without it, which anyone on the
+ * path can forge, is a truncated transfer and fails like a record that
+ * does not check, which resets the connection of the program.
+ */
+
+#include "base.h"
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+/**
+ * the environment variable of the client naming the PEM file of the
+ * certificates the server must be signed by, the client asks for TLS
+ * when it is set
+ */
+#define TLS_CA_ENV "FTP_TLS"
+
+/**
+ * the bytes a relay holds in each direction
+ */
+#define TLS_RELAY_BUF_SIZE (64 * 1024)
+
+/**
+ * the longest wait at exit() for the relays to send what they hold
+ */
+#define TLS_FINISH_MS 5000
+
+/**
+ * 1 once a context was made by tls_server_initialize() or
+ * tls_client_initialize()
+ */
+static int tls_configured = 0;
+
+/**
+ * make the context of a server from the PEM file at path holding its
+ * certificate chain and its private key
+ * return 0 if success or -1 if error
+ */
+int tls_server_initialize(const char *path);
+
+/**
+ * make the context of a client checking the server against the PEM file
+ * of certificates at ca_path
+ * return 0 if success or -1 if error
+ */
+int tls_client_initialize(const char *ca_path);
+
+/**
+ * run the handshake of a server on sockfd, which must resume the session
+ * of the command connection if resume is 1; sockfd keeps its number
+ * return 1 if the kernel does the records, 0 if a relay does or -1 if error
+ */
+int tls_accept(int sockfd, int resume);
+
+/**
+ * run the handshake of a client on sockfd, checking the certificate of
+ * host and offering the session of the first connection; sockfd keeps its
+ * number
+ * return 1 if the kernel does the records, 0 if a relay does or -1 if error
+ */
+int tls_connect(int sockfd, const char *host);
+
+/**
+ * return 1 if the kernel does the records of sockfd, a relay or a plain
+ * connection gives 0
+ */
+int tls_kernel_records(int sockfd);
+
+/**
+ * send the close_notify alert ending the data connection sockfd after a
+ * transfer that succeeded, a relay sends it by itself once sockfd is
+ * closed
+ * return 0 if success or -1 if error
+ */
+int tls_close_notify(int sockfd);
+
+/**
+ * check how the data read from sockfd ended, size being what the last
+ * recv() returned, 0 or -1 with errno; on a kTLS socket a FIN is a
+ * truncation and the close_notify alert, which recv() fails on with EIO,
+ * is the end
+ * return size, or 0 if the alert ended the data, or -1 with EPROTO if the
+ * data was cut short
+ */
+int tls_recv_end(int sockfd, int size);
+
+/**
+ * wait for the relays to send what they hold, run at exit()
+ */
+void tls_finish(void);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+#ifndef FTP_TLS
+
+int tls_server_initialize(const char *path)
+{
+    error_handling("built without TLS, make TLS=1");
+    return -1;
+}
+
+int tls_client_initialize(const char *ca_path)
+{
+    error_handling("built without TLS, make TLS=1");
+    return -1;
+}
+
+int tls_accept(int sockfd, int resume)
+{
+    return -1;
+}
+
+int tls_connect(int sockfd, const char *host)
+{
+    return -1;
+}
+
+int tls_kernel_records(int sockfd)
+{
+    return 0;
+}
+
+int tls_close_notify(int sockfd)
+{
+    return 0;
+}
+
+int tls_recv_end(int sockfd, int size)
+{
+    return size;
+}
+
+void tls_finish(void)
+{
+}
+
+#else
+
+#include <linux/tls.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+/**
+ * the content type of an alert record and the close_notify alert
+ */
+#define TLS_RECORD_ALERT 21
+#define TLS_ALERT_WARNING 1
+#define TLS_ALERT_CLOSE_NOTIFY 0
+
+/**
+ * one connection whose records are done in user space, out is from the
+ * program to the peer and in from the peer to the program
+ */
+struct tls_relay
+{
+    SSL *ssl;
+    int sockfd; /* the real socket, non-blocking */
+    int plain;  /* the end of the pair of the relay */
+    char out[TLS_RELAY_BUF_SIZE];
+    int out_start;
+    int out_end;
+    int out_eof;
+    char in[TLS_RELAY_BUF_SIZE];
+    int in_start;
+    int in_end;
+    int in_eof;
+    int in_shut;
+    int data; /* a data connection, which must end with close_notify */
+};
+
+static SSL_CTX *tls_context = NULL;
+static SSL_SESSION *tls_session = NULL; /* of the client, offered again */
+static int tls_relays = 0;
+static int tls_exiting = 0;
+static int tls_wake_fd = -1; /* readable once the process exits */
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tls_idle = PTHREAD_COND_INITIALIZER;
+
+/**
+ * make the context shared by the server and the client
+ * return it or NULL if error
+ */
+static SSL_CTX *tls_context_new(const SSL_METHOD *method)
+{
+    SSL_CTX *context;
+
+    context = SSL_CTX_new(method);
+    if (!context)
+        return NULL;
+
+    if (!SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION) ||
+        !SSL_CTX_set_max_proto_version(context, TLS1_2_VERSION) ||
+        !SSL_CTX_set_cipher_list(context, "ECDHE+AESGCM:ECDHE+CHACHA20"))
+    {
+        SSL_CTX_free(context);
+        return NULL;
+    }
+
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET);
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE);
+
+    return context;
+}
+
+int tls_server_initialize(const char *path)
+{
+    tls_context = tls_context_new(TLS_server_method());
+
+    if (!tls_context || SSL_CTX_use_certificate_chain_file(tls_context, path) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_context, path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_context) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        error_handling("the certificate and the key of the server are unusable");
+        return -1;
+    }
+
+    SSL_CTX_set_session_id_context(tls_context, (const unsigned char *)"ftp", 3);
+    tls_configured = 1;
+
+    return 0;
+}
+
+int tls_client_initialize(const char *ca_path)
+{
+    tls_context = tls_context_new(TLS_client_method());
+
+    if (!tls_context || SSL_CTX_load_verify_locations(tls_context, ca_path, NULL) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        error_handling("the certificates of " TLS_CA_ENV " are unusable");
+        return -1;
+    }
+
+    SSL_CTX_set_verify(tls_context, SSL_VERIFY_PEER, NULL);
+    tls_configured = 1;
+
+    return 0;
+}
+
+/**
+ * add to *events what the SSL call that returned result waits for
+ * return 0 if it waits or -1 if it failed
+ */
+static int tls_wanted(SSL *ssl, int result, short *events)
+{
+    switch (SSL_get_error(ssl, result))
+    {
+    case SSL_ERROR_WANT_READ:
+        *events |= POLLIN;
+        return 0;
+    case SSL_ERROR_WANT_WRITE:
+        *events |= POLLOUT;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void *tls_relay_main(void *arg)
+{
+    struct tls_relay *relay = arg;
+    struct pollfd pollfds[3];
+    struct linger linger;
+    sigset_t signals;
+    ssize_t size;
+    short wanted;
+    int progress;
+    int exiting;
+    int failed;
+    int result;
+
+    /* a write to a peer that is gone fails with EPIPE, the client does not
+     * ignore SIGPIPE */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    failed = 0;
+
+    while (1)
+    {
+        progress = 0;
+        wanted = 0;
+        pollfds[0].events = 0;
+
+        /* from the program to the peer */
+        if (relay->out_start == relay->out_end && !relay->out_eof)
+        {
+            size = recv(relay->plain, relay->out, TLS_RELAY_BUF_SIZE, MSG_DONTWAIT);
+            if (size > 0)
+            {
+                relay->out_start = 0;
+                relay->out_end = size;
+                progress = 1;
+            }
+            else if (0 == size || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                relay->out_eof = 1;
+                progress = 1;
+            }
+            else
+            {
+                pollfds[0].events |= POLLIN;
+            }
+        }
+
+        if (relay->out_start < relay->out_end)
+        {
+            ERR_clear_error();
+            result = SSL_write(relay->ssl, relay->out + relay->out_start, relay->out_end - relay->out_start);
+            if (result > 0)
+            {
+                relay->out_start += result;
+                progress = 1;
+            }
+            else if (tls_wanted(relay->ssl, result, &wanted) < 0)
+            {
+                failed = 1;
+                break;
+            }
+        }
+        else if (relay->out_eof)
+        {
+            /* the program closed its end and all it sent is out, a data
+             * connection says so with close_notify before the FIN; a peer
+             * that sent its own first may be gone already */
+            ERR_clear_error();
+            result = relay->data ? SSL_shutdown(relay->ssl) : 0;
+            if (result >= 0 || relay->in_eof)
+            {
+                shutdown(relay->sockfd, SHUT_WR);
+                break;
+            }
+            if (tls_wanted(relay->ssl, result, &wanted) < 0)
+            {
+                failed = 1;
+                break;
+            }
+        }
+
+        /* from the peer to the program */
+        if (relay->in_start == relay->in_end && !relay->in_eof)
+        {
+            ERR_clear_error();
+            result = SSL_read(relay->ssl, relay->in, TLS_RELAY_BUF_SIZE);
+            if (result > 0)
+            {
+                relay->in_start = 0;
+                relay->in_end = result;
+                progress = 1;
+            }
+            else if (SSL_ERROR_ZERO_RETURN == SSL_get_error(relay->ssl, result) ||
+                     (!relay->data && ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING))
+            {
+                /* a command connection may end with the FIN alone */
+                relay->in_eof = 1;
+                progress = 1;
+            }
+            else if (tls_wanted(relay->ssl, result, &wanted) < 0)
+            {
+                failed = 1;
+                break;
+            }
+        }
+
+        if (relay->in_start < relay->in_end)
+        {
+            size = send(relay->plain, relay->in + relay->in_start, relay->in_end - relay->in_start,
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (size > 0)
+            {
+                relay->in_start += size;
+                progress = 1;
+            }
+            else if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+            {
+                pollfds[0].events |= POLLOUT;
+            }
+            else
+            {
+                break; /* the program is gone */
+            }
+        }
+        else if (relay->in_eof && !relay->in_shut)
+        {
+            shutdown(relay->plain, SHUT_WR);
+            relay->in_shut = 1;
+        }
+
+        if (progress)
+            continue;
+
+        exiting = __atomic_load_n(&tls_exiting, __ATOMIC_ACQUIRE);
+
+        pollfds[0].fd = relay->plain;
+        pollfds[1].fd = relay->sockfd;
+        pollfds[1].events = wanted;
+        pollfds[2].fd = tls_wake_fd;
+        pollfds[2].events = exiting ? 0 : POLLIN;
+
+        /* once exiting the program is only checked for what it left */
+        if (poll(pollfds, 3, exiting && (pollfds[0].events & POLLIN) ? 0 : -1) < 0 && errno != EINTR)
+            break;
+
+        /* the program exits and has nothing more to send */
+        if ((pollfds[0].events & POLLIN) && !(pollfds[0].revents & (POLLIN | POLLHUP | POLLERR)) &&
+            __atomic_load_n(&tls_exiting, __ATOMIC_ACQUIRE))
+            relay->out_eof = 1;
+    }
+
+    /* a record that did not check must not look like the end of a file */
+    if (failed)
+    {
+        ERR_clear_error();
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+        setsockopt(relay->plain, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    else
+    {
+        /* only keeps the session resumable, what had to be sent is out */
+        SSL_set_quiet_shutdown(relay->ssl, 1);
+        SSL_shutdown(relay->ssl);
+    }
+
+    SSL_free(relay->ssl);
+    close(relay->sockfd);
+    close(relay->plain);
+    free(relay);
+
+    pthread_mutex_lock(&tls_lock);
+    tls_relays--;
+    pthread_cond_broadcast(&tls_idle);
+    pthread_mutex_unlock(&tls_lock);
+
+    return NULL;
+}
+
+/**
+ * put a relay of ssl under sockfd, which becomes the end of the program;
+ * data is 1 for a data connection
+ * return 0 if success or -1 if error
+ */
+static int tls_relay_start(SSL *ssl, int sockfd, int data)
+{
+    struct tls_relay *relay;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int enable;
+    int fds[2];
+
+    if (tls_wake_fd < 0)
+    {
+        tls_wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (tls_wake_fd < 0)
+        {
+            perror("eventfd() error");
+            return -1;
+        }
+        atexit(tls_finish);
+    }
+
+    relay = calloc(1, sizeof(struct tls_relay));
+    if (!relay)
+        return -1;
+
+    /* a loopback TCP pair, the socket options of the program still work */
+    if (netem_pair(fds) < 0)
+    {
+        perror("tls_relay_start() error");
+        free(relay);
+        return -1;
+    }
+
+    relay->ssl = ssl;
+    relay->data = data;
+    relay->plain = fds[1];
+    relay->sockfd = fcntl(sockfd, F_DUPFD_CLOEXEC, 0);
+
+    if (relay->sockfd < 0 || dup3(fds[0], sockfd, O_CLOEXEC) < 0)
+    {
+        perror("dup3() error");
+        if (relay->sockfd >= 0)
+            close(relay->sockfd);
+        close(fds[0]);
+        close(fds[1]);
+        free(relay);
+        return -1;
+    }
+
+    close(fds[0]);
+
+    SSL_set_fd(ssl, relay->sockfd);
+    fcntl(relay->sockfd, F_SETFL, fcntl(relay->sockfd, F_GETFL) | O_NONBLOCK);
+
+    /* the records hold what the program sent, Nagle would hold them back */
+    enable = 1;
+    setsockopt(relay->sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    setsockopt(relay->plain, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    pthread_mutex_lock(&tls_lock);
+    tls_relays++;
+    pthread_mutex_unlock(&tls_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attr, tls_relay_main, relay) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        error_handling("pthread_create() error");
+        pthread_mutex_lock(&tls_lock);
+        tls_relays--;
+        pthread_mutex_unlock(&tls_lock);
+        close(relay->sockfd);
+        close(relay->plain);
+        free(relay);
+        return -1;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return 0;
+}
+
+/**
+ * hand the connection of ssl after its handshake to the kernel or a relay,
+ * ssl is freed or kept by the relay; data is 1 for a data connection
+ * return 1 if the kernel does the records, 0 if a relay does or -1 if error
+ */
+static int tls_attach(SSL *ssl, int sockfd, int data)
+{
+#ifndef OPENSSL_NO_KTLS
+    /* the socket itself does the records, SSL is not needed any more; the
+     * quiet SSL_shutdown() sends nothing and keeps the session resumable */
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl))
+    {
+        SSL_set_quiet_shutdown(ssl, 1);
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        return 1;
+    }
+#endif
+
+    if (tls_relay_start(ssl, sockfd, data) < 0)
+    {
+        SSL_free(ssl);
+        return -1;
+    }
+
+    return 0;
+}
+
+int tls_accept(int sockfd, int resume)
+{
+    SSL *ssl;
+
+    ssl = SSL_new(tls_context);
+    if (!ssl || !SSL_set_fd(ssl, sockfd))
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+
+    ERR_clear_error();
+    if (SSL_accept(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        error_handling("SSL_accept() error");
+        SSL_free(ssl);
+        return -1;
+    }
+
+    if (resume && !SSL_session_reused(ssl))
+    {
+        error_handling("the data connection did not resume the TLS session of the command connection");
+        SSL_free(ssl);
+        return -1;
+    }
+
+    return tls_attach(ssl, sockfd, resume);
+}
+
+int tls_connect(int sockfd, const char *host)
+{
+    long verified;
+    SSL *ssl;
+    int data;
+
+    ssl = SSL_new(tls_context);
+    if (!ssl || !SSL_set_fd(ssl, sockfd))
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+
+    /* the server is reached by its address, a name is checked as a name */
+    if (!X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host))
+    {
+        SSL_set1_host(ssl, host);
+        SSL_set_tlsext_host_name(ssl, host);
+    }
+
+    /* the connections after the first are data connections */
+    data = tls_session != NULL;
+    if (tls_session)
+        SSL_set_session(ssl, tls_session);
+
+    ERR_clear_error();
+    if (SSL_connect(ssl) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+
+        verified = SSL_get_verify_result(ssl);
+        if (verified != X509_V_OK)
+            error_handling(X509_verify_cert_error_string(verified));
+
+        error_handling("SSL_connect() error");
+        SSL_free(ssl);
+        return -1;
+    }
+
+    if (!tls_session)
+        tls_session = SSL_get1_session(ssl);
+
+    return tls_attach(ssl, sockfd, data);
+}
+
+int tls_kernel_records(int sockfd)
+{
+    char ulp[16];
+    socklen_t length;
+
+    if (!tls_configured)
+        return 0;
+
+    memset(ulp, 0, sizeof(ulp));
+    length = sizeof(ulp) - 1;
+
+    return 0 == getsockopt(sockfd, IPPROTO_TCP, TCP_ULP, ulp, &length) && 0 == strcmp(ulp, "tls");
+}
+
+int tls_close_notify(int sockfd)
+{
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    char alert[2] = {TLS_ALERT_WARNING, TLS_ALERT_CLOSE_NOTIFY};
+    struct cmsghdr *cmsg;
+    struct msghdr message;
+    struct iovec iov;
+
+    if (!tls_kernel_records(sockfd))
+        return 0;
+
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = alert;
+    iov.iov_len = sizeof(alert);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    /* the kernel sends the bytes as one alert record */
+    cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = TLS_RECORD_ALERT;
+
+    if (sendmsg(sockfd, &message, MSG_NOSIGNAL) < 0)
+    {
+        perror("sendmsg() error");
+        return -1;
+    }
+
+    return 0;
+}
+
+int tls_recv_end(int sockfd, int size)
+{
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    unsigned char alert[2];
+    struct cmsghdr *cmsg;
+    struct msghdr message;
+    struct iovec iov;
+    ssize_t result;
+
+    /* a relay resets the program on a FIN without close_notify */
+    if (size > 0 || (size < 0 && errno != EIO) || !tls_kernel_records(sockfd))
+        return size;
+
+    if (size < 0)
+    {
+        /* recv() stops at a record that is not data, it is read with its type */
+        memset(&message, 0, sizeof(message));
+        iov.iov_base = alert;
+        iov.iov_len = sizeof(alert);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        result = recvmsg(sockfd, &message, 0);
+        cmsg = result == sizeof(alert) ? CMSG_FIRSTHDR(&message) : NULL;
+
+        if (cmsg && SOL_TLS == cmsg->cmsg_level && TLS_GET_RECORD_TYPE == cmsg->cmsg_type &&
+            TLS_RECORD_ALERT == *CMSG_DATA(cmsg) && TLS_ALERT_CLOSE_NOTIFY == alert[1])
+            return 0;
+    }
+
+    errno = EPROTO;
+    return -1;
+}
+
+void tls_finish(void)
+{
+    unsigned long long one = 1;
+    struct timespec deadline;
+
+    __atomic_store_n(&tls_exiting, 1, __ATOMIC_RELEASE);
+    if (write(tls_wake_fd, &one, sizeof(one)) < 0)
+        perror("write() error");
+
+    /* a peer that stopped reading must not keep the process forever */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TLS_FINISH_MS / 1000;
+
+    pthread_mutex_lock(&tls_lock);
+    while (tls_relays > 0)
+    {
+        if (ETIMEDOUT == pthread_cond_timedwait(&tls_idle, &tls_lock, &deadline))
+            break;
+    }
+    pthread_mutex_unlock(&tls_lock);
+}
+
+#endif /* FTP_TLS */
+
+#endif
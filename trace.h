@@ -0,0 +1,400 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * --- trace.h defines ---
+ * opt-in timeline tracing of sessions and transfers,
+ * shared by server and client
+ *
+ * Tracing is enabled by the environment variable FTP_TRACE naming a
+ * directory. Every process then writes the timestamped spans of its
+ * commands and transfer phases into <dir>/<role>.<pid>.trace, a compact
+ * binary file that tracecvt turns into a Chrome/Perfetto trace. Disk and
+ * socket time inside a transfer is summed over windows of TRACE_WINDOW_NS
+ * instead of one span per chunk. With tracing disabled every hook is a
+ * single test of trace_enabled.
+ */
+
+#include "base.h"
+#include <errno.h>
+
+#define TRACE_MAGIC "FTPTRACE"
+#define TRACE_VERSION 1
+
+/**
+ * events buffered in memory before a write() to the trace file
+ */
+#define TRACE_BUF_EVENTS 1024
+
+/**
+ * the disk and socket time of a transfer is summed over windows this long
+ */
+#define TRACE_WINDOW_NS 1000000LL
+
+#define TRACE_DETAIL_LEN 32
+
+/**
+ * the spans of a trace, the i/o spans are summed over windows
+ */
+enum trace_span
+{
+    TRACE_SESSION,
+    TRACE_CONNECT,
+    TRACE_LOGIN,
+    TRACE_COMMAND,
+    TRACE_PORT_SETUP,
+    TRACE_DATA_ACCEPT,
+    TRACE_DATA_CONNECT,
+    TRACE_REPLY_WAIT,
+    TRACE_TRANSFER,
+    TRACE_DISK_READ,
+    TRACE_DISK_WRITE,
+    TRACE_NET_SEND,
+    TRACE_NET_RECV,
+    TRACE_SPANS
+};
+
+#define TRACE_FIRST_IO TRACE_DISK_READ
+#define TRACE_IO_SPANS (TRACE_SPANS - TRACE_FIRST_IO)
+
+/**
+ * the head of a trace file
+ */
+struct trace_header
+{
+    char magic[8];
+    int version;
+    int pid;
+    char role[16];
+    long long realtime_offset; /* CLOCK_REALTIME minus CLOCK_MONOTONIC, in ns */
+};
+
+/**
+ * a span of a trace file, value is bytes for transfers
+ * and the number of calls for the i/o windows
+ */
+struct trace_event
+{
+    long long start;
+    long long duration;
+    long long value;
+    int span;
+    char detail[TRACE_DETAIL_LEN];
+};
+
+/**
+ * the i/o time of a helper thread, which must not touch the trace state,
+ * kept apart until the thread is joined
+ */
+struct trace_io_total
+{
+    long long start; /* of the first call */
+    long long ns;
+    long long calls;
+};
+
+static int trace_enabled = 0;
+static int trace_fd = -1;
+static char trace_dir[BUF_SIZE * 2];
+static char trace_role[16];
+static struct trace_event trace_events[TRACE_BUF_EVENTS];
+static int trace_count = 0;
+static long long trace_window_start = 0;
+static long long trace_io_ns[TRACE_IO_SPANS];
+static long long trace_io_calls[TRACE_IO_SPANS];
+
+/**
+ * get a start time for a span, 0 if tracing is disabled
+ */
+#define trace_begin() (trace_enabled ? monotonic_ns() : 0)
+
+/**
+ * record span started at start with a detail string and a value
+ */
+#define trace_end(span, start, detail, value)                    \
+    do                                                           \
+    {                                                            \
+        if (trace_enabled)                                       \
+            trace_record((span), (start), (detail), (value));    \
+    } while (0)
+
+/**
+ * add the time since start to the window of the i/o span
+ */
+#define trace_io(span, start)              \
+    do                                     \
+    {                                      \
+        if (trace_enabled)                 \
+            trace_io_add((span), (start)); \
+    } while (0)
+
+/**
+ * add the time since start to the i/o total of a helper thread
+ */
+#define trace_io_thread(total, start)             \
+    do                                            \
+    {                                             \
+        if (trace_enabled)                        \
+            trace_io_total_add((total), (start)); \
+    } while (0)
+
+/**
+ * enable tracing if FTP_TRACE is set, role names the trace files
+ * return 0 if success or -1 if error
+ */
+int trace_initialize(const char *role);
+
+/**
+ * forget the events of the parent and start a trace file
+ * for the new process, called in the child after fork()
+ */
+void trace_after_fork(void);
+
+/**
+ * record a span
+ */
+void trace_record(int span, long long start, const char *detail, long long value);
+
+/**
+ * add the time since start to the current window of an i/o span
+ */
+void trace_io_add(int span, long long start);
+
+/**
+ * record the open windows of the i/o spans
+ */
+void trace_io_flush(void);
+
+/**
+ * add the time since start to total, safe outside the traced thread
+ */
+void trace_io_total_add(struct trace_io_total *total, long long start);
+
+/**
+ * record total as one event of the i/o span and clear it, called by the
+ * traced thread once the helper thread that summed it is joined
+ */
+void trace_io_total_record(int span, struct trace_io_total *total);
+
+/**
+ * write the buffered events into the trace file
+ * return 0 if success or -1 if error
+ */
+int trace_flush(void);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static void trace_atexit(void)
+{
+    if (!trace_enabled)
+        return;
+
+    trace_io_flush();
+    trace_flush();
+}
+
+int trace_initialize(const char *role)
+{
+    const char *dir;
+
+    dir = getenv("FTP_TRACE");
+    if (!dir || !*dir)
+        return 0;
+
+    if (strlen(dir) >= sizeof(trace_dir) - 64)
+    {
+        error_handling("FTP_TRACE is too long");
+        return -1;
+    }
+
+    strcpy(trace_dir, dir);
+    memset(trace_role, 0, sizeof(trace_role));
+    strncpy(trace_role, role, sizeof(trace_role) - 1);
+
+    trace_enabled = 1;
+    trace_count = 0;
+    trace_fd = -1;
+
+    atexit(trace_atexit);
+
+    return 0;
+}
+
+void trace_after_fork(void)
+{
+    if (!trace_enabled)
+        return;
+
+    trace_count = 0;
+    trace_window_start = 0;
+    memset(trace_io_ns, 0, sizeof(trace_io_ns));
+    memset(trace_io_calls, 0, sizeof(trace_io_calls));
+
+    if (trace_fd >= 0)
+    {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+/**
+ * create the trace file of the process and write its header
+ * return 0 if success or -1 if error
+ */
+static int trace_open(void)
+{
+    char path[sizeof(trace_dir) + 64];
+    struct trace_header header;
+    struct timespec realtime;
+    int result;
+
+    snprintf(path, sizeof(path), "%s/%s.%d.trace", trace_dir, trace_role, (int)getpid());
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (trace_fd < 0)
+    {
+        perror("open() trace error");
+        trace_enabled = 0;
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.pid = getpid();
+    strcpy(header.role, trace_role);
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    header.realtime_offset = (long long)realtime.tv_sec * 1000000000LL + realtime.tv_nsec - monotonic_ns();
+
+    result = write(trace_fd, &header, sizeof(header));
+
+    if (result < 0)
+    {
+        perror("write() trace error");
+        close(trace_fd);
+        trace_fd = -1;
+        trace_enabled = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int trace_flush(void)
+{
+    int result;
+
+    if (0 == trace_count)
+        return 0;
+
+    if (trace_fd < 0 && trace_open() < 0)
+        return -1;
+
+    result = write(trace_fd, trace_events, trace_count * sizeof(struct trace_event));
+    trace_count = 0;
+
+    if (result < 0)
+    {
+        perror("write() trace error");
+        return -1;
+    }
+
+    return 0;
+}
+
+void trace_record(int span, long long start, const char *detail, long long value)
+{
+    struct trace_event *event;
+
+    if (trace_count == TRACE_BUF_EVENTS)
+        trace_flush();
+
+    event = &trace_events[trace_count++];
+    event->start = start;
+    event->duration = monotonic_ns() - start;
+    event->value = value;
+    event->span = span;
+
+    memset(event->detail, 0, TRACE_DETAIL_LEN);
+    if (detail)
+        strncpy(event->detail, detail, TRACE_DETAIL_LEN - 1);
+}
+
+void trace_io_flush(void)
+{
+    struct trace_event *event;
+    int i;
+
+    for (i = 0; i < TRACE_IO_SPANS; i++)
+    {
+        if (0 == trace_io_calls[i])
+            continue;
+
+        if (trace_count == TRACE_BUF_EVENTS)
+            trace_flush();
+
+        event = &trace_events[trace_count++];
+        event->start = trace_window_start;
+        event->duration = trace_io_ns[i];
+        event->value = trace_io_calls[i];
+        event->span = TRACE_FIRST_IO + i;
+        memset(event->detail, 0, TRACE_DETAIL_LEN);
+
+        trace_io_ns[i] = 0;
+        trace_io_calls[i] = 0;
+    }
+
+    trace_window_start = 0;
+}
+
+void trace_io_add(int span, long long start)
+{
+    long long now;
+
+    now = monotonic_ns();
+
+    if (trace_window_start > 0 && now - trace_window_start >= TRACE_WINDOW_NS)
+        trace_io_flush();
+
+    if (0 == trace_window_start)
+        trace_window_start = start;
+
+    trace_io_ns[span - TRACE_FIRST_IO] += now - start;
+    trace_io_calls[span - TRACE_FIRST_IO]++;
+}
+
+void trace_io_total_add(struct trace_io_total *total, long long start)
+{
+    if (0 == total->calls)
+        total->start = start;
+
+    total->ns += monotonic_ns() - start;
+    total->calls++;
+}
+
+void trace_io_total_record(int span, struct trace_io_total *total)
+{
+    struct trace_event *event;
+
+    if (!trace_enabled || 0 == total->calls)
+        return;
+
+    if (trace_count == TRACE_BUF_EVENTS)
+        trace_flush();
+
+    event = &trace_events[trace_count++];
+    event->start = total->start;
+    event->duration = total->ns;
+    event->value = total->calls;
+    event->span = span;
+    memset(event->detail, 0, TRACE_DETAIL_LEN);
+
+    memset(total, 0, sizeof(*total));
+}
+
+#endif
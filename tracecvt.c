@@ -0,0 +1,201 @@
+/**
+ * the trace converter
+ * turns the trace files written with FTP_TRACE into
+ * the Chrome trace event format read by chrome://tracing and Perfetto
+ *
+ * usage: ./tracecvt file.trace... > trace.json
+ */
+
+#include "trace.h"
+
+/**
+ * the names of the spans, in the order of enum trace_span
+ */
+static const char *trace_span_names[TRACE_SPANS] = {
+    "session",
+    "connect",
+    "login",
+    "command",
+    "port setup",
+    "data accept",
+    "data connect",
+    "reply wait",
+    "transfer",
+    "disk read",
+    "disk write",
+    "net send",
+    "net recv",
+};
+
+/**
+ * the thread lanes of the viewer, the session and command spans,
+ * the transfers and the summed i/o windows go to separate rows
+ */
+#define LANE_SESSION 1
+#define LANE_PHASE 2
+#define LANE_TRANSFER 3
+#define LANE_DISK 4
+#define LANE_NET 5
+
+/**
+ * get the lane of span
+ */
+int span_lane(int span);
+
+/**
+ * write str as a JSON string
+ */
+void write_json_string(FILE *out, const char *str);
+
+/**
+ * convert one trace file, first is 1 if no event has been written yet
+ * return the number of events written or -1 if error
+ */
+int convert_file(FILE *out, const char *path, int first);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+int span_lane(int span)
+{
+    switch (span)
+    {
+    case TRACE_SESSION:
+    case TRACE_COMMAND:
+        return LANE_SESSION;
+    case TRACE_TRANSFER:
+        return LANE_TRANSFER;
+    case TRACE_DISK_READ:
+    case TRACE_DISK_WRITE:
+        return LANE_DISK;
+    case TRACE_NET_SEND:
+    case TRACE_NET_RECV:
+        return LANE_NET;
+    default:
+        return LANE_PHASE;
+    }
+}
+
+void write_json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+
+    for (; *str; str++)
+    {
+        if ('"' == *str || '\\' == *str)
+            fprintf(out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char)*str);
+        else
+            fputc(*str, out);
+    }
+
+    fputc('"', out);
+}
+
+int convert_file(FILE *out, const char *path, int first)
+{
+    struct trace_header header;
+    struct trace_event event;
+    char detail[TRACE_DETAIL_LEN + 1];
+    char label[16 + 32];
+    long long start;
+    int count;
+    FILE *fd;
+
+    fd = fopen(path, "rb");
+
+    if (!fd)
+    {
+        perror("fopen() error");
+        return -1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fd) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION)
+    {
+        fclose(fd);
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return -1;
+    }
+
+    header.role[sizeof(header.role) - 1] = '\0';
+    snprintf(label, sizeof(label), "%s %d", header.role, header.pid);
+
+    fprintf(out, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":",
+            first ? "\n" : ",\n", header.pid);
+    write_json_string(out, label);
+    fprintf(out, "}}");
+
+    count = 0;
+
+    while (fread(&event, sizeof(event), 1, fd) == 1)
+    {
+        if (event.span < 0 || event.span >= TRACE_SPANS)
+            continue;
+
+        memcpy(detail, event.detail, TRACE_DETAIL_LEN);
+        detail[TRACE_DETAIL_LEN] = '\0';
+
+        /* the viewers expect wall clock microseconds */
+        start = event.start + header.realtime_offset;
+
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld.%03lld,\"dur\":%lld.%03lld,"
+                     "\"pid\":%d,\"tid\":%d,\"args\":{",
+                trace_span_names[event.span], header.role, start / 1000, start % 1000,
+                event.duration / 1000, event.duration % 1000,
+                header.pid, span_lane(event.span));
+
+        if (event.span >= TRACE_FIRST_IO)
+            fprintf(out, "\"calls\":%lld", event.value);
+        else
+            fprintf(out, "\"value\":%lld", event.value);
+
+        if (detail[0])
+        {
+            fprintf(out, ",\"detail\":");
+            write_json_string(out, detail);
+        }
+
+        fprintf(out, "}}");
+        count++;
+    }
+
+    fclose(fd);
+
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int result;
+    int total;
+
+    if (argc < 2)
+    {
+        error_handling("usage: ./tracecvt file.trace... > trace.json\n");
+        exit(1);
+    }
+
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    total = 0;
+    for (i = 1; i < argc; i++)
+    {
+        result = convert_file(stdout, argv[i], i == 1);
+        if (result < 0)
+            exit(1);
+
+        total += result;
+    }
+
+    printf("\n]}\n");
+
+    fprintf(stderr, "%d events from %d files\n", total, argc - 1);
+
+    exit(0);
+}
@@ -0,0 +1,239 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/**
+ * --- upgrade.h defines ---
+ * the upgrade of the server binary without refusing a connection
+ *
+ * On SIGUSR2 the server execs its binary again, by the path it was started
+ * with so a binary replaced on the disk is the one that runs, with the same
+ * arguments. The listening socket is inherited, its fd given in
+ * UPGRADE_LISTEN_ENV, so the new server does not bind and the backlog is
+ * never closed: both processes accept from it until the new one is ready.
+ * Then it writes a byte on the pipe of UPGRADE_READY_ENV and the old server
+ * closes its copy of the socket, so the new one takes all the connections
+ * from then on. The old server keeps running its sessions until the last
+ * one ends and then exits.
+ *
+ * A new binary that fails before it is ready closes the pipe without a
+ * byte, and the old server goes on alone.
+ *
+ * The two servers share nothing but the socket: the new one maps its own
+ * rate limits and admission table, so while the sessions of the old one
+ * run each server holds only its own to -m, -i, -g and -u, and together
+ * they may serve up to twice the sessions and the bandwidth set until the
+ * last old session ends.
+ */
+
+#include "base.h"
+#include "log.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+
+#define UPGRADE_LISTEN_ENV "FTP_LISTEN_FD"
+#define UPGRADE_READY_ENV "FTP_READY_FD"
+
+/* set by SIGUSR2 */
+static volatile sig_atomic_t upgrade_requested = 0;
+
+/* the path and the arguments to exec */
+static char upgrade_path[PATH_MAX];
+static char **upgrade_argv = NULL;
+
+/* the write end of the pipe to the old server, in a new one */
+static int upgrade_ready_fd = -1;
+
+/* a byte written on it wakes the loop of the server after SIGUSR2 */
+static int upgrade_wake_fd = -1;
+
+/**
+ * remember how the server was started and take what an old server handed
+ * over, SIGUSR2 starts an upgrade from then on and writes a byte on wake_fd
+ * return the inherited listen sock fd, -1 if there is none or -2 if error
+ */
+int upgrade_initialize(char *argv[], int wake_fd);
+
+/**
+ * exec a new server sharing listen_sockfd
+ * return the read end of its ready pipe or -1 if error
+ */
+int upgrade_start(int listen_sockfd);
+
+/**
+ * read the ready pipe of the new server once it is readable and close it
+ * return 1 if the new server is ready or 0 if it failed
+ */
+int upgrade_finish(int ready_fd);
+
+/**
+ * tell the old server that this one accepts the connections
+ */
+void upgrade_ready(void);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static void upgrade_handler(int signo)
+{
+    int saved_errno;
+
+    upgrade_requested = 1;
+
+    /* set after the loop checked it, the byte still ends its poll() */
+    saved_errno = errno;
+    if (write(upgrade_wake_fd, "", 1) < 0)
+    {
+        /* the pipe is full, the loop wakes anyway */
+    }
+    errno = saved_errno;
+}
+
+/**
+ * take the fd in the environment variable name and remove it
+ * return the fd, -1 if it is not set or -2 if it is malformed
+ */
+static int upgrade_take_fd(const char *name)
+{
+    const char *value;
+    char *end;
+    long fd;
+
+    value = getenv(name);
+    if (!value)
+        return -1;
+
+    fd = strtol(value, &end, 10);
+    unsetenv(name);
+
+    if (end == value || *end != '\0' || fd < 3 || fd > INT_MAX || fcntl((int)fd, F_GETFD) < 0)
+        return -2;
+
+    /* a later upgrade must not pass it on */
+    fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+
+    return (int)fd;
+}
+
+int upgrade_initialize(char *argv[], int wake_fd)
+{
+    struct sigaction action;
+    socklen_t len;
+    int listen_sockfd;
+    int listening;
+
+    /* a bare name is looked up in PATH again, like the shell did */
+    if (!strchr(argv[0], '/') || !realpath(argv[0], upgrade_path))
+        snprintf(upgrade_path, sizeof(upgrade_path), "%s", argv[0]);
+    upgrade_argv = argv;
+    upgrade_wake_fd = wake_fd;
+
+    /* no SA_RESTART, the signal interrupts poll() to be handled at once */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = upgrade_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR2, &action, NULL);
+
+    listen_sockfd = upgrade_take_fd(UPGRADE_LISTEN_ENV);
+    upgrade_ready_fd = upgrade_take_fd(UPGRADE_READY_ENV);
+
+    if (-2 == listen_sockfd || -2 == upgrade_ready_fd)
+    {
+        error_handling("invalid " UPGRADE_LISTEN_ENV " or " UPGRADE_READY_ENV);
+        return -2;
+    }
+
+    if (listen_sockfd >= 0)
+    {
+        len = sizeof(listening);
+        if (getsockopt(listen_sockfd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+        {
+            error_handling(UPGRADE_LISTEN_ENV " is not a listening socket");
+            return -2;
+        }
+    }
+
+    return listen_sockfd;
+}
+
+int upgrade_start(int listen_sockfd)
+{
+    char value[16];
+    int pipefd[2];
+    pid_t pid;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+    {
+        perror("pipe2() error");
+        return -1;
+    }
+
+    /* set before fork(), only async-signal-safe calls are made after it */
+    snprintf(value, sizeof(value), "%d", listen_sockfd);
+    setenv(UPGRADE_LISTEN_ENV, value, 1);
+    snprintf(value, sizeof(value), "%d", pipefd[1]);
+    setenv(UPGRADE_READY_ENV, value, 1);
+
+    pid = fork();
+
+    if (0 == pid)
+    {
+        /* forked twice, the new server is not a session of the old one */
+        if (fork() != 0)
+            _exit(0);
+
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        fcntl(listen_sockfd, F_SETFD, 0);
+        fcntl(pipefd[1], F_SETFD, 0);
+
+        execvp(upgrade_path, upgrade_argv);
+        _exit(127);
+    }
+
+    unsetenv(UPGRADE_LISTEN_ENV);
+    unsetenv(UPGRADE_READY_ENV);
+    close(pipefd[1]);
+
+    if (pid < 0)
+    {
+        perror("fork() error");
+        close(pipefd[0]);
+        return -1;
+    }
+
+    log_info("upgrading to %s.", upgrade_path);
+
+    return pipefd[0];
+}
+
+int upgrade_finish(int ready_fd)
+{
+    char byte;
+    ssize_t size;
+
+    do
+        size = read(ready_fd, &byte, 1);
+    while (size < 0 && EINTR == errno);
+
+    close(ready_fd);
+
+    return 1 == size;
+}
+
+void upgrade_ready(void)
+{
+    char byte = 1;
+
+    if (upgrade_ready_fd < 0)
+        return;
+
+    if (write(upgrade_ready_fd, &byte, 1) < 0)
+        perror("write() error");
+
+    close(upgrade_ready_fd);
+    upgrade_ready_fd = -1;
+}
+
+#endif
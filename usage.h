@@ -0,0 +1,415 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+/**
+ * --- usage.h defines ---
+ * the disk usage of every user, kept up to date by the commands that
+ * change the files instead of walking the directories
+ *
+ * The index is a file mapped MAP_SHARED by the server before any session
+ * is forked, so it is shared by the sessions and survives a restart. It
+ * holds the bytes and files of every user and, for every file made by a
+ * session, its device, inode, size and owner in a hash table with linear
+ * probing. A file keeps its owner through renames and overwrites because
+ * it is found by its inode; files the server did not make belong to
+ * nobody. Directories count as files of 0 bytes.
+ *
+ * An index that does not match this server is never changed in place, an
+ * older server still draining after an upgrade may have it mapped. A new
+ * empty index is made in a temporary file and renamed over it, and the old
+ * server keeps the one it mapped until it exits. The lock is a robust
+ * mutex, a session killed holding it does not stall the others.
+ *
+ * The quota is checked against the bytes of the user before a STOR or a
+ * COPY starts, one read of the mapping. An upload that passes the check
+ * is not cut short, so a user may go over the quota by the size of the
+ * last file.
+ */
+
+#include "base.h"
+#include <sys/mman.h>
+
+/**
+ * the index of the server when -X is not given, relative to where it starts
+ */
+#define USAGE_DEFAULT_PATH "ftp-usage.idx"
+
+#define USAGE_MAGIC 0x55505446 /* "FTPU" */
+#define USAGE_VERSION 2
+
+/**
+ * the users and the files the index can hold
+ */
+#define USAGE_USERS 256
+#define USAGE_FILES (1 << 18)
+
+#define USAGE_NAME_LEN 64
+
+struct usage_user
+{
+    char name[USAGE_NAME_LEN];
+    long long bytes;
+    long long files;
+};
+
+struct usage_file
+{
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    int user;
+    int used;
+};
+
+struct usage_index
+{
+    unsigned int magic;
+    unsigned int version;
+    pthread_mutex_t lock;
+    int user_count;
+    long long file_count;
+    struct usage_user users[USAGE_USERS];
+    struct usage_file files[USAGE_FILES];
+};
+
+static struct usage_index *usage_index = NULL;
+static long long usage_quota = 0;
+static int usage_user = -1;
+
+/**
+ * map the index at path, making it if it does not exist,
+ * quota is the bytes of each user and 0 means unlimited,
+ * shared is 1 when a server handing over still uses the index
+ * return 0 if success or -1 if error
+ */
+int usage_initialize(const char *path, long long quota, int shared);
+
+/**
+ * charge the files the current session makes to user_name
+ * return 0 if success or -1 if the index has no room for the user
+ */
+int usage_session_begin(const char *user_name);
+
+/**
+ * return 1 if the user of the session has used its quota or 0 if not
+ */
+int usage_over_quota(void);
+
+/**
+ * account for name after it was made or written, charging a new file to
+ * the user of the session and the change of size of a known one to its owner
+ */
+void usage_update(const char *name);
+
+/**
+ * account for the removal of the file whose lstat() before was statbuf
+ */
+void usage_forget(const struct stat *statbuf);
+
+/**
+ * write the usage of the user of the session into buffer of size chars
+ * return the length written
+ */
+int usage_write(char *buffer, int size);
+
+/**
+ * function definitions
+ * --------------------------------------------------------------------------
+ */
+
+static void usage_lock(void)
+{
+    shared_mutex_lock(&usage_index->lock);
+}
+
+static void usage_unlock(void)
+{
+    pthread_mutex_unlock(&usage_index->lock);
+}
+
+/**
+ * make an empty index in a temporary file next to path and rename it over path
+ * return its fd or -1 if error
+ */
+static int usage_create(const char *path)
+{
+    unsigned int header[2] = {USAGE_MAGIC, USAGE_VERSION};
+    char temp[PATH_MAX];
+    int fd;
+
+    if (snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid()) >= (int)sizeof(temp))
+    {
+        error_handling("the usage index path is too long");
+        return -1;
+    }
+
+    fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        perror("open() error");
+        return -1;
+    }
+
+    /* a sparse file of zeros after the magic and the version */
+    if (ftruncate(fd, sizeof(struct usage_index)) < 0 ||
+        pwrite(fd, header, sizeof(header), 0) != sizeof(header) ||
+        rename(temp, path) < 0)
+    {
+        perror("usage_create() error");
+        close(fd);
+        unlink(temp);
+        return -1;
+    }
+
+    return fd;
+}
+
+int usage_initialize(const char *path, long long quota, int shared)
+{
+    struct usage_index *index;
+    struct stat statbuf;
+    unsigned int header[2];
+    int fd;
+
+    if (quota < 0)
+    {
+        error_handling("negative quota");
+        return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        perror("open() error");
+        return -1;
+    }
+
+    if (fstat(fd, &statbuf) < 0)
+    {
+        perror("fstat() error");
+        close(fd);
+        return -1;
+    }
+
+    if (statbuf.st_size != sizeof(struct usage_index) ||
+        pread(fd, header, sizeof(header), 0) != sizeof(header) ||
+        header[0] != USAGE_MAGIC || header[1] != USAGE_VERSION)
+    {
+        if (statbuf.st_size > 0)
+            error_handling("the usage index does not match this server, it starts empty");
+
+        close(fd);
+
+        fd = usage_create(path);
+        if (fd < 0)
+            return -1;
+
+        /* the new index is this server's alone */
+        shared = 0;
+    }
+
+    index = mmap(NULL, sizeof(struct usage_index), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (MAP_FAILED == index)
+    {
+        perror("mmap() error");
+        return -1;
+    }
+
+    /* a server killed while holding it left it locked, one handing over uses it */
+    if (!shared && shared_mutex_initialize(&index->lock) < 0)
+    {
+        munmap(index, sizeof(struct usage_index));
+        return -1;
+    }
+
+    usage_index = index;
+    usage_quota = quota;
+
+    return 0;
+}
+
+int usage_session_begin(const char *user_name)
+{
+    int i;
+
+    if (!usage_index || strlen(user_name) >= USAGE_NAME_LEN)
+        return -1;
+
+    usage_lock();
+
+    for (i = 0; i < usage_index->user_count; i++)
+    {
+        if (0 == strcmp(usage_index->users[i].name, user_name))
+            break;
+    }
+
+    if (i == usage_index->user_count && i < USAGE_USERS)
+    {
+        strcpy(usage_index->users[i].name, user_name);
+        usage_index->user_count++;
+    }
+
+    usage_unlock();
+
+    if (i == USAGE_USERS)
+        return -1;
+
+    usage_user = i;
+
+    return 0;
+}
+
+int usage_over_quota(void)
+{
+    if (!usage_index || 0 == usage_quota || usage_user < 0)
+        return 0;
+
+    return __atomic_load_n(&usage_index->users[usage_user].bytes, __ATOMIC_RELAXED) >= usage_quota;
+}
+
+/**
+ * the slot where the file of dev and ino is looked for first
+ */
+static int usage_home(unsigned long long dev, unsigned long long ino)
+{
+    unsigned long long hash;
+
+    hash = (dev * 0x9e3779b97f4a7c15ULL) ^ (ino * 0xbf58476d1ce4e5b9ULL);
+
+    return (int)(hash >> 40) & (USAGE_FILES - 1);
+}
+
+/**
+ * return the slot of the file of dev and ino, or the free slot where it goes
+ */
+static int usage_find(unsigned long long dev, unsigned long long ino)
+{
+    int slot;
+
+    slot = usage_home(dev, ino);
+
+    while (usage_index->files[slot].used &&
+           (usage_index->files[slot].dev != dev || usage_index->files[slot].ino != ino))
+        slot = (slot + 1) & (USAGE_FILES - 1);
+
+    return slot;
+}
+
+/**
+ * empty slot, moving back the files after it that probed past it
+ */
+static void usage_remove_slot(int slot)
+{
+    struct usage_file *files = usage_index->files;
+    int next;
+    int home;
+
+    for (next = (slot + 1) & (USAGE_FILES - 1); files[next].used; next = (next + 1) & (USAGE_FILES - 1))
+    {
+        home = usage_home(files[next].dev, files[next].ino);
+
+        /* next stays if its home is cyclically in (slot, next] */
+        if ((slot < next) ? (home > slot && home <= next) : (home > slot || home <= next))
+            continue;
+
+        files[slot] = files[next];
+        slot = next;
+    }
+
+    files[slot].used = 0;
+}
+
+void usage_update(const char *name)
+{
+    struct usage_file *file;
+    struct stat statbuf;
+    long long size;
+    int slot;
+
+    if (!usage_index || lstat(name, &statbuf) < 0)
+        return;
+
+    size = S_ISREG(statbuf.st_mode) ? statbuf.st_size : 0;
+
+    usage_lock();
+
+    slot = usage_find(statbuf.st_dev, statbuf.st_ino);
+    file = &usage_index->files[slot];
+
+    if (file->used)
+    {
+        if (file->user >= 0)
+            usage_index->users[file->user].bytes += size - file->size;
+        file->size = size;
+    }
+    else if (usage_user >= 0 && usage_index->file_count < USAGE_FILES / 2)
+    {
+        /* kept at most half full, probes stay short */
+        file->dev = statbuf.st_dev;
+        file->ino = statbuf.st_ino;
+        file->size = size;
+        file->user = usage_user;
+        file->used = 1;
+
+        usage_index->users[usage_user].bytes += size;
+        usage_index->users[usage_user].files++;
+        usage_index->file_count++;
+    }
+
+    usage_unlock();
+}
+
+void usage_forget(const struct stat *statbuf)
+{
+    struct usage_file *file;
+    int slot;
+
+    /* another hard link still holds the data */
+    if (!usage_index || (S_ISREG(statbuf->st_mode) && statbuf->st_nlink > 1))
+        return;
+
+    usage_lock();
+
+    slot = usage_find(statbuf->st_dev, statbuf->st_ino);
+    file = &usage_index->files[slot];
+
+    if (file->used)
+    {
+        if (file->user >= 0)
+        {
+            usage_index->users[file->user].bytes -= file->size;
+            usage_index->users[file->user].files--;
+        }
+
+        usage_remove_slot(slot);
+        usage_index->file_count--;
+    }
+
+    usage_unlock();
+}
+
+int usage_write(char *buffer, int size)
+{
+    struct usage_user user;
+    int length;
+
+    if (!usage_index || usage_user < 0)
+        return snprintf(buffer, size, "no usage is kept for this user\n");
+
+    usage_lock();
+    user = usage_index->users[usage_user];
+    usage_unlock();
+
+    if (usage_quota > 0)
+        length = snprintf(buffer, size, "%s\t%lld bytes in %lld files, quota %lld bytes (%.1f%%)\n",
+                          user.name, user.bytes, user.files, usage_quota, 100.0 * user.bytes / usage_quota);
+    else
+        length = snprintf(buffer, size, "%s\t%lld bytes in %lld files, no quota\n",
+                          user.name, user.bytes, user.files);
+
+    return length < size ? length : size - 1;
+}
+
+#endif